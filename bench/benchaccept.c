@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "../libnetfiles.h"
+
+/**
+ * Connection setup benchmark.
+ * 
+ * Forks a number of client processes that connect, complete the netserverinit()
+ * handshake and disconnect again as fast as they can. Prints how many
+ * connections per second were set up, and how the server spread them over
+ * its listener shards.
+ * 
+ *   bench/benchaccept [url] [clients] [seconds]
+ */
+
+double now() {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Body of one client process. Returns how many handshakes completed and
+ * stores how many failed in failed.
+ */
+long runConnector(char *url, double seconds, long *failed) {
+	long done = 0;
+	double end = now() + seconds;
+	
+	*failed = 0;
+	while (now() < end) {
+		// netserverinit() drops the previous connection before making a new one
+		if (netserverinit(url, MODE_UNRESTRCT) == 0) done++;
+		else (*failed)++;
+	}
+	return done;
+}
+
+int main(int argc, char *argv[]) {
+	char *url = argc > 1 ? argv[1] : "localhost";
+	int clients = argc > 2 ? atoi(argv[2]) : 8;
+	double seconds = argc > 3 ? atof(argv[3]) : 3;
+	long done = 0, failed = 0, val[2];
+	char report[4096], *line;
+	int i, pipefd[2];
+	double start, elapsed;
+	
+	pipe(pipefd);
+	start = now();
+	for (i=0; i<clients; i++) {
+		if (fork() == 0) {
+			val[0] = runConnector(url, seconds, &val[1]);
+			write(pipefd[1], val, sizeof(val));
+			_exit(0);
+		}
+	}
+	close(pipefd[1]);
+	for (i=0; i<clients; i++) {
+		if (read(pipefd[0], val, sizeof(val)) == sizeof(val)) {
+			done += val[0];
+			failed += val[1];
+		}
+		wait(NULL);
+	}
+	elapsed = now() - start;
+	
+	printf("%-24s %8s %14s %8s\n", "url", "clients", "connects/s", "failed");
+	printf("%-24s %8d %14.0f %8ld\n", url, clients, done / elapsed, failed);
+	
+	// per shard accept counts, as seen by the server
+	if (netserverinit(url, MODE_UNRESTRCT) == 0 && netstats(report, sizeof(report)) > 0) {
+		for (line = strtok(report, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+			if (strncmp(line, "shard", 5) == 0 || strncmp(line, "connections ", 12) == 0) printf("  %s\n", line);
+		}
+	}
+	return 0;
+}
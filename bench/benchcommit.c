@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "../libnetfiles.h"
+
+/**
+ * Durable write benchmark.
+ * 
+ * Forks a number of writer processes, each with its own connection, spread
+ * over a number of files (one shared file by default), and has them write
+ * fixed size records for a while in each durability mode.
+ * For every mode it prints how many writes per second were acknowledged and
+ * how many fdatasync() calls per second the server made for them, taken from
+ * the server's counters.
+ * 
+ * The server opens existing files only, so run this from the server's working
+ * directory:
+ * 
+ *   bench/benchcommit [host] [clients] [files] [seconds] [record size]
+ */
+
+/**
+ * Returns the value of one server counter, or -1 if it can't be read.
+ */
+long readCounter(const char *name) {
+	char buf[4096], *line;
+	size_t len = strlen(name);
+	
+	if (netstats(buf, sizeof(buf)) == -1) return -1;
+	for (line = strtok(buf, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+		if (strncmp(line, name, len) == 0 && line[len] == ' ') return atol(line + len + 1);
+	}
+	return -1;
+}
+
+double now() {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Body of one writer process. Writes records until the time is up and
+ * returns how many of them the server acknowledged.
+ */
+long runWriter(char *host, int id, int file, int durability, double seconds, int recsize) {
+	char fname[64], *rec;
+	long acked = 0;
+	double end;
+	int fd;
+	
+	sprintf(fname, "benchcommit.%d.dat", file);
+	close(open(fname, O_CREAT | O_WRONLY, 0644));
+	if (netserverinit(host, MODE_UNRESTRCT) == -1) return -1;
+	fd = netopen(fname, MODE_WR | durability);
+	if (fd == -1) return -1;
+	
+	rec = malloc(recsize);
+	memset(rec, 'a' + id % 26, recsize);
+	end = now() + seconds;
+	while (now() < end) {
+		if (netwrite(fd, rec, recsize) != recsize) break;
+		// make non durable writes round trip too, so every mode counts server acks
+		if (durability == DURABLE_NONE && netflush(fd) == -1) break;
+		acked++;
+	}
+	
+	netclose(fd);
+	free(rec);
+	return acked;
+}
+
+int main(int argc, char *argv[]) {
+	const char *names[] = { "none", "sync", "group" };
+	int modes[] = { DURABLE_NONE, DURABLE_SYNC, DURABLE_GROUP };
+	char *host = argc > 1 ? argv[1] : "localhost";
+	int clients = argc > 2 ? atoi(argv[2]) : 8;
+	int files = argc > 3 ? atoi(argv[3]) : 1;
+	double seconds = argc > 4 ? atof(argv[4]) : 3;
+	int recsize = argc > 5 ? atoi(argv[5]) : 4096;
+	char fname[64];
+	long fsyncs, acked, val;
+	int i, m, pipefd[2];
+	double start, elapsed;
+	
+	if (netserverinit(host, MODE_UNRESTRCT) == -1) {
+		perror("Unable to connect");
+		return 1;
+	}
+	
+	printf("%-6s %8s %6s %12s %12s %14s\n", "mode", "clients", "files", "writes/s", "fsyncs/s", "writes/fsync");
+	for (m=0; m<3; m++) {
+		fsyncs = readCounter("fsyncs");
+		pipe(pipefd);
+		start = now();
+		for (i=0; i<clients; i++) {
+			if (fork() == 0) {
+				val = runWriter(host, i, i % files, modes[m], seconds, recsize);
+				write(pipefd[1], &val, sizeof(val));
+				_exit(0);
+			}
+		}
+		close(pipefd[1]);
+		
+		acked = 0;
+		for (i=0; i<clients; i++) {
+			if (read(pipefd[0], &val, sizeof(val)) == sizeof(val) && val > 0) acked += val;
+			wait(NULL);
+		}
+		close(pipefd[0]);
+		elapsed = now() - start;
+		fsyncs = readCounter("fsyncs") - fsyncs;
+		
+		printf("%-6s %8d %6d %12.0f %12.0f %14.2f\n", names[m], clients, files, acked / elapsed,
+			fsyncs / elapsed, fsyncs ? (double) acked / fsyncs : 0.0);
+		fflush(stdout);
+	}
+	
+	for (i=0; i<files; i++) {
+		sprintf(fname, "benchcommit.%d.dat", i);
+		unlink(fname);
+	}
+	
+	return 0;
+}
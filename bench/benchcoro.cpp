@@ -0,0 +1,109 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../netfiles.hpp"
+
+/**
+ * Coroutine layer benchmark.
+ *
+ * Starts many coroutines on one netfiles::Loop, each of which writes records
+ * to a file of its own, closes it, opens it again and reads them back.
+ * Prints the file operations per second and
+ * how many threads the process used doing it, which stays at two (main and
+ * the loop) however many coroutines there are. The server opens existing
+ * files only, so run this from its working directory:
+ *
+ *   bench/benchcoro <server> [coroutines] [records each] [record size]
+ */
+
+static long ops = 0;
+static long failures = 0;
+static long peakThreads = 0;
+
+/**
+ * Returns the number of threads in this process.
+ */
+long countThreads() {
+	std::ifstream status("/proc/self/status");
+	std::string line;
+
+	while (std::getline(status, line)) {
+		if (line.compare(0, 8, "Threads:") == 0) return atol(line.c_str() + 8);
+	}
+	return -1;
+}
+
+// a client may only have a file open once, so each worker has its own
+std::string fileName(int worker) {
+	return "benchcoro." + std::to_string(worker) + ".dat";
+}
+
+netfiles::Task<> worker(netfiles::Loop &loop, int id, int records, int size) {
+	try {
+		netfiles::Buffer rec(size);
+
+		memset(rec.data(), 'x', size);
+		netfiles::File out = co_await netfiles::File::open(loop, fileName(id), MODE_WR);
+		for (int i=0; i<records; i++) {
+			co_await out.write(rec);
+		}
+		co_await out.close();
+		netfiles::File in = co_await netfiles::File::open(loop, fileName(id), MODE_RD);
+		for (int i=0; i<records; i++) {
+			netfiles::Buffer got = co_await in.read(size);
+
+			if (got.size() != (size_t) size) failures++;
+		}
+		co_await in.close();
+		ops += 4 + 2 * records;
+	} catch (const std::system_error &e) {
+		if (failures++ == 0) fprintf(stderr, "%s\n", e.what());
+	}
+	long threads = countThreads();
+	if (threads > peakThreads) peakThreads = threads;
+}
+
+netfiles::Task<> runAll(netfiles::Loop &loop, int coroutines, int records, int size) {
+	std::vector<netfiles::Task<>> tasks;
+
+	for (int i=0; i<coroutines; i++) tasks.push_back(worker(loop, i, records, size));
+	// each awaits its first call, then the loop takes them in turn
+	for (auto &task : tasks) loop.spawn(std::move(task));
+	co_return;
+}
+
+int main(int argc, char *argv[]) {
+	int coroutines = argc > 2 ? atoi(argv[2]) : 1000;
+	int records = argc > 3 ? atoi(argv[3]) : 16;
+	int size = argc > 4 ? atoi(argv[4]) : 4096;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <server> [coroutines] [records each] [record size]\n", argv[0]);
+		return 1;
+	}
+	for (int i=0; i<coroutines; i++) close(open(fileName(i).c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644));
+	auto start = std::chrono::steady_clock::now();
+	try {
+		netfiles::Loop loop(argv[1]);
+
+		loop.run(runAll(loop, coroutines, records, size));
+		// the loop drains what the workers still have queued before it stops
+	} catch (const std::system_error &e) {
+		fprintf(stderr, "%s: %s\n", argv[1], e.what());
+		return 1;
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%d coroutines, %ld operations in %.2f s, %.0f ops/s, %ld failed, %ld threads at most\n",
+		coroutines, ops, elapsed, ops / elapsed, failures, peakThreads);
+	for (int i=0; i<coroutines; i++) unlink(fileName(i).c_str());
+	return failures > 0;
+}
@@ -0,0 +1,469 @@
+// the server's internals are called directly, so it is built in, without its main()
+#define main serverMain
+#include "../netfileserver.c"
+#undef main
+
+#include <sys/resource.h>
+
+/**
+ * Microbenchmarks of the server's internals, as JSON.
+ *
+ * Runs each piece on its own, in this process, with no client or network in
+ * the way:
+ *  - file_table.*: the open file table at 10 to 100k open files. Opening a
+ *    file that isn't open yet (getFileByName() and addOwner()), looking up one
+ *    that is, adding and removing a second owner, and lookupHandle(), which
+ *    maps a client's handle to its ClientHandle.
+ *  - frame.*: reading a request with getMessage() and sending a response with
+ *    sendResponseData(), over a unix socketpair, with and without frame CRCs.
+ *    Includes the read() and write() on the other end.
+ *  - path.*: stat() of a file 1 to 16 directories down, walking its whole path
+ *    and through the directory cache (statPath()).
+ *  - file_lock.open_close: openFile() and closeFile() from 1 to 16 threads at
+ *    once, which all take fileLock.
+ *  - io.read, io.write: readFile() and writeFile() on a file in tmpfs.
+ *
+ * Every result is one line of the "results" array, so two runs diff cleanly.
+ * A result is identified by its name and params; ops_per_sec and mb_per_sec
+ * (null where bytes don't apply) are what to compare. Results that can't run
+ * here, like more open files than RLIMIT_NOFILE allows, have "skipped" and
+ * the reason instead. The server's own logging goes to /dev/null.
+ *
+ *   bench/benchserver [-t seconds per result] [-n most open files] [-d directory, tmpfs by default]
+ */
+
+# define BENCH_FORMAT 1				// bumped when the meaning of a field changes
+# define BENCH_CLIENT 1				// session id the setup opens files as
+# define LOCK_FILES 16				// files the file_lock threads share
+# define IO_FILE_SIZE (16L * 1024 * 1024)
+
+FILE *out;							// the real stdout
+double minSeconds = 0.2;			// each result runs at least this long
+int firstResult = 1;
+volatile int stopThreads;
+
+/**
+ * Reports what failed and exits. The server's error() exits with 0.
+ */
+void die(const char *msg) {
+	perror(msg);
+	exit(1);
+}
+
+double benchNow() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Writes one result. params is the inside of a JSON object, bytes what each
+ * op moved, or 0 if that doesn't apply.
+ */
+void report(const char *name, const char *params, long ops, double seconds, long bytes) {
+	fprintf(out, "%s\n    {\"name\": \"%s\", \"params\": {%s}, \"ops\": %ld, \"seconds\": %.4f, \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, ",
+		firstResult ? "" : ",", name, params, ops, seconds, seconds * 1e9 / ops, ops / seconds);
+	if (bytes > 0) fprintf(out, "\"mb_per_sec\": %.1f}", ops * (double) bytes / seconds / (1024 * 1024));
+	else fprintf(out, "\"mb_per_sec\": null}");
+	firstResult = 0;
+	fflush(out);
+}
+
+void skip(const char *name, const char *params, const char *reason) {
+	fprintf(out, "%s\n    {\"name\": \"%s\", \"params\": {%s}, \"skipped\": \"%s\"}", firstResult ? "" : ",", name, params, reason);
+	firstResult = 0;
+	fflush(out);
+}
+
+/****************************************************************************************************
+ * 																									*
+ * 	Open file table																					*
+ * 																									*
+ * 	Files are named f<n> in the working directory, so names differ early, as in a directory of		*
+ * 	many files.																						*
+ * 																									*
+ ****************************************************************************************************/
+
+char (*names)[16];
+
+void benchFileTable(int nfiles) {
+	ClientHandle **handles, *extra;
+	HandleTable table = {NULL, 0, -1};
+	MultiFile *file;
+	char params[32];
+	double start, elapsed;
+	long ops;
+	int i, fd, nhandles, *ids;
+	struct rlimit lim;
+
+	sprintf(params, "\"files\": %d", nfiles);
+	getrlimit(RLIMIT_NOFILE, &lim);
+	if ((rlim_t) nfiles + 64 > lim.rlim_cur) {
+		skip("file_table.open_new", params, "RLIMIT_NOFILE");
+		skip("file_table.lookup", params, "RLIMIT_NOFILE");
+		skip("file_table.add_remove_owner", params, "RLIMIT_NOFILE");
+		skip("file_table.lookup_handle", params, "RLIMIT_NOFILE");
+		return;
+	}
+	names = malloc(sizeof(*names) * nfiles);
+	handles = malloc(sizeof(ClientHandle *) * nfiles);
+	for (i=0; i<nfiles; i++) {
+		sprintf(names[i], "f%d", i);
+		fd = open(names[i], O_CREAT | O_WRONLY, 0644);
+		if (fd == -1) die("Can't create the files");
+		close(fd);
+	}
+
+	// every file is new to the table when it is opened, so this is all misses
+	start = benchNow();
+	pthread_mutex_lock(&fileLock);
+	for (i=0; i<nfiles; i++) {
+		file = getFileByName(names[i]);
+		handles[i] = file != NULL ? addOwner(file, O_RDONLY, BENCH_CLIENT, MODE_UNRESTRCT) : NULL;
+		if (handles[i] == NULL) die("Can't open the files");
+	}
+	pthread_mutex_unlock(&fileLock);
+	report("file_table.open_new", params, nfiles, benchNow() - start, 0);
+
+	ops = 0;
+	start = benchNow();
+	do {
+		pthread_mutex_lock(&fileLock);
+		for (i=0; i<256; i++) {
+			if (getFileByName(names[random() % nfiles]) == NULL) die("Lost a file");
+		}
+		pthread_mutex_unlock(&fileLock);
+		ops += 256;
+	} while ((elapsed = benchNow() - start) < minSeconds);
+	report("file_table.lookup", params, ops, elapsed, 0);
+
+	ops = 0;
+	start = benchNow();
+	do {
+		pthread_mutex_lock(&fileLock);
+		for (i=0; i<256; i++) {
+			extra = addOwner(handles[random() % nfiles]->file, O_RDONLY, BENCH_CLIENT + 1, MODE_UNRESTRCT);
+			if (extra == NULL) die("Can't add an owner");
+			removeOwner(extra);
+		}
+		pthread_mutex_unlock(&fileLock);
+		ops += 256;
+	} while ((elapsed = benchNow() - start) < minSeconds);
+	report("file_table.add_remove_owner", params, ops, elapsed, 0);
+
+	// a session holds at most MAX_HANDLES
+	nhandles = nfiles < MAX_HANDLES ? nfiles : MAX_HANDLES;
+	ids = malloc(sizeof(int) * nhandles);
+	for (i=0; i<nhandles; i++) ids[i] = allocHandle(&table, handles[i]);
+	ops = 0;
+	start = benchNow();
+	do {
+		for (i=0; i<256; i++) {
+			if (lookupHandle(&table, ids[random() % nhandles]) == NULL) die("Lost a handle");
+		}
+		ops += 256;
+	} while ((elapsed = benchNow() - start) < minSeconds);
+	report("file_table.lookup_handle", params, ops, elapsed, 0);
+
+	pthread_mutex_lock(&fileLock);
+	for (i=0; i<nfiles; i++) removeOwner(handles[i]);
+	pthread_mutex_unlock(&fileLock);
+	for (i=0; i<nfiles; i++) unlink(names[i]);
+	free(table.slots);
+	free(ids);
+	free(handles);
+	free(names);
+}
+
+/****************************************************************************************************
+ * 																									*
+ * 	Frames																							*
+ * 																									*
+ ****************************************************************************************************/
+
+/**
+ * Reads exactly len bytes, or exits.
+ */
+void drain(int fd, char *buf, int len) {
+	int n, got = 0;
+
+	while (got < len) {
+		n = read(fd, buf + got, len - got);
+		if (n <= 0) die("Lost the socketpair");
+		got += n;
+	}
+}
+
+void benchFrames(int size, int crc) {
+	char params[48], *frame, *msg, *body;
+	double start, elapsed;
+	int sv[2], len, framelen, msglen, i;
+	uint32_t sum;
+	long ops;
+	Transport *t;
+
+	sprintf(params, "\"bytes\": %d, \"crc\": %d", size, crc);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) die("No socketpair");
+	t = transportSocket(sv[0], TRANSPORT_UNIX);
+	t->crc = crc;
+
+	// a read request padded out to size, as the client would frame it
+	body = malloc(size);
+	memset(body, 'x', size);
+	memcpy(body, "R,-4097,0,5,", size < 12 ? size : 12);
+	framelen = 4 + size + (crc ? CRC_SIZE : 0);
+	frame = malloc(framelen + 6);
+	len = framelen - 4;
+	memcpy(frame, &len, 4);
+	memcpy(frame + 4, body, size);
+	if (crc) {
+		sum = netcrc32c(0, body, size);
+		memcpy(frame + 4 + size, &sum, CRC_SIZE);
+	}
+
+	ops = 0;
+	start = benchNow();
+	do {
+		for (i=0; i<64; i++) {
+			if (write(sv[1], frame, framelen) != framelen) die("Short write");
+			msg = getMessage(t, &msglen);
+			if (msg == NULL || msglen != size) die("Bad frame");
+			free(msg);
+		}
+		ops += 64;
+	} while ((elapsed = benchNow() - start) < minSeconds);
+	report("frame.decode", params, ops, elapsed, size);
+
+	// a read response carrying size bytes, taken off the socket as the client would
+	ops = 0;
+	start = benchNow();
+	do {
+		for (i=0; i<64; i++) {
+			if (sendResponseData(t, STATUS_SUCCESS, body, size) == -1) die("Can't send");
+			drain(sv[1], frame, 6 + size + (crc ? CRC_SIZE : 0));
+		}
+		ops += 64;
+	} while ((elapsed = benchNow() - start) < minSeconds);
+	report("frame.encode", params, ops, elapsed, size);
+
+	transportClose(t);
+	close(sv[1]);
+	free(body);
+	free(frame);
+}
+
+/****************************************************************************************************
+ * 																									*
+ * 	Path resolution																					*
+ * 																									*
+ * 	A file some directories down, stat()ed by its whole path as the server used to, and				*
+ * 	through statPath(), which finds its directory in the cache and looks up one name.				*
+ * 																									*
+ ****************************************************************************************************/
+
+void benchPaths(int depth) {
+	char params[32], path[depth * 8 + 8], *p = path;
+	double start, elapsed;
+	struct stat st;
+	long ops;
+	int i;
+
+	sprintf(params, "\"depth\": %d", depth);
+	for (i=0; i<depth; i++) {
+		p += sprintf(p, "%sd%d", i == 0 ? "" : "/", i);
+		if (mkdir(path, 0755) == -1) die("Can't make the directories");
+	}
+	strcpy(p, "/file");
+	close(open(path, O_CREAT | O_WRONLY, 0644));
+
+	ops = 0;
+	start = benchNow();
+	do {
+		for (i=0; i<256; i++) {
+			if (stat(path, &st) == -1) die("Lost the file");
+		}
+		ops += 256;
+	} while ((elapsed = benchNow() - start) < minSeconds);
+	report("path.stat_walk", params, ops, elapsed, 0);
+
+	ops = 0;
+	start = benchNow();
+	do {
+		for (i=0; i<256; i++) {
+			if (statPath(path, &st) == -1) die("Lost the file");
+		}
+		ops += 256;
+	} while ((elapsed = benchNow() - start) < minSeconds);
+	report("path.stat_cached", params, ops, elapsed, 0);
+
+	unlink(path);
+	while ((p = strrchr(path, '/')) != NULL) {
+		*p = '\0';
+		rmdir(path);
+	}
+}
+
+/****************************************************************************************************
+ * 																									*
+ * 	fileLock contention																				*
+ * 																									*
+ * 	Every thread is its own client, opening and closing the same few files, which setup keeps		*
+ * 	open so they are never really closed.															*
+ * 																									*
+ ****************************************************************************************************/
+
+typedef struct {
+	int client;
+	long ops;
+	pthread_t thread;
+} LockWorker;
+
+void *lockWorker(void *ptr) {
+	LockWorker *w = ptr;
+	ClientHandle *handle;
+	char name[16];
+	int i = w->client;
+
+	while (!stopThreads) {
+		sprintf(name, "lock%d", i++ % LOCK_FILES);
+		handle = openFile(name, O_RDONLY, w->client, MODE_UNRESTRCT, 0);
+		if (handle == NULL) die("Can't open");
+		closeFile(handle);
+		w->ops++;
+	}
+	return NULL;
+}
+
+void benchFileLock(int nthreads) {
+	LockWorker *workers = calloc(sizeof(LockWorker), nthreads);
+	char params[32];
+	double start, elapsed;
+	long ops = 0;
+	int i;
+
+	sprintf(params, "\"threads\": %d", nthreads);
+	stopThreads = 0;
+	start = benchNow();
+	for (i=0; i<nthreads; i++) {
+		workers[i].client = BENCH_CLIENT + 1 + i;
+		pthread_create(&workers[i].thread, NULL, lockWorker, &workers[i]);
+	}
+	usleep(minSeconds * 1e6);
+	stopThreads = 1;
+	for (i=0; i<nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+	}
+	elapsed = benchNow() - start;
+	report("file_lock.open_close", params, ops, elapsed, 0);
+	free(workers);
+}
+
+/****************************************************************************************************
+ * 																									*
+ * 	Read and write paths																			*
+ * 																									*
+ ****************************************************************************************************/
+
+void benchIO(ClientHandle *handle, int size) {
+	WriteRange range = {0, size};
+	char params[32], *data, *got;
+	double start, elapsed;
+	long ops, seq;
+	int len;
+
+	sprintf(params, "\"bytes\": %d", size);
+	data = malloc(size);
+	memset(data, 'y', size);
+
+	ops = 0;
+	start = benchNow();
+	do {
+		range.offset = ops * size % IO_FILE_SIZE;
+		if (writeFile(handle, &range, 1, data, &seq) != size) die("Short write");
+		ops++;
+	} while ((elapsed = benchNow() - start) < minSeconds);
+	report("io.write", params, ops, elapsed, size);
+
+	ops = 0;
+	start = benchNow();
+	do {
+		got = readFile(handle, ops * size % IO_FILE_SIZE, size, 0, CODEC_NONE, &len);
+		if (got == NULL || len != size) die("Short read");
+		free(got);
+		ops++;
+	} while ((elapsed = benchNow() - start) < minSeconds);
+	report("io.read", params, ops, elapsed, size);
+	free(data);
+}
+
+int main(int argc, char *argv[]) {
+	static const int tableSizes[] = {10, 100, 1000, 10000, 100000};
+	static const int frameSizes[] = {16, 4096, 65536};
+	static const int ioSizes[] = {4096, 65536, 1024 * 1024};
+	ClientHandle *keep[LOCK_FILES], *io;
+	char dir[256], name[16], *base = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+	int opt, maxFiles = 100000, i, crc, threads;
+	struct rlimit lim;
+
+	while ((opt = getopt(argc, argv, "t:n:d:")) != -1) {
+		if (opt == 't') minSeconds = atof(optarg);
+		else if (opt == 'n') maxFiles = atoi(optarg);
+		else if (opt == 'd') base = optarg;
+		else {
+			fprintf(stderr, "Usage: %s [-t seconds per result] [-n most open files] [-d directory, tmpfs by default]\n", argv[0]);
+			exit(1);
+		}
+	}
+	sprintf(dir, "%s/benchserver.%d", base, getpid());
+	if (mkdir(dir, 0755) == -1 || chdir(dir) == -1) die("Can't make the working directory");
+
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (freopen("/dev/null", "w", stdout) == NULL) die("Can't silence the server");
+	signal(SIGPIPE, SIG_IGN);
+	if (pthread_mutex_init(&fileLock, NULL) != 0) die("Mutex init failed");
+	if (initPaths(NULL) == -1) die("Can't set up path resolution");
+	// as many open files as allowed, for the big tables
+	getrlimit(RLIMIT_NOFILE, &lim);
+	lim.rlim_cur = lim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &lim);
+	srandom(1);
+
+	fprintf(out, "{\n  \"suite\": \"benchserver\",\n  \"format\": %d,\n  \"cpus\": %ld,\n  \"dir\": \"%s\",\n  \"results\": [",
+		BENCH_FORMAT, sysconf(_SC_NPROCESSORS_ONLN), base);
+
+	for (i=0; i<5 && tableSizes[i]<=maxFiles; i++) benchFileTable(tableSizes[i]);
+
+	for (i=0; i<3; i++) {
+		for (crc=0; crc<2; crc++) benchFrames(frameSizes[i], crc);
+	}
+
+	for (i=1; i<=16; i*=4) benchPaths(i);
+
+	for (i=0; i<LOCK_FILES; i++) {
+		sprintf(name, "lock%d", i);
+		close(open(name, O_CREAT | O_WRONLY, 0644));
+		keep[i] = openFile(name, O_RDONLY, BENCH_CLIENT, MODE_UNRESTRCT, 0);
+		if (keep[i] == NULL) die("Can't open");
+	}
+	for (threads=1; threads<=16; threads*=2) benchFileLock(threads);
+	for (i=0; i<LOCK_FILES; i++) {
+		closeFile(keep[i]);
+		sprintf(name, "lock%d", i);
+		unlink(name);
+	}
+
+	// all of it exists, so reads are never short
+	close(open("io", O_CREAT | O_WRONLY, 0644));
+	if (truncate("io", IO_FILE_SIZE) == -1) die("Can't size the file");
+	io = openFile("io", O_RDWR, BENCH_CLIENT, MODE_UNRESTRCT, 0);
+	if (io == NULL) die("Can't open");
+	for (i=0; i<3; i++) benchIO(io, ioSizes[i]);
+	closeFile(io);
+	unlink("io");
+
+	fprintf(out, "\n  ]\n}\n");
+	if (chdir("/") == -1 || rmdir(dir) == -1) die("Can't remove the working directory");
+	return 0;
+}
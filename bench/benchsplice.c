@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../libnetfiles.h"
+
+/**
+ * Large write benchmark, buffered against spliced.
+ * 
+ * Writes records of growing sizes for a while to two servers: one that
+ * copies every write through a buffer (started with -w 0) and one that
+ * splices them from the socket into the file (-w 1). For each size it prints
+ * the throughput and the server CPU time per MB of both, which shows the
+ * size from which splicing pays off, the server's -w default.
+ * 
+ * Compression and frame checks keep the server from splicing, so they are
+ * turned off. Use unix:// or tcp:// addresses; shared memory is never
+ * spliced. The server opens existing files only, so run this from the
+ * servers' working directory (they may share it):
+ * 
+ *   bench/benchsplice <buffered server> <spliced server> [seconds] [largest size]
+ */
+
+# define FILE_WRAP (256L * 1024 * 1024)	// start over at the beginning of the file after this
+
+/**
+ * Returns the value of one server counter, or -1 if it can't be read.
+ */
+long readCounter(const char *name) {
+	char buf[8192], *line;
+	size_t len = strlen(name);
+	
+	if (netstats(buf, sizeof(buf)) == -1) return -1;
+	for (line = strtok(buf, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+		if (strncmp(line, name, len) == 0 && line[len] == ' ') return atol(line + len + 1);
+	}
+	return -1;
+}
+
+double now() {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Writes records of recsize bytes to one server for a while. Stores the MB
+ * per second written in rate and the server CPU us per MB in cpu.
+ * Returns 0 on success, or -1 on error.
+ */
+int runSize(char *host, const char *fname, char *rec, int recsize, double seconds, double *rate, double *cpu) {
+	long written = 0, sinceOpen = 0, cpuStart;
+	double start, elapsed;
+	int fd;
+	
+	if (netserverinit(host, MODE_UNRESTRCT) == -1) return -1;
+	fd = netopen(fname, MODE_WR);
+	if (fd == -1) return -1;
+	cpuStart = readCounter("cpu_us");
+	start = now();
+	while ((elapsed = now() - start) < seconds) {
+		if (sinceOpen >= FILE_WRAP) {
+			// reopening starts at offset 0 again, so the file stays small
+			netclose(fd);
+			fd = netopen(fname, MODE_WR);
+			if (fd == -1) return -1;
+			sinceOpen = 0;
+		}
+		if (netwrite(fd, rec, recsize) != recsize || netflush(fd) == -1) return -1;
+		written += recsize;
+		sinceOpen += recsize;
+	}
+	*rate = written / elapsed / (1024 * 1024);
+	*cpu = (readCounter("cpu_us") - cpuStart) / (written / (1024.0 * 1024));
+	netclose(fd);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	char *hosts[2], *rec;
+	const char *fname = "benchsplice.dat";
+	double seconds = argc > 3 ? atof(argv[3]) : 1;
+	int largest = argc > 4 ? atoi(argv[4]) : 16 * 1024 * 1024;
+	double rate[2], cpu[2];
+	int size, i;
+	
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <buffered server> <spliced server> [seconds] [largest size]\n", argv[0]);
+		return 1;
+	}
+	hosts[0] = argv[1];
+	hosts[1] = argv[2];
+	netsetoption(NET_OPT_COMPRESSION, 0);
+	close(open(fname, O_CREAT | O_WRONLY, 0644));
+	rec = malloc(largest);
+	memset(rec, 'x', largest);
+	
+	printf("%10s %14s %14s %16s %16s\n", "size", "buffered MB/s", "spliced MB/s", "buffered us/MB", "spliced us/MB");
+	for (size = 4096; size <= largest; size *= 2) {
+		for (i=0; i<2; i++) {
+			if (runSize(hosts[i], fname, rec, size, seconds, &rate[i], &cpu[i]) == -1) {
+				perror(hosts[i]);
+				return 1;
+			}
+		}
+		printf("%10d %14.1f %14.1f %16.1f %16.1f\n", size, rate[0], rate[1], cpu[0], cpu[1]);
+		fflush(stdout);
+	}
+	
+	unlink(fname);
+	free(rec);
+	return 0;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../libnetfiles.h"
+
+/**
+ * Connection churn soak test.
+ *
+ * Forks a number of client processes that each, round after round, connect,
+ * open a few files, write to them and then drop the connection without
+ * closing anything, so the server has to tear the session down itself.
+ * Server memory is sampled after a warm up pass and again at the end, and the
+ * test fails if it grew by more than the allowed slack, or if any file or
+ * handle is still open on the server once every client is gone.
+ *
+ * The files are created under /tmp by the clients, so the server has to run
+ * on the same host.
+ *
+ *   bench/soak [url] [clients] [rounds] [files per round] [slack kB]
+ */
+
+/**
+ * Reads one counter out of the server's stats, or -1 if it isn't there.
+ */
+long getCounter(char *url, const char *name) {
+	char report[8192], *line;
+	size_t len = strlen(name);
+
+	if (netserverinit(url, MODE_UNRESTRCT) == -1 || netstats(report, sizeof(report)) == -1) return -1;
+	for (line = strtok(report, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+		if (strncmp(line, name, len) == 0 && line[len] == ' ') return atol(line + len + 1);
+	}
+	return -1;
+}
+
+/**
+ * Body of one client process. Returns the number of rounds that failed.
+ */
+int churn(char *url, int id, int rounds, int files) {
+	char path[64];
+	int r, i, fd, failed = 0;
+
+	for (r=0; r<rounds; r++) {
+		if (netserverinit(url, MODE_UNRESTRCT) == -1) {
+			failed++;
+			continue;
+		}
+		for (i=0; i<files; i++) {
+			sprintf(path, "/tmp/netsoak.%d.%d", id, i);
+			fd = netopen(path, MODE_RW);
+			if (fd == -1 || netwrite(fd, path, strlen(path)) == -1 || netflush(fd) == -1) {
+				failed++;
+				break;
+			}
+		}
+		// the next netserverinit() drops the connection with every file still open
+	}
+	return failed;
+}
+
+/**
+ * Runs one churn pass over all clients. Returns the number of failed rounds.
+ */
+int runPass(char *url, int clients, int rounds, int files) {
+	int i, status, failed = 0;
+
+	for (i=0; i<clients; i++) {
+		if (fork() == 0) _exit(churn(url, i, rounds, files) > 0);
+	}
+	for (i=0; i<clients; i++) {
+		wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+	}
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+	char *url = argc > 1 ? argv[1] : "localhost";
+	int clients = argc > 2 ? atoi(argv[2]) : 8;
+	int rounds = argc > 3 ? atoi(argv[3]) : 500;
+	int files = argc > 4 ? atoi(argv[4]) : 4;
+	long slack = argc > 5 ? atol(argv[5]) : 4096;
+	long before, after, openFiles, openHandles;
+	char path[64];
+	int i, j, failed;
+
+	for (i=0; i<clients; i++) {
+		for (j=0; j<files; j++) {
+			sprintf(path, "/tmp/netsoak.%d.%d", i, j);
+			close(open(path, O_WRONLY | O_CREAT, 0644));
+		}
+	}
+
+	// the first pass grows thread stacks and malloc arenas to their working size
+	failed = runPass(url, clients, rounds / 10 + 1, files);
+	usleep(200000);
+	before = getCounter(url, "rss_kb");
+	failed += runPass(url, clients, rounds, files);
+	// give the server a moment to notice the last disconnects
+	usleep(200000);
+	after = getCounter(url, "rss_kb");
+	openFiles = getCounter(url, "open_files");
+	openHandles = getCounter(url, "open_handles");
+
+	printf("%-24s %8s %8s %8s %10s %10s %8s %8s\n", "url", "clients", "rounds", "files", "rss_kb", "rss_kb", "files", "handles");
+	printf("%-24s %8d %8d %8d %10ld %10ld %8ld %8ld\n", url, clients, rounds, files, before, after, openFiles, openHandles);
+
+	for (i=0; i<clients; i++) {
+		for (j=0; j<files; j++) {
+			sprintf(path, "/tmp/netsoak.%d.%d", i, j);
+			unlink(path);
+		}
+	}
+
+	if (before < 0 || after < 0 || failed > 0) {
+		printf("FAIL: %d client(s) failed\n", failed);
+		return 1;
+	}
+	if (after - before > slack || openFiles != 0 || openHandles != 0) {
+		printf("FAIL: grew by %ld kB with %ld file(s) and %ld handle(s) left open\n", after - before, openFiles, openHandles);
+		return 1;
+	}
+	printf("PASS: grew by %ld kB\n", after - before);
+	return 0;
+}
@@ -1,92 +1,438 @@
 #include "libnetfiles.h"
+#include "nettransport.h"
+#include "netdelta.h"
+#include "netcompress.h"
+#include "netcrc.h"
 #include <stdio.h>
 #include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 
-int sockfd = -1;
-struct sockaddr_in serverAddressInfo;						// Super-special secret C struct that holds address info for building our socket
-struct hostent *serverIPAddress;									// Super-special secret C struct that holds info about a machine's address
+/**
+ * Every server given to netserverinit(). Paths are spread over them with
+ * consistent hashing: each server is hashed onto a ring at SERVER_VNODES
+ * points, and a path belongs to the first point at or after its own hash.
+ * Adding a server only moves the paths that land on its new points.
+ * 
+ * Handles returned to the caller carry the index (shard) of the server they
+ * live on in their low SHARD_BITS, so calls on a handle go straight to the
+ * right server without hashing again.
+ * 
+ * A server may have replicas that follow its writes. Files opened read only
+ * are spread over the replicas round robin, everything else goes to the
+ * primary. The next NODE_BITS of a handle say which of them it was opened on
+ * (0 for the primary), since each numbers its handles independently. With
+ * read your writes on, reads on a replica carry the sequence number of the
+ * last write this client made on the primary; a replica that can't catch up
+ * in time fails the read, and the handle moves to the primary.
+ */
+typedef struct {
+	char *url;					// of the primary, which is also its key on the hash ring
+	Transport *conn;			// see nettransport.h
+	char *replicaUrl[MAX_REPLICAS];
+	Transport *replicas[MAX_REPLICAS];
+	int nreplicas;
+	int nextReplica;			// replica the next read only open goes to
+	long long lastSeq;			// primary's log sequence number of our last write
+	char session[MAX_REPLICAS + 1][SESSION_TOKEN_SIZE];	// to resume our session on each, primary first
+} Server;
+
+typedef struct {
+	uint64_t hash;
+	int server;
+} HashPoint;
+
+Server servers[MAX_SERVERS];
+int nservers = 0;
+HashPoint *hashRing = NULL;
+int nhashRing = 0;
+
+int serverMode;				// as given to netserverinit(), for reconnecting
+pid_t serverPid;			// process that connected, a forked child shares its connections
+int readYourWrites = 0;
+int compression = 1;		// offer CODEC_DEFLATE to servers reached over TCP
+int frameChecks = 0;		// ask servers to check every frame with a CRC32C
+
+# define SHARD_BITS 6
+# define NODE_BITS 3
+# define makeHandle(remote, shard, node) (-(((-(remote) << NODE_BITS | (node)) << SHARD_BITS) | (shard)))
+# define handleShard(fd) ((-(fd)) & ((1 << SHARD_BITS) - 1))
+# define handleNode(fd) (((-(fd)) >> SHARD_BITS) & ((1 << NODE_BITS) - 1))
+# define handleRemote(fd) (-((-(fd)) >> (SHARD_BITS + NODE_BITS)))
+# define nodeConn(shard, node) ((node) == 0 ? servers[shard].conn : servers[shard].replicas[(node) - 1])
+
+/**
+ * Client side state for every file we have open on the server. Reads carry
+ * an explicit offset, so the library keeps track of each handle's position.
+ * 
+ * Writes are buffered per handle (write-behind). Consecutive writes that
+ * continue where the previous one ended are coalesced into one range, and
+ * the buffered ranges go to the server in a single batch once the buffer
+ * fills up, the oldest write gets older than WB_MAX_DELAY_MS, or the handle
+ * is read, flushed or closed. Errors from a flush the caller didn't ask for
+ * are kept in werror and reported by the next call on that handle.
+ */
+typedef struct s_NetHandle {
+	int fd;							// handle as seen by the caller
+	int remote;						// handle as seen by the server
+	Transport *conn;				// server the file lives on
+	int shard;
+	int node;						// 0 for the primary, 1.. for its replicas
+	char *path;						// to reopen the file on the primary
+	int spare;						// replica's handle, kept after moving to the primary
+	Transport *spareConn;
+	off_t offset;
+	char *wbuf;						// data of all buffered ranges, back to back
+	size_t wlen;
+	WriteRange ranges[WB_MAX_RANGES];
+	int nranges;
+	struct timespec wfirst;			// when the oldest buffered write was made
+	int werror;						// deferred write error, 0 if none
+	int durable;					// writes must be acknowledged on disk, so never buffered
+	int append;						// the server writes at the end of the file, offset stays put
+	struct s_NetHandle *next;
+} NetHandle;
+
+NetHandle *handles = NULL;
+
+/**
+ * Files the client watches, on the primary of the server they live on.
+ * Events come in on the same connection as responses, possibly while the
+ * client waits for the response to something else, so getResponse() sets
+ * them aside in a queue that netnextevent() takes them from.
+ */
+typedef struct s_NetWatch {
+	int id;							// watch as seen by the caller
+	int remote;						// watch as seen by the server
+	Transport *conn;
+	char *path;
+	struct s_NetWatch *next;
+} NetWatch;
+
+typedef struct s_QueuedEvent {
+	NetEvent ev;
+	struct s_QueuedEvent *next;
+} QueuedEvent;
+
+NetWatch *watches = NULL;
+int lastWatch = 0;
+QueuedEvent *eventsFirst = NULL, **eventsLast = &eventsFirst;
+
+/**
+ * Views of open files (see netmap()). A view is fetched a NET_MAP_PAGE page
+ * at a time with ranged reads, as the caller touches it, and the pages are
+ * kept in a cache shared by every view. The cache holds at most mapBudget
+ * bytes and lets the least recently used pages go first. A miss right after
+ * the page before it fetches the pages after it in the same read, twice as
+ * many as last time up to MAP_MAX_WINDOW, so scanning a view costs few
+ * round trips. Writes made through the library drop the pages they touch.
+ */
+typedef struct s_MapPage {
+	struct s_NetMap *map;
+	long index;						// offset in the file / NET_MAP_PAGE
+	size_t len;						// less than NET_MAP_PAGE where the file ended
+	struct s_MapPage *chain;		// next in the view's hash bucket
+	struct s_MapPage *prev, *next;	// in the cache, most recently used first
+	char data[];
+} MapPage;
+
+# define MAP_BUCKETS 1024			// per view, by page index
+# define MAP_MAX_WINDOW 16			// most pages fetched in one read
+
+struct s_NetMap {
+	int fd;							// handle the view reads through
+	size_t len;
+	long pages;						// len in pages, rounded up
+	MapPage *buckets[MAP_BUCKETS];
+	long shortPage;					// first cached page that came back short, -1 if none
+	long lastPage;					// touched last, -1 at first
+	int window;						// pages the next sequential miss fetches
+	struct s_NetMap *next;
+};
+
+NetMap *maps = NULL;
+MapPage *mapFirst = NULL, *mapLast = NULL;
+size_t mapBytes = 0;				// in the cache
+size_t mapBudget = NET_MAP_CACHE;
+
+/**
+ * Takes a page out of the cache and its view, and frees it.
+ */
+void dropMapPage(MapPage *page) {
+	MapPage **pp;
+	
+	for (pp = &page->map->buckets[page->index % MAP_BUCKETS]; *pp != page; pp = &(*pp)->chain);
+	*pp = page->chain;
+	if (page->prev != NULL) page->prev->next = page->next;
+	else mapFirst = page->next;
+	if (page->next != NULL) page->next->prev = page->prev;
+	else mapLast = page->prev;
+	mapBytes -= NET_MAP_PAGE;
+	free(page);
+}
+
+/**
+ * Evicts the least recently used pages until want more bytes fit in the
+ * budget, or the cache is empty.
+ */
+void trimMapCache(size_t want) {
+	while (mapLast != NULL && mapBytes + want > mapBudget) dropMapPage(mapLast);
+}
+
+/**
+ * Drops the cached pages of a view from first to last.
+ */
+void dropMapPages(NetMap *map, long first, long last) {
+	MapPage *page, *next;
+	long from = 0, to = MAP_BUCKETS - 1, i;
+	
+	if (last - first < MAP_BUCKETS) {
+		// a short run only needs the buckets of its own pages
+		from = first;
+		to = last;
+	}
+	for (i=from; i<=to; i++) {
+		for (page = map->buckets[i % MAP_BUCKETS]; page != NULL; page = next) {
+			next = page->chain;
+			if (page->index >= first && page->index <= last) dropMapPage(page);
+		}
+	}
+}
+
+/**
+ * Drops the cached pages of every view of a handle that overlap len bytes
+ * from offset on, or everything from offset on if len is -1, after the file
+ * was changed through the handle. Pages that came back short go too, since
+ * the file may have grown into them.
+ */
+void dropMapRange(int fd, off_t offset, off_t len) {
+	NetMap *map;
+	
+	for (map = maps; map != NULL; map = map->next) {
+		if (map->fd != fd) continue;
+		if (len != 0) dropMapPages(map, offset / NET_MAP_PAGE, len == -1 ? map->pages - 1 : (offset + len - 1) / NET_MAP_PAGE);
+		if (map->shortPage != -1) dropMapPages(map, map->shortPage, map->pages - 1);
+		map->shortPage = -1;
+	}
+}
+
+/**
+ * Returns the state for a handle returned by netopen(), or NULL with errno
+ * set to EBADF if there is no such handle.
+ */
+NetHandle *getHandle(int fd) {
+	NetHandle *h;
+	
+	for (h = handles; h != NULL; h = h->next) {
+		if (h->fd == fd) return h;
+	}
+	errno = EBADF;
+	return NULL;
+}
+
+void addHandle(int remote, int shard, int node, int flags, const char *path) {
+	NetHandle *h = calloc(sizeof(NetHandle), 1);
+	h->fd = makeHandle(remote, shard, node);
+	h->remote = remote;
+	h->conn = nodeConn(shard, node);
+	h->shard = shard;
+	h->node = node;
+	h->path = strdup(path);
+	h->durable = flags & DURABLE_MASK;
+	h->append = (flags & NET_APPEND) != 0;
+	h->next = handles;
+	handles = h;
+}
 
-void error(char *msg) {
-    perror(msg);
-    exit(0);
+void removeHandle(int fd) {
+	NetHandle **hp, *h;
+	
+	for (hp = &handles; *hp != NULL; hp = &(*hp)->next) {
+		if ((*hp)->fd == fd) {
+			h = *hp;
+			*hp = h->next;
+			free(h->wbuf);
+			free(h->path);
+			free(h);
+			return;
+		}
+	}
 }
 
+/**
+ * The request waiting for its response, so it can be sent again if the
+ * connection drops first (see reconnect()). The library makes one request at
+ * a time, so one is enough. The header is a copy, the data belongs to the
+ * caller, which keeps it until the response is in.
+ */
+typedef struct {
+	Transport *conn;
+	char cmd;
+	char *hdr;
+	const void *data;
+	int datalen;
+	int pack;				// compress the data if the connection agreed on a codec
+	int replay;				// running it twice does no harm
+	int tries;				// times it was sent again
+} PendingRequest;
+
+# define MAX_REPLAYS 3
+
+PendingRequest pending;
+int reconnecting = 0;		// reconnect() is running, so a dropped connection stays dropped
+
+int reconnect(Transport *t);
+int transmit(PendingRequest *req);
+
 /**
  * Receives a message from a client. Returns null on error with errno set, and a 
  * malloc()'ed character string containing all the data sent from the client. 
- * Remember to free the character pointer returned from this function.
+ * Remember to free the character pointer returned from this function. The
+ * message is NUL terminated, and if msglen is not NULL the real length of the
+ * message (which may contain binary data) is stored there.
  * 
  * If this method returns NULL, then the connection was lost, and ERRNO was set
- * appropriately. It will deal with other types of errors internally.
+ * appropriately. A frame that fails its CRC check closes the connection too,
+ * with EBADMSG. It will deal with other types of errors internally.
  */
-char *getResponse(int fd) {
+char *readFrame(Transport *t, int *msglen) {
+	uint32_t crc;
 	int val, len;
 	// read length of message
-	val = read(fd, &len, 4);
+	val = transportRead(t, &len, 4);
 	// if val == 0 we got a clean close, if val == -1, an error occurred
 	if (val == 0 || val == -1) {
-		// either way, we should try to close the socket and return, while maintaining errno
+		// either way, we should try to close the connection and return, while maintaining errno
 		val = errno;
-		close(fd);
+		transportClose(t);
 		errno = val;
 		return NULL;
 	}
 	
 	char *msg = malloc(len+1);
 	// read actual message
-	val = read(fd, msg, len);
+	val = transportRead(t, msg, len);
 	// if val == 0 we got a clean close, if val == -1, an error occurred
-	if (val == 0 || val == -1) {
-		// either way, we should try to close the socket and return, while maintaining errno
+	if (len > 0 && (val == 0 || val == -1)) {
+		// either way, we should try to close the connection and return, while maintaining errno
 		val = errno;
-		close(fd);
+		transportClose(t);
 		free(msg);
 		errno = val;
 		return NULL;
 	}
+	if (t->crc) {
+		// the status is in the damage too, so an event can't be told from a
+		// response: the frames still coming may not be what they are taken for
+		if (len >= CRC_SIZE) memcpy(&crc, msg + len - CRC_SIZE, CRC_SIZE);
+		if (len < CRC_SIZE || netcrc32c(0, msg, len - CRC_SIZE) != crc) {
+			transportClose(t);
+			free(msg);
+			errno = EBADMSG;
+			return NULL;
+		}
+		len -= CRC_SIZE;
+	}
 	
 	msg[len] = 0;
+	if (msglen != NULL) *msglen = len;
 	return msg;
 }
 
 /**
- * Sends a status character, and a string message to a client specified by fd.
+ * Sets an event from a server aside for netnextevent(), and frees the
+ * message. Events of watches the client has ended are dropped.
+ */
+void queueEvent(Transport *t, char *msg) {
+	long long remote, offset, len, size;
+	QueuedEvent *q;
+	NetWatch *w;
+	long version;
+	
+	if (sscanf(msg + 2, "%lld,%lld,%lld,%lld,%ld", &remote, &offset, &len, &size, &version) == 5) {
+		for (w = watches; w != NULL && (w->conn != t || w->remote != remote); w = w->next);
+		if (w != NULL) {
+			q = malloc(sizeof(QueuedEvent));
+			q->ev.watch = w->id;
+			q->ev.path = w->path;
+			q->ev.offset = offset;
+			q->ev.len = len;
+			q->ev.size = size;
+			q->ev.version = version;
+			q->next = NULL;
+			*eventsLast = q;
+			eventsLast = &q->next;
+		}
+	}
+	free(msg);
+}
+
+/**
+ * Receives the response to a request, like readFrame(), setting aside any
+ * events that come in ahead of it. If the connection drops, or a damaged
+ * frame comes, before the response is in, it is reconnected, and a request that is safe to run
+ * twice is sent again once the session is back. Any other request fails
+ * with ECONNRESET, since the server may or may not have run it.
+ */
+char *getResponse(Transport *t, int *msglen) {
+	char *msg;
+	
+	for (;;) {
+		while ((msg = readFrame(t, msglen)) != NULL && msg[0] == STATUS_EVENT) queueEvent(t, msg);
+		if (msg != NULL || pending.conn != t) return msg;
+		if (reconnect(t) != 1 || !pending.replay || pending.tries++ == MAX_REPLAYS) {
+			errno = ECONNRESET;
+			return NULL;
+		}
+		if (transmit(&pending) == -1) return NULL;
+	}
+}
+
+/**
+ * Sends a command with a text header followed by len bytes of raw data, all
+ * in one message: "<cmd>,<hdr><data>". Both pieces go out in a single writev()
+ * so small requests don't get held back by Nagle's algorithm.
  * Returns 0 on success, or -1 on error, with errno set
- * 
- * If this method returns -1, then the connection was lost, and ERRNO was set
- * appropriately. It will deal with other types of errors internally.
  */
-int sendMessage(int fd, char cmd, const char *args, char opt) {
-	char msg[strlen(args) + 4];
-	int val, len;
-	// create full message to send, and get length
-	sprintf(msg, "%c%c%s%c%c", cmd, SEP_CHAR, args, SEP_CHAR, opt);
-	len = strlen(msg);
-	// first step is to write the message length to the client (first 4 bytes)
-	val = write(fd, &len, 4);
-	// if val == 0 we got a clean close, if val == -1, an error occurred
-	if (val == 0 || val == -1) {
-		// either way, we should try to close the socket and return, while maintaining errno
-		val = errno;
-		close(fd);
-		errno = val;
+int sendFrame(Transport *t, char cmd, const char *hdr, const void *data, int datalen) {
+	char prefix[6];
+	struct iovec iov[4];
+	uint32_t crc;
+	int val, len, cnt = 3;
+	
+	if (t == NULL) {
+		// netserverinit() hasn't been called
+		errno = ENOTCONN;
 		return -1;
 	}
+	len = 2 + strlen(hdr) + datalen;
+	memcpy(prefix, &len, 4);
+	prefix[4] = cmd;
+	prefix[5] = SEP_CHAR;
+	iov[0].iov_base = prefix;
+	iov[0].iov_len = 6;
+	iov[1].iov_base = (void *) hdr;
+	iov[1].iov_len = strlen(hdr);
+	iov[2].iov_base = (void *) data;
+	iov[2].iov_len = datalen;
+	if (t->crc) {
+		crc = netcrc32c(netcrc32c(netcrc32c(0, prefix + 4, 2), hdr, strlen(hdr)), data, datalen);
+		iov[3].iov_base = &crc;
+		iov[3].iov_len = CRC_SIZE;
+		len += CRC_SIZE;
+		memcpy(prefix, &len, 4);
+		cnt = 4;
+	}
 	
-	// now we write the actual message
-	val = write(fd, msg, len);
-	// if val == 0 we got a clean close, if val == -1, an error occurred
-	if (val == 0 || val == -1) {
-		// either way, we should try to close the socket and return, while maintaining errno
+	if (transportWritev(t, iov, cnt) == -1) {
+		// we should try to close the connection and return, while maintaining errno
 		val = errno;
-		close(fd);
+		transportClose(t);
 		errno = val;
 		return -1;
 	}
@@ -94,6 +440,86 @@ int sendMessage(int fd, char cmd, const char *args, char opt) {
 	return 0;
 }
 
+/**
+ * Sends a request with sendFrame(), compressing its data first if asked to
+ * and the connection agreed on a codec (see netcompress.h).
+ * Returns 0 on success, or -1 on error, with errno set
+ */
+int transmit(PendingRequest *req) {
+	Transport *t = req->conn;
+	char *packed;
+	int ret;
+	
+	if (!req->pack || t == NULL || t->codec == CODEC_NONE) return sendFrame(t, req->cmd, req->hdr, req->data, req->datalen);
+	packed = malloc(payloadBound(req->datalen));
+	ret = sendFrame(t, req->cmd, req->hdr, packed, encodePayload(t->codec, req->data, req->datalen, packed));
+	free(packed);
+	return ret;
+}
+
+/**
+ * Tells whether a request can be sent again when it isn't known whether the
+ * server ran it: only ones that change nothing. A write or truncate run twice
+ * would undo whatever another client did in between, and log the change twice.
+ */
+int replayable(char cmd) {
+	return cmd == FN_READ || cmd == FN_FSYNC
+		|| cmd == FN_CHECKSUM || cmd == FN_SIGNATURE || cmd == FN_STAT || cmd == FN_FSTAT || cmd == FN_LISTDIR || cmd == FN_STATS;
+}
+
+/**
+ * Sends a request and keeps it as the pending one for getResponse(). A
+ * connection that dropped earlier, or drops while the request is on its
+ * way, is reconnected and the request sent once more: a frame that didn't
+ * arrive whole was never run.
+ * Returns 0 on success, or -1 on error, with errno set
+ */
+int sendRequest(Transport *t, char cmd, const char *hdr, const void *data, int datalen, int pack) {
+	// the server would hang up on it, and the retry below with it
+	if (2 + strlen(hdr) + (pack ? payloadBound((size_t) datalen) : (size_t) datalen) + CRC_SIZE > MAX_FRAME_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	free(pending.hdr);
+	pending = (PendingRequest) { t, cmd, strdup(hdr), data, datalen, pack, replayable(cmd), 0 };
+	if (t == NULL) return transmit(&pending);
+	if (t->fd == -1 && reconnect(t) == -1) return -1;
+	if (transmit(&pending) == 0) return 0;
+	if (reconnect(t) == -1) return -1;
+	return transmit(&pending);
+}
+
+/**
+ * Sends a request with a text header and raw data, see sendFrame().
+ * Returns 0 on success, or -1 on error, with errno set
+ */
+int sendMessageData(Transport *t, char cmd, const char *hdr, const void *data, int datalen) {
+	return sendRequest(t, cmd, hdr, data, datalen, 0);
+}
+
+/**
+ * Sends a write request like sendMessageData(), compressing the data if the
+ * connection agreed on a codec.
+ * Returns 0 on success, or -1 on error, with errno set
+ */
+int sendWriteData(Transport *t, char cmd, const char *hdr, const void *data, int datalen) {
+	return sendRequest(t, cmd, hdr, data, datalen, 1);
+}
+
+/**
+ * Sends a status character, and a string message to a client specified by fd.
+ * Returns 0 on success, or -1 on error, with errno set
+ * 
+ * If this method returns -1, then the connection was lost, and ERRNO was set
+ * appropriately. It will deal with other types of errors internally.
+ */
+int sendMessage(Transport *t, char cmd, const char *args, char opt) {
+	char msg[strlen(args) + 3];
+	// everything after the command, the opt character ends the string if it's 0
+	sprintf(msg, "%s%c%c", args, SEP_CHAR, opt);
+	return sendMessageData(t, cmd, msg, NULL, 0);
+}
+
 /**
  * Sends a status character, and integer to a client specified by fd.
  * Returns 0 on success, or -1 on error, with errno set
@@ -101,111 +527,555 @@ int sendMessage(int fd, char cmd, const char *args, char opt) {
  * If this method returns -1, then the connection was lost, and ERRNO was set
  * appropriately. It will deal with other types of errors internally.
  */
-int sendMessageInt(int fd, char cmd, int num) {
-	char msg[10];
+int sendMessageInt(Transport *t, char cmd, int num) {
+	char msg[12];
 	
 	sprintf(msg, "%d", num);
-	return sendMessage(fd, cmd, msg, 0);
+	return sendMessage(t, cmd, msg, 0);
 }
 
-int netserverinit(char * hostname, int connectMode){
-	char *message;
-	int status;
-	// look up the IP address that matches up with the name given - the name given might
-	//    BE an IP address, which is fine, and store it in the 'serverIPAddress' struct
-    serverIPAddress = gethostbyname(hostname);
-    if (serverIPAddress == NULL)
-	{
-        fprintf(stderr,"ERROR, no such host\n");
-        return -1;
-    }
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) 
-	{
-        error("ERROR creating socket");
-        return -1;
+/**
+ * Parses a reply that carries a number (descriptor, byte count) on success
+ * and an errno value on failure. Frees the message.
+ * 
+ * Returns the number on success, or -1 with errno set.
+ */
+long long getResponseNum(char *message) {
+	long long num;
+	char status;
+	
+	if (message == NULL) return -1;
+	status = message[0];
+	num = atoll(message + 2);
+	free(message);
+	if (status != STATUS_SUCCESS) {
+		errno = num;
+		return -1;
+	}
+	return num;
+}
+
+/**
+ * Parses the reply to a request that changed a file on a server, like
+ * getResponseNum(), and remembers how far the primary's log got for read
+ * your writes. Frees the message.
+ * 
+ * Returns the number of bytes written on success, or -1 with errno set.
+ */
+long long getWriteResponse(int shard, char *message) {
+	char *seq;
+	
+	if (message != NULL && message[0] == STATUS_SUCCESS && (seq = strchr(message + 2, SEP_CHAR)) != NULL) {
+		if (atoll(seq + 1) > servers[shard].lastSeq) servers[shard].lastSeq = atoll(seq + 1);
+	}
+	return getResponseNum(message);
+}
+
+/**
+ * Sends every buffered range of a handle to the server in one batch and
+ * empties the buffer. The buffered data is dropped even if the server
+ * rejects it, like the kernel does with a failed writeback.
+ * 
+ * Returns 0 on success, or -1 with errno set.
+ */
+int flushHandle(NetHandle *h) {
+	char *hdr, *p;
+	int i, status;
+	
+	if (h->nranges == 0) return 0;
+	// "<fd>,<count>," followed by "<offset>,<len>," per range
+	hdr = malloc(32 + h->nranges * 48);
+	p = hdr + sprintf(hdr, "%d,%d,", h->remote, h->nranges);
+	for (i=0; i<h->nranges; i++) {
+		p += sprintf(p, "%lld,%zu,", (long long) h->ranges[i].offset, h->ranges[i].len);
+	}
+	
+	status = sendWriteData(h->conn, FN_WRITEV, hdr, h->wbuf, h->wlen);
+	free(hdr);
+	h->nranges = 0;
+	h->wlen = 0;
+	if (status == -1) return -1;
+	if (getWriteResponse(h->shard, getResponse(h->conn, NULL)) == -1) return -1;
+	return 0;
+}
+
+/**
+ * Moves a handle opened on a replica over to the primary, at the same offset.
+ * The replica's handle stays open until netclose(), since it is part of the
+ * number the caller knows the handle by.
+ * 
+ * Returns 0 on success, or -1 with errno set.
+ */
+int moveToPrimary(NetHandle *h) {
+	Transport *conn = servers[h->shard].conn;
+	char hdr[strlen(h->path) + 16];
+	long long remote;
+	
+	sprintf(hdr, "%s%c%c%c%d", h->path, SEP_CHAR, MODE_RD, SEP_CHAR, 0);
+	if (sendMessageData(conn, FN_OPEN, hdr, NULL, 0) == -1) return -1;
+	remote = getResponseNum(getResponse(conn, NULL));
+	if (remote == -1) return -1;
+	h->spare = h->remote;
+	h->spareConn = h->conn;
+	h->remote = remote;
+	h->conn = conn;
+	h->node = 0;
+	return 0;
+}
+
+/**
+ * Flushes every handle whose oldest buffered write is older than
+ * WB_MAX_DELAY_MS. Called on entry to every library function, since the
+ * library has no thread of its own. Failures are parked on the handle.
+ */
+void flushExpired() {
+	struct timespec now;
+	NetHandle *h;
+	long age;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (h = handles; h != NULL; h = h->next) {
+		if (h->nranges == 0) continue;
+		age = (now.tv_sec - h->wfirst.tv_sec) * 1000 + (now.tv_nsec - h->wfirst.tv_nsec) / 1000000;
+		if (age >= WB_MAX_DELAY_MS && flushHandle(h) == -1 && h->werror == 0) h->werror = errno;
+	}
+}
+
+/**
+ * Looks up a handle for an API call, reporting (and clearing) any write error
+ * left behind by an earlier background flush.
+ * 
+ * Returns the handle, or NULL with errno set.
+ */
+NetHandle *useHandle(int fd) {
+	NetHandle *h;
+	
+	flushExpired();
+	h = getHandle(fd);
+	if (h == NULL) return NULL;
+	if (h->werror) {
+		errno = h->werror;
+		h->werror = 0;
+		return NULL;
 	}
+	return h;
+}
+
+/**
+ * 64 bit FNV-1a hash of a string, with a final mix so that similar strings
+ * end up far apart on the ring.
+ */
+uint64_t hashString(const char *str) {
+	uint64_t h = 0xcbf29ce484222325ULL;
 	
-	/** We now have the IP address and port to connect to on the server, we have to get    **/
-	/**   that information into C's special address struct for connecting sockets                     **/
+	while (*str) {
+		h ^= (unsigned char) *str++;
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
 
-	// zero out the socket address info struct .. always initialize!
-    bzero((char *) &serverAddressInfo, sizeof(serverAddressInfo));
+int compareHashPoints(const void *a, const void *b) {
+	uint64_t x = ((const HashPoint *) a)->hash, y = ((const HashPoint *) b)->hash;
+	return x < y ? -1 : x > y;
+}
 
-	// set a flag to indicate the type of network address we'll be using 
-    serverAddressInfo.sin_family = AF_INET;
+/**
+ * Places SERVER_VNODES points per server on the hash ring.
+ */
+void buildHashRing() {
+	char key[512];
+	int i, v;
 	
-	// set the remote port .. translate from a 'normal' int to a super-special 'network-port-int'
-	serverAddressInfo.sin_port = htons(PORT_NUM);
+	free(hashRing);
+	nhashRing = nservers * SERVER_VNODES;
+	hashRing = malloc(sizeof(HashPoint) * nhashRing);
+	for (i=0; i<nservers; i++) {
+		for (v=0; v<SERVER_VNODES; v++) {
+			snprintf(key, sizeof(key), "%s#%d", servers[i].url, v);
+			hashRing[i * SERVER_VNODES + v].hash = hashString(key);
+			hashRing[i * SERVER_VNODES + v].server = i;
+		}
+	}
+	qsort(hashRing, nhashRing, sizeof(HashPoint), compareHashPoints);
+}
 
-	// do a raw copy of the bytes that represent the server's IP address in 
-	//   the 'serverIPAddress' struct into our serverIPAddressInfo struct
-    bcopy((char *)serverIPAddress->h_addr, (char *)&serverAddressInfo.sin_addr.s_addr, serverIPAddress->h_length);
+/**
+ * Writes the name path has on the hash ring to key, which must have room for
+ * strlen(path) + 2 bytes. Like the server's canonPath(): no empty or "."
+ * components, no trailing '/', and ".." only at the start. The leading '/' is
+ * dropped too, since a server with a root takes "/a" to be "a"; for one
+ * without, the two only share a server.
+ */
+void routeKey(const char *path, char *key) {
+	char *o = key;
+	const char *p = path, *end;
+	int depth = 0;
+	size_t n;
+	
+	while (*p != '\0') {
+		while (*p == '/') p++;
+		if (*p == '\0') break;
+		for (end = p; *end != '\0' && *end != '/'; end++);
+		n = end - p;
+		if (n == 2 && p[0] == '.' && p[1] == '.' && depth > 0) {
+			// drop the component before it, and the '/' in front of that
+			while (o > key && o[-1] != '/') o--;
+			if (o > key) o--;
+			depth--;
+		} else if (n != 1 || p[0] != '.') {
+			if (o > key) *o++ = '/';
+			memcpy(o, p, n);
+			o += n;
+			if (n != 2 || p[0] != '.' || p[1] != '.') depth++;
+		}
+		p = end;
+	}
+	if (o == key) *o++ = '.';
+	*o = '\0';
+}
 
+/**
+ * Returns the index of the server that owns a path. Paths naming the same
+ * file the same way up to routeKey() go to the same server.
+ */
+int routePath(const char *path) {
+	char key[strlen(path) + 2];
+	int lo = 0, hi = nhashRing, mid;
+	uint64_t h;
+	
+	if (nservers == 1) return 0;
+	routeKey(path, key);
+	h = hashString(key);
+	// first point with a hash >= h, wrapping around to the start of the ring
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (hashRing[mid].hash < h) lo = mid + 1;
+		else hi = mid;
+	}
+	return hashRing[lo == nhashRing ? 0 : lo].server;
+}
 
+/**
+ * Drops the connections to every server, and with them every open handle
+ * and watch. The servers are told we are done, so they don't keep our
+ * sessions around for us to come back to.
+ */
+void disconnectAll() {
+	NetHandle *h;
+	NetWatch *w;
+	QueuedEvent *q;
+	int i, j;
+	
+	reconnecting = 1;
+	for (i=0; i<nservers && getpid() == serverPid; i++) {
+		for (j=0; j<=servers[i].nreplicas; j++) {
+			if (nodeConn(i, j) != NULL && nodeConn(i, j)->fd != -1 && sendMessage(nodeConn(i, j), FN_ENDSESSION, "", '\0') != -1) {
+				free(getResponse(nodeConn(i, j), NULL));
+			}
+		}
+	}
+	reconnecting = 0;
+	pending.conn = NULL;
+	
+	while (handles != NULL) {
+		h = handles;
+		handles = h->next;
+		free(h->wbuf);
+		free(h->path);
+		free(h);
+	}
+	while (watches != NULL) {
+		w = watches;
+		watches = w->next;
+		free(w->path);
+		free(w);
+	}
+	while (eventsFirst != NULL) {
+		q = eventsFirst;
+		eventsFirst = q->next;
+		free(q);
+	}
+	eventsLast = &eventsFirst;
+	for (i=0; i<nservers; i++) {
+		for (j=0; j<=servers[i].nreplicas; j++) {
+			if (nodeConn(i, j) != NULL) {
+				transportClose(nodeConn(i, j));
+				free(nodeConn(i, j));
+			}
+		}
+		for (j=0; j<servers[i].nreplicas; j++) free(servers[i].replicaUrl[j]);
+		free(servers[i].url);
+	}
+	memset(servers, 0, sizeof(servers));
+	nservers = 0;
+}
 
-	/** We now have a blank socket and a fully parameterized address info struct .. time to connect **/
+/**
+ * Connects to one server and performs the opening handshake, resuming the
+ * session session names, or starting a new one if it is "" or the server no
+ * longer has it. The token of the session we got is left in session.
+ * Returns the connection, or NULL with errno set.
+ */
+Transport *connectServer(const char *url, int connectMode, char *session) {
+	Transport *t;
+	long long status;
+	char *message, offer[4 + SESSION_TOKEN_SIZE] = "", *f;
+	int len;
 	
-	// try to connect to the server using our blank socket and the address info struct 
-	//   if it doesn't work, complain and exit
-    if (connect(sockfd,(struct sockaddr *)&serverAddressInfo,sizeof(serverAddressInfo)) < 0) 
-	{
-        error("ERROR connecting");
-        return -1;
-	}		
+	// url picks the transport, see nettransport.h
+	t = transportConnect(url);
+	if (t == NULL) {
+		return NULL;
+	}
 	/** If we're here, we're connected to the server .. w00t!  **/
 	
-	status = sendMessageInt(sockfd, connectMode, '\0');	
+	// compression only pays off where the network is slower than the CPU
+	if (compression && t->kind == TRANSPORT_TCP) strcat(offer, (char []) { CODEC_DEFLATE, '\0' });
+	if (frameChecks) strcat(offer, (char []) { FRAME_CRC, '\0' });
+	sprintf(offer + strlen(offer), "%c%s", SEP_CHAR, session);
+	status = sendFrame(t, connectMode, offer, NULL, 0);
+	if (status != -1) {
+		message = readFrame(t, &len);
+		// the server answers with what it agreed to, then the session's token
+		for (f = message != NULL && message[0] == STATUS_SUCCESS ? message + 2 : ""; *f != '\0' && *f != SEP_CHAR; f++) {
+			if (codecSupported(*f)) t->codec = *f;
+			if (*f == FRAME_CRC) t->crc = 1;
+		}
+		// a server that keeps no sessions doesn't send one
+		session[0] = '\0';
+		if (*f == SEP_CHAR) snprintf(session, SESSION_TOKEN_SIZE, "%s", f + 1);
+		status = getResponseNum(message);
+	}
 	if (status == -1) {
-		return status;}
-	message = getResponse(sockfd);
-	if (message == NULL){
+		status = errno;
+		transportClose(t);
+		free(t);
+		errno = status;
+		return NULL;
+	}
+	return t;
+}
+
+/**
+ * Connects a dropped connection to its server again, in place, so the
+ * handles and watches that point at it stay valid, and resumes the session
+ * the server kept for it. If the server no longer has the session, what was
+ * opened on the connection is gone, and fails with EBADF from then on.
+ * Watches are taken out again either way, but events from while the
+ * connection was down are lost.
+ * 
+ * Returns 1 if the session was resumed, 0 if a new one was started, or -1
+ * with errno set if the server can't be reached.
+ */
+int reconnect(Transport *t) {
+	char session[SESSION_TOKEN_SIZE], *token = NULL;
+	const char *url = NULL;
+	Transport *fresh;
+	NetHandle *h;
+	NetWatch *w;
+	int i, j, resumed;
+	
+	for (i=0; i<nservers && url == NULL; i++) {
+		for (j=0; j<=servers[i].nreplicas; j++) {
+			if (nodeConn(i, j) != t) continue;
+			url = j == 0 ? servers[i].url : servers[i].replicaUrl[j - 1];
+			token = servers[i].session[j];
+			break;
+		}
+	}
+	if (reconnecting || url == NULL) {
+		errno = ECONNRESET;
 		return -1;
-	} else if (message[0] == STATUS_SUCCESS){
-		free(message);
-		return 0;
-	} else {
-		errno = atoi(message + 2);
-		free(message);
+	}
+	reconnecting = 1;
+	strcpy(session, token);
+	fresh = connectServer(url, serverMode, session);
+	if (fresh == NULL) {
+		reconnecting = 0;
 		return -1;
 	}
+	resumed = token[0] != '\0' && strcmp(session, token) == 0;
+	strcpy(token, session);
+	transportClose(t);
+	*t = *fresh;
+	free(fresh);
+	if (!resumed) {
+		// the new session numbers its handles from scratch, so ours must not reach it
+		for (h = handles; h != NULL; h = h->next) {
+			if (h->conn == t) h->remote = 0;
+			if (h->spareConn == t) h->spare = 0;
+		}
+	}
+	for (w = watches; w != NULL; w = w->next) {
+		if (w->conn == t && sendFrame(t, FN_WATCH, w->path, NULL, 0) != -1) w->remote = getResponseNum(readFrame(t, NULL));
+	}
+	reconnecting = 0;
+	return resumed;
+}
+
+/**
+ * Connects to the server, or servers, files live on. hostname is one server
+ * or a comma separated list of them, each a host name or a url, optionally
+ * followed by its replicas: "primary|replica|replica". Any earlier
+ * connections are dropped first.
+ * 
+ * Returns 0 on success, or -1 with errno set if any server can't be reached.
+ */
+int netserverinit(char * hostname, int connectMode){
+	char *list, *group, *url, *save = NULL, *gsave;
+	Server *srv;
+	static int registered = 0;
+	int err;
 	
+	disconnectAll();
+	// so the servers don't keep our sessions after we exit
+	if (!registered) atexit(disconnectAll);
+	registered = 1;
+	serverMode = connectMode;
+	serverPid = getpid();
+	list = strdup(hostname);
+	for (group = strtok_r(list, ",", &save); group != NULL; group = strtok_r(NULL, ",", &save)) {
+		if (nservers == MAX_SERVERS) {
+			errno = EINVAL;
+			goto INITFAIL;
+		}
+		srv = &servers[nservers++];
+		url = strtok_r(group, "|", &gsave);
+		srv->url = strdup(url);
+		srv->conn = connectServer(url, connectMode, srv->session[0]);
+		if (srv->conn == NULL) goto INITFAIL;
+		while ((url = strtok_r(NULL, "|", &gsave)) != NULL) {
+			if (srv->nreplicas == MAX_REPLICAS) {
+				errno = EINVAL;
+				goto INITFAIL;
+			}
+			srv->replicaUrl[srv->nreplicas] = strdup(url);
+			srv->replicas[srv->nreplicas] = connectServer(url, connectMode, srv->session[srv->nreplicas + 1]);
+			if (srv->replicas[srv->nreplicas++] == NULL) goto INITFAIL;
+		}
+	}
+	free(list);
+	if (nservers == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	buildHashRing();
+	return 0;
 	
+	INITFAIL:
+	err = errno;
+	free(list);
+	disconnectAll();
+	errno = err;
+	return -1;
 }
 
 //The  argument  flags  must  include  one of the following access  modes:  O_RDONLY, 
 //O_WRONLY,  or  O_RDWR. These request   opening  the  file  read-only,  write-only,  or 
-//read/write, respectively.
+//read/write, respectively. One of the DURABLE_* values may be or'ed in to choose
+//when writes through the handle are acknowledged, NET_APPEND to have every
+//write go to the end of the file, and NET_CREATE to create a file opened for
+//writing if it doesn't exist.
 /* Open:
  *  Client->Server
  * 	- 1 byte function 'O'
  *  - 1 byte sep
  *  - n bytes file name
  *  - 1 byte sep
- *  - 1 byte mode */
+ *  - 1 byte mode
+ *  - 1 byte sep
+ *  - n bytes options */
  
 int netopen(const char *pathname, int flags){
-	int ret;
+	int ret, shard, node = 0;
 	char * message;
-	ret = sendMessage(sockfd, FN_OPEN, pathname, flags);
-	if (ret == -1) {
-		return ret;
+	char opts[32];
+	char hdr[strlen(pathname) + sizeof(opts)];
+	Transport *conn;
+	flushExpired();
+	if (nservers == 0) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	shard = routePath(pathname);
+	if ((flags & 0xff) == MODE_RD && servers[shard].nreplicas > 0) {
+		// reads scale out over the replicas
+		node = 1 + servers[shard].nextReplica++ % servers[shard].nreplicas;
+	}
+	// "<name>,<mode>,<options>"
+	sprintf(opts, "%c%c%d", flags & 0xff, SEP_CHAR, flags & (DURABLE_MASK | NET_APPEND | NET_CREATE));
+	sprintf(hdr, "%s%c%s", pathname, SEP_CHAR, opts);
+	
+	OPEN:
+	conn = nodeConn(shard, node);
+	ret = sendMessageData(conn, FN_OPEN, hdr, NULL, 0);
+	if (ret == -1 && node > 0) {
+		// replica unreachable, the primary has the file too
+		node = 0;
+		goto OPEN;
 	}
-	message = getResponse(sockfd);
+	if (ret == -1) {
+		return ret;
+	}
+	message = getResponse(conn, NULL);
 	if (message == NULL){
 		return -1;
 	} else if (message[0] == STATUS_SUCCESS){
 		ret = atoi(message + 2);
 		free(message);
-		return ret;
+		addHandle(ret, shard, node, flags, pathname);
+		return makeHandle(ret, shard, node);
 	} else {
 		errno = atoi(message + 2);
 		free(message);
+		if (node > 0 && (errno == ENOENT || errno == ESTALE)) {
+			// a file just created may not have reached the replica yet, or
+			// the replica fell behind for good
+			node = 0;
+			goto OPEN;
+		}
 		return -1;
 	}
 	
 }	
 
+/**
+ * Moves the offset the next netread() or netwrite() on a handle starts at,
+ * like lseek() with SEEK_SET, SEEK_CUR or SEEK_END. The library keeps the
+ * offset, so only SEEK_END asks the server, for the size of the file. Writes
+ * through a NET_APPEND handle still go to the end.
+ * Returns the new offset, or -1 with errno set.
+ */
+off_t netlseek(int fd, off_t offset, int whence){
+	NetStat st;
+	NetHandle *h;
+	off_t base;
+	
+	h = useHandle(fd);
+	if (h == NULL){
+		return -1;}
+	if (whence == SEEK_SET){
+		base = 0;
+	} else if (whence == SEEK_CUR){
+		base = h->offset;
+	} else if (whence == SEEK_END){
+		if (netfstat(fd, &st) == -1){
+			return -1;}
+		base = st.size;
+	} else {
+		errno = EINVAL;
+		return -1;}
+	if (base + offset < 0){
+		errno = EINVAL;
+		return -1;}
+	h->offset = base + offset;
+	return h->offset;
+}
+
 
  /* Close:
  *  Client->Server
@@ -223,17 +1093,36 @@ RETURN VALUE
 netclose()  returns zero on  success. On  error, -1 is returned, and errno is set appropriately.
 */
 int netclose(int fd){
-	int ret;
+	int ret, flusherr = 0;
 	char * message;
-	ret = sendMessageInt(sockfd, FN_CLOSE, fd);
+	NetHandle *handle;
+	Transport *conn;
+	
+	handle = getHandle(fd);
+	if (handle == NULL) {
+		return -1;
+	}
+	// pending writes go out before the close, their failure is still reported
+	flushExpired();
+	flusherr = handle->werror;
+	if (flushHandle(handle) == -1 && flusherr == 0) flusherr = errno;
+	conn = handle->conn;
+	ret = sendMessageInt(conn, FN_CLOSE, handle->remote);
 	if (ret == -1) {
 		return ret;}
-	message = getResponse(sockfd);
+	message = getResponse(conn, NULL);
 	if (message == NULL){
 		return -1;
 		}
 	else if (message[0] == STATUS_SUCCESS){
 		free(message);
+		if (handle->spare != 0 && sendMessageInt(handle->spareConn, FN_CLOSE, handle->spare) != -1){
+			free(getResponse(handle->spareConn, NULL));}
+		removeHandle(fd);
+		if (flusherr) {
+			errno = flusherr;
+			return -1;
+		}
 		return 0;
 	} else {
 		errno = atoi(message + 2);
@@ -242,11 +1131,69 @@ int netclose(int fd){
 	}
 }	
 
+/**
+ * Reads up to nbyte bytes from offset on, without moving the handle's offset.
+ * A handle on a replica that is too far behind moves to the primary.
+ * Returns the number of bytes read, or -1 with errno set.
+ */
+ssize_t readAt(NetHandle *handle, off_t offset, void *buf, size_t nbyte){
+	int status;
+	char * message, *data;
+	size_t size;
+	char args[64];
+	int len;
+	
+	if (nbyte > MAX_READ_SIZE){
+		nbyte = MAX_READ_SIZE;}
+	
+	READ:
+	sprintf(args, "%d,%lld,%zu", handle->remote, (long long) offset, nbyte);
+	if (readYourWrites && handle->node > 0 && servers[handle->shard].lastSeq > 0){
+		// the replica must have applied our last write before it reads
+		sprintf(args + strlen(args), ",%lld", servers[handle->shard].lastSeq);}
+	status = sendMessage(handle->conn, FN_READ, args, '\0');
+	if (status == -1){
+		return status;}
+	message = getResponse(handle->conn, &len);
+	if (message == NULL){
+		return -1;}
+	else if (message[0] == STATUS_SUCCESS && handle->conn->codec != CODEC_NONE){
+		// the data comes in compressed chunks
+		data = decodePayload(handle->conn->codec, message + 2, len - 2, &size);
+		free(message);
+		if (data != NULL && size > nbyte){
+			free(data);
+			data = NULL;
+			errno = EPROTO;}
+		if (data == NULL){
+			return -1;}
+		memcpy(buf, data, size);
+		free(data);
+		return size;
+	} else if (message[0] == STATUS_SUCCESS){
+		len -= 2;
+		memcpy(buf, message + 2, len);
+		free(message);
+		return len;
+	} else {
+		errno = atoi(message + 2);
+		free(message);
+		if ((errno == ETIMEDOUT || errno == ESTALE) && handle->node > 0 && moveToPrimary(handle) == 0){
+			// the replica is too far behind, read from the primary from now on
+			goto READ;}
+		return -1;
+	} 
+}
+
  /* Read:
  *  Client->Server
  * 	- 1 byte function 'R'
  *  - 1 byte sep
  *  - 8 byte file descriptor
+ *  - 1 byte sep
+ *  - n bytes offset
+ *  - 1 byte sep
+ *  - n bytes size
  *  Server->Client
  *  - 1 byte status
  *  - 1 byte separator
@@ -259,43 +1206,32 @@ number of bytes  actually  read.  Otherwise,  the  function should return -1 and
 indicate the error
  */
 ssize_t netread(int fileDesc, void *buf, size_t nbyte){
-	int status;
-	char * message;
-	int len;
-	status = sendMessageInt(sockfd, FN_READ, fileDesc);
-	if (status == -1){
-		return status;}
-	message = getResponse(sockfd);
-	if (message == NULL){
+	NetHandle *handle;
+	ssize_t len;
+	
+	handle = useHandle(fileDesc);
+	if (handle == NULL){
 		return -1;}
-	else if (message[0] == STATUS_SUCCESS){
-		len = strlen(message + 2);
-		if (len >= nbyte){
-			strncpy(buf, message + 2, len-2);
-			((char *) buf)[nbyte -1] = '\0';
-			free(message);
-			return nbyte;
-		} else {
-			strcpy(buf, message + 2);
-			((char *) buf)[len] = '\0';
-			free(message);
-			return len;
-		}
-	} else {
-		errno = atoi(message + 2);
-		free(message);
-		return -1;
-	} 
+	// make our own buffered writes visible to the read
+	if (flushHandle(handle) == -1){
+		return -1;}
+	len = readAt(handle, handle->offset, buf, nbyte);
+	if (len > 0){
+		handle->offset += len;}
+	return len;
 }
 
 
 
+
  /* Write:
  *  Client->Server
  * 	- 1 byte function 'W'
  *  - 1 byte sep
  *  - 8 byte file descriptor
  *  - 1 byte sep
+ *  - n bytes offset
+ *  - 1 byte sep
  *  - n bytes data
   *  Server->Client
  *  - 1 byte status
@@ -307,33 +1243,1063 @@ ssize_t netread(int fileDesc, void *buf, size_t nbyte){
 //Upon successful completion, netwrite()  should return  the  number of bytes actually written to
 //the file associated  with  fildes.  This  number  should never be greater than nbyte. Otherwise, -1
 //should be returned and errno set to indicate the error.
+//
+//Small writes are buffered (see NetHandle) and counted as written as soon as they
+//are buffered. An error writing them out is returned by a later call on the handle.
+//Handles opened with DURABLE_SYNC or DURABLE_GROUP are never buffered.
+//
+//On a handle opened with NET_APPEND every write lands at the end of the file in
+//one piece, even with other clients appending to it. Buffered appends are sent
+//together and so stay together. The handle's offset, which netread() uses, doesn't
+//move.
+//
+//At most MAX_READ_SIZE bytes are written at a time, so a frame never grows past
+//MAX_FRAME_SIZE.
 
 ssize_t netwrite(int fileDesc, const void *buf, size_t nbyte){
-	int status;
+	char args[64];
+	long long bytes;
+	NetHandle *h;
+	WriteRange *last;
+	
+	h = useHandle(fileDesc);
+	if (h == NULL){
+		return -1;}
+	if (nbyte > MAX_READ_SIZE){
+		nbyte = MAX_READ_SIZE;}
+	dropMapRange(fileDesc, h->offset, h->append ? 0 : nbyte);
+	
+	if (nbyte >= WB_MAX_BYTES || h->durable){
+		// too big to be worth buffering, or the caller wants it on disk before we
+		// return, so send it straight away after what's pending
+		if (flushHandle(h) == -1){
+			return -1;}
+		sprintf(args, "%d,%lld,", h->remote, (long long) h->offset);
+		if (sendWriteData(h->conn, FN_WRITE, args, buf, nbyte) == -1){
+			return -1;}
+		bytes = getWriteResponse(h->shard, getResponse(h->conn, NULL));
+		if (bytes == -1){
+			return -1;}
+		if (!h->append){
+			h->offset += bytes;}
+		return bytes;
+	}
+	
+	last = h->nranges ? &h->ranges[h->nranges - 1] : NULL;
+	// appends all go to the end anyway, so they always grow the last range
+	if (last != NULL && (h->append || last->offset + (off_t) last->len == h->offset) && h->wlen + nbyte <= WB_MAX_BYTES){
+		// continues the previous write, so just grow that range
+		last->len += nbyte;
+	} else {
+		if (h->nranges == WB_MAX_RANGES || h->wlen + nbyte > WB_MAX_BYTES){
+			if (flushHandle(h) == -1){
+				return -1;}
+		}
+		if (h->nranges == 0){
+			clock_gettime(CLOCK_MONOTONIC, &h->wfirst);}
+		h->ranges[h->nranges].offset = h->offset;
+		h->ranges[h->nranges].len = nbyte;
+		h->nranges++;
+	}
+	
+	if (h->wbuf == NULL){
+		h->wbuf = malloc(WB_MAX_BYTES);}
+	memcpy(h->wbuf + h->wlen, buf, nbyte);
+	h->wlen += nbyte;
+	if (!h->append){
+		h->offset += nbyte;}
+	return nbyte;
+}
+
+/**
+ * Sends all writes buffered on a handle to the server and waits for them to
+ * be written. Returns 0 on success, or -1 with errno set, which includes
+ * errors from earlier background flushes of this handle.
+ */
+int netflush(int fd){
+	NetHandle *h;
+	
+	h = useHandle(fd);
+	if (h == NULL){
+		return -1;}
+	return flushHandle(h);
+}
+
+/**
+ * Flushes a handle like netflush(), then asks the server to fsync() the file
+ * so everything written through it is on stable storage.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int netfsync(int fd){
+	char args[16];
+	NetHandle *h;
+	
+	if (netflush(fd) == -1){
+		return -1;}
+	h = getHandle(fd);
+	sprintf(args, "%d,", h->remote);
+	if (sendMessage(h->conn, FN_FSYNC, args, '\0') == -1){
+		return -1;}
+	if (getResponseNum(getResponse(h->conn, NULL)) == -1){
+		return -1;}
+	return 0;
+}
+
+/**
+ * Sets the size of a file open for writing, like ftruncate(), after writing
+ * out what is buffered on the handle. The handle's offset doesn't move.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int netftruncate(int fd, off_t length){
+	char args[48];
+	NetHandle *h;
+	
+	if (netflush(fd) == -1){
+		return -1;}
+	h = getHandle(fd);
+	dropMapRange(fd, length, -1);
+	sprintf(args, "%d,%lld", h->remote, (long long) length);
+	if (sendMessage(h->conn, FN_TRUNCATE, args, '\0') == -1){
+		return -1;}
+	return getWriteResponse(h->shard, getResponse(h->conn, NULL)) == -1 ? -1 : 0;
+}
+
+/**
+ * Allocates len bytes of a file open for writing from offset on, like
+ * fallocate(), so a large file can be laid out in one go. mode is 0 to
+ * allocate (growing the file if the range runs past its end), or a
+ * combination of NET_FALLOC_* values. Buffered writes are written out first.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int netfallocate(int fd, int mode, off_t offset, off_t len){
+	char args[80];
+	NetHandle *h;
+	
+	if (netflush(fd) == -1){
+		return -1;}
+	h = getHandle(fd);
+	dropMapRange(fd, offset, len);
+	sprintf(args, "%d,%d,%lld,%lld", h->remote, mode, (long long) offset, (long long) len);
+	if (sendMessage(h->conn, FN_ALLOCATE, args, '\0') == -1){
+		return -1;}
+	return getWriteResponse(h->shard, getResponse(h->conn, NULL)) == -1 ? -1 : 0;
+}
+
+/**
+ * Sets a library option, one of the NET_OPT_* values.
+ * Returns 0 on success, or -1 with errno set to EINVAL for an unknown option.
+ */
+int netsetoption(int option, int value){
+	if (option == NET_OPT_READ_YOUR_WRITES){
+		readYourWrites = value != 0;
+		return 0;
+	}
+	if (option == NET_OPT_COMPRESSION){
+		compression = value != 0;
+		return 0;
+	}
+	if (option == NET_OPT_CHECKSUM){
+		frameChecks = value != 0;
+		return 0;
+	}
+	if (option == NET_OPT_MAP_CACHE && value > 0){
+		mapBudget = (size_t) value << 20;
+		trimMapCache(0);
+		return 0;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * Fetches the counters of one server as "name value" lines.
+ * Returns a malloc()'ed string, or NULL with errno set.
+ */
+char *getStats(Transport *conn) {
 	char * message;
-	int bytes;
-	status = sendMessageInt(sockfd, FN_WRITE, fileDesc);
-	status = sendMessage(sockfd, FN_WRITE, buf, '\0');
-	if (status == -1){
-		return status;}
-	message = getResponse(sockfd);
+	int len;
+	if (sendMessage(conn, FN_STATS, "", '\0') == -1){
+		return NULL;}
+	message = getResponse(conn, &len);
 	if (message == NULL){
-		return -1;}
+		return NULL;}
 	else if (message[0] == STATUS_SUCCESS){
-	bytes = atoi(message + 2);
-		if (bytes > nbyte){
-			free(message);
-			printf("Too many bytes written\n");
-			return -1;
+		memmove(message, message + 2, len - 1);
+		return message;
+	} else {
+		errno = atoi(message + 2);
+		free(message);
+		return NULL;
+	}
+}
+
+/**
+ * Copies the servers' counters, as "name value" lines, into buf. With more
+ * than one server (replicas included) every counter is the sum over all of
+ * them, except sequence numbers and replica lag, which are the highest, and
+ * compression ratios, which are worked out from the summed byte counts. The
+ * text is always NUL terminated and truncated to fit.
+ * 
+ * Returns the length of the text on success, or -1 with errno set.
+ */
+int netstats(char *buf, size_t size){
+	char *names[256], *text, *line, *save;
+	long long values[256];
+	long long val;
+	int nnames = 0, i, j, node, len = 0;
+	
+	flushExpired();
+	if (nservers == 0){
+		errno = ENOTCONN;
+		return -1;}
+	
+	for (i=0; i<nservers; i++) for (node=0; node<=servers[i].nreplicas; node++){
+		text = getStats(nodeConn(i, node));
+		if (text == NULL){
+			for (j=0; j<nnames; j++) free(names[j]);
+			return -1;}
+		for (line = strtok_r(text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)){
+			char *sp = strrchr(line, ' ');
+			if (sp == NULL) continue;
+			*sp = '\0';
+			for (j=0; j<nnames && strcmp(names[j], line) != 0; j++);
+			if (j == nnames){
+				if (nnames == 256) continue;
+				names[nnames] = strdup(line);
+				values[nnames++] = 0;
+			}
+			val = atoll(sp + 1);
+			if (strstr(line, "_seq") != NULL || strstr(line, "_lag_") != NULL){
+				if (val > values[j]) values[j] = val;}
+			else values[j] += val;
 		}
+		free(text);
+	}
+	
+	// ratios don't add up over servers, work them out again from the totals
+	for (j=0; j<nnames; j++){
+		char *suffix = strstr(names[j], "_ratio_pct");
+		long long raw = 0, sent = 0;
+		if (suffix == NULL) continue;
+		for (i=0; i<nnames; i++){
+			if (strncmp(names[i], names[j], suffix - names[j]) != 0) continue;
+			if (strcmp(names[i] + (suffix - names[j]), "_raw_bytes") == 0) raw = values[i];
+			if (strcmp(names[i] + (suffix - names[j]), "_sent_bytes") == 0) sent = values[i];
+		}
+		values[j] = sent > 0 ? raw * 100 / sent : 0;
+	}
+	
+	buf[0] = '\0';
+	for (j=0; j<nnames; j++){
+		if (len < (int) size) len += snprintf(buf + len, size - len, "%s %lld\n", names[j], values[j]);
+		free(names[j]);
+	}
+	if (len >= (int) size) len = size - 1;
+	return len;
+}
+
+/**
+ * Flushes the buffered writes of every handle on a file, so that an operation
+ * the server does on the file by name sees them. Failures are parked on the
+ * handles, like background flushes.
+ */
+void flushPath(const char *path){
+	NetHandle *h;
+	
+	for (h = handles; h != NULL; h = h->next){
+		if (strcmp(h->path, path) == 0 && flushHandle(h) == -1 && h->werror == 0) h->werror = errno;
+	}
+}
+
+/**
+ * Sends a request naming two files, "<hdr><length of first>,<first><second>",
+ * to the server both live on, and parses the reply like getWriteResponse().
+ * 
+ * Returns the number in the reply, or -1 with errno set (EXDEV if the files
+ * live on different servers).
+ */
+long long sendNames(char cmd, const char *hdr, const char *first, const char *second){
+	size_t flen = strlen(first), slen = strlen(second);
+	char args[strlen(hdr) + 24], names[flen + slen];
+	int shard;
+	
+	flushExpired();
+	if (nservers == 0){
+		errno = ENOTCONN;
+		return -1;}
+	shard = routePath(first);
+	if (routePath(second) != shard){
+		errno = EXDEV;
+		return -1;}
+	flushPath(first);
+	flushPath(second);
+	sprintf(args, "%s%zu,", hdr, flen);
+	memcpy(names, first, flen);
+	memcpy(names + flen, second, slen);
+	if (sendMessageData(servers[shard].conn, cmd, args, names, flen + slen) == -1){
+		return -1;}
+	return getWriteResponse(shard, getResponse(servers[shard].conn, NULL));
+}
+
+/**
+ * Copies file src over file dst (which is created if needed) on the server,
+ * without the data passing through the client. Both must live on the same
+ * server.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int netcopy(const char *src, const char *dst){
+	return sendNames(FN_COPY, "", src, dst) == -1 ? -1 : 0;
+}
+
+/**
+ * Copies len bytes at srcoff in one open file to dstoff in another on the
+ * server, like copy_file_range(). The offsets of the handles don't move.
+ * Returns the number of bytes copied, which is short at the end of the
+ * source file, or -1 with errno set.
+ */
+ssize_t netcopyrange(int srcfd, off_t srcoff, int dstfd, off_t dstoff, size_t len){
+	char args[96];
+	NetHandle *in, *out;
+	
+	in = useHandle(srcfd);
+	out = in != NULL ? useHandle(dstfd) : NULL;
+	if (out == NULL){
+		return -1;}
+	if (in->shard != out->shard){
+		errno = EXDEV;
+		return -1;}
+	if (in->conn != out->conn && in->node > 0 && moveToPrimary(in) == -1){
+		return -1;}
+	if (in->conn != out->conn){
+		// the destination was opened read only on a replica
+		errno = EACCES;
+		return -1;}
+	if (flushHandle(in) == -1 || flushHandle(out) == -1){
+		return -1;}
+	dropMapRange(dstfd, dstoff, len);
+	sprintf(args, "%d,%lld,%d,%lld,%zu", in->remote, (long long) srcoff, out->remote, (long long) dstoff, len);
+	if (sendMessage(in->conn, FN_COPYRANGE, args, '\0') == -1){
+		return -1;}
+	return getWriteResponse(in->shard, getResponse(in->conn, NULL));
+}
+
+/**
+ * Renames a file on the server, like renameat2() with the NET_RENAME_* flags.
+ * Both names must live on the same server, otherwise this fails with EXDEV
+ * the way rename() does across file systems.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int netrename(const char *from, const char *to, int flags){
+	char hdr[16];
+	NetHandle *h;
+	
+	sprintf(hdr, "%d,", flags);
+	if (sendNames(FN_RENAME, hdr, from, to) == -1){
+		return -1;}
+	// handles remember their file's name, to reopen it on the primary
+	for (h = handles; h != NULL; h = h->next){
+		if (strcmp(h->path, from) == 0){
+			free(h->path);
+			h->path = strdup(to);
+		} else if (strcmp(h->path, to) == 0 && (flags & NET_RENAME_EXCHANGE)){
+			free(h->path);
+			h->path = strdup(from);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Slot of a weak checksum in the block table of netdeltawrite().
+ */
+# define weakSlot(w, mask) (((w) * 0x9E3779B1u >> 7) & (mask))
+
+# define DELTA_RETRIES 3				// deltas made again when the file changed under them, see netdeltawrite()
+
+/**
+ * Sends one delta that turns the file behind h into the size bytes in buf,
+ * see netdeltawrite(). The delta carries the stamp of the signature it was
+ * made against and the CRC32C of buf, so the server refuses it with ESTALE
+ * if the file changed in between, and fails it with EIO if the result isn't
+ * buf after all.
+ * Returns size on success, or -1 with errno set.
+ */
+ssize_t sendDelta(NetHandle *h, const void *buf, size_t size){
+	const unsigned char *data = buf;
+	char args[64], *sig, *hdr, *p, *lits;
+	size_t bs, nblocks, mask, i, j, lit, nlit = 0;
+	long long *pblock, *pcount, best, want;
+	uint32_t *weak, w;
+	uint64_t *strong, s = 0;
+	int64_t stamp[4];
+	int *table, len, n = 0, haveStrong;
+	WeakSum sum;
+	
+	// around sqrt(size) keeps both the signature and the literal data small
+	for (bs = DELTA_MIN_BLOCK; bs * bs < size && bs < DELTA_MAX_BLOCK; bs *= 2);
+	
+	sprintf(args, "%d,%zu", h->remote, bs);
+	if (sendMessage(h->conn, FN_SIGNATURE, args, '\0') == -1){
+		return -1;}
+	sig = getResponse(h->conn, &len);
+	if (sig == NULL){
+		return -1;}
+	if (sig[0] != STATUS_SUCCESS || len < 2 + DELTA_STAMP_SIZE){
+		errno = sig[0] != STATUS_SUCCESS ? atoi(sig + 2) : EPROTO;
+		free(sig);
+		return -1;}
+	memcpy(stamp, sig + 2, DELTA_STAMP_SIZE);
+	nblocks = (len - 2 - DELTA_STAMP_SIZE) / DELTA_SUM_SIZE;
+	
+	// open addressing table of block number + 1, keyed on the weak checksum
+	for (mask = 15; mask < nblocks * 2; mask = mask * 2 + 1);
+	table = calloc(mask + 1, sizeof(int));
+	weak = malloc(nblocks * sizeof(uint32_t) + 1);
+	strong = malloc(nblocks * sizeof(uint64_t) + 1);
+	for (i=0; i<nblocks; i++){
+		memcpy(&weak[i], sig + 2 + DELTA_STAMP_SIZE + i * DELTA_SUM_SIZE, 4);
+		memcpy(&strong[i], sig + 6 + DELTA_STAMP_SIZE + i * DELTA_SUM_SIZE, 8);
+		for (j = weakSlot(weak[i], mask); table[j] != 0; j = (j + 1) & mask);
+		table[j] = i + 1;
+	}
+	free(sig);
+	
+	// every match adds at most a literal and a copy
+	pblock = malloc((2 * (size / bs) + 2) * sizeof(long long));
+	pcount = malloc((2 * (size / bs) + 2) * sizeof(long long));
+	i = 0;
+	lit = 0;
+	if (nblocks > 0 && size >= bs){
+		sum = weakSum(data, bs);}
+	while (nblocks > 0 && i + bs <= size){
+		w = weakValue(sum);
+		// prefer the block that continues the last copy, or stays where it is
+		if (n > 0 && lit == i && pblock[n - 1] >= 0){
+			want = pblock[n - 1] + pcount[n - 1];}
 		else {
-			free(message);
-			return bytes;
+			want = i % bs == 0 ? (long long) (i / bs) : -1;}
+		best = -1;
+		haveStrong = 0;
+		for (j = weakSlot(w, mask); table[j] != 0; j = (j + 1) & mask){
+			if (weak[table[j] - 1] != w){
+				continue;}
+			if (!haveStrong){
+				s = strongSum(data + i, bs);
+				haveStrong = 1;}
+			if (strong[table[j] - 1] != s){
+				continue;}
+			if (best == -1 || table[j] - 1 == want){
+				best = table[j] - 1;}
+			if (best == want){
+				break;}
+		}
+		if (best == -1){
+			// no block starts here, slide the window one byte on
+			if (i + bs == size){
+				break;}
+			sum = weakRoll(sum, data[i], data[i + bs], bs);
+			i++;
+			continue;
+		}
+		if (i > lit){
+			pblock[n] = -1;
+			pcount[n++] = i - lit;
+			nlit += i - lit;}
+		if (n > 0 && pblock[n - 1] >= 0 && pblock[n - 1] + pcount[n - 1] == best){
+			pcount[n - 1]++;}
+		else {
+			pblock[n] = best;
+			pcount[n++] = 1;}
+		i += bs;
+		lit = i;
+		if (i + bs <= size){
+			sum = weakSum(data + i, bs);}
+	}
+	if (size > lit){
+		pblock[n] = -1;
+		pcount[n++] = size - lit;
+		nlit += size - lit;}
+	free(table);
+	free(weak);
+	free(strong);
+	
+	// "<fd>,<stamp>,<crc>,<bs>,<size>,<pieces>," then "<block>,<count>," per piece, then the literals
+	hdr = malloc(192 + n * 42);
+	lits = malloc(nlit + 1);
+	p = hdr + sprintf(hdr, "%d,%lld,%lld,%lld,%lld,%u,%zu,%zu,%d,", h->remote, (long long) stamp[0], (long long) stamp[1],
+		(long long) stamp[2], (long long) stamp[3], netcrc32c(0, data, size), bs, size, n);
+	nlit = 0;
+	lit = 0;
+	for (j=0; j<(size_t) n; j++){
+		p += sprintf(p, "%lld,%lld,", pblock[j], pcount[j]);
+		if (pblock[j] == -1){
+			memcpy(lits + nlit, data + lit, pcount[j]);
+			nlit += pcount[j];
+			lit += pcount[j];}
+		else {
+			lit += pcount[j] * bs;}
+	}
+	free(pblock);
+	free(pcount);
+	
+	len = sendMessageData(h->conn, FN_DELTA, hdr, lits, nlit);
+	free(hdr);
+	free(lits);
+	if (len == -1 || getWriteResponse(h->shard, getResponse(h->conn, NULL)) == -1){
+		return -1;}
+	return size;
+}
+
+/**
+ * Replaces the contents of an open file with the size bytes in buf, sending
+ * only what changed. The server sends the checksums of the file's blocks,
+ * and every block buf still holds, wherever it moved to, goes back as a copy
+ * instruction instead of data (see netdelta.h). The handle must be open for
+ * reading and writing, and its offset moves to the end of the new contents.
+ *
+ * A delta the file changed under is made again, a few times. After that, or
+ * if the server found the result isn't buf, buf is written whole.
+ * Returns size on success, or -1 with errno set.
+ */
+ssize_t netdeltawrite(int fd, const void *buf, size_t size){
+	const char *data = buf;
+	ssize_t ret, n;
+	size_t done;
+	NetHandle *h;
+	int tries;
+	
+	h = useHandle(fd);
+	if (h == NULL){
+		return -1;}
+	if (flushHandle(h) == -1){
+		return -1;}
+	dropMapRange(fd, 0, -1);
+	for (tries = 0; tries < DELTA_RETRIES; tries++){
+		ret = sendDelta(h, buf, size);
+		if (ret != -1 || errno != ESTALE){
+			break;}
+	}
+	if (ret == -1 && errno != ESTALE && errno != EIO){
+		return -1;}
+	if (ret == -1){
+		h->offset = 0;
+		for (done = 0; done < size; done += n){
+			n = netwrite(fd, data + done, size - done);
+			if (n == -1){
+				return -1;}
+		}
+		if (netftruncate(fd, size) == -1){
+			return -1;}
+	}
+	h->offset = size;
+	return size;
+}
+
+/**
+ * Asks the server for the CRC32C (see netcrc.h) of len bytes of an open file
+ * from offset on, or of the rest of the file if len is 0, and stores it in
+ * crc. Buffered writes are flushed first. Comparing it with netcrc32c() of
+ * what was written shows the data reached the file intact.
+ * Returns the number of bytes the checksum covers, short at the end of the
+ * file, or -1 with errno set.
+ */
+ssize_t netchecksum(int fd, off_t offset, size_t len, uint32_t *crc){
+	char args[64], *message;
+	unsigned int value;
+	long long covered;
+	NetHandle *h;
+	
+	h = useHandle(fd);
+	if (h == NULL){
+		return -1;}
+	if (flushHandle(h) == -1){
+		return -1;}
+	sprintf(args, "%d,%lld,%zu", h->remote, (long long) offset, len);
+	if (sendMessage(h->conn, FN_CHECKSUM, args, '\0') == -1){
+		return -1;}
+	message = getResponse(h->conn, NULL);
+	if (message == NULL){
+		return -1;}
+	if (message[0] != STATUS_SUCCESS || sscanf(message + 2, "%u,%lld", &value, &covered) != 2){
+		errno = message[0] != STATUS_SUCCESS ? atoi(message + 2) : EPROTO;
+		free(message);
+		if (errno == ESTALE && h->node > 0 && moveToPrimary(h) == 0){
+			// the replica fell behind for good, see netread()
+			return netchecksum(fd, offset, len, crc);}
+		return -1;}
+	free(message);
+	*crc = value;
+	return covered;
+}
+
+/**
+ * Subscribes to the changes of a file, which must exist. From then on every
+ * change to the file, made through any server connection or by another
+ * process on the server's host, is reported by netnextevent(). Changes made
+ * through the server come with the range they touched; a change may be
+ * reported more than once, and changes made in quick succession by other
+ * processes may be reported as one.
+ * 
+ * Returns the id of the watch, or -1 with errno set.
+ */
+int netwatch(const char *path){
+	long long remote;
+	NetWatch *w;
+	int shard;
+	
+	flushExpired();
+	if (nservers == 0){
+		errno = ENOTCONN;
+		return -1;}
+	shard = routePath(path);
+	// changes are reported where they are made, on the primary
+	if (sendMessageData(servers[shard].conn, FN_WATCH, path, NULL, 0) == -1){
+		return -1;}
+	remote = getResponseNum(getResponse(servers[shard].conn, NULL));
+	if (remote == -1){
+		return -1;}
+	w = calloc(sizeof(NetWatch), 1);
+	w->id = ++lastWatch;
+	w->remote = remote;
+	w->conn = servers[shard].conn;
+	w->path = strdup(path);
+	w->next = watches;
+	watches = w;
+	return w->id;
+}
+
+/**
+ * Ends a watch started by netwatch(). Its events still waiting to be taken
+ * by netnextevent() are dropped.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int netunwatch(int watch){
+	NetWatch **wp, *w;
+	QueuedEvent **qp, *q;
+	int status = 0;
+	
+	for (wp = &watches; *wp != NULL && (*wp)->id != watch; wp = &(*wp)->next);
+	if (*wp == NULL){
+		errno = EINVAL;
+		return -1;}
+	w = *wp;
+	*wp = w->next;
+	for (qp = &eventsFirst; *qp != NULL; ){
+		q = *qp;
+		if (q->ev.watch != watch){
+			qp = &q->next;
+			continue;}
+		*qp = q->next;
+		free(q);
+	}
+	for (eventsLast = &eventsFirst; *eventsLast != NULL; eventsLast = &(*eventsLast)->next);
+	// the server may still have sent a few, queueEvent() drops them now
+	if (sendMessageInt(w->conn, FN_UNWATCH, w->remote) == -1 || getResponseNum(getResponse(w->conn, NULL)) == -1){
+		status = -1;}
+	free(w->path);
+	free(w);
+	return status;
+}
+
+/**
+ * Takes the oldest change to a watched file that hasn't been taken yet,
+ * waiting up to timeout ms for one to come in (-1 to wait for ever, 0 not
+ * to wait at all). The path in the event stays valid until its watch ends.
+ * 
+ * Returns 1 with the change in ev, 0 if none came in time, or -1 with errno
+ * set if a connection was lost.
+ */
+int netnextevent(NetEvent *ev, int timeout){
+	Transport *conns[MAX_SERVERS];
+	char ready[MAX_SERVERS], *msg;
+	struct timespec now, until;
+	QueuedEvent *q;
+	NetWatch *w;
+	int n = 0, i, left = timeout;
+	
+	flushExpired();
+	for (w = watches; w != NULL; w = w->next){
+		for (i=0; i<n && conns[i] != w->conn; i++);
+		if (i == n) conns[n++] = w->conn;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	until.tv_sec += timeout / 1000;
+	until.tv_nsec += (timeout % 1000) * 1000000L;
+	while (eventsFirst == NULL){
+		if (n == 0){
+			return 0;}
+		i = transportPoll(conns, n, left, ready);
+		if (i == -1){
+			return -1;}
+		if (i == 0){
+			return 0;}
+		for (i=0; i<n; i++){
+			if (!ready[i]) continue;
+			// nothing was asked, so anything that comes is an event
+			msg = readFrame(conns[i], NULL);
+			if (msg == NULL){
+				return -1;}
+			if (msg[0] == STATUS_EVENT) queueEvent(conns[i], msg);
+			else free(msg);
+		}
+		if (timeout > 0){
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left = (until.tv_sec - now.tv_sec) * 1000 + (until.tv_nsec - now.tv_nsec) / 1000000;
+			if (left < 0) left = 0;
 		}
 	}
-	else {
-		errno = bytes;
+	q = eventsFirst;
+	eventsFirst = q->next;
+	if (eventsFirst == NULL) eventsLast = &eventsFirst;
+	*ev = q->ev;
+	free(q);
+	return 1;
+}
+
+/**
+ * Parses attributes as the server sends them, "<mode>,<size>,<mtime s>,
+ * <mtime ns>,<inode>,<links>", at p into st.
+ * Returns the number of characters parsed, or -1 if they are malformed.
+ */
+int parseAttrs(const char *p, NetStat *st){
+	unsigned long long ino;
+	unsigned long nlink;
+	long long size, sec;
+	unsigned int mode;
+	int used = -1;
+	long nsec;
+	
+	if (sscanf(p, "%u,%lld,%lld,%ld,%llu,%lu%n", &mode, &size, &sec, &nsec, &ino, &nlink, &used) != 6){
+		return -1;}
+	st->mode = mode;
+	st->size = size;
+	st->mtime.tv_sec = sec;
+	st->mtime.tv_nsec = nsec;
+	st->ino = ino;
+	st->nlink = nlink;
+	return used;
+}
+
+/**
+ * Parses the reply to a stat request into st. Frees the message.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int getStatResponse(char *message, NetStat *st){
+	if (message == NULL){
+		return -1;}
+	if (message[0] != STATUS_SUCCESS || parseAttrs(message + 2, st) == -1){
+		errno = message[0] != STATUS_SUCCESS ? atoi(message + 2) : EPROTO;
+		free(message);
+		return -1;}
+	free(message);
+	return 0;
+}
+
+/**
+ * Gets the attributes of a file by name, like stat(), without opening it.
+ * Writes buffered on handles of the file are flushed first, so the size
+ * includes them.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int netstat(const char *path, NetStat *st){
+	int shard;
+	
+	flushExpired();
+	if (nservers == 0){
+		errno = ENOTCONN;
+		return -1;}
+	shard = routePath(path);
+	flushPath(path);
+	if (sendMessageData(servers[shard].conn, FN_STAT, path, NULL, 0) == -1){
+		return -1;}
+	return getStatResponse(getResponse(servers[shard].conn, NULL), st);
+}
+
+/**
+ * Gets the attributes of an open file, like fstat(), after flushing the
+ * writes buffered on the handle.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int netfstat(int fd, NetStat *st){
+	NetHandle *h;
+	
+	h = useHandle(fd);
+	if (h == NULL){
+		return -1;}
+	if (flushHandle(h) == -1){
+		return -1;}
+	if (sendMessageInt(h->conn, FN_FSTAT, h->remote) == -1){
+		return -1;}
+	return getStatResponse(getResponse(h->conn, NULL), st);
+}
+
+// a listing cookie holds the server in its top bits, and where to go on there below
+# define COOKIE_SHARD_SHIFT 40
+# define COOKIE_INDEX_MASK ((1L << COOKIE_SHARD_SHIFT) - 1)
+
+/**
+ * Lists a directory a page at a time, in name order. cookie says where to
+ * go on, and must be 0 for the first page; it is updated for the next one.
+ * Up to max entries are stored in entries, with their attributes if attrs
+ * is set. With several servers the listing is the union of the directory
+ * on all of them, so a name present on more than one (like a subdirectory)
+ * is listed once per server, and a directory none of them has lists empty.
+ * Like readdir(), entries added or removed while listing may be missed or
+ * listed twice.
+ * 
+ * Returns the number of entries stored, 0 once the listing is done, or -1
+ * with errno set.
+ */
+ssize_t netlistdir(const char *path, long *cookie, NetDirEntry *entries, size_t max, int attrs){
+	char args[64], *message, *p, *end;
+	long long next, count, namelen, i;
+	long start = *cookie & COOKIE_INDEX_MASK;
+	int shard = *cookie >> COOKIE_SHARD_SHIFT, len, n;
+	
+	flushExpired();
+	if (nservers == 0){
+		errno = ENOTCONN;
+		return -1;}
+	if (max == 0){
+		errno = EINVAL;
+		return -1;}
+	while (shard < nservers){
+		sprintf(args, "%ld,%zu,%d,", start, max, attrs != 0);
+		if (sendMessageData(servers[shard].conn, FN_LISTDIR, args, path, strlen(path)) == -1){
+			return -1;}
+		message = getResponse(servers[shard].conn, &len);
+		if (message == NULL){
+			return -1;}
+		if (message[0] != STATUS_SUCCESS){
+			errno = atoi(message + 2);
+			free(message);
+			// a server that holds nothing in the directory may not have it
+			if (errno != ENOENT || nservers == 1){
+				return -1;}
+			shard++;
+			start = 0;
+			continue;}
+		
+		p = message + 2;
+		end = message + len;
+		if (sscanf(p, "%lld,%lld,%n", &next, &count, &n) != 2 || count < 0 || count > (long long) max){
+			goto LISTFAIL;}
+		p += n;
+		for (i=0; i<count; i++){
+			if (sscanf(p, "%lld,%n", &namelen, &n) != 1 || namelen < 0 || namelen > NET_NAME_MAX || namelen > end - p - n){
+				goto LISTFAIL;}
+			p += n;
+			memcpy(entries[i].name, p, namelen);
+			entries[i].name[namelen] = '\0';
+			p += namelen;
+			if (attrs && ((n = parseAttrs(p, &entries[i].st)) == -1 || p[n] != SEP_CHAR)){
+				goto LISTFAIL;}
+			if (attrs) p += n + 1;
+		}
 		free(message);
-		return -1;} 
 		
+		if (next == start){
+			// done with this server
+			shard++;
+			start = 0;
+			continue;}
+		start = next;
+		if (count > 0){
+			*cookie = (long) shard << COOKIE_SHARD_SHIFT | start;
+			return count;}
+	}
+	*cookie = (long) nservers << COOKIE_SHARD_SHIFT;
+	return 0;
+	
+	LISTFAIL:
+	free(message);
+	errno = EPROTO;
+	return -1;
+}
+
+/**
+ * Makes a read only view of the first len bytes of an open file, or of all
+ * of it as it is now if len is 0. Reading the view with netmapread() or
+ * netmapptr() fetches the pages it touches and keeps them cached (see
+ * NET_OPT_MAP_CACHE), so a large file can be read at random without pulling
+ * all of it over. Writes made through the library show up in the view, other
+ * clients' only in pages that aren't cached yet. A view must be unmapped
+ * before its handle is closed.
+ * 
+ * Returns the view, or NULL with errno set.
+ */
+NetMap *netmap(int fd, size_t len){
+	NetStat st;
+	NetMap *map;
+	
+	if (useHandle(fd) == NULL){
+		return NULL;}
+	if (len == 0){
+		if (netfstat(fd, &st) == -1){
+			return NULL;}
+		len = st.size;
+	}
+	if (len == 0){
+		errno = EINVAL;
+		return NULL;}
+	map = calloc(sizeof(NetMap), 1);
+	map->fd = fd;
+	map->len = len;
+	map->pages = (len + NET_MAP_PAGE - 1) / NET_MAP_PAGE;
+	map->shortPage = -1;
+	map->lastPage = -1;
+	map->window = 1;
+	map->next = maps;
+	maps = map;
+	return map;
+}
+
+/**
+ * Returns the page of a view with the given index, from the cache if it is
+ * there. A miss fetches the page, and on sequential access the pages after
+ * it, in one read through the view's handle, after writing out what is
+ * buffered on it.
+ * Returns the page, or NULL with errno set.
+ */
+MapPage *mapPage(NetMap *map, long index) {
+	MapPage *page, *p;
+	NetHandle *h;
+	long count, i, limit;
+	ssize_t got;
+	char *run;
+	
+	for (page = map->buckets[index % MAP_BUCKETS]; page != NULL && page->index != index; page = page->chain);
+	if (page != NULL && page != mapFirst) {
+		// most recently used goes first
+		page->prev->next = page->next;
+		if (page->next != NULL) page->next->prev = page->prev;
+		else mapLast = page->prev;
+		page->prev = NULL;
+		page->next = mapFirst;
+		mapFirst->prev = page;
+		mapFirst = page;
+	}
+	if (page == NULL) {
+		h = useHandle(map->fd);
+		if (h == NULL || flushHandle(h) == -1) return NULL;
+		// sequential misses fetch twice as much each time, up to MAP_MAX_WINDOW
+		if (index != map->lastPage + 1) map->window = 1;
+		else if (map->window < MAP_MAX_WINDOW) map->window *= 2;
+		// a fetch takes at most a quarter of the budget, so it can't evict itself
+		limit = mapBudget / NET_MAP_PAGE / 4;
+		count = map->window < limit ? map->window : limit;
+		if (count < 1) count = 1;
+		if (count > map->pages - index) count = map->pages - index;
+		for (i=1; i<count; i++) {
+			// stop short of what is cached already
+			for (p = map->buckets[(index + i) % MAP_BUCKETS]; p != NULL && p->index != index + i; p = p->chain);
+			if (p != NULL) break;
+		}
+		count = i;
+		run = malloc(count * NET_MAP_PAGE);
+		got = readAt(h, (off_t) index * NET_MAP_PAGE, run, count * NET_MAP_PAGE);
+		if (got == -1) {
+			free(run);
+			return NULL;
+		}
+		// the page asked for goes in last, so it ends up first in the cache
+		for (i=count-1; i>=0; i--) {
+			trimMapCache(NET_MAP_PAGE);
+			page = malloc(sizeof(MapPage) + NET_MAP_PAGE);
+			page->map = map;
+			page->index = index + i;
+			page->len = got <= i * NET_MAP_PAGE ? 0 : got - i * NET_MAP_PAGE < NET_MAP_PAGE ? got - i * NET_MAP_PAGE : NET_MAP_PAGE;
+			memcpy(page->data, run + i * NET_MAP_PAGE, page->len);
+			page->chain = map->buckets[page->index % MAP_BUCKETS];
+			map->buckets[page->index % MAP_BUCKETS] = page;
+			page->prev = NULL;
+			page->next = mapFirst;
+			if (mapFirst != NULL) mapFirst->prev = page;
+			else mapLast = page;
+			mapFirst = page;
+			mapBytes += NET_MAP_PAGE;
+			if (page->len < NET_MAP_PAGE && (map->shortPage == -1 || page->index < map->shortPage)) map->shortPage = page->index;
+		}
+		free(run);
+	}
+	map->lastPage = index;
+	return page;
+}
+
+/**
+ * Copies up to size bytes of a view from offset on into buf, like pread().
+ * Returns the number of bytes copied, 0 at the end of the view or of the
+ * file, or -1 with errno set.
+ */
+ssize_t netmapread(NetMap *map, off_t offset, void *buf, size_t size){
+	size_t done = 0, in, n;
+	MapPage *page;
+	
+	flushExpired();
+	if (offset < 0){
+		errno = EINVAL;
+		return -1;}
+	if ((size_t) offset >= map->len){
+		return 0;}
+	if (size > map->len - offset){
+		size = map->len - offset;}
+	while (done < size){
+		page = mapPage(map, (offset + done) / NET_MAP_PAGE);
+		if (page == NULL){
+			return done > 0 ? (ssize_t) done : -1;}
+		in = (offset + done) % NET_MAP_PAGE;
+		if (in >= page->len){
+			// the file ends before the view does
+			break;}
+		n = page->len - in < size - done ? page->len - in : size - done;
+		memcpy((char *) buf + done, page->data + in, n);
+		done += n;
+	}
+	return done;
+}
+
+/**
+ * Returns a pointer to the byte of a view at offset, inside its cached page,
+ * and stores in avail how many bytes from there on are in the same page (0
+ * past the end of the file). The pointer is good until the next call on any
+ * view, which may evict the page.
+ * Returns NULL with errno set on error, or EINVAL if offset isn't in the view.
+ */
+const void *netmapptr(NetMap *map, off_t offset, size_t *avail){
+	MapPage *page;
+	size_t in;
+	
+	flushExpired();
+	if (offset < 0 || (size_t) offset >= map->len){
+		errno = EINVAL;
+		return NULL;}
+	page = mapPage(map, offset / NET_MAP_PAGE);
+	if (page == NULL){
+		return NULL;}
+	in = offset % NET_MAP_PAGE;
+	*avail = in < page->len ? page->len - in : 0;
+	if (*avail > map->len - offset){
+		*avail = map->len - offset;}
+	return page->data + in;
+}
+
+/**
+ * Returns the length of a view.
+ */
+size_t netmaplen(NetMap *map){
+	return map->len;
+}
+
+/**
+ * Ends a view, freeing its cached pages.
+ * Returns 0.
+ */
+int netunmap(NetMap *map){
+	NetMap **mp;
+	
+	dropMapPages(map, 0, map->pages - 1);
+	for (mp = &maps; *mp != map; mp = &(*mp)->next);
+	*mp = map->next;
+	free(map);
+	return 0;
 }
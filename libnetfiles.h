@@ -1,5 +1,7 @@
 
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/types.h>
 
 /**
@@ -14,10 +16,24 @@
  *  Client->Server
  *  - 1 byte mode 'U'/'E'/'T'
  *  - 1 byte separator
+ *  - optionally, the codecs the client can use (see netcompress.h), one byte
+ *    each, best first, and FRAME_CRC to have frames checked (see netcrc.h)
+ *  - optionally, 1 byte sep and the token of a session to resume, or nothing
+ *    for a new session that can be resumed
  *  Server->Client
  *  - 1 byte status
  *  - 1 byte sep
- *  - n bytes error if any
+ *  - 1 byte codec the server picked, none if it can't use any of them, then
+ *    FRAME_CRC if it will check frames, or error if any. With a codec, the
+ *    data of read responses and of write and batched write requests is sent
+ *    as compressed chunks. With FRAME_CRC every later frame ends in a CRC32C,
+ *    and a request that fails its check is answered with EBADMSG
+ *  - if the client sent a token: 1 byte sep and the token of its session, at
+ *    most SESSION_TOKEN_SIZE - 1 bytes and empty if the server keeps no
+ *    sessions. It is the token sent if that session was resumed. If the
+ *    connection drops, the server keeps the session's handles (and the locks
+ *    they hold) for a grace period, for the client to resume it with the
+ *    token. Watches are not kept
  * 
  * Open:
  *  Client->Server
@@ -26,10 +42,15 @@
  *  - n bytes file name
  *  - 1 byte sep
  *  - 1 byte mode
+ *  - 1 byte sep
+ *  - n bytes decimal open options (DURABLE_*, NET_APPEND and NET_CREATE bits
+ *    of the netopen() flags)
  *  Server->Client
  *  - 1 byte status
  *  - 1 byte separator
- *  - n byte FD/error condition
+ *  - n byte handle/error condition. Handles are negative, only mean something
+ *    on the connection they were opened on, and are what the requests below
+ *    call the file descriptor
  * 
  * Close:
  *  Client->Server
@@ -46,10 +67,18 @@
  * 	- 1 byte function 'R'
  *  - 1 byte sep
  *  - 8 byte file descriptor
+ *  - 1 byte sep
+ *  - n bytes decimal offset to read from
+ *  - 1 byte sep
+ *  - n bytes decimal number of bytes wanted (at most MAX_READ_SIZE)
+ *  - optionally, 1 byte sep and n bytes decimal replication sequence number
+ *    the server must have applied before it reads (read your writes)
  *  Server->Client
  *  - 1 byte status
  *  - 1 byte separator
- *  - n bytes data or error condition
+ *  - n bytes data or error condition. On success the data is raw file
+ *    contents, or compressed chunks if a codec was agreed on at connect,
+ *    and the message length gives how many bytes were read
  * 
  * Write:
  *  Client->Server
@@ -57,16 +86,265 @@
  *  - 1 byte sep
  *  - 8 byte file descriptor
  *  - 1 byte sep
- *  - n bytes data
+ *  - n bytes decimal offset to write at
+ *  - 1 byte sep
+ *  - n bytes raw data, up to the end of the message
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - 8 byte length/error condition. A replication primary follows the
+ *    length with a sep and the sequence number of the write in its log
+ * 
+ * Batched write:
+ *  Client->Server
+ * 	- 1 byte function 'V'
+ *  - 1 byte sep
+ *  - 8 byte file descriptor
+ *  - 1 byte sep
+ *  - n bytes decimal number of ranges
+ *  - 1 byte sep
+ *  - for each range: decimal offset, sep, decimal length, sep
+ *  - raw data of every range back to back, up to the end of the message
+ *  The data of either write is sent as compressed chunks if a codec was
+ *  agreed on at connect
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - 8 byte total length/error condition, and the sequence number of the
+ *    last range from a replication primary, as for 'W'
+ * 
+ * Truncate:
+ *  Client->Server
+ * 	- 1 byte function 'T'
+ *  - 1 byte sep
+ *  - 8 byte file descriptor
+ *  - 1 byte sep
+ *  - n bytes decimal new size
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - 0/error condition, and the sequence number from a replication primary,
+ *    as for 'W'
+ * 
+ * Allocate:
+ *  Client->Server
+ * 	- 1 byte function 'P'
+ *  - 1 byte sep
+ *  - 8 byte file descriptor
+ *  - 1 byte sep
+ *  - decimal NET_FALLOC_* mode, sep, decimal offset, sep, decimal length
+ *  Server->Client
+ *  - as for 'T'
+ * 
+ * Fsync:
+ *  Client->Server
+ * 	- 1 byte function 'Y'
+ *  - 1 byte sep
+ *  - 8 byte file descriptor
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - n byte error condition if any
+ * 
+ * Copy (whole file, replacing or creating the destination):
+ *  Client->Server
+ * 	- 1 byte function 'K'
+ *  - 1 byte sep
+ *  - n bytes decimal length of the source name
+ *  - 1 byte sep
+ *  - source name, then destination name up to the end of the message
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - n bytes length copied/error condition, and the sequence number from a
+ *    replication primary, as for 'W'
+ * 
+ * Copy range:
+ *  Client->Server
+ * 	- 1 byte function 'G'
+ *  - 1 byte sep
+ *  - source file descriptor, sep, decimal source offset, sep,
+ *    destination file descriptor, sep, decimal destination offset, sep,
+ *    decimal number of bytes
+ *  Server->Client
+ *  - as for copy
+ * 
+ * Rename:
+ *  Client->Server
+ * 	- 1 byte function 'N'
+ *  - 1 byte sep
+ *  - n bytes decimal NET_RENAME_* flags
+ *  - 1 byte sep
+ *  - n bytes decimal length of the old name
+ *  - 1 byte sep
+ *  - old name, then new name up to the end of the message
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - 0/error condition, and the sequence number from a replication primary
+ * 
+ * Signature (of a file about to be rewritten with a delta):
+ *  Client->Server
+ * 	- 1 byte function 'X'
+ *  - 1 byte sep
+ *  - 8 byte file descriptor
+ *  - 1 byte sep
+ *  - n bytes decimal block size, DELTA_MIN_BLOCK to DELTA_MAX_BLOCK
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - the file's stamp as 8 byte binary size, version, and modification time
+ *    in seconds and nanoseconds, then for every whole block a 4 byte weak and
+ *    an 8 byte strong checksum (see netdelta.h), or an error condition
+ * 
+ * Delta:
+ *  Client->Server
+ * 	- 1 byte function 'D'
+ *  - 1 byte sep
+ *  - 8 byte file descriptor, opened for reading and writing
+ *  - 1 byte sep
+ *  - the four fields of the signature's stamp in decimal, each followed by a
+ *    sep, then the decimal CRC32C of the new contents, sep
+ *  - decimal block size, sep, decimal new file size, sep, decimal number of
+ *    pieces, sep
+ *  - for each piece of the new contents, in order: decimal block, sep,
+ *    decimal count, sep. A piece copies count blocks from block on out of the
+ *    old contents, or is count bytes of literal data if block is -1
+ *  - the literal data of every piece back to back, up to the end of the message
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - n bytes new file size/error condition, and the sequence number from a
+ *    replication primary, as for 'W'. ESTALE if the file changed since the
+ *    signature, and nothing was written; EIO if the new contents don't match
+ *    the CRC32C
+ * 
+ * Checksum:
+ *  Client->Server
+ * 	- 1 byte function 'H'
+ *  - 1 byte sep
+ *  - 8 byte file descriptor
+ *  - 1 byte sep
+ *  - n bytes decimal offset
+ *  - 1 byte sep
+ *  - n bytes decimal length, 0 for the rest of the file
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - decimal CRC32C, sep, decimal number of bytes it covers/error condition
+ * 
+ * Watch:
+ *  Client->Server
+ * 	- 1 byte function 'Q'
+ *  - 1 byte sep
+ *  - n bytes file name
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - n bytes decimal watch id/error condition
+ * 
+ * Unwatch:
+ *  Client->Server
+ * 	- 1 byte function 'Z'
+ *  - 1 byte sep
+ *  - n bytes decimal watch id
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - nothing/error condition
+ * 
+ * Event (Server->Client, unasked, on a connection with watches; it may come
+ * ahead of the response to any request):
+ *  - 1 byte status 'E'
+ *  - 1 byte separator
+ *  - decimal watch id, sep, decimal offset and length of the range that
+ *    changed, sep, decimal new file size (-1 once the file is deleted), sep,
+ *    decimal number of changes reported for the file so far
+ * 
+ * Stat:
+ *  Client->Server
+ * 	- 1 byte function 'A'
+ *  - 1 byte sep
+ *  - n bytes file name
  *  Server->Client
  *  - 1 byte status
  *  - 1 byte separator
- *  - 8 byte length/error condition
+ *  - attributes/error condition: decimal mode, sep, size, sep, mtime seconds,
+ *    sep, mtime nanoseconds, sep, inode, sep, link count
+ * 
+ * Fstat:
+ *  Client->Server
+ * 	- 1 byte function 'J'
+ *  - 1 byte sep
+ *  - 8 byte file descriptor
+ *  Server->Client
+ *  - as for 'A'
+ * 
+ * List directory:
+ *  Client->Server
+ * 	- 1 byte function 'M'
+ *  - 1 byte sep
+ *  - n bytes decimal index of the first entry wanted, in name order
+ *  - 1 byte sep
+ *  - n bytes decimal most entries wanted
+ *  - 1 byte sep
+ *  - 1 byte '1' to have each entry's attributes, '0' for names only
+ *  - 1 byte sep
+ *  - n bytes directory name
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - decimal index of the next page, sep, decimal number of entries, sep/error
+ *    condition
+ *  - for each entry: decimal name length, sep, the name, then if asked for
+ *    its attributes as for 'A' and sep. The listing is done when the next
+ *    page would start where this one did
+ * 
+ * End session (the client is done, nothing is kept for it once the
+ * connection closes):
+ *  Client->Server
+ * 	- 1 byte function 'B'
+ *  - 1 byte sep
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ * 
+ * Stats:
+ *  Client->Server
+ * 	- 1 byte function 'I'
+ *  - 1 byte sep
+ *  Server->Client
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - n bytes of "name value" lines, one per server counter
+ * 
+ * Replicate (sent by a replica to its primary):
+ *  Client->Server
+ * 	- 1 byte function 'L'
+ *  - 1 byte sep
+ *  - n bytes decimal sequence number of the first log entry wanted
+ *  Server->Client, one message per log entry from then on
+ *  - 1 byte status
+ *  - 1 byte separator
+ *  - decimal sequence number, sep, decimal newest sequence number in the log,
+ *    sep, decimal primary time of the entry in ms, sep, 1 byte operation,
+ *    sep, decimal offset, sep, decimal path length, sep
+ *  - path, then the data of the operation up to the end of the message:
+ *    'W' the raw data written at offset; 'G' "<dst offset>,<len>,<dst path>"
+ *    copied from offset; 'N' the new name, with the flags in offset;
+ *    'D' the delta request after the CRC32C, offset is 0;
+ *    'T' nothing, the file was truncated to offset; 'P' "<mode>,<len>" as
+ *    for an allocate request at offset
+ *  A failure (ERANGE) means the entry is no longer in the primary's log.
  */
 
 #ifndef __LIBNETFILES_H
 #  define __LIBNETFILES_H
 
+#  ifdef __cplusplus
+extern "C" {
+#  endif
+
 #  define MODE_UNRESTRCT '0'
 #  define MODE_EXCLUSIVE '1'
 #  define MODE_TRANSACTN '2'
@@ -75,24 +353,158 @@
 #  define MODE_WR  'W'
 #  define MODE_RW  'B'
 
+// durability of writes, or'ed into the netopen() flags along with the mode
+#  define DURABLE_NONE  0x000	// acknowledged once written to the page cache
+#  define DURABLE_SYNC  0x100	// fdatasync() before every acknowledgement
+#  define DURABLE_GROUP 0x200	// acknowledged after the next group commit round
+#  define DURABLE_MASK  0x300
+
+// like O_APPEND (and the same bit): every write goes to the end of the file, in one piece
+#  define NET_APPEND    0x400
+// like O_CREAT: opening for writing creates the file, and the directories on the way to it
+#  define NET_CREATE    0x800
+
 #  define FN_OPEN  'O'
 #  define FN_CLOSE 'C'
 #  define FN_WRITE 'W'
 #  define FN_READ  'R'
+#  define FN_STATS 'I'
+#  define FN_WRITEV 'V'
+#  define FN_FSYNC 'Y'
+#  define FN_REPLICATE 'L'
+#  define FN_COPY 'K'
+#  define FN_COPYRANGE 'G'
+#  define FN_RENAME 'N'
+#  define FN_SIGNATURE 'X'
+#  define FN_DELTA 'D'
+#  define FN_CHECKSUM 'H'
+#  define FN_WATCH 'Q'
+#  define FN_UNWATCH 'Z'
+#  define FN_STAT 'A'
+#  define FN_FSTAT 'J'
+#  define FN_LISTDIR 'M'
+#  define FN_TRUNCATE 'T'
+#  define FN_ALLOCATE 'P'
+#  define FN_ENDSESSION 'B'
 #  define SEP_CHAR ','
 
 #  define STATUS_SUCCESS 'S'
 #  define STATUS_FAILURE 'F'
+#  define STATUS_EVENT   'E'
 
 #  define PORT_NUM 20000
 
+// servers a client can spread its files over, and points per server on the hash ring
+#  define MAX_SERVERS 64
+#  define SERVER_VNODES 128
+// replicas per server, see netserverinit()
+#  define MAX_REPLICAS 7
+
 #  define INVALID_FILE_MODE -55
 
+// longest session token, see the connect message
+#  define SESSION_TOKEN_SIZE 32
+
+#  define MAX_READ_SIZE (64 * 1024 * 1024)
+
+// longest frame either side takes, CRC included: a write of MAX_READ_SIZE
+// bytes still fits with its header, compressed or not
+#  define MAX_FRAME_SIZE (MAX_READ_SIZE + 1024 * 1024)
+
+// client side write-behind limits, per handle
+#  define WB_MAX_BYTES    (1024 * 1024)
+#  define WB_MAX_RANGES   256
+#  define WB_MAX_DELAY_MS 50
+
+// options for netsetoption()
+#  define NET_OPT_READ_YOUR_WRITES 1	// reads from replicas see this client's own writes
+#  define NET_OPT_COMPRESSION      2	// offer compression over TCP (the default), from the next netserverinit()
+#  define NET_OPT_CHECKSUM         3	// have every frame checked with a CRC32C, from the next netserverinit()
+#  define NET_OPT_MAP_CACHE        4	// MB of memory the pages of netmap() views may take, over all of them
+
+// flags for netrename(), same as renameat2()
+#  define NET_RENAME_NOREPLACE 1	// fail with EEXIST if the new name exists
+#  define NET_RENAME_EXCHANGE  2	// swap the two files, both must exist
+
+// modes for netfallocate(), same as fallocate(); 0 allocates and may grow the file
+#  define NET_FALLOC_KEEP_SIZE  0x01	// don't change the size, even past the end
+#  define NET_FALLOC_PUNCH_HOLE 0x02	// free the range, it reads as zeros; needs KEEP_SIZE
+#  define NET_FALLOC_ZERO_RANGE 0x10	// zero the range, allocating it
+
+typedef struct {
+	off_t offset;
+	size_t len;
+} WriteRange;
+
+// attributes of a file, see netstat()
+typedef struct {
+	mode_t mode;			// type and permission bits, as in struct stat
+	off_t size;
+	struct timespec mtime;
+	ino_t ino;
+	nlink_t nlink;
+} NetStat;
+
+#  define NET_NAME_MAX 255
+
+// an entry of a directory, see netlistdir()
+typedef struct {
+	char name[NET_NAME_MAX + 1];
+	NetStat st;				// only filled in when asked for
+} NetDirEntry;
+
+// views of open files, see netmap()
+#  define NET_MAP_PAGE  (64 * 1024)			// views are fetched and cached in pages this big, on this alignment
+#  define NET_MAP_CACHE (64 * 1024 * 1024)	// default budget for their pages, see NET_OPT_MAP_CACHE
+
+typedef struct s_NetMap NetMap;
+
+// a change to a watched file, see netwatch()
+typedef struct {
+	int watch;			// as returned by netwatch()
+	const char *path;	// as given to netwatch(), valid until netunwatch()
+	off_t offset;		// range that changed, the whole file if the server can't tell
+	off_t len;
+	off_t size;			// of the file after the change, -1 once it was deleted
+	long version;		// changes the server has reported for the file so far
+} NetEvent;
+
 int netopen(const char *pathname, int flags);
+off_t netlseek(int fd, off_t offset, int whence);
 ssize_t netread(int fd, void *buf, size_t size);
 ssize_t netwrite(int fd, const void *buf, size_t size);
 int netclose(int fd);
+int netflush(int fd);
+int netfsync(int fd);
+int netstats(char *buf, size_t size);
+int netsetoption(int option, int value);
+int netcopy(const char *src, const char *dst);
+ssize_t netcopyrange(int srcfd, off_t srcoff, int dstfd, off_t dstoff, size_t len);
+int netrename(const char *from, const char *to, int flags);
+ssize_t netdeltawrite(int fd, const void *buf, size_t size);
+ssize_t netchecksum(int fd, off_t offset, size_t len, uint32_t *crc);
+uint32_t netcrc32c(uint32_t crc, const void *data, size_t len);
+int netwatch(const char *path);
+int netunwatch(int watch);
+int netnextevent(NetEvent *ev, int timeout);
+int netstat(const char *path, NetStat *st);
+int netfstat(int fd, NetStat *st);
+ssize_t netlistdir(const char *path, long *cookie, NetDirEntry *entries, size_t max, int attrs);
+int netftruncate(int fd, off_t length);
+int netfallocate(int fd, int mode, off_t offset, off_t len);
+NetMap *netmap(int fd, size_t len);
+ssize_t netmapread(NetMap *map, off_t offset, void *buf, size_t size);
+const void *netmapptr(NetMap *map, off_t offset, size_t *avail);
+size_t netmaplen(NetMap *map);
+int netunmap(NetMap *map);
 
+// hostname is a host name or a tcp://, unix:// or shm:// url (see nettransport.h),
+// or a comma separated list of them to spread files over several servers. Each
+// server may be followed by its replicas, separated by '|': "primary|replica|..."
 int netserverinit(char * hostname, int filemode);
 
+#  ifdef __cplusplus
+}
+#  endif
+
 #endif
\ No newline at end of file
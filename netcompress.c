@@ -0,0 +1,150 @@
+#include "netcompress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <zlib.h>
+
+/**
+ * Every thread keeps one deflate and one inflate stream and resets them
+ * between chunks, since setting one up costs more than a small chunk.
+ */
+static __thread z_stream *deflater = NULL;
+static __thread z_stream *inflater = NULL;
+
+/**
+ * Ends and frees the calling thread's streams. Threads that come and go,
+ * like the server's one per connection, call it before they exit.
+ */
+void codecRelease() {
+	if (deflater != NULL) {
+		deflateEnd(deflater);
+		free(deflater);
+		deflater = NULL;
+	}
+	if (inflater != NULL) {
+		inflateEnd(inflater);
+		free(inflater);
+		inflater = NULL;
+	}
+}
+
+int codecSupported(char codec) {
+	return codec == CODEC_DEFLATE;
+}
+
+/**
+ * Writes one chunk of up to COMPRESS_CHUNK bytes of data to out, header
+ * included, compressed if that makes it smaller. out must have room for
+ * len + COMPRESS_HDR bytes.
+ *
+ * Returns the number of bytes written to out.
+ */
+size_t compressChunk(char codec, const char *data, size_t len, char *out) {
+	uint32_t raw = len, sent = len;
+
+	if (codec == CODEC_DEFLATE && len >= COMPRESS_MIN) {
+		if (deflater == NULL) {
+			deflater = calloc(sizeof(z_stream), 1);
+			// raw deflate, the chunk header already says how long it is
+			if (deflateInit2(deflater, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				free(deflater);
+				deflater = NULL;
+			}
+		}
+		if (deflater != NULL) {
+			deflater->next_in = (Bytef *) data;
+			deflater->avail_in = len;
+			deflater->next_out = (Bytef *) out + COMPRESS_HDR;
+			// anything that doesn't come out smaller is sent as is
+			deflater->avail_out = len - 1;
+			if (deflate(deflater, Z_FINISH) == Z_STREAM_END) sent = deflater->total_out;
+			deflateReset(deflater);
+		}
+	}
+	if (sent == raw) memcpy(out + COMPRESS_HDR, data, len);
+	memcpy(out, &raw, 4);
+	memcpy(out + 4, &sent, 4);
+	return COMPRESS_HDR + sent;
+}
+
+/**
+ * Splits len bytes of data into chunks and writes them to out, which must
+ * have room for payloadBound(len) bytes.
+ *
+ * Returns the number of bytes written to out.
+ */
+size_t encodePayload(char codec, const char *data, size_t len, char *out) {
+	size_t done = 0, n, total = 0;
+
+	do {
+		n = len - done < COMPRESS_CHUNK ? len - done : COMPRESS_CHUNK;
+		total += compressChunk(codec, data + done, n, out + total);
+		done += n;
+	} while (done < len);
+	return total;
+}
+
+/**
+ * Reassembles the inlen bytes of chunks at in. The length of the result is
+ * stored in len.
+ *
+ * Returns a malloc()'ed buffer, or NULL with errno set to EINVAL if the
+ * chunks are malformed.
+ */
+char *decodePayload(char codec, const char *in, size_t inlen, size_t *len) {
+	const char *p, *end = in + inlen;
+	uint32_t raw, sent = 0;
+	size_t total = 0;
+	char *out;
+	int ret;
+
+	// one pass for the size, so the result can be allocated once
+	for (p = in; end - p >= COMPRESS_HDR; p += COMPRESS_HDR + sent) {
+		memcpy(&raw, p, 4);
+		memcpy(&sent, p + 4, 4);
+		if (raw > COMPRESS_CHUNK || sent > raw || sent > end - p - COMPRESS_HDR) break;
+		total += raw;
+	}
+	if (p != end) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	out = malloc(total + 1);
+	total = 0;
+	for (p = in; p < end; p += COMPRESS_HDR + sent) {
+		memcpy(&raw, p, 4);
+		memcpy(&sent, p + 4, 4);
+		if (sent == raw) {
+			memcpy(out + total, p + COMPRESS_HDR, raw);
+			total += raw;
+			continue;
+		}
+		if (codec != CODEC_DEFLATE) break;
+		if (inflater == NULL) {
+			inflater = calloc(sizeof(z_stream), 1);
+			if (inflateInit2(inflater, -15) != Z_OK) {
+				free(inflater);
+				inflater = NULL;
+				break;
+			}
+		}
+		inflater->next_in = (Bytef *) p + COMPRESS_HDR;
+		inflater->avail_in = sent;
+		inflater->next_out = (Bytef *) out + total;
+		inflater->avail_out = raw;
+		ret = inflate(inflater, Z_FINISH);
+		if (ret == Z_STREAM_END && inflater->avail_out != 0) ret = Z_DATA_ERROR;
+		inflateReset(inflater);
+		if (ret != Z_STREAM_END) break;
+		total += raw;
+	}
+	if (p != end) {
+		free(out);
+		errno = EINVAL;
+		return NULL;
+	}
+	*len = total;
+	return out;
+}
@@ -0,0 +1,41 @@
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Payload compression for read and write transfers.
+ *
+ * A client offers the codecs it can use when it connects, and the server
+ * picks one (see the connect message in libnetfiles.h). From then on the
+ * data of read responses and of write requests on that connection is sent
+ * as a run of chunks, each at most COMPRESS_CHUNK bytes of file data:
+ *
+ *  - 4 byte binary length of the chunk's file data
+ *  - 4 byte binary length of the chunk as sent
+ *  - the chunk as sent
+ *
+ * A chunk is compressed only if it is at least COMPRESS_MIN bytes and
+ * compressing it saves space. Otherwise it is sent as is, which the receiver
+ * tells from both lengths being equal.
+ */
+
+#ifndef __NETCOMPRESS_H
+#  define __NETCOMPRESS_H
+
+#  define CODEC_NONE    0
+#  define CODEC_DEFLATE 'z'			// zlib, at its fastest level
+
+#  define COMPRESS_CHUNK (64 * 1024)
+#  define COMPRESS_MIN   1024
+#  define COMPRESS_HDR   8
+
+// most bytes a payload of len bytes can take on the wire
+#  define payloadBound(len) ((len) + ((len) / COMPRESS_CHUNK + 1) * COMPRESS_HDR)
+
+int codecSupported(char codec);
+void codecRelease();
+size_t compressChunk(char codec, const char *data, size_t len, char *out);
+size_t encodePayload(char codec, const char *data, size_t len, char *out);
+char *decodePayload(char codec, const char *in, size_t inlen, size_t *len);
+
+#endif
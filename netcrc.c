@@ -0,0 +1,117 @@
+#include "netcrc.h"
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#  include <nmmintrin.h>
+#endif
+
+# define POLY   0x82F63B78u		// Castagnoli polynomial, bit reversed
+# define STRIPE 4096			// bytes per stream of the interleaved kernel
+
+/**
+ * The kernels work on the raw CRC register, without the inversions at both
+ * ends. The register is linear in its starting value, so running the same
+ * data from two starting values differs by the first value moved past the
+ * data's length in zero bytes. That lets the hardware kernel run three
+ * stripes as independent streams and join them afterwards.
+ */
+
+static uint32_t table[8][256];			// slice by 8 tables
+static uint32_t shiftTable[4][256];		// moves a register past STRIPE zero bytes, a byte at a time
+
+static uint32_t crcSoft(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t w;
+
+	while (len >= 8) {
+		memcpy(&w, p, 8);
+		w ^= crc;
+		crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^ table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff]
+			^ table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^ table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+static uint32_t (*kernel)(uint32_t, const unsigned char *, size_t) = crcSoft;
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+
+#if defined(__x86_64__)
+static inline uint32_t shiftStripe(uint32_t crc) {
+	return shiftTable[0][crc & 0xff] ^ shiftTable[1][(crc >> 8) & 0xff] ^ shiftTable[2][(crc >> 16) & 0xff] ^ shiftTable[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crcHardware(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t c0, c1, c2, w0, w1, w2;
+	size_t i;
+
+	// the crc32 instruction takes 3 cycles but can start one a cycle
+	while (len >= 3 * STRIPE) {
+		c0 = crc;
+		c1 = 0;
+		c2 = 0;
+		for (i=0; i<STRIPE; i+=8) {
+			memcpy(&w0, p + i, 8);
+			memcpy(&w1, p + STRIPE + i, 8);
+			memcpy(&w2, p + 2 * STRIPE + i, 8);
+			c0 = _mm_crc32_u64(c0, w0);
+			c1 = _mm_crc32_u64(c1, w1);
+			c2 = _mm_crc32_u64(c2, w2);
+		}
+		crc = shiftStripe(shiftStripe(c0) ^ c1) ^ c2;
+		p += 3 * STRIPE;
+		len -= 3 * STRIPE;
+	}
+	c0 = crc;
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w0, p, 8);
+		c0 = _mm_crc32_u64(c0, w0);
+	}
+	while (len-- > 0) c0 = _mm_crc32_u8(c0, *p++);
+	return c0;
+}
+#endif
+
+static void initTables() {
+	uint32_t c, basis[32];
+	int i, j, k;
+
+	for (i=0; i<256; i++) {
+		c = i;
+		for (j=0; j<8; j++) c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+		table[0][i] = c;
+	}
+	for (i=0; i<256; i++) {
+		for (k=1; k<8; k++) table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+	}
+	// moving past zeros is linear, so one pass per register bit is enough
+	for (j=0; j<32; j++) {
+		c = 1u << j;
+		for (i=0; i<STRIPE; i++) c = (c >> 8) ^ table[0][c & 0xff];
+		basis[j] = c;
+	}
+	for (k=0; k<4; k++) {
+		for (i=0; i<256; i++) {
+			c = 0;
+			for (j=0; j<8; j++) {
+				if (i & (1 << j)) c ^= basis[8 * k + j];
+			}
+			shiftTable[k][i] = c;
+		}
+	}
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	kernel = __builtin_cpu_supports("sse4.2") ? crcHardware : crcSoft;
+#endif
+}
+
+/**
+ * CRC32C of len bytes, continuing from crc, the CRC32C of everything before
+ * them (0 at the start).
+ */
+uint32_t netcrc32c(uint32_t crc, const void *data, size_t len) {
+	pthread_once(&initOnce, initTables);
+	return ~kernel(~crc, data, len);
+}
@@ -0,0 +1,24 @@
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * CRC32C (Castagnoli), as used by iSCSI, ext4 and friends, for checking
+ * frames on the wire and the contents of files (netchecksum()).
+ *
+ * A client that sets NET_OPT_CHECKSUM asks for FRAME_CRC when it connects
+ * (see libnetfiles.h). If the server agrees, every frame after the connect
+ * exchange, in either direction, ends with the 4 byte binary CRC32C of
+ * everything between the length and the CRC. The length counts the CRC.
+ */
+
+#ifndef __NETCRC_H
+#  define __NETCRC_H
+
+#  define FRAME_CRC 'c'
+#  define CRC_SIZE  4
+
+// crc is the result for the data before, 0 to start
+uint32_t netcrc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,163 @@
+#include "netdelta.h"
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#  include <immintrin.h>
+#endif
+
+/****************************************************************************************************
+ * 																									*
+ * Weak checksum																					*
+ * 																									*
+ * Computed 16 (SSE2) or 32 (AVX2) bytes at a time on x86-64, and a byte at							*
+ * a time elsewhere. For a chunk starting at i the contribution to b is								*
+ * (len - i) * sum(chunk) - sum(j * chunk[j]), so a SAD against zero gives							*
+ * the byte sum and a multiply-add against the weights 0, 1, 2 ... gives the						*
+ * second term, kept in vector lanes until the end.													*
+ * 																									*
+ ****************************************************************************************************/
+
+/**
+ * Adds bytes i up to len of a window of len bytes to a checksum, one at a time.
+ */
+static WeakSum weakTail(const unsigned char *data, size_t i, size_t len, WeakSum sum) {
+	for (; i < len; i++) {
+		sum.a += data[i];
+		sum.b += (uint32_t) (len - i) * data[i];
+	}
+	return sum;
+}
+
+static WeakSum weakSumScalar(const unsigned char *data, size_t len) {
+	WeakSum sum = {0, 0};
+
+	return weakTail(data, 0, len, sum);
+}
+
+static WeakSum (*kernel)(const unsigned char *, size_t) = weakSumScalar;
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+
+#if defined(__x86_64__)
+static WeakSum weakSumSSE2(const unsigned char *data, size_t len) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i wlo = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m128i whi = _mm_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i x, sad, weighted = zero;
+	WeakSum sum = {0, 0};
+	uint32_t bytes;
+	size_t i;
+
+	for (i=0; i + 16 <= len; i += 16) {
+		x = _mm_loadu_si128((const __m128i *) (data + i));
+		sad = _mm_sad_epu8(x, zero);
+		bytes = _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+		sum.a += bytes;
+		sum.b += (uint32_t) (len - i) * bytes;
+		weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), wlo));
+		weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), whi));
+	}
+	weighted = _mm_add_epi32(weighted, _mm_shuffle_epi32(weighted, _MM_SHUFFLE(1, 0, 3, 2)));
+	weighted = _mm_add_epi32(weighted, _mm_shuffle_epi32(weighted, _MM_SHUFFLE(2, 3, 0, 1)));
+	sum.b -= (uint32_t) _mm_cvtsi128_si32(weighted);
+	return weakTail(data, i, len, sum);
+}
+
+__attribute__((target("avx2")))
+static WeakSum weakSumAVX2(const unsigned char *data, size_t len) {
+	const __m256i zero = _mm256_setzero_si256();
+	// unpacking works within each 128 bit half, so the weights follow suit
+	const __m256i wlo = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 16, 17, 18, 19, 20, 21, 22, 23);
+	const __m256i whi = _mm256_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15, 24, 25, 26, 27, 28, 29, 30, 31);
+	__m256i x, sad, weighted = zero;
+	__m128i half;
+	WeakSum sum = {0, 0};
+	uint32_t bytes;
+	size_t i;
+
+	for (i=0; i + 32 <= len; i += 32) {
+		x = _mm256_loadu_si256((const __m256i *) (data + i));
+		sad = _mm256_sad_epu8(x, zero);
+		half = _mm_add_epi64(_mm256_castsi256_si128(sad), _mm256_extracti128_si256(sad, 1));
+		bytes = _mm_cvtsi128_si32(half) + _mm_extract_epi16(half, 4);
+		sum.a += bytes;
+		sum.b += (uint32_t) (len - i) * bytes;
+		weighted = _mm256_add_epi32(weighted, _mm256_madd_epi16(_mm256_unpacklo_epi8(x, zero), wlo));
+		weighted = _mm256_add_epi32(weighted, _mm256_madd_epi16(_mm256_unpackhi_epi8(x, zero), whi));
+	}
+	half = _mm_add_epi32(_mm256_castsi256_si128(weighted), _mm256_extracti128_si256(weighted, 1));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+	sum.b -= (uint32_t) _mm_cvtsi128_si32(half);
+	return weakTail(data, i, len, sum);
+}
+#endif
+
+static void pickKernel() {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	kernel = __builtin_cpu_supports("avx2") ? weakSumAVX2 : weakSumSSE2;
+#endif
+}
+
+/**
+ * Weak checksum of len bytes, using the widest vector unit the CPU has.
+ */
+WeakSum weakSum(const unsigned char *data, size_t len) {
+	pthread_once(&kernelOnce, pickKernel);
+	return kernel(data, len);
+}
+
+/**
+ * Moves a window of len bytes one byte on: out leaves at the front and in
+ * joins at the back.
+ */
+WeakSum weakRoll(WeakSum sum, unsigned char out, unsigned char in, size_t len) {
+	sum.a += in - out;
+	sum.b += sum.a - (uint32_t) len * out;
+	return sum;
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Strong checksum																					*
+ * 																									*
+ * A multiply-rotate hash over 32 byte stripes, with four independent lanes							*
+ * so the multiplies of one stripe overlap instead of waiting on each other.						*
+ * 																									*
+ ****************************************************************************************************/
+
+# define PRIME1 0x9E3779B185EBCA87ULL
+# define PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+uint64_t strongSum(const unsigned char *data, size_t len) {
+	uint64_t lane[4] = { PRIME1 + PRIME2, PRIME2, 0, -PRIME1 }, word, h;
+	size_t i;
+	int l;
+
+	for (i=0; i + 32 <= len; i += 32) {
+		for (l=0; l<4; l++) {
+			memcpy(&word, data + i + l * 8, 8);
+			lane[l] = rotl(lane[l] + word * PRIME2, 31) * PRIME1;
+		}
+	}
+	h = rotl(lane[0], 1) + rotl(lane[1], 7) + rotl(lane[2], 12) + rotl(lane[3], 18) + len;
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&word, data + i, 8);
+		h ^= rotl(word * PRIME2, 31) * PRIME1;
+		h = rotl(h, 27) * PRIME1 + PRIME2;
+	}
+	for (; i < len; i++) {
+		h ^= data[i] * PRIME1;
+		h = rotl(h, 11) * PRIME2;
+	}
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME1;
+	h ^= h >> 32;
+	return h;
+}
@@ -0,0 +1,39 @@
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Block checksums for delta writes (netdeltawrite() in libnetfiles).
+ *
+ * The server splits a file into blocks and sends a weak and a strong checksum
+ * of each. The client slides a window over the new contents, rolling the
+ * weak checksum one byte at a time, and only computes the strong checksum of
+ * the window when the weak one matches a block. Blocks found this way are
+ * sent as copy instructions, everything else as literal data.
+ *
+ * The weak checksum is the rsync one: with a the sum of the bytes and b the
+ * sum of each byte times its distance from the end of the window, both
+ * modulo 2^32, it is (a & 0xffff) | b << 16. The strong checksum is a 64 bit
+ * hash.
+ */
+
+#ifndef __NETDELTA_H
+#  define __NETDELTA_H
+
+#  define DELTA_MIN_BLOCK 512
+#  define DELTA_MAX_BLOCK (64 * 1024)
+#  define DELTA_STAMP_SIZE 32		// bytes a signature starts with: the file's size, version and mtime
+#  define DELTA_SUM_SIZE 12			// bytes per block in a signature: weak, then strong
+
+typedef struct {
+	uint32_t a;
+	uint32_t b;
+} WeakSum;
+
+WeakSum weakSum(const unsigned char *data, size_t len);
+WeakSum weakRoll(WeakSum sum, unsigned char out, unsigned char in, size_t len);
+uint64_t strongSum(const unsigned char *data, size_t len);
+
+#  define weakValue(s) (((s).a & 0xffff) | (s).b << 16)
+
+#endif
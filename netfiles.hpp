@@ -0,0 +1,478 @@
+
+#include <coroutine>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "libnetfiles.h"
+
+/**
+ * C++20 coroutine layer over libnetfiles, header only.
+ *
+ * libnetfiles keeps its connections and handles in globals and has no locking,
+ * so it must only ever be called from one thread at a time. A Loop owns that
+ * thread: every call into the library is queued to it, and the coroutine that
+ * made it is resumed there once it returns. Coroutines never need a thread of
+ * their own, so thousands of them can have file operations outstanding, and
+ * the loop takes them in turn, in the order they were asked for.
+ *
+ * Each connection carries one request at a time (see the protocol in
+ * libnetfiles.h), so the loop runs one request at a time too. What overlaps is
+ * everything else: buffered writes return at once (see WB_MAX_BYTES), and
+ * while one coroutine waits for its turn the others keep going.
+ *
+ *   netfiles::Loop loop("tcp://fileserver");
+ *   loop.run([](netfiles::Loop &loop) -> netfiles::Task<> {
+ *       netfiles::File f = co_await netfiles::File::open(loop, "log.txt", MODE_RW);
+ *       co_await f.write("hello\n", 6);
+ *       netfiles::Buffer data = co_await f.read(4096);
+ *   }(loop));
+ *
+ * Library calls that fail throw std::system_error with the errno they set.
+ * Only one Loop may exist at a time, since the library's state is global.
+ */
+
+#ifndef __NETFILES_HPP
+#  define __NETFILES_HPP
+
+namespace netfiles {
+
+template <typename T = void> class Task;
+
+namespace detail {
+
+	/**
+	 * What the promises of every Task have in common: the coroutine waiting
+	 * for the task, resumed when it finishes, and the exception it ended with.
+	 */
+	struct PromiseBase {
+		std::coroutine_handle<> continuation;
+		std::exception_ptr error;
+
+		struct FinalAwaiter {
+			bool await_ready() noexcept { return false; }
+
+			template <typename P>
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<P> done) noexcept {
+				std::coroutine_handle<> next = done.promise().continuation;
+
+				return next ? next : std::noop_coroutine();
+			}
+
+			void await_resume() noexcept {}
+		};
+
+		// tasks start when they are awaited
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		FinalAwaiter final_suspend() noexcept { return {}; }
+		void unhandled_exception() { error = std::current_exception(); }
+	};
+
+	template <typename T>
+	struct Promise : PromiseBase {
+		std::optional<T> value;
+
+		Task<T> get_return_object();
+		void return_value(T v) { value.emplace(std::move(v)); }
+
+		T result() {
+			if (error) std::rethrow_exception(error);
+			return std::move(*value);
+		}
+	};
+
+	template <>
+	struct Promise<void> : PromiseBase {
+		Task<void> get_return_object();
+		void return_void() {}
+
+		void result() {
+			if (error) std::rethrow_exception(error);
+		}
+	};
+
+	/**
+	 * Fire and forget coroutine, for tasks the loop runs on their own.
+	 */
+	struct Detached {
+		struct promise_type {
+			Detached get_return_object() { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+			// like an exception escaping a std::thread
+			void unhandled_exception() { std::terminate(); }
+		};
+	};
+
+	inline std::system_error libraryError(int err, const char *what) {
+		return std::system_error(err, std::generic_category(), what);
+	}
+
+	// libnetfiles reports failure with -1, or NULL for pointers
+	template <typename R>
+	bool failed(const R &result) {
+		if constexpr (std::is_pointer_v<R>) return result == nullptr;
+		else return result == -1;
+	}
+
+}
+
+/**
+ * A coroutine that produces a T, or nothing for Task<>. It starts when it is
+ * first awaited and resumes its awaiter when done; an exception it ends with
+ * is rethrown there. Move only.
+ */
+template <typename T>
+class Task {
+public:
+	using promise_type = detail::Promise<T>;
+
+	explicit Task(std::coroutine_handle<promise_type> coro) : coro(coro) {}
+	Task(Task &&other) noexcept : coro(std::exchange(other.coro, nullptr)) {}
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+
+	Task &operator=(Task &&other) noexcept {
+		if (this != &other) {
+			if (coro) coro.destroy();
+			coro = std::exchange(other.coro, nullptr);
+		}
+		return *this;
+	}
+
+	~Task() {
+		if (coro) coro.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+		coro.promise().continuation = awaiter;
+		return coro;
+	}
+
+	T await_resume() { return coro.promise().result(); }
+
+private:
+	std::coroutine_handle<promise_type> coro;
+};
+
+template <typename T>
+Task<T> detail::Promise<T>::get_return_object() {
+	return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object() {
+	return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+/**
+ * The one thread that calls into libnetfiles, and runs the coroutines that
+ * use it.
+ */
+class Loop {
+public:
+	/**
+	 * Awaitable for one library call: queues it to the loop, and gives its
+	 * result to the coroutine once it has run.
+	 */
+	template <typename F>
+	class Call {
+	public:
+		using Result = std::invoke_result_t<F &>;
+
+		Call(Loop &loop, F fn) : loop(loop), fn(std::move(fn)) {}
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> awaiter) {
+			loop.post([this, awaiter] {
+				result = fn();
+				err = errno;
+				awaiter.resume();
+			});
+		}
+
+		Result await_resume() {
+			if (detail::failed(result)) throw detail::libraryError(err, "libnetfiles");
+			return result;
+		}
+
+	private:
+		Loop &loop;
+		F fn;
+		Result result{};
+		int err = 0;
+	};
+
+	/**
+	 * Starts the loop thread and connects to the servers, as netserverinit().
+	 * Throws std::system_error if they can't be reached.
+	 */
+	explicit Loop(std::string hostname, int mode = MODE_UNRESTRCT) : thread([this] { work(); }) {
+		std::promise<int> connected;
+
+		post([&] {
+			// the library wants a writable copy
+			std::string host = hostname;
+
+			connected.set_value(netserverinit(host.data(), mode) == -1 ? errno : 0);
+		});
+		int err = connected.get_future().get();
+		if (err != 0) {
+			stop();
+			throw detail::libraryError(err, "netserverinit");
+		}
+	}
+
+	Loop(const Loop &) = delete;
+	Loop &operator=(const Loop &) = delete;
+
+	/**
+	 * Runs what is queued, including the closes of files destroyed on the
+	 * way, then stops the thread. Tasks still waiting on a call are dropped.
+	 */
+	~Loop() { stop(); }
+
+	/**
+	 * Queues a job to run on the loop thread.
+	 */
+	void post(std::function<void()> job) {
+		{
+			std::lock_guard<std::mutex> hold(lock);
+			jobs.push_back(std::move(job));
+		}
+		wake.notify_one();
+	}
+
+	/**
+	 * Returns an awaitable that runs fn, a call into libnetfiles, on the loop
+	 * thread. If it returns -1 (or NULL), awaiting it throws
+	 * std::system_error with the errno fn set.
+	 */
+	template <typename F>
+	Call<F> call(F fn) { return Call<F>(*this, std::move(fn)); }
+
+	/**
+	 * Starts a task on the loop thread and lets it run on its own. An
+	 * exception it ends with terminates the program.
+	 */
+	void spawn(Task<> task) {
+		auto holder = std::make_shared<Task<>>(std::move(task));
+
+		post([holder] { detach(std::move(*holder)); });
+	}
+
+	/**
+	 * Runs a task on the loop thread and waits for it, from any other thread.
+	 * Returns its result, or rethrows the exception it ended with.
+	 */
+	template <typename T>
+	T run(Task<T> task) {
+		std::promise<T> done;
+		std::future<T> result = done.get_future();
+
+		spawn(deliver(std::move(task), done));
+		return result.get();
+	}
+
+private:
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<std::function<void()>> jobs;
+	bool stopping = false;
+	std::thread thread;		// last, so the rest is set up before it starts
+
+	void work() {
+		std::function<void()> job;
+
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> hold(lock);
+				wake.wait(hold, [this] { return stopping || !jobs.empty(); });
+				if (jobs.empty()) return;
+				job = std::move(jobs.front());
+				jobs.pop_front();
+			}
+			job();
+		}
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> hold(lock);
+			stopping = true;
+		}
+		wake.notify_one();
+		if (thread.joinable()) thread.join();
+	}
+
+	static detail::Detached detach(Task<> task) {
+		co_await task;
+	}
+
+	template <typename T>
+	static Task<> deliver(Task<T> task, std::promise<T> &done) {
+		try {
+			if constexpr (std::is_void_v<T>) {
+				co_await task;
+				done.set_value();
+			} else {
+				done.set_value(co_await task);
+			}
+		} catch (...) {
+			done.set_exception(std::current_exception());
+		}
+	}
+};
+
+/**
+ * Bytes owned by one holder at a time, such as the data a read returned.
+ * Move only, so handing it on never copies it.
+ */
+class Buffer {
+public:
+	Buffer() = default;
+	explicit Buffer(size_t capacity) : bytes(new char[capacity]), used(capacity), room(capacity) {}
+
+	Buffer(const void *data, size_t len) : Buffer(len) {
+		std::memcpy(bytes.get(), data, len);
+	}
+
+	Buffer(Buffer &&other) noexcept
+		: bytes(std::move(other.bytes)), used(std::exchange(other.used, 0)), room(std::exchange(other.room, 0)) {}
+
+	Buffer &operator=(Buffer &&other) noexcept {
+		bytes = std::move(other.bytes);
+		used = std::exchange(other.used, 0);
+		room = std::exchange(other.room, 0);
+		return *this;
+	}
+
+	Buffer(const Buffer &) = delete;
+	Buffer &operator=(const Buffer &) = delete;
+
+	char *data() { return bytes.get(); }
+	const char *data() const { return bytes.get(); }
+	size_t size() const { return used; }
+	size_t capacity() const { return room; }
+
+	// shrinks or regrows within the capacity
+	void resize(size_t len) { used = len < room ? len : room; }
+
+private:
+	std::unique_ptr<char[]> bytes;
+	size_t used = 0;
+	size_t room = 0;
+};
+
+/**
+ * An open remote file. Closed when destroyed, on the loop thread without
+ * waiting; close() waits and reports errors. Must not outlive its loop.
+ * Move only.
+ */
+class File {
+public:
+	File() = default;
+	File(Loop &loop, int fd) : loop(&loop), fd(fd) {}
+	File(File &&other) noexcept : loop(other.loop), fd(std::exchange(other.fd, -1)) {}
+	File(const File &) = delete;
+	File &operator=(const File &) = delete;
+
+	File &operator=(File &&other) noexcept {
+		if (this != &other) {
+			release();
+			loop = other.loop;
+			fd = std::exchange(other.fd, -1);
+		}
+		return *this;
+	}
+
+	~File() { release(); }
+
+	/**
+	 * Opens a file as netopen(), with its mode and durability flags.
+	 */
+	static Task<File> open(Loop &loop, std::string path, int flags) {
+		int fd = co_await loop.call([&] { return netopen(path.c_str(), flags); });
+
+		co_return File(loop, fd);
+	}
+
+	/**
+	 * Reads up to size bytes from the file's offset on, as netread().
+	 * Returns them, fewer at the end of the file.
+	 */
+	Task<Buffer> read(size_t size) {
+		Buffer buf(size);
+		ssize_t got = co_await loop->call([&] { return netread(fd, buf.data(), size); });
+
+		buf.resize(got);
+		co_return buf;
+	}
+
+	/**
+	 * Writes size bytes at the file's offset, as netwrite(). data must stay
+	 * put until this completes, as it does while its awaiter waits.
+	 */
+	auto write(const void *data, size_t size) {
+		return loop->call([this, data, size] { return netwrite(fd, data, size); });
+	}
+
+	auto write(const Buffer &buf) { return write(buf.data(), buf.size()); }
+
+	auto flush() {
+		return loop->call([this] { return netflush(fd); });
+	}
+
+	auto fsync() {
+		return loop->call([this] { return netfsync(fd); });
+	}
+
+	Task<NetStat> stat() {
+		NetStat st;
+
+		co_await loop->call([&] { return netfstat(fd, &st); });
+		co_return st;
+	}
+
+	/**
+	 * Closes the file now, as netclose(), writing out what is buffered.
+	 */
+	Task<> close() {
+		int handle = std::exchange(fd, -1);
+
+		if (handle != -1) co_await loop->call([handle] { return netclose(handle); });
+	}
+
+	bool isOpen() const { return fd != -1; }
+
+	// for the libnetfiles calls this doesn't wrap, on the loop thread
+	int handle() const { return fd; }
+
+private:
+	Loop *loop = nullptr;
+	int fd = -1;			// libnetfiles handle, -1 when closed
+
+	void release() {
+		int handle = std::exchange(fd, -1);
+
+		if (handle != -1) loop->post([handle] { netclose(handle); });
+	}
+};
+
+}
+
+#endif
@@ -1,11 +1,26 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <sys/stat.h> 
 #include <sys/types.h> 
 #include <sys/types.h> 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <dirent.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/filter.h>
+#include <linux/openat2.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,610 +29,4342 @@
 #include <signal.h>
 
 #include "libnetfiles.h"
+#include "nettransport.h"
+#include "netdelta.h"
+#include "netcompress.h"
+#include "netcrc.h"
 
 /****************************************************************************************************
  * 																									*
- * Generic LinkedList methods and definitions														*
+ * Intrusive lists																					*
  * 																									*
  * Used to keep track of the global list of open files, the owners of each file, and				*
- * what files each client owns individually. 														*
+ * what files each client owns individually. The links live in the objects							*
+ * themselves, so adding or removing an object never allocates or searches.							*
  * 																									*
  ****************************************************************************************************/
- 
+
+/**
+ * Pushes node onto the front of the list starting at head, using the link
+ * fields named prev and next.
+ */
+# define listPush(head, node, prev, next) do {			\
+	(node)->prev = NULL;								\
+	(node)->next = (head);								\
+	if ((head) != NULL) (head)->prev = (node);			\
+	(head) = (node);									\
+} while (0)
+
+/**
+ * Unlinks node from the list starting at head.
+ */
+# define listUnlink(head, node, prev, next) do {		\
+	if ((node)->prev != NULL) (node)->prev->next = (node)->next;	\
+	else (head) = (node)->next;							\
+	if ((node)->next != NULL) (node)->next->prev = (node)->prev;	\
+} while (0)
+
+/****************************************************************************************************
+ * 																									*
+ * Server statistics																				*
+ * 																									*
+ * Counters that are bumped on the request paths and reported to clients							*
+ * through the stats function (netstats() in libnetfiles).											*
+ * 																									*
+ ****************************************************************************************************/
+
+# define MAX_SHARDS 64
+
 typedef struct {
-	void *value;
-	void *prev;
-	void *next;
-} LinkedNode;
+	long reads;
+	long readBytes;
+	long seqReads;
+	long randomReads;
+	long raIssued;		// number of readahead windows issued
+	long raBytes;		// total bytes requested through readahead
+	long raHits;		// reads fully served from a prefetched window
+	long raHitBytes;
+	long raResets;		// windows dropped because the client went random
+	long durableWrites;	// writes acknowledged only once they were on disk
+	long fsyncs;		// fdatasync() calls made for durable writes
+	long groupCommits;	// batches flushed by the group commit thread
+	long connections;
+	long staleHandles;	// requests on a handle that was closed or never opened
+	long openFiles;		// files open by at least one client
+	long openHandles;	// handles open over all clients
+	long copies;		// server side copies (netcopy, netcopyrange)
+	long copyBytes;
+	long renames;
+	long signatures;	// block signatures sent for delta writes
+	long deltas;		// delta writes applied
+	long deltaLiteral;	// bytes of new data they carried
+	long deltaReused;	// bytes they kept from the old contents
+	long deltaMoved;	// of which had to move to another offset
+	long deltaInPlace;	// deltas applied without a scratch copy
+	long compressRaw;	// read data sent compressed, before and after
+	long compressSent;
+	long compressNs;	// thread CPU time spent compressing it
+	long decompressRaw;	// written data received compressed, after and before
+	long decompressSent;
+	long decompressNs;
+	long zcacheHits;	// chunks served from a file's compressed cache
+	long zcacheMisses;
+	long zcacheBytes;
+	long checksums;		// netchecksum() requests
+	long checksumCached;	// of which answered from the file's cache
+	long checksumBytes;	// file data read to answer the others
+	long crcErrors;		// frames that failed their CRC
+	long watches;		// netwatch() subscriptions, over all clients
+	long watchEvents;	// change events sent to them
+	long watchDropped;	// events dropped because the client wasn't reading
+	long attrHits;		// netstat() and listed attributes answered from the cache
+	long attrMisses;
+	long attrEntries;	// attributes cached, which also bounds the cache
+	long listHits;		// netlistdir() pages answered from a cached listing
+	long listMisses;
+	long attrOverflows;	// times inotify lost events and the cache was emptied
+	long spliceWrites;	// writes moved from the socket to the file with splice()
+	long spliceBytes;
+	long openConns;		// connections being served
+	long connWaits;		// times the listeners stopped accepting at the connection limit
+	long runningRequests;	// requests admitted and not yet done
+	long inflightBytes;	// what they cost between them, see admitRequest()
+	long admitWaits;	// requests that had to wait to be admitted
+	long admitWaitMs;	// and how long they waited in total
+	long sessionsParked;	// sessions kept after losing their connection
+	long sessionsResumed;	// times a client came back for one
+	long sessionsExpired;	// parked sessions ended when their grace period ran out
+	long dirHits;		// directory lookups answered by a cached descriptor
+	long dirMisses;
+	long dirHandles;	// directories held open, which also bounds the cache
+	long pathEscapes;	// paths refused because they led out of the root
+	int shards;
+	long shardAccepts[MAX_SHARDS];	// connections accepted by each listener shard
+	char replRole;		// 'P' for a replication primary, 'R' for a replica, 0 otherwise
+	long logSeq;		// newest entry in the primary's replication log
+	long logEntries;	// entries still held for replicas
+	long logBytes;
+	long replicas;		// replicas currently streaming the log
+	long appliedSeq;	// last log entry a replica has applied
+	long appliedStamp;	// primary time of that entry, in ms
+	long primarySeq;	// newest entry the primary has told a replica about
+	long following;		// replica is connected to its primary
+	long stale;			// replica missed log entries, and sends its readers to the primary
+} ServerStats;
+
+ServerStats stats = {0};
+
+# define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+# define STAT_GET(field) __atomic_load_n(&stats.field, __ATOMIC_RELAXED)
+# define STAT_SET(field, v) __atomic_store_n(&stats.field, (v), __ATOMIC_RELAXED)
+
+/**
+ * Wall clock time in milliseconds. Replication log entries are stamped with
+ * it, so replica lag can be measured across processes.
+ */
+long nowMs() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * CPU time used by the calling thread in nanoseconds.
+ */
+long cpuNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+ * CPU time used by the whole server in microseconds.
+ */
+long processCpuUs() {
+	struct timespec now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+/**
+ * Resident memory of the server in kB, or 0 if it can't be read.
+ */
+long rssKB() {
+	long size, pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	
+	if (f == NULL) return 0;
+	if (fscanf(f, "%ld %ld", &size, &pages) != 2) pages = 0;
+	fclose(f);
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * Formats all counters as "name value" lines into a malloc()'ed string.
+ * Remember to free the returned pointer.
+ */
+char *formatStats() {
+	char *out = NULL;
+	size_t size;
+	FILE *f = open_memstream(&out, &size);
+	long applied, primary, raw, sent;
+	int i;
+	
+	fprintf(f, "reads %ld\n", STAT_GET(reads));
+	fprintf(f, "read_bytes %ld\n", STAT_GET(readBytes));
+	fprintf(f, "seq_reads %ld\n", STAT_GET(seqReads));
+	fprintf(f, "random_reads %ld\n", STAT_GET(randomReads));
+	fprintf(f, "readahead_issued %ld\n", STAT_GET(raIssued));
+	fprintf(f, "readahead_bytes %ld\n", STAT_GET(raBytes));
+	fprintf(f, "readahead_hits %ld\n", STAT_GET(raHits));
+	fprintf(f, "readahead_hit_bytes %ld\n", STAT_GET(raHitBytes));
+	fprintf(f, "readahead_resets %ld\n", STAT_GET(raResets));
+	fprintf(f, "durable_writes %ld\n", STAT_GET(durableWrites));
+	fprintf(f, "fsyncs %ld\n", STAT_GET(fsyncs));
+	fprintf(f, "group_commits %ld\n", STAT_GET(groupCommits));
+	fprintf(f, "connections %ld\n", STAT_GET(connections));
+	fprintf(f, "stale_handles %ld\n", STAT_GET(staleHandles));
+	fprintf(f, "open_files %ld\n", STAT_GET(openFiles));
+	fprintf(f, "open_handles %ld\n", STAT_GET(openHandles));
+	fprintf(f, "rss_kb %ld\n", rssKB());
+	fprintf(f, "cpu_us %ld\n", processCpuUs());
+	fprintf(f, "copies %ld\n", STAT_GET(copies));
+	fprintf(f, "copy_bytes %ld\n", STAT_GET(copyBytes));
+	fprintf(f, "renames %ld\n", STAT_GET(renames));
+	fprintf(f, "signatures %ld\n", STAT_GET(signatures));
+	fprintf(f, "deltas %ld\n", STAT_GET(deltas));
+	fprintf(f, "delta_literal_bytes %ld\n", STAT_GET(deltaLiteral));
+	fprintf(f, "delta_reused_bytes %ld\n", STAT_GET(deltaReused));
+	fprintf(f, "delta_moved_bytes %ld\n", STAT_GET(deltaMoved));
+	fprintf(f, "delta_in_place %ld\n", STAT_GET(deltaInPlace));
+	raw = STAT_GET(compressRaw);
+	sent = STAT_GET(compressSent);
+	fprintf(f, "compress_raw_bytes %ld\n", raw);
+	fprintf(f, "compress_sent_bytes %ld\n", sent);
+	fprintf(f, "compress_ratio_pct %ld\n", sent > 0 ? raw * 100 / sent : 0);
+	fprintf(f, "compress_cpu_us %ld\n", STAT_GET(compressNs) / 1000);
+	raw = STAT_GET(decompressRaw);
+	sent = STAT_GET(decompressSent);
+	fprintf(f, "decompress_raw_bytes %ld\n", raw);
+	fprintf(f, "decompress_sent_bytes %ld\n", sent);
+	fprintf(f, "decompress_ratio_pct %ld\n", sent > 0 ? raw * 100 / sent : 0);
+	fprintf(f, "decompress_cpu_us %ld\n", STAT_GET(decompressNs) / 1000);
+	fprintf(f, "zcache_hits %ld\n", STAT_GET(zcacheHits));
+	fprintf(f, "zcache_misses %ld\n", STAT_GET(zcacheMisses));
+	fprintf(f, "zcache_bytes %ld\n", STAT_GET(zcacheBytes));
+	fprintf(f, "checksums %ld\n", STAT_GET(checksums));
+	fprintf(f, "checksum_cached %ld\n", STAT_GET(checksumCached));
+	fprintf(f, "checksum_bytes %ld\n", STAT_GET(checksumBytes));
+	fprintf(f, "crc_errors %ld\n", STAT_GET(crcErrors));
+	fprintf(f, "watches %ld\n", STAT_GET(watches));
+	fprintf(f, "watch_events %ld\n", STAT_GET(watchEvents));
+	fprintf(f, "watch_dropped %ld\n", STAT_GET(watchDropped));
+	fprintf(f, "attr_hits %ld\n", STAT_GET(attrHits));
+	fprintf(f, "attr_misses %ld\n", STAT_GET(attrMisses));
+	fprintf(f, "attr_entries %ld\n", STAT_GET(attrEntries));
+	fprintf(f, "list_hits %ld\n", STAT_GET(listHits));
+	fprintf(f, "list_misses %ld\n", STAT_GET(listMisses));
+	fprintf(f, "attr_overflows %ld\n", STAT_GET(attrOverflows));
+	fprintf(f, "splice_writes %ld\n", STAT_GET(spliceWrites));
+	fprintf(f, "splice_bytes %ld\n", STAT_GET(spliceBytes));
+	fprintf(f, "open_connections %ld\n", STAT_GET(openConns));
+	fprintf(f, "connection_waits %ld\n", STAT_GET(connWaits));
+	fprintf(f, "running_requests %ld\n", STAT_GET(runningRequests));
+	fprintf(f, "inflight_bytes %ld\n", STAT_GET(inflightBytes));
+	fprintf(f, "admit_waits %ld\n", STAT_GET(admitWaits));
+	fprintf(f, "admit_wait_ms %ld\n", STAT_GET(admitWaitMs));
+	fprintf(f, "sessions_parked %ld\n", STAT_GET(sessionsParked));
+	fprintf(f, "sessions_resumed %ld\n", STAT_GET(sessionsResumed));
+	fprintf(f, "sessions_expired %ld\n", STAT_GET(sessionsExpired));
+	fprintf(f, "dir_handle_hits %ld\n", STAT_GET(dirHits));
+	fprintf(f, "dir_handle_misses %ld\n", STAT_GET(dirMisses));
+	fprintf(f, "dir_handles %ld\n", STAT_GET(dirHandles));
+	fprintf(f, "path_escapes %ld\n", STAT_GET(pathEscapes));
+	for (i=0; i<stats.shards; i++) {
+		fprintf(f, "shard%d_accepted %ld\n", i, STAT_GET(shardAccepts[i]));
+	}
+	if (stats.replRole == 'P') {
+		fprintf(f, "repl_log_seq %ld\n", STAT_GET(logSeq));
+		fprintf(f, "repl_log_entries %ld\n", STAT_GET(logEntries));
+		fprintf(f, "repl_log_bytes %ld\n", STAT_GET(logBytes));
+		fprintf(f, "repl_replicas %ld\n", STAT_GET(replicas));
+	} else if (stats.replRole == 'R') {
+		applied = STAT_GET(appliedSeq);
+		primary = STAT_GET(primarySeq);
+		fprintf(f, "replica_connected %ld\n", STAT_GET(following));
+		fprintf(f, "replica_stale %ld\n", STAT_GET(stale));
+		fprintf(f, "replica_applied_seq %ld\n", applied);
+		fprintf(f, "replica_primary_seq %ld\n", primary);
+		fprintf(f, "replica_lag_ops %ld\n", primary - applied);
+		// while behind, how long ago the primary logged the entry we are at
+		fprintf(f, "replica_lag_ms %ld\n", primary > applied ? nowMs() - STAT_GET(appliedStamp) : 0);
+	}
+	fclose(f);
+	return out;
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Sequential access detection																		*
+ * 																									*
+ * Every client handle remembers where its last read ended. Once a handle has						*
+ * read sequentially a few times we start asking the kernel to pull the next						*
+ * window of the file into the page cache with posix_fadvise(WILLNEED), so the						*
+ * following reads do not wait on the disk. The window doubles every time the						*
+ * client actually consumes a prefetched window, and a single out of order read						*
+ * drops it again.																					*
+ * 																									*
+ ****************************************************************************************************/
+
+# define RA_MIN_RUN     2				// sequential reads needed before prefetching
+# define RA_INIT_WINDOW (128 * 1024)
+# define RA_MAX_WINDOW  (8 * 1024 * 1024)
 
 typedef struct {
-	int length;
-	int index;
-	LinkedNode *cur;
-	LinkedNode *head;
-	LinkedNode *tail;
-} LinkedList;
-
-# define getNext(nd) ((LinkedNode *) nd->next)
-# define getPrev(nd) ((LinkedNode *) nd->prev)
-# define getHead(lst) ((LinkedNode *) lst->head)
-# define getTail(lst) ((LinkedNode *) lst->tail)
-
-/**
- * Added a value to the end of a linked list
- */
-void linkedListAdd(LinkedList *list, void *val) {
-	LinkedNode *node = calloc(sizeof(LinkedNode), 1);
-	node->value = val;
-	if (list->head == NULL) {
-		list->head = node;
-		list->tail = node;
-		list->cur = node;
+	off_t next;			// offset just past the previous read
+	int run;			// number of back to back sequential reads
+	int hit;			// whether the current window has been read from
+	size_t window;		// size of the last window issued, 0 when not prefetching
+	off_t raStart;		// range covered by the issued windows
+	off_t raEnd;
+} ReadPattern;
+
+/**
+ * Records a read of [offset, offset+len) on a handle and issues readahead for
+ * the file behind filefd when the handle looks like a sequential stream. It is
+ * called before the read itself so the prefetch overlaps with it.
+ */
+void trackRead(ReadPattern *pat, int filefd, off_t offset, size_t len) {
+	off_t end = offset + len;
+	off_t start;
+	
+	STAT_ADD(reads, 1);
+	
+	if (offset == pat->next) {
+		pat->run++;
+		STAT_ADD(seqReads, 1);
 	} else {
-		getTail(list)->next = node;
-		node->prev = getTail(list);
-		list->tail = node;
+		// random access, stop prefetching until the client streams again
+		if (pat->window) STAT_ADD(raResets, 1);
+		pat->run = 1;
+		pat->hit = 0;
+		pat->window = 0;
+		pat->raStart = pat->raEnd = 0;
+		STAT_ADD(randomReads, 1);
+	}
+	pat->next = end;
+	
+	if (pat->window && offset >= pat->raStart && end <= pat->raEnd) {
+		pat->hit = 1;
+		STAT_ADD(raHits, 1);
+		STAT_ADD(raHitBytes, len);
+	}
+	
+	if (pat->run < RA_MIN_RUN) return;
+	// only issue the next window once the client is past half of the current one
+	if (pat->window && end + (off_t) pat->window / 2 < pat->raEnd) return;
+	
+	if (pat->window == 0) {
+		pat->window = len * 4 > RA_INIT_WINDOW ? len * 4 : RA_INIT_WINDOW;
+		pat->raStart = end;
+		pat->raEnd = end;
+	} else if (pat->hit && pat->window < RA_MAX_WINDOW) {
+		// the last window paid off, so grow the next one
+		pat->window *= 2;
+		if (pat->window > RA_MAX_WINDOW) pat->window = RA_MAX_WINDOW;
+	}
+	
+	start = pat->raEnd > end ? pat->raEnd : end;
+	if (posix_fadvise(filefd, start, pat->window, POSIX_FADV_WILLNEED) != 0) return;
+	pat->raEnd = start + pat->window;
+	pat->hit = 0;
+	STAT_ADD(raIssued, 1);
+	STAT_ADD(raBytes, pat->window);
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Path resolution																					*
+ * 																									*
+ * Clients name files by path. A server given a root (-d) resolves them beneath it					*
+ * with openat2() and RESOLVE_BENEATH, so neither ".." nor a symlink takes a client					*
+ * out of it, and a leading '/' means the root. Without one, paths are resolved						*
+ * from the working directory as they always were. Paths are made canonical as						*
+ * requests come in, so every table keyed by name sees a file under one name.						*
+ * Directories are opened a component at a time and kept open (O_PATH), so a						*
+ * file in a directory used before costs one lookup of its last component.							*
+ * Each of them, and the root, has an inotify watch, and a directory moved or						*
+ * deleted in one is dropped along with everything cached under it. Only							*
+ * directories whose parents are cached are, so none of that goes unseen. The						*
+ * events are applied by a thread of their own, so a lookup the cache answers						*
+ * makes no system call.																			*
+ * 																									*
+ ****************************************************************************************************/
+
+typedef struct s_DirHandle {
+	char *path;
+	int fd;						// O_PATH descriptor of the directory
+	int wd;						// inotify watch descriptor, -1 unless cached
+	int refs;					// lookups using fd, plus one while cached
+	struct s_DirHandle *hashNext;
+	struct s_DirHandle *prev, *next;	// most recently used first
+} DirHandle;
+
+# define DIRFD_BUCKETS 4096
+# define DIRFD_MAX     256			// each one holds a descriptor and an inotify watch
+# define DIRFD_MASK    (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+pthread_mutex_t dirfdLock = PTHREAD_MUTEX_INITIALIZER;
+DirHandle *dirfdTable[DIRFD_BUCKETS];
+DirHandle *dirfdFirst = NULL, *dirfdLast = NULL;
+int dirfdInotifyFd = -1;
+long dirfdGen = 0;					// bumped by every event about a directory
+int confined = 0;					// paths are resolved beneath rootDir
+int haveOpenat2 = 1;
+DirHandle rootDir = { ".", AT_FDCWD, -1, 1, NULL, NULL, NULL };
+DirHandle slashDir = { "/", -1, -1, 1, NULL, NULL, NULL };
+
+/**
+ * 64 bit FNV-1a hash of a path.
+ */
+uint64_t hashPath(const char *path) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	
+	while (*path) {
+		h ^= (unsigned char) *path++;
+		h *= 0x100000001b3ULL;
+	}
+	return h ^ (h >> 29);
+}
+
+/**
+ * Copies the directory a path is in to dir, which must be as long as path.
+ */
+void parentDir(const char *path, char *dir) {
+	const char *slash = strrchr(path, '/');
+	
+	if (slash == NULL) strcpy(dir, ".");
+	else if (slash == path) strcpy(dir, "/");
+	else {
+		memcpy(dir, path, slash - path);
+		dir[slash - path] = '\0';
+	}
+}
+
+/**
+ * Returns the last component of a canonical path, "." for the root itself.
+ */
+const char *baseName(const char *path) {
+	const char *slash = strrchr(path, '/');
+	
+	if (slash == NULL) return path;
+	return slash[1] == '\0' ? "." : slash + 1;
+}
+
+/**
+ * Returns a malloc()'ed canonical copy of a path sent by a client: no empty or
+ * "." components, no trailing '/', and ".." only at the start, where it can't
+ * be taken out. "." names the root (or working directory) itself. With a root
+ * a leading '/' is dropped, since paths start at the root anyway, and a path
+ * that climbs out of it fails.
+ * 
+ * Returns NULL with errno set to EACCES if the path leaves the root.
+ */
+char *canonPath(const char *path) {
+	char *out = malloc(strlen(path) + 2), *o = out, *base;
+	const char *p = path, *end;
+	int depth = 0;
+	size_t n;
+	
+	if (*p == '/' && !confined) *o++ = '/';
+	base = o;
+	while (*p != '\0') {
+		while (*p == '/') p++;
+		if (*p == '\0') break;
+		end = strchrnul(p, '/');
+		n = end - p;
+		if (n == 2 && p[0] == '.' && p[1] == '.') {
+			if (depth > 0) {
+				// drop the component before it, and the '/' in front of that
+				while (o > base && o[-1] != '/') o--;
+				if (o > base) o--;
+				depth--;
+			} else if (confined) {
+				STAT_ADD(pathEscapes, 1);
+				free(out);
+				errno = EACCES;
+				return NULL;
+			} else if (base == out) {
+				// "/.." is "/", so only a relative path keeps it
+				if (o > base) *o++ = '/';
+				memcpy(o, p, 2);
+				o += 2;
+			}
+		} else if (n != 1 || p[0] != '.') {
+			if (o > base) *o++ = '/';
+			memcpy(o, p, n);
+			o += n;
+			depth++;
+		}
+		p = end;
+	}
+	if (o == out) *o++ = '.';
+	*o = '\0';
+	return out;
+}
+
+/**
+ * openat2() confined to the root if there is one, with RESOLVE_* flags in
+ * resolve on top. A path that would leave the root fails with EXDEV.
+ * Returns the new descriptor, or -1 with errno set appropriately
+ */
+int openUnder(int dirfd, const char *path, int flags, mode_t mode, uint64_t resolve) {
+	struct open_how how = { flags, flags & O_CREAT ? mode : 0, resolve };
+	
+	if (!haveOpenat2) return openat(dirfd, path, flags, mode);
+	if (confined) how.resolve |= RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+	return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+}
+
+/**
+ * Turns the EXDEV of a lookup that would have left the root into EACCES.
+ */
+int escaped(int fd) {
+	if (fd == -1 && errno == EXDEV && confined) {
+		STAT_ADD(pathEscapes, 1);
+		errno = EACCES;
+	}
+	return fd;
+}
+
+/**
+ * Drops a reference to a directory, closing it with the last.
+ */
+void releaseDir(DirHandle *h) {
+	if (h == &rootDir || h == &slashDir) return;
+	if (__atomic_sub_fetch(&h->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+	close(h->fd);
+	free(h->path);
+	free(h);
+}
+
+/**
+ * Removes an inotify watch of the directory cache, unless another directory
+ * cached has it too: watching the same directory twice gives the same one.
+ * Must be called with dirfdLock held.
+ */
+void dropWatch(int wd) {
+	DirHandle *h;
+	
+	if (wd == rootDir.wd || wd == slashDir.wd) return;
+	for (h = dirfdFirst; h != NULL && h->wd != wd; h = h->next);
+	if (h == NULL) inotify_rm_watch(dirfdInotifyFd, wd);
+}
+
+/**
+ * Takes a directory out of the cache. Must be called with dirfdLock held.
+ */
+void uncacheDir(DirHandle *h) {
+	DirHandle **hp;
+	
+	for (hp = &dirfdTable[hashPath(h->path) % DIRFD_BUCKETS]; *hp != h; hp = &(*hp)->hashNext);
+	*hp = h->hashNext;
+	if (h == dirfdLast) dirfdLast = h->prev;
+	listUnlink(dirfdFirst, h, prev, next);
+	dropWatch(h->wd);
+	STAT_ADD(dirHandles, -1);
+	releaseDir(h);
+}
+
+/**
+ * Takes a directory out of the cache along with every one under it.
+ * Must be called with dirfdLock held.
+ */
+void uncacheTree(const char *path) {
+	size_t len = strlen(path);
+	DirHandle *h, *next;
+	
+	for (h = dirfdFirst; h != NULL; h = next) {
+		next = h->next;
+		if (strncmp(h->path, path, len) == 0 && (h->path[len] == '\0' || h->path[len] == '/')) uncacheDir(h);
+	}
+}
+
+/**
+ * Applies every pending inotify event to the directory cache.
+ * Must be called with dirfdLock held.
+ */
+void drainDirfdEvents() {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	DirHandle *h;
+	ssize_t len;
+	char *p;
+	
+	if (dirfdInotifyFd == -1) return;
+	while ((len = read(dirfdInotifyFd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *) p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				dirfdGen++;
+				while (dirfdFirst != NULL) uncacheDir(dirfdFirst);
+				continue;
+			}
+			// a directory went somewhere else, away, or was replaced, so its name means something new
+			if (!(ev->mask & IN_ISDIR) || ev->len == 0) continue;
+			dirfdGen++;
+			if (ev->wd == rootDir.wd) uncacheTree(ev->name);
+			// h stays cached, so h->next is kept right as what is under it goes
+			for (h = dirfdFirst; h != NULL; h = h->next) {
+				if (h->wd != ev->wd) continue;
+				char path[strlen(h->path) + ev->len + 2];
+				sprintf(path, "%s/%s", h->path, ev->name);
+				uncacheTree(path);
+			}
+			if (ev->wd == slashDir.wd) {
+				char path[ev->len + 2];
+				sprintf(path, "/%s", ev->name);
+				uncacheTree(path);
+			}
+		}
+	}
+}
+
+/**
+ * Body of the thread that applies directory cache events as they come.
+ */
+void *applyDirEvents(void *arg) {
+	struct pollfd pfd = { dirfdInotifyFd, POLLIN, 0 };
+	(void) arg;
+	
+	while (poll(&pfd, 1, -1) != -1 || errno == EINTR) {
+		pthread_mutex_lock(&dirfdLock);
+		drainDirfdEvents();
+		pthread_mutex_unlock(&dirfdLock);
+	}
+	return NULL;
+}
+
+/**
+ * Puts an inotify watch on the file open as fd (the working directory for
+ * AT_FDCWD), by its /proc name so it is the file that was opened.
+ * Returns the watch descriptor, or -1 with errno set.
+ */
+int watchFd(int inotify, int fd, uint32_t mask) {
+	char proc[32];
+	
+	if (fd == AT_FDCWD) return inotify_add_watch(inotify, ".", mask);
+	sprintf(proc, "/proc/self/fd/%d", fd);
+	return inotify_add_watch(inotify, proc, mask);
+}
+
+/**
+ * Returns a handle on the directory at canonical path dir, to be given back
+ * with releaseDir(). Directories are opened from their parents one component
+ * at a time, and cached if their parent is. A path through a symlink is
+ * opened whole, and not cached, since the link could change unseen.
+ * 
+ * Returns NULL with errno set appropriately
+ */
+DirHandle *lookupDir(const char *dir) {
+	char parent[strlen(dir) + 2];
+	DirHandle *h, *up, **bucket;
+	int fd, wd = -1;
+	long gen;
+	
+	if (strcmp(dir, ".") == 0) return &rootDir;
+	if (strcmp(dir, "/") == 0) return &slashDir;
+	pthread_mutex_lock(&dirfdLock);
+	bucket = &dirfdTable[hashPath(dir) % DIRFD_BUCKETS];
+	for (h = *bucket; h != NULL && strcmp(h->path, dir) != 0; h = h->hashNext);
+	if (h != NULL) {
+		__atomic_add_fetch(&h->refs, 1, __ATOMIC_RELAXED);
+		if (h != dirfdFirst) {
+			if (h == dirfdLast) dirfdLast = h->prev;
+			listUnlink(dirfdFirst, h, prev, next);
+			listPush(dirfdFirst, h, prev, next);
+		}
+		pthread_mutex_unlock(&dirfdLock);
+		STAT_ADD(dirHits, 1);
+		return h;
+	}
+	gen = dirfdGen;
+	pthread_mutex_unlock(&dirfdLock);
+	STAT_ADD(dirMisses, 1);
+	
+	parentDir(dir, parent);
+	up = lookupDir(parent);
+	if (up == NULL) return NULL;
+	fd = haveOpenat2 ? openUnder(up->fd, baseName(dir), O_PATH | O_DIRECTORY | O_CLOEXEC, 0, RESOLVE_NO_SYMLINKS) : -1;
+	// the parent's watch tells if the name stops leading here
+	if (fd != -1 && up->wd != -1) wd = watchFd(dirfdInotifyFd, fd, DIRFD_MASK);
+	releaseDir(up);
+	if (fd == -1 && (errno == ELOOP || errno == EXDEV || !haveOpenat2)) {
+		fd = escaped(openUnder(dir[0] == '/' ? AT_FDCWD : rootDir.fd, dir, O_PATH | O_DIRECTORY | O_CLOEXEC, 0, 0));
+	}
+	if (fd == -1) return NULL;
+	
+	h = calloc(sizeof(DirHandle), 1);
+	h->path = strdup(dir);
+	h->fd = fd;
+	h->wd = -1;
+	h->refs = 1;
+	if (wd == -1) return h;
+	pthread_mutex_lock(&dirfdLock);
+	// a directory moved since we looked must not be cached, nor another thread's entry doubled
+	drainDirfdEvents();
+	for (up = *bucket; up != NULL && strcmp(up->path, dir) != 0; up = up->hashNext);
+	if (up != NULL || dirfdGen != gen) dropWatch(wd);
+	else {
+		// what is under a directory goes with it, its watch was the one keeping them right
+		while (STAT_GET(dirHandles) >= DIRFD_MAX && dirfdLast != NULL) {
+			char last[strlen(dirfdLast->path) + 1];
+			strcpy(last, dirfdLast->path);
+			uncacheTree(last);
+		}
+		h->wd = wd;
+		h->refs++;
+		h->hashNext = *bucket;
+		*bucket = h;
+		listPush(dirfdFirst, h, prev, next);
+		if (dirfdLast == NULL) dirfdLast = h;
+		STAT_ADD(dirHandles, 1);
+	}
+	pthread_mutex_unlock(&dirfdLock);
+	return h;
+}
+
+/**
+ * open() of a canonical path, through the directory cache.
+ * Returns the new descriptor, or -1 with errno set appropriately
+ */
+int openPath(const char *path, int flags, mode_t mode) {
+	char dir[strlen(path) + 2];
+	DirHandle *h;
+	int fd;
+	
+	parentDir(path, dir);
+	h = lookupDir(dir);
+	if (h == NULL) return -1;
+	fd = openUnder(h->fd, baseName(path), flags, mode, 0);
+	releaseDir(h);
+	// a symlink in the last component may lead elsewhere under the root
+	if (fd == -1 && errno == EXDEV && confined) fd = openUnder(rootDir.fd, path, flags, mode, 0);
+	return escaped(fd);
+}
+
+/**
+ * stat() of a canonical path, through the directory cache.
+ * Returns 0 on success, -1 with errno set appropriately
+ */
+int statPath(const char *path, struct stat *st) {
+	char dir[strlen(path) + 2];
+	DirHandle *h;
+	int ret, fd;
+	
+	parentDir(path, dir);
+	h = lookupDir(dir);
+	if (h == NULL) return -1;
+	ret = fstatat(h->fd, baseName(path), st, confined ? AT_SYMLINK_NOFOLLOW : 0);
+	releaseDir(h);
+	if (ret == -1 || !S_ISLNK(st->st_mode) || !confined) return ret;
+	// where the link leads has to be checked
+	fd = openPath(path, O_PATH | O_CLOEXEC, 0);
+	if (fd == -1) return -1;
+	ret = fstat(fd, st);
+	close(fd);
+	return ret;
+}
+
+/**
+ * mkdir() of a canonical path, through the directory cache.
+ * Returns 0 on success, -1 with errno set appropriately
+ */
+int mkdirPath(const char *path, mode_t mode) {
+	char dir[strlen(path) + 2];
+	DirHandle *h;
+	int ret;
+	
+	parentDir(path, dir);
+	h = lookupDir(dir);
+	if (h == NULL) return -1;
+	ret = mkdirat(h->fd, baseName(path), mode);
+	releaseDir(h);
+	return ret;
+}
+
+/**
+ * renameat2() of two canonical paths, through the directory cache. Both
+ * names are taken out of the cache right away rather than when the events
+ * come, so no request after the rename resolves through the old name.
+ * Returns 0 on success, -1 with errno set appropriately
+ */
+int renamePath(const char *from, const char *to, int flags) {
+	char fromDir[strlen(from) + 2], toDir[strlen(to) + 2];
+	DirHandle *a, *b = NULL;
+	int ret = -1;
+	
+	parentDir(from, fromDir);
+	parentDir(to, toDir);
+	a = lookupDir(fromDir);
+	if (a != NULL) b = lookupDir(toDir);
+	if (b != NULL) ret = renameat2(a->fd, baseName(from), b->fd, baseName(to), flags);
+	if (a != NULL) releaseDir(a);
+	if (b != NULL) releaseDir(b);
+	if (ret == 0) {
+		// to may have been a directory replaced, or exchanged with from
+		pthread_mutex_lock(&dirfdLock);
+		dirfdGen++;
+		uncacheTree(from);
+		uncacheTree(to);
+		pthread_mutex_unlock(&dirfdLock);
+	}
+	return ret;
+}
+
+/**
+ * Sets up path resolution, beneath root if it isn't NULL.
+ * Returns 0 on success, -1 with errno set appropriately
+ */
+int initPaths(const char *root) {
+	struct open_how how = { O_PATH | O_DIRECTORY | O_CLOEXEC, 0, 0 };
+	pthread_t applier;
+	int fd;
+	
+	if (root != NULL) {
+		rootDir.fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (rootDir.fd == -1) return -1;
+		confined = 1;
+	}
+	slashDir.fd = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	fd = syscall(SYS_openat2, rootDir.fd, ".", &how, sizeof(how));
+	if (fd != -1) close(fd);
+	else if (errno == ENOSYS) {
+		// kernels before 5.6 can't keep a client beneath the root
+		if (confined) return -1;
+		haveOpenat2 = 0;
 	}
+	// without them nothing is cached, and every lookup walks the whole path
+	if (haveOpenat2) dirfdInotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (dirfdInotifyFd != -1) {
+		rootDir.wd = watchFd(dirfdInotifyFd, rootDir.fd, DIRFD_MASK);
+		// absolute paths only lead anywhere without a root
+		if (!confined) slashDir.wd = watchFd(dirfdInotifyFd, slashDir.fd, DIRFD_MASK);
+		if (pthread_create(&applier, NULL, &applyDirEvents, NULL) != 0) return -1;
+	}
+	return 0;
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Attribute cache																					*
+ * 																									*
+ * netstat() and netlistdir() are answered from a cache of file attributes and						*
+ * directory listings, so scanning a large tree again doesn't stat every file						*
+ * again. Everything cached belongs to the directory it is in, which has an							*
+ * inotify watch (on an instance of its own), and pending events are applied						*
+ * before every answer, so whatever any process changed before a request is							*
+ * seen by it. Writes through the server also drop what they touch right away.						*
+ * The attributes of directories themselves are not cached, see cachedStat().						*
+ * Directories are evicted least recently used first, with their entries.							*
+ * 																									*
+ ****************************************************************************************************/
+
+typedef struct s_AttrEntry {
+	char *path;
+	struct stat st;
+	struct s_DirCache *dir;
+	struct s_AttrEntry *hashNext;
+	struct s_AttrEntry *prevInDir, *nextInDir;
+} AttrEntry;
+
+typedef struct s_DirCache {
+	char *path;
+	int wd;						// inotify watch descriptor, -1 once the kernel dropped it
+	long gen;					// bumped by every event, so lookups made without the lock can tell
+	char **names;				// sorted listing, NULL until listed or once out of date
+	int nnames;
+	AttrEntry *entries;
+	int nentries;
+	struct s_DirCache *hashNext;
+	struct s_DirCache *prev, *next;		// most recently used first
+} DirCache;
+
+# define ATTR_BUCKETS     16384
+# define ATTR_MAX_ENTRIES 65536
+# define ATTR_MAX_DIRS    1024		// each one holds an inotify watch
+# define LISTDIR_MAX      1024		// entries per netlistdir() page
+# define DIR_MASK (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+pthread_mutex_t attrLock = PTHREAD_MUTEX_INITIALIZER;
+AttrEntry *attrTable[ATTR_BUCKETS];
+DirCache *dirTable[ATTR_BUCKETS];
+DirCache *dirsFirst = NULL, *dirsLast = NULL;
+int attrDirs = 0;
+int dirInotifyFd = -1;
+
+AttrEntry *findAttr(const char *path) {
+	AttrEntry *e;
+	
+	for (e = attrTable[hashPath(path) % ATTR_BUCKETS]; e != NULL && strcmp(e->path, path) != 0; e = e->hashNext);
+	return e;
+}
+
+DirCache *findDir(const char *path) {
+	DirCache *d;
+	
+	for (d = dirTable[hashPath(path) % ATTR_BUCKETS]; d != NULL && strcmp(d->path, path) != 0; d = d->hashNext);
+	return d;
+}
+
+/**
+ * Moves a directory to the front of the eviction order.
+ */
+void touchDir(DirCache *d) {
+	if (d == dirsFirst) return;
+	if (d == dirsLast) dirsLast = d->prev;
+	listUnlink(dirsFirst, d, prev, next);
+	listPush(dirsFirst, d, prev, next);
+	if (dirsLast == NULL) dirsLast = d;
+}
+
+void dropAttr(AttrEntry *e) {
+	AttrEntry **ep;
+	
+	for (ep = &attrTable[hashPath(e->path) % ATTR_BUCKETS]; *ep != e; ep = &(*ep)->hashNext);
+	*ep = e->hashNext;
+	listUnlink(e->dir->entries, e, prevInDir, nextInDir);
+	e->dir->nentries--;
+	free(e->path);
+	free(e);
+	STAT_ADD(attrEntries, -1);
+}
+
+void dropListing(DirCache *d) {
+	int i;
+	
+	for (i=0; i<d->nnames; i++) free(d->names[i]);
+	free(d->names);
+	d->names = NULL;
+	d->nnames = 0;
+}
+
+/**
+ * Forgets a directory and everything cached in it.
+ */
+void dropDir(DirCache *d) {
+	DirCache **dp;
+	
+	while (d->entries != NULL) dropAttr(d->entries);
+	dropListing(d);
+	if (d->wd != -1) inotify_rm_watch(dirInotifyFd, d->wd);
+	for (dp = &dirTable[hashPath(d->path) % ATTR_BUCKETS]; *dp != d; dp = &(*dp)->hashNext);
+	*dp = d->hashNext;
+	if (d == dirsLast) dirsLast = d->prev;
+	listUnlink(dirsFirst, d, prev, next);
+	free(d->path);
+	free(d);
+	attrDirs--;
+}
+
+/**
+ * Returns the cache of a directory, watching it first if it has none, or
+ * NULL if it can't be watched (it doesn't exist, or we are out of watches).
+ * Must be called with attrLock held.
+ */
+DirCache *cacheDir(const char *path) {
+	DirCache *d = findDir(path);
+	DirHandle *h;
+	int wd;
+	
+	if (d != NULL) {
+		touchDir(d);
+		return d;
+	}
+	if (dirInotifyFd == -1) return NULL;
+	while (attrDirs >= ATTR_MAX_DIRS && dirsLast != NULL) dropDir(dirsLast);
+	h = lookupDir(path);
+	if (h == NULL) return NULL;
+	wd = watchFd(dirInotifyFd, h->fd, DIR_MASK | IN_ONLYDIR);
+	releaseDir(h);
+	if (wd == -1) return NULL;
+	d = calloc(sizeof(DirCache), 1);
+	d->path = strdup(path);
+	d->wd = wd;
+	d->hashNext = dirTable[hashPath(path) % ATTR_BUCKETS];
+	dirTable[hashPath(path) % ATTR_BUCKETS] = d;
+	listPush(dirsFirst, d, prev, next);
+	if (dirsLast == NULL) dirsLast = d;
+	attrDirs++;
+	return d;
+}
+
+/**
+ * Caches the attributes of path, which is in directory d.
+ * Must be called with attrLock held.
+ */
+void addAttr(DirCache *d, const char *path, struct stat *st) {
+	AttrEntry *e = findAttr(path);
+	
+	if (e != NULL) {
+		e->st = *st;
+		return;
+	}
+	// make room in the least recently used directories, but never in d
+	while (STAT_GET(attrEntries) >= ATTR_MAX_ENTRIES && dirsLast != NULL && dirsLast != d) dropDir(dirsLast);
+	if (STAT_GET(attrEntries) >= ATTR_MAX_ENTRIES) return;
+	e = calloc(sizeof(AttrEntry), 1);
+	e->path = strdup(path);
+	e->st = *st;
+	e->dir = d;
+	e->hashNext = attrTable[hashPath(path) % ATTR_BUCKETS];
+	attrTable[hashPath(path) % ATTR_BUCKETS] = e;
+	listPush(d->entries, e, prevInDir, nextInDir);
+	d->nentries++;
+	STAT_ADD(attrEntries, 1);
+}
+
+/**
+ * Applies every pending inotify event to the cache.
+ * Must be called with attrLock held.
+ */
+void drainDirEvents() {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	AttrEntry *e;
+	DirCache *d;
+	ssize_t len;
+	char *p;
+	
+	if (dirInotifyFd == -1) return;
+	while ((len = read(dirInotifyFd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *) p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				// events were lost, so nothing cached can be trusted
+				STAT_ADD(attrOverflows, 1);
+				while (dirsFirst != NULL) dropDir(dirsFirst);
+				continue;
+			}
+			for (d = dirsFirst; d != NULL && d->wd != ev->wd; d = d->next);
+			if (d == NULL) continue;
+			d->gen++;
+			if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+				if (ev->mask & IN_IGNORED) d->wd = -1;
+				dropDir(d);
+				continue;
+			}
+			if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) dropListing(d);
+			if (ev->len == 0) continue;
+			char path[strlen(d->path) + ev->len + 2];
+			sprintf(path, "%s/%s", strcmp(d->path, ".") == 0 ? "" : d->path, ev->name);
+			e = findAttr(strcmp(d->path, ".") == 0 ? path + 1 : path);
+			if (e != NULL) dropAttr(e);
+		}
+	}
+}
 
-	list->length++;
+/**
+ * Drops the cached attributes of a file the server just changed, so the
+ * next netstat() doesn't have to wait for inotify to tell.
+ */
+void attrChanged(const char *path) {
+	AttrEntry *e;
+	
+	if (STAT_GET(attrEntries) == 0) return;
+	pthread_mutex_lock(&attrLock);
+	e = findAttr(path);
+	if (e != NULL) {
+		e->dir->gen++;
+		dropAttr(e);
+	}
+	pthread_mutex_unlock(&attrLock);
+}
+
+/**
+ * stat() through the cache.
+ * Returns 0 on success, -1 with errno set appropriately
+ */
+int cachedStat(const char *path, struct stat *st) {
+	char dir[strlen(path) + 2];
+	AttrEntry *e;
+	DirCache *d;
+	long gen = 0;
+	
+	parentDir(path, dir);
+	pthread_mutex_lock(&attrLock);
+	drainDirEvents();
+	e = findAttr(path);
+	if (e != NULL) {
+		*st = e->st;
+		touchDir(e->dir);
+		pthread_mutex_unlock(&attrLock);
+		STAT_ADD(attrHits, 1);
+		return 0;
+	}
+	// watch the directory before looking, so no change can slip in between
+	d = cacheDir(dir);
+	if (d != NULL) gen = d->gen;
+	pthread_mutex_unlock(&attrLock);
+	STAT_ADD(attrMisses, 1);
+	
+	if (statPath(path, st) == -1) return -1;
+	// a directory's times and link count change with what is in it, which its parent's watch doesn't see
+	if (d == NULL || S_ISDIR(st->st_mode)) return 0;
+	pthread_mutex_lock(&attrLock);
+	drainDirEvents();
+	d = findDir(dir);
+	if (d != NULL && d->gen == gen) addAttr(d, path, st);
+	pthread_mutex_unlock(&attrLock);
+	return 0;
+}
+
+int compareNames(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/**
+ * Reads the names in a directory, sorted, into a malloc()'ed array of
+ * malloc()'ed strings. Returns the number of names, or -1 with errno set.
+ */
+int readNames(const char *path, char ***names) {
+	struct dirent *de;
+	int n = 0, size = 64, fd;
+	DIR *dir;
+	
+	fd = openPath(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+	if (fd == -1) return -1;
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return -1;
+	}
+	*names = malloc(sizeof(char *) * size);
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+		if (n == size) *names = realloc(*names, sizeof(char *) * (size *= 2));
+		(*names)[n++] = strdup(de->d_name);
+	}
+	closedir(dir);
+	qsort(*names, n, sizeof(char *), compareNames);
+	return n;
+}
+
+# define ATTRS_SIZE 128
+
+/**
+ * Formats the attributes the protocol carries for a file into buf, which
+ * must hold ATTRS_SIZE bytes: "<mode>,<size>,<mtime s>,<mtime ns>,<inode>,<links>"
+ */
+void formatAttrs(char *buf, struct stat *st) {
+	sprintf(buf, "%u,%lld,%lld,%ld,%llu,%lu", (unsigned) st->st_mode, (long long) st->st_size, (long long) st->st_mtim.tv_sec,
+		st->st_mtim.tv_nsec, (unsigned long long) st->st_ino, (unsigned long) st->st_nlink);
+}
+
+/**
+ * Lists up to max entries of a directory, starting at the start-th in name
+ * order: for every entry its name's length, sep, the name, and with attrs
+ * set its attributes and sep (see formatAttrs()). The number of entries is
+ * stored in count and where the next page starts in next. Entries that
+ * vanish while being listed are left out.
+ * 
+ * Returns a malloc()'ed string with its length in len, or NULL with errno set
+ */
+char *listDir(const char *path, long start, int max, int attrs, long *next, int *count, size_t *len) {
+	const char *sep = path[strlen(path) - 1] == '/' ? "" : "/";
+	char **names = NULL, **page, *out = NULL, attrbuf[ATTRS_SIZE];
+	int i, n, own = 0;
+	DirCache *d;
+	struct stat st;
+	long gen = 0;
+	FILE *f;
+	
+	pthread_mutex_lock(&attrLock);
+	drainDirEvents();
+	d = cacheDir(path);
+	if (d != NULL && d->names != NULL) {
+		n = d->nnames;
+		names = d->names;
+		STAT_ADD(listHits, 1);
+	} else {
+		if (d != NULL) gen = d->gen;
+		pthread_mutex_unlock(&attrLock);
+		STAT_ADD(listMisses, 1);
+		n = readNames(path, &names);
+		if (n == -1) return NULL;
+		pthread_mutex_lock(&attrLock);
+		drainDirEvents();
+		d = findDir(path);
+		if (d != NULL && d->gen == gen && d->names == NULL) {
+			d->names = names;
+			d->nnames = n;
+		} else own = 1;
+	}
+	// the names of the page are copied, the listing may go stale once we let go
+	if (start > n) start = n;
+	if (max > n - start) max = n - start;
+	page = malloc(sizeof(char *) * (max + 1));
+	for (i=0; i<max; i++) page[i] = strdup(names[start + i]);
+	pthread_mutex_unlock(&attrLock);
+	if (own) {
+		for (i=0; i<n; i++) free(names[i]);
+		free(names);
+	}
+	
+	f = open_memstream(&out, len);
+	*count = 0;
+	for (i=0; i<max; i++) {
+		char full[strlen(path) + strlen(page[i]) + 2];
+		// named the way clients name it, so it is found again in the cache
+		if (strcmp(path, ".") == 0) strcpy(full, page[i]);
+		else sprintf(full, "%s%s%s", path, sep, page[i]);
+		if (attrs && cachedStat(full, &st) == -1) continue;
+		fprintf(f, "%zu,%s", strlen(page[i]), page[i]);
+		if (attrs) {
+			formatAttrs(attrbuf, &st);
+			fprintf(f, "%s,", attrbuf);
+		}
+		(*count)++;
+	}
+	for (i=0; i<max; i++) free(page[i]);
+	free(page);
+	fclose(f);
+	*next = start + max;
+	return out;
+}
+
+/****************************************************************************************************
+ * 																									*
+ * File permission management																		*	
+ * 																									*
+ * Code below provides a mechanism for implementing unrestricted mode,								*
+ * exclusive mode and transaction mode, allowing for clients to choose								*
+ * how they view files.																				*
+ * 																									*	
+ ****************************************************************************************************/
+ 
+/*
+ * 
+ * How this file management system works:
+ * 
+ * There is a global linked list of files that are open by clients. Each node
+ * represents 1 MultiFile object which describes particulars on a file. A file
+ * is added to the global file when it is opened by a client for the first time,
+ * and removed when no more clients have it opened.
+ * 
+ * Each MultiFile keeps track of the highest access level (most restrictive)
+ * and whether or not any clients have write access. This is for easy permission
+ * checking during opens. The highest access level and write value are re-evaluated
+ * when a client closes the file.
+ * 
+ * When a client performs an operation on a file, we first check if they have
+ * the file open and that their permissions are appropriate before fufilling
+ * the request.
+ * 
+ * When a client performs a read or write, the issue of "what the fuck happens
+ * to the file index" comes up. In transaction mode, the files index remains
+ * wherever the client left it last since it will never be modified by anyone
+ * else. In any other mode, the file index is set to 0 (start of file). This 
+ * may seem like a lousy implementation, and that's because it is. But we 
+ * don't have a netseek function, which is even lousier. So this is the only 
+ * solution where we don't have to come up with some stupid special case about 
+ * "what the fuck happens to the file index once someone rewrites the file"
+ * 
+ * Now you always get from the start of the file, and always write to the start
+ * of the file. Unless you completely own the file.
+ * 
+ * Deal with it.
+ * 
+ * Update: reads and writes now carry an explicit offset from the client, which
+ * tracks its own position per handle, so they no longer touch the shared file
+ * index at all (pread/pwrite).
+ * 
+ * Update: clients no longer see our file descriptors. Each connection has a
+ * handle table (see below) that takes a client's handle straight to its
+ * ClientHandle, which points back at the MultiFile.
+ */
+ 
+struct s_MultiFile;
+
+/**
+ * What a file's contents were at, as far as the caches can tell: the version
+ * covers changes made through the server, the modification time and size
+ * those made to the file behind its back. See stampFile().
+ */
+typedef struct {
+	long version;
+	struct timespec mtime;
+	off_t size;
+} FileStamp;
+
+/**
+ * A whole COMPRESS_CHUNK of a file, kept compressed (header included) for
+ * clients that read it again. Only valid while the file is at stamp.
+ */
+typedef struct {
+	long chunk;			// offset in the file / COMPRESS_CHUNK
+	FileStamp stamp;
+	size_t len;
+	char *data;			// NULL for an empty slot
+} ZChunk;
+
+# define ZCACHE_SLOTS 64					// chunks cached per file, by chunk number
+# define ZCACHE_BYTES (64 * 1024 * 1024)	// most cached over all files
+
+/**
+ * A checksum of a range of a file, valid while the file is at stamp.
+ */
+typedef struct {
+	FileStamp stamp;
+	off_t offset;
+	size_t len;			// as asked for, 0 for the rest of the file
+	size_t covered;		// bytes the checksum covers
+	uint32_t crc;
+	char valid;
+} CrcEntry;
+
+# define CRC_CACHE_SLOTS 4					// checksums cached per file, oldest replaced first
+
+typedef struct s_ClientHandle {
+	int client;			// session of the client holding the handle, see resumeSession()
+	int permission;
+	char access;
+	int durability;		// DURABLE_NONE, DURABLE_SYNC or DURABLE_GROUP
+	int append;			// opened with NET_APPEND, every write goes to the end of the file
+	ReadPattern pattern;
+	struct s_MultiFile *file;
+	struct s_ClientHandle *prevOwner, *nextOwner;	// the file's other owners
+	struct s_ClientHandle *prevHeld, *nextHeld;		// the session's other handles
+} ClientHandle;
+
+typedef struct s_MultiFile {
+	int fd;
+	dev_t dev;					// the file the fd is on, whatever its name is by now
+	ino_t ino;
+	int refcount;
+	int write;
+	char access;
+	char *fname;
+	ClientHandle *owners;
+	int writers;				// owners with write permission
+	int accessCount[3];			// owners in each access mode, MODE_UNRESTRCT first
+	pthread_mutex_t writeLock;	// orders writes with their replication log entries, and appends with each other
+	long version;				// bumped after every change, see fileChanged()
+	pthread_mutex_t cacheLock;
+	ZChunk *zcache;				// ZCACHE_SLOTS entries once read compressed, NULL before
+	CrcEntry crcCache[CRC_CACHE_SLOTS];
+	int crcNext;				// slot the next checksum goes in
+	struct s_MultiFile *prev, *next;
+} MultiFile;
+
+pthread_mutex_t fileLock;
+pthread_mutex_t nameLock = PTHREAD_MUTEX_INITIALIZER;	// held with fileLock to change a file's name, either is enough to read it, see logFileOp()
+MultiFile *fileList = NULL;
+
+/**
+ * Returns the open file named fname, or NULL if it isn't open.
+ * Must be called with fileLock held.
+ */
+MultiFile *findFile(const char *fname) {
+	MultiFile *file;
+	
+	for (file = fileList; file != NULL; file = file->next) {
+		if (strcmp(file->fname, fname) == 0) return file;
+	}
+	return NULL;
+}
+
+/**
+ * Checks all open files to see if this file is open by another client.
+ * If it is, we return a reference to that MultiFile. If not, then this
+ * method creates a new MultiFile for the requested file. A file that is
+ * open under another name, because a rename hasn't caught up with it yet
+ * (see renameFile()), is found by its inode.
+ * Must be called with fileLock held.
+ * 
+ * On success, returns a MultiFile representing the specified file
+ * On failure, returns NULL with errno set appropriately
+ */
+MultiFile *getFileByName(const char *fname) {
+	MultiFile *file;
+	struct stat st;
+	int fd;
+	
+	file = findFile(fname);
+	if (file != NULL) return file;
+	// file not yet opened by another client, so open it with r/w permission
+	fd = openPath(fname, O_RDWR, 0);
+	if (fd == -1) return NULL;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+	for (file = fileList; file != NULL; file = file->next) {
+		if (file->dev == st.st_dev && file->ino == st.st_ino) {
+			close(fd);
+			return file;
+		}
+	}
+	// allocate MultiFile, and initialize values
+	file = calloc(sizeof(MultiFile), 1);
+	file->fd = fd;
+	file->dev = st.st_dev;
+	file->ino = st.st_ino;
+	file->fname = strdup(fname);
+	pthread_mutex_init(&file->writeLock, NULL);
+	pthread_mutex_init(&file->cacheLock, NULL);
+	// add file to linked list
+	listPush(fileList, file, prev, next);
+	STAT_ADD(openFiles, 1);
+	return file;
+}
+
+/**
+ * Returns what is left of path after dir, if path is dir or a path beneath
+ * it, or NULL otherwise.
+ */
+const char *pathUnder(const char *path, const char *dir) {
+	size_t len = strlen(dir);
+	
+	if (strncmp(path, dir, len) != 0 || (path[len] != '\0' && path[len] != '/')) return NULL;
+	return path + len;
+}
+
+/**
+ * Renames the open files affected by renaming from to to on disk, so later
+ * opens by name find the right one. Either may be a directory, which renames
+ * the open files beneath it. A file the rename replaced is no longer
+ * reachable by name, and stays open only for its current owners.
+ * Must be called with fileLock and nameLock held.
+ */
+void renameOpenFiles(const char *from, const char *to, int flags) {
+	const char *rest, *base;
+	MultiFile *file;
+	char *name;
+	
+	for (file = fileList; file != NULL; file = file->next) {
+		if ((rest = pathUnder(file->fname, from)) != NULL) base = to;
+		else if ((rest = pathUnder(file->fname, to)) != NULL) base = flags & NET_RENAME_EXCHANGE ? from : NULL;
+		else continue;
+		if (base == NULL) {
+			name = strdup("");
+		} else {
+			name = malloc(strlen(base) + strlen(rest) + 1);
+			sprintf(name, "%s%s", base, rest);
+		}
+		free(file->fname);
+		file->fname = name;
+	}
+}
+
+/**
+ * Stores what a file is at in stamp. Must be taken before the file is read,
+ * like the version alone.
+ */
+void stampFile(MultiFile *file, FileStamp *stamp) {
+	struct stat st;
+	
+	stamp->version = __atomic_load_n(&file->version, __ATOMIC_ACQUIRE);
+	// a file that can't be looked at is never the same twice
+	if (fstat(file->fd, &st) == -1) {
+		stamp->size = -1;
+		stamp->mtime.tv_sec = 0;
+		stamp->mtime.tv_nsec = -1;
+		return;
+	}
+	stamp->mtime = st.st_mtim;
+	stamp->size = st.st_size;
+}
+
+/**
+ * Returns 1 if two stamps of a file are the same, 0 if it changed in between.
+ */
+int sameStamp(const FileStamp *a, const FileStamp *b) {
+	return a->size >= 0 && a->version == b->version && a->size == b->size
+		&& a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+/**
+ * Marks a file as changed, so chunks cached compressed at its old contents
+ * are no longer used. Must be called after the change is made: readers take
+ * the version before they read.
+ */
+void fileChanged(MultiFile *file) {
+	char *name;
+	
+	__atomic_add_fetch(&file->version, 1, __ATOMIC_RELEASE);
+	if (STAT_GET(attrEntries) == 0) return;
+	// a rename frees the old name, see renameOpenFiles()
+	pthread_mutex_lock(&nameLock);
+	name = strdup(file->fname);
+	pthread_mutex_unlock(&nameLock);
+	attrChanged(name);
+	free(name);
+}
+
+void notifyChange(int filefd, off_t offset, off_t len);	// see Change notification
+
+/**
+ * Marks the open file named path as changed, if it is open. For changes made
+ * without a MultiFile, like those a replica applies from its primary.
+ */
+void pathChanged(const char *path) {
+	MultiFile *file;
+	
+	attrChanged(path);
+	pthread_mutex_lock(&fileLock);
+	for (file = fileList; file != NULL; file = file->next) {
+		if (strcmp(file->fname, path) == 0) __atomic_add_fetch(&file->version, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&fileLock);
+}
+
+/**
+ * Frees every chunk a file has cached compressed.
+ */
+void dropCache(MultiFile *file) {
+	int i;
+	
+	if (file->zcache == NULL) return;
+	for (i=0; i<ZCACHE_SLOTS; i++) {
+		if (file->zcache[i].data == NULL) continue;
+		STAT_ADD(zcacheBytes, -(long) file->zcache[i].len);
+		free(file->zcache[i].data);
+	}
+	free(file->zcache);
+	file->zcache = NULL;
+}
+
+/**
+ * Returns 0 if client does not have file open in any way, 1 if the 
+ * client has access in the given permission, and -1 if the client has
+ * access that differs from the specified permission
+ */
+int hasAccess(MultiFile *file, int client, int permission) {
+	ClientHandle *handle;
+
+	for (handle = file->owners; handle != NULL; handle = handle->nextOwner) {
+		if (handle->client == client) {
+			if (handle->permission == permission) return 1;
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+/**
+ * Updates the maximum access level and write permission on the file when
+ * handle joins (dir 1) or leaves (dir -1) its owners.
+ */
+void updateAccess(MultiFile *file, ClientHandle *handle, int dir) {
+	int i;
+	
+	if (handle->permission == O_WRONLY || handle->permission == O_RDWR) file->writers += dir;
+	file->accessCount[handle->access - MODE_UNRESTRCT] += dir;
+	
+	file->access = 0;
+	for (i=0; i<3; i++) {
+		if (file->accessCount[i] > 0) file->access = MODE_UNRESTRCT + i;
+	}
+	file->write = file->writers > 0;
+}
+
+/**
+ * Attempts to add client as an owner of a given MultiFile.
+ * 
+ * Returns the client's new handle on the file if it was successful, or NULL
+ * if we are unable to attach to the file due to permission conflicts.
+ */
+ClientHandle *addOwner(MultiFile *file, int flags, int client, char access) {
+	
+	ClientHandle *handle;
+	
+	if (hasAccess(file, client, flags)) {
+		// don't let clients open a file twice
+		goto BADPERM;
+	}
+	
+	if (file->access == 0) {
+		// new file, add client no matter what
+		goto GOODPERM;
+	}
+	
+	if (file->access == MODE_TRANSACTN || access == MODE_TRANSACTN) {
+		// if the file is not new, and someone has/wants transaction mode, that can't happen
+		goto BADPERM;
+	}
+	
+	if (flags == O_RDONLY) {
+		// if the file is in exclusive or unrestricted and we want to read, we're good to go
+		goto GOODPERM;
+	}
+	
+	// past here, we know this client wants some form of write access
+	if ((file->access == MODE_EXCLUSIVE || access == MODE_EXCLUSIVE) && file->write) {
+		// fail if the file is/would be in exclusive mode and someone else has write access
+		goto BADPERM;
+	}
+	
+	// now either no one else has write access, or we're all in unrestricted mode and don't care!
+	GOODPERM:
+	// initialize client handle
+	handle = calloc(sizeof(ClientHandle), 1);
+	handle->access = access;
+	handle->client = client;
+	handle->permission = flags;
+	handle->file = file;
+	file->refcount++;
+	listPush(file->owners, handle, prevOwner, nextOwner);
+	updateAccess(file, handle, 1);	// update access level
+	STAT_ADD(openHandles, 1);
+	return handle;
+	
+	// there was a conflict with existing permissions
+	BADPERM:
+	errno = EPERM;
+	return NULL;
+}
+
+/**
+ * Removes an owner's handle from its file and frees it, closing the file when
+ * no one else has it open.
+ */
+void removeOwner(ClientHandle *handle) {
+	MultiFile *file = handle->file;
+	
+	listUnlink(file->owners, handle, prevOwner, nextOwner);
+	updateAccess(file, handle, -1);
+	STAT_ADD(openHandles, -1);
+	free(handle);
+	// update refcount
+	file->refcount--;
+	if (file->refcount == 0) {
+		// if no one is holding the file, close and remove file from linked list
+		listUnlink(fileList, file, prev, next);
+		STAT_ADD(openFiles, -1);
+		close(file->fd);	// close file
+		free(file->fname); 	// free string name
+		pthread_mutex_destroy(&file->writeLock);
+		dropCache(file);
+		pthread_mutex_destroy(&file->cacheLock);
+		free(file); 		// finally, free the file descriptor
+	}
+}
+
+/**
+ * Gives a client access to a file named by path for one server side operation,
+ * checked against everyone else's access modes as if the client opened it
+ * with flags. If the client already has the file open, its own handle is
+ * used as long as it allows flags. Otherwise the file is opened for the
+ * client, and *temp is set, until returnFile().
+ * Must be called with fileLock held.
+ * 
+ * Returns the handle on success, or NULL with errno set
+ */
+ClientHandle *borrowFile(const char *fname, int flags, int client, char access, int *temp) {
+	MultiFile *file;
+	ClientHandle *handle;
+	
+	*temp = 0;
+	file = getFileByName(fname);
+	if (file == NULL) return NULL;
+	for (handle = file->owners; handle != NULL; handle = handle->nextOwner) {
+		if (handle->client != client) continue;
+		if (handle->permission == flags || handle->permission == O_RDWR) return handle;
+		errno = EPERM;
+		return NULL;
+	}
+	handle = addOwner(file, flags, client, access);
+	if (handle != NULL) *temp = 1;
+	return handle;
+}
+
+/**
+ * Gives back a handle from borrowFile(). Must be called with fileLock held.
+ */
+void returnFile(ClientHandle *handle, int temp) {
+	if (handle != NULL && temp) removeOwner(handle);
+}
+
+void printFileTree() {
+	MultiFile *file;
+	ClientHandle *client;
+	
+	printf("\n\nTREE: \n");
+	for (file = fileList; file != NULL; file = file->next) {
+		printf("\tFNAME: %s\n\tFD:    %d\n\tMAXAC: %c\n\tWRITE: %d\n\tREFCT: %d\n\tOWNED:\n", file->fname, file->fd, file->access, file->write, file->refcount);
+		
+		for (client = file->owners; client != NULL; client = client->nextOwner) {
+			printf("\t\tSession: %d\n\t\tAC: %c\n\t\tRW: %d\n\n", client->client, client->access, client->permission);
+		}
+	}
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Admission control																				*
+ * 																									*
+ * Every request is admitted before the server reads its data or runs it.							*
+ * At most maxRequests run at once, holding at most maxInflight bytes of							*
+ * request and response data between them. A request that doesn't fit								*
+ * waits, and so does its connection: nothing more is read from it, so the							*
+ * client backs up into its socket buffer (or its ring), not into our memory.						*
+ * Waiting connections take turns by deficit round robin. Each visit								*
+ * credits a connection ADMIT_QUANTUM bytes, and a request goes once its							*
+ * connection has credit for its cost, so small requests go straight								*
+ * through while bulk transfers share what is left. Connections themselves							*
+ * are capped at maxConns, above which the listeners stop accepting and								*
+ * new clients wait in the listen backlog.															*
+ * 																									*
+ ****************************************************************************************************/
+
+# define ADMIT_CONNS    4096				// default for maxConns (-c)
+# define ADMIT_REQUESTS 64					// default for maxRequests (-r)
+# define ADMIT_BYTES    (256L << 20)		// default for maxInflight (-m, in MB)
+# define ADMIT_QUANTUM  (64 * 1024)			// credit per round robin visit
+# define ADMIT_MIN_COST 512					// what the smallest request costs
+# define ADMIT_SMALL    8192				// frames up to this are read before admission
+
+/**
+ * A connection's place in admission. Connections run one request at a time,
+ * so this is also its one request.
+ */
+typedef struct s_Admission {
+	long cost;					// of the request waiting or running, 0 if none
+	long deficit;				// round robin credit, only kept while waiting
+	int waiting;
+	pthread_cond_t ready;		// signalled once admitted
+	struct s_Admission *prev, *next;	// ring of waiting connections
+} Admission;
+
+pthread_mutex_t admitLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t connFreed = PTHREAD_COND_INITIALIZER;
+Admission *admitCursor = NULL;		// next waiting connection to visit, NULL if none wait
+int admitWaiting = 0;				// connections in the ring
+int runningRequests = 0, runningBulk = 0;	// bulk ones cost more than ADMIT_QUANTUM
+long inflightBytes = 0;
+int openConns = 0;
+int maxConns = ADMIT_CONNS, maxRequests = ADMIT_REQUESTS;
+long maxInflight = ADMIT_BYTES;
+
+/**
+ * Tells whether a request of cost bytes can run now. Bulk requests leave a
+ * quarter of the places and a sixteenth of the bytes to small ones, and one
+ * bigger than its whole budget runs when nothing else holds any. Called with
+ * admitLock held.
+ */
+int admitFits(long cost) {
+	int bulkMax = maxRequests - (maxRequests > 4 ? maxRequests / 4 : 1);
+	long limit = maxInflight;
+	
+	if (runningRequests >= maxRequests) return 0;
+	if (cost > ADMIT_QUANTUM) {
+		if (runningBulk >= (bulkMax > 0 ? bulkMax : 1)) return 0;
+		limit -= maxInflight / 16;
+	}
+	return inflightBytes == 0 || inflightBytes + cost <= limit;
+}
+
+/**
+ * Lets a connection's request run. Called with admitLock held.
+ */
+void admitRun(Admission *a) {
+	runningRequests++;
+	if (a->cost > ADMIT_QUANTUM) runningBulk++;
+	inflightBytes += a->cost;
+	STAT_SET(runningRequests, runningRequests);
+	STAT_SET(inflightBytes, inflightBytes);
+}
+
+/**
+ * Takes a connection out of the ring and lets its request run. Called with
+ * admitLock held.
+ */
+void admitWaiter(Admission *a) {
+	if (admitCursor == a) admitCursor = a->next != a ? a->next : NULL;
+	a->prev->next = a->next;
+	a->next->prev = a->prev;
+	admitWaiting--;
+	a->waiting = 0;
+	a->deficit = 0;
+	admitRun(a);
+	pthread_cond_signal(&a->ready);
+}
+
+/**
+ * Admits waiting requests in round robin order for as long as they fit.
+ * The one whose turn it is keeps its turn until it fits, so bulk requests
+ * can't be starved by a stream of others, but small requests behind it that
+ * fit go ahead rather than wait for it. Called with admitLock held.
+ */
+void scheduleWaiting() {
+	Admission *a, *w, *next;
+	long rounds, need;
+	int visited = 0;
+	
+	while ((a = admitCursor) != NULL) {
+		if (a->deficit >= a->cost) {
+			if (!admitFits(a->cost)) break;
+			admitWaiter(a);
+			visited = 0;
+			continue;
+		}
+		if (visited == admitWaiting) {
+			// a whole round without anyone going, skip ahead to the round someone can
+			rounds = -1;
+			w = a;
+			do {
+				need = (w->cost - w->deficit + ADMIT_QUANTUM - 1) / ADMIT_QUANTUM;
+				if (rounds == -1 || need < rounds) rounds = need;
+				w = w->next;
+			} while (w != a);
+			do {
+				w->deficit += (rounds - 1) * ADMIT_QUANTUM;
+				w = w->next;
+			} while (w != a);
+			visited = 0;
+		}
+		a->deficit += ADMIT_QUANTUM;
+		visited++;
+		if (a->deficit < a->cost) admitCursor = a->next;
+	}
+	if (admitCursor == NULL) return;
+	for (w = admitCursor->next; w != admitCursor; w = next) {
+		next = w->next;
+		if (w->cost <= ADMIT_QUANTUM && admitFits(w->cost)) admitWaiter(w);
+	}
+}
+
+/**
+ * Waits until a connection's request of cost bytes may run. Must be paired
+ * with admitDone().
+ */
+void admitRequest(Admission *a, long cost) {
+	long start;
+	
+	if (cost < ADMIT_MIN_COST) cost = ADMIT_MIN_COST;
+	pthread_mutex_lock(&admitLock);
+	a->cost = cost;
+	if (admitCursor == NULL && admitFits(cost)) {
+		admitRun(a);
+		pthread_mutex_unlock(&admitLock);
+		return;
+	}
+	// join the ring at the end of the current round
+	if (admitCursor == NULL) {
+		a->prev = a->next = a;
+		admitCursor = a;
+	} else {
+		a->next = admitCursor;
+		a->prev = admitCursor->prev;
+		a->prev->next = a;
+		admitCursor->prev = a;
+	}
+	admitWaiting++;
+	a->waiting = 1;
+	a->deficit = 0;
+	STAT_ADD(admitWaits, 1);
+	start = nowMs();
+	scheduleWaiting();
+	while (a->waiting) pthread_cond_wait(&a->ready, &admitLock);
+	pthread_mutex_unlock(&admitLock);
+	STAT_ADD(admitWaitMs, nowMs() - start);
+}
+
+/**
+ * Ends a connection's running request, if it has one, and lets the next
+ * ones in.
+ */
+void admitDone(Admission *a) {
+	if (a->cost == 0) return;
+	pthread_mutex_lock(&admitLock);
+	runningRequests--;
+	if (a->cost > ADMIT_QUANTUM) runningBulk--;
+	inflightBytes -= a->cost;
+	a->cost = 0;
+	STAT_SET(runningRequests, runningRequests);
+	STAT_SET(inflightBytes, inflightBytes);
+	scheduleWaiting();
+	pthread_mutex_unlock(&admitLock);
+}
+
+/**
+ * What running a request of len bytes costs: its size, or for a read the
+ * data it will send back.
+ */
+long requestCost(const char *msg, int len) {
+	long long offset, size;
+	int fd;
+	
+	if (msg[0] == FN_READ && sscanf(msg + 2, "%d,%lld,%lld", &fd, &offset, &size) == 3 && size > len) return size;
+	return len;
+}
+
+/**
+ * Waits until the server may take another connection, and counts it. Called
+ * by the listeners before accepting, so connections over the limit stay in
+ * the listen backlog.
+ */
+void connStart() {
+	pthread_mutex_lock(&admitLock);
+	if (maxConns > 0 && openConns >= maxConns) STAT_ADD(connWaits, 1);
+	while (maxConns > 0 && openConns >= maxConns) pthread_cond_wait(&connFreed, &admitLock);
+	openConns++;
+	STAT_SET(openConns, openConns);
+	pthread_mutex_unlock(&admitLock);
+}
+
+/**
+ * Gives back a connection counted by connStart().
+ */
+void connDone() {
+	pthread_mutex_lock(&admitLock);
+	openConns--;
+	STAT_SET(openConns, openConns);
+	pthread_cond_signal(&connFreed);
+	pthread_mutex_unlock(&admitLock);
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Sessions and handle tables																		*
+ * 																									*
+ * Every connection keeps its open files in a table of slots, and the handle						*
+ * a client gets back from an open is the index of its slot with the slot's							*
+ * generation above it. Looking a handle up is indexing the table and comparing						*
+ * the generation, which is bumped whenever the slot is freed, so a handle that						*
+ * was closed (or never handed out) is refused without touching the file list.						*
+ * Slots are reused from a free list, and only the connection's own worker							*
+ * touches its table, so none of this needs a lock.													*
+ * 																									*
+ * The session also links every handle it holds into a list of its own, so							*
+ * when the connection goes away everything it held is released in one pass							*
+ * over that list, in time proportional to what it held.											*
+ * 																									*
+ ****************************************************************************************************/
+
+# define HANDLE_INDEX_BITS 12
+# define HANDLE_GEN_BITS 10		// the client keeps 9 bits of its own on top, see libnetfiles.c
+# define MAX_HANDLES (1 << HANDLE_INDEX_BITS)
+
+typedef struct {
+	ClientHandle *handle;	// NULL while the slot is free
+	int gen;				// 1 .. (1 << HANDLE_GEN_BITS) - 1
+	int nextFree;			// next slot on the free list, -1 at the end
+} HandleSlot;
+
+typedef struct {
+	HandleSlot *slots;
+	int nslots;
+	int freeSlot;			// first free slot, -1 if the table is full
+} HandleTable;
+
+typedef struct {
+	int id;					// identifies the client in the file tables, and stays the same when it resumes
+	struct s_Resumable *resume;	// NULL unless the client may come back for the session
+	HandleTable table;
+	ClientHandle *held;		// every handle the session has open
+	struct s_Watcher *watches;	// every file it watches, see watchFile()
+	int lastWatch;			// id of the newest watch
+	int pipe[2];			// for spliceWrite(), -1 until the first one
+	Admission admit;		// of the request being run
+} Session;
+
+/**
+ * Stores a client's handle in a free slot, growing the table if needed.
+ * 
+ * Returns the handle to give the client, or -1 with errno set to EMFILE if
+ * the connection has MAX_HANDLES files open.
+ */
+int allocHandle(HandleTable *table, ClientHandle *handle) {
+	HandleSlot *slot;
+	int i, grown;
+	
+	if (table->freeSlot == -1) {
+		if (table->nslots == MAX_HANDLES) {
+			errno = EMFILE;
+			return -1;
+		}
+		grown = table->nslots == 0 ? 16 : table->nslots * 2;
+		table->slots = realloc(table->slots, sizeof(HandleSlot) * grown);
+		for (i=table->nslots; i<grown; i++) {
+			table->slots[i].handle = NULL;
+			table->slots[i].gen = 1;
+			table->slots[i].nextFree = i + 1 < grown ? i + 1 : -1;
+		}
+		table->freeSlot = table->nslots;
+		table->nslots = grown;
+	}
+	i = table->freeSlot;
+	slot = &table->slots[i];
+	table->freeSlot = slot->nextFree;
+	slot->handle = handle;
+	return slot->gen << HANDLE_INDEX_BITS | i;
+}
+
+/**
+ * Returns the ClientHandle behind a client's handle, or NULL with errno set
+ * to EBADF if the handle isn't open on this connection.
+ */
+ClientHandle *lookupHandle(HandleTable *table, int handle) {
+	int i = handle & (MAX_HANDLES - 1);
+	
+	if (handle < 0 || i >= table->nslots || table->slots[i].handle == NULL || table->slots[i].gen != handle >> HANDLE_INDEX_BITS) {
+		STAT_ADD(staleHandles, 1);
+		errno = EBADF;
+		return NULL;
+	}
+	return table->slots[i].handle;
+}
+
+/**
+ * Frees the slot of a handle returned by lookupHandle(), so the handle
+ * becomes stale.
+ */
+void freeHandle(HandleTable *table, int handle) {
+	HandleSlot *slot = &table->slots[handle & (MAX_HANDLES - 1)];
+	
+	slot->handle = NULL;
+	slot->gen = slot->gen == (1 << HANDLE_GEN_BITS) - 1 ? 1 : slot->gen + 1;
+	slot->nextFree = table->freeSlot;
+	table->freeSlot = handle & (MAX_HANDLES - 1);
+}
+
+/**
+ * Gives a session a newly opened handle.
+ * 
+ * Returns the handle to give the client, or -1 with errno set, see allocHandle()
+ */
+int holdHandle(Session *session, ClientHandle *handle) {
+	int val = allocHandle(&session->table, handle);
+	if (val != -1) listPush(session->held, handle, prevHeld, nextHeld);
+	return val;
+}
+
+/**
+ * Takes a handle back from a session, returning its ClientHandle so the
+ * caller can close it, or NULL with errno set to EBADF if it isn't open.
+ */
+ClientHandle *dropHandle(Session *session, int val) {
+	ClientHandle *handle = lookupHandle(&session->table, val);
+	if (handle == NULL) return NULL;
+	freeHandle(&session->table, val);
+	listUnlink(session->held, handle, prevHeld, nextHeld);
+	return handle;
+}
+
+/**
+ * Closes every handle on a list of held ones and frees the table they were in.
+ */
+void releaseHandles(ClientHandle *held, HandleTable *table) {
+	ClientHandle *handle, *next;
+	
+	pthread_mutex_lock(&fileLock);
+	for (handle = held; handle != NULL; handle = next) {
+		next = handle->nextHeld;
+		removeOwner(handle);
+	}
+	pthread_mutex_unlock(&fileLock);
+	free(table->slots);
+	table->slots = NULL;
+	table->nslots = 0;
+	table->freeSlot = -1;
+}
+
+/**
+ * Releases everything a session holds, when its connection is gone.
+ */
+void endSession(Session *session) {
+	releaseHandles(session->held, &session->table);
+	session->held = NULL;
+	if (session->pipe[0] != -1) {
+		close(session->pipe[0]);
+		close(session->pipe[1]);
+		session->pipe[0] = session->pipe[1] = -1;
+	}
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Session resumption																				*
+ * 																									*
+ * A client that asks for it when it connects gets a token for its session.							*
+ * If the connection drops, the session is parked instead of ended: its								*
+ * handles, and with them its exclusive and transaction locks, are kept for							*
+ * sessionGrace seconds, and a client that connects again with the token in							*
+ * that time gets them back under the same handle numbers. A client that is							*
+ * done says so (FN_ENDSESSION), so only lost connections are kept. Parked							*
+ * sessions nobody comes back for are ended by the reaper thread.									*
+ * 																									*
+ * Since a resumed session arrives on a new socket, clients are told apart							*
+ * in the file tables by the session's id rather than by their socket.								*
+ * 																									*
+ ****************************************************************************************************/
+
+# define SESSION_GRACE 30		// seconds a dropped session is kept for by default
+# define RESUME_WAIT 5			// longest a resume waits for the old connection to let go
+
+typedef struct s_Resumable {
+	int id;
+	uint64_t secret;			// the rest of the token, so sessions can't be taken over by guessing ids
+	Transport *conn;			// connection the session is on, NULL while parked
+	HandleTable table;			// what the session holds while it is parked
+	ClientHandle *held;
+	time_t expires;				// when a parked session is ended
+	struct s_Resumable *prev, *next;
+} Resumable;
+
+pthread_mutex_t resumeLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sessionParked = PTHREAD_COND_INITIALIZER;
+Resumable *resumables = NULL;
+int sessionGrace = SESSION_GRACE;	// 0 to end sessions with their connection
+int lastSession = 0;
+
+/**
+ * Makes a session resumable, unless the server keeps no sessions.
+ */
+void registerSession(Session *session, Transport *conn) {
+	Resumable *r;
+	
+	if (sessionGrace <= 0) return;
+	r = calloc(sizeof(Resumable), 1);
+	if (getrandom(&r->secret, sizeof(r->secret), 0) != sizeof(r->secret)) {
+		free(r);
+		return;
+	}
+	r->id = session->id;
+	r->conn = conn;
+	pthread_mutex_lock(&resumeLock);
+	listPush(resumables, r, prev, next);
+	pthread_mutex_unlock(&resumeLock);
+	session->resume = r;
+}
+
+/**
+ * Writes the token a client can resume its session with to token, which has
+ * room for SESSION_TOKEN_SIZE bytes, or "" if the session can't be resumed.
+ */
+void sessionToken(Session *session, char *token) {
+	Resumable *r = session->resume;
+	
+	token[0] = '\0';
+	// digits only, so it can't be mistaken for a codec or FRAME_CRC
+	if (r != NULL) snprintf(token, SESSION_TOKEN_SIZE, "%d.%llu", r->id, (unsigned long long) r->secret);
+}
+
+/**
+ * Finds a session by its token. Called with resumeLock held.
+ */
+Resumable *findSession(int id, unsigned long long secret) {
+	Resumable *r;
+	
+	for (r = resumables; r != NULL && (r->id != id || r->secret != secret); r = r->next);
+	return r;
+}
+
+/**
+ * Hands a parked session over to a new connection of its client. If the
+ * old connection hasn't noticed that it is gone yet, it is shut down, and
+ * given up to RESUME_WAIT seconds to park the session.
+ * 
+ * Returns 0 on success, or -1 if there is no such session (any more).
+ */
+int resumeSession(Session *session, Transport *conn, const char *token) {
+	struct timespec deadline;
+	unsigned long long secret;
+	Resumable *r;
+	int id;
+	
+	if (sscanf(token, "%d.%llu", &id, &secret) != 2) return -1;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += RESUME_WAIT;
+	pthread_mutex_lock(&resumeLock);
+	while ((r = findSession(id, secret)) != NULL && r->conn != NULL) {
+		shutdown(r->conn->fd, SHUT_RDWR);
+		if (pthread_cond_timedwait(&sessionParked, &resumeLock, &deadline) == ETIMEDOUT) {
+			r = findSession(id, secret);
+			break;
+		}
+	}
+	if (r != NULL && r->conn == NULL) {
+		session->id = r->id;
+		session->table = r->table;
+		session->held = r->held;
+		session->resume = r;
+		r->held = NULL;
+		r->conn = conn;
+		STAT_ADD(sessionsParked, -1);
+		STAT_ADD(sessionsResumed, 1);
+	}
+	pthread_mutex_unlock(&resumeLock);
+	return session->resume != NULL ? 0 : -1;
+}
+
+/**
+ * Keeps what a session holds for its client to come back for, after its
+ * connection was lost. Does nothing to a session that can't be resumed, so
+ * endSession() releases it as usual.
+ */
+void parkSession(Session *session) {
+	Resumable *r = session->resume;
+	
+	if (r == NULL) return;
+	pthread_mutex_lock(&resumeLock);
+	r->table = session->table;
+	r->held = session->held;
+	r->conn = NULL;
+	r->expires = time(NULL) + sessionGrace;
+	pthread_cond_broadcast(&sessionParked);
+	pthread_mutex_unlock(&resumeLock);
+	STAT_ADD(sessionsParked, 1);
+	session->resume = NULL;
+	session->held = NULL;
+	session->table = (HandleTable) { NULL, 0, -1 };
+}
+
+/**
+ * Makes a session end with its connection, when its client is done with it.
+ */
+void forgetSession(Session *session) {
+	Resumable *r = session->resume;
+	
+	if (r == NULL) return;
+	pthread_mutex_lock(&resumeLock);
+	listUnlink(resumables, r, prev, next);
+	pthread_cond_broadcast(&sessionParked);
+	pthread_mutex_unlock(&resumeLock);
+	session->resume = NULL;
+	free(r);
+}
+
+/**
+ * Ends parked sessions once their grace period is over. Runs on its own
+ * thread, checking every second.
+ */
+void *reapSessions(void *arg) {
+	Resumable *r, *next, *expired;
+	time_t now;
+	(void) arg;
+	
+	for (;;) {
+		sleep(1);
+		expired = NULL;
+		now = time(NULL);
+		pthread_mutex_lock(&resumeLock);
+		for (r = resumables; r != NULL; r = next) {
+			next = r->next;
+			if (r->conn != NULL || r->expires > now) continue;
+			listUnlink(resumables, r, prev, next);
+			r->next = expired;
+			expired = r;
+		}
+		pthread_mutex_unlock(&resumeLock);
+		// closing files can block on their locks, so it is done outside resumeLock
+		for (r = expired; r != NULL; r = next) {
+			next = r->next;
+			releaseHandles(r->held, &r->table);
+			STAT_ADD(sessionsParked, -1);
+			STAT_ADD(sessionsExpired, 1);
+			free(r);
+		}
+	}
+	return NULL;
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Group commit																						*
+ * 																									*
+ * Writes through a handle opened with DURABLE_GROUP are not acknowledged until						*
+ * they are on disk, but instead of every client calling fdatasync() itself they					*
+ * queue up for the commit thread. The thread takes everything queued, issues						*
+ * one fdatasync() per distinct file, and wakes all of the writers at once.							*
+ * While a round is on disk the next batch builds up behind it, so the number						*
+ * of syncs stays flat as the number of writers grows.												*
+ * 																									*
+ ****************************************************************************************************/
+
+typedef struct s_CommitRequest {
+	int filefd;
+	int done;
+	int err;				// errno from the sync, 0 on success
+	struct s_CommitRequest *next;
+} CommitRequest;
+
+pthread_mutex_t commitLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commitReady = PTHREAD_COND_INITIALIZER;	// signalled when requests are queued
+pthread_cond_t commitDone = PTHREAD_COND_INITIALIZER;	// broadcast when a round is on disk
+CommitRequest *commitQueue = NULL;
+
+void *commitThread(void *ptr) {
+	CommitRequest *batch, *req, *prev;
+	int err;
+	(void) ptr;
+	
+	pthread_mutex_lock(&commitLock);
+	while (1) {
+		while (commitQueue == NULL) pthread_cond_wait(&commitReady, &commitLock);
+		batch = commitQueue;
+		commitQueue = NULL;
+		pthread_mutex_unlock(&commitLock);
+		
+		// one sync per file, shared by every request in the batch for that file
+		for (req = batch; req != NULL; req = req->next) {
+			for (prev = batch; prev != req; prev = prev->next) {
+				if (prev->filefd == req->filefd) break;
+			}
+			if (prev != req) {
+				req->err = prev->err;
+				continue;
+			}
+			err = fdatasync(req->filefd);
+			req->err = err == -1 ? errno : 0;
+			STAT_ADD(fsyncs, 1);
+		}
+		STAT_ADD(groupCommits, 1);
+		
+		pthread_mutex_lock(&commitLock);
+		for (req = batch; req != NULL; req = req->next) req->done = 1;
+		pthread_cond_broadcast(&commitDone);
+	}
+	
+	return NULL;
+}
+
+/**
+ * Makes everything written to filefd so far durable, according to the
+ * durability mode of the handle that wrote it.
+ * 
+ * Returns 0 on success, -1 on failure with errno set appropriately
+ */
+int commitWrite(int filefd, int durability) {
+	CommitRequest req = {0};
+	
+	if (durability == DURABLE_NONE) return 0;
+	STAT_ADD(durableWrites, 1);
+	
+	if (durability == DURABLE_SYNC) {
+		STAT_ADD(fsyncs, 1);
+		return fdatasync(filefd);
+	}
+	
+	req.filefd = filefd;
+	pthread_mutex_lock(&commitLock);
+	req.next = commitQueue;
+	commitQueue = &req;
+	pthread_cond_signal(&commitReady);
+	while (!req.done) pthread_cond_wait(&commitDone, &commitLock);
+	pthread_mutex_unlock(&commitLock);
+	
+	if (req.err) {
+		errno = req.err;
+		return -1;
+	}
+	return 0;
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Replication log																					*
+ * 																									*
+ * A server started with -P is a replication primary. Every write it applies						*
+ * is appended to an in memory log and numbered; writes to one file are logged						*
+ * in the order they reach the file, so a replica applying the log in order							*
+ * ends up with the same contents. Replicas (started with -f) connect like							*
+ * any client and ask for the log from the first entry they are missing, see						*
+ * the replication streams below. The log only keeps the most recent entries,						*
+ * and the log is lost when the primary restarts. A replica that falls out of						*
+ * it, or outlives its primary, has to be resynced by hand.											*
+ * 																									*
+ ****************************************************************************************************/
+
+typedef struct {
+	long seq;
+	long stamp;			// primary wall clock when the entry was logged, in ms
+	char op;			// see logOp()
+	char *path;
+	off_t offset;
+	size_t len;
+	char *data;
+	int refs;			// one for the log, plus one per streamer sending the entry
+} LogEntry;
+
+# define REPL_LOG_ENTRIES 65536				// entries kept for replicas
+# define REPL_LOG_BYTES (64 * 1024 * 1024)	// and at most this much data
+# define REPL_WAIT_MS 1000					// longest a read waits for a replica to catch up
+
+int replPrimary = 0;		// keep a log and serve it to replicas
+char *replSource = NULL;	// url of the primary, if this server is a replica
+int replStale = 0;			// the replica missed entries, see followPrimary()
+
+pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t logAppended = PTHREAD_COND_INITIALIZER;
+LogEntry *replLog[REPL_LOG_ENTRIES];
+long logFirst = 1, logLast = 0;		// oldest and newest sequence numbers in the log
+size_t logBytes = 0;
+
+pthread_mutex_t applyLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t applyAdvanced = PTHREAD_COND_INITIALIZER;
+long appliedSeq = 0;				// on a replica, last entry applied
+
+/**
+ * Drops a reference to a log entry, freeing it with the last one.
+ * Must be called with logLock held.
+ */
+void releaseEntry(LogEntry *e) {
+	if (--e->refs > 0) return;
+	free(e->path);
+	free(e->data);
+	free(e);
+}
+
+# define LOG_ALLOCATE 'P'
+
+/**
+ * Appends an operation on path to the log, evicting the oldest entries if the
+ * log is full. What offset and the len bytes of data mean depends on op:
+ * 
+ *  FN_WRITE		data was written at offset
+ *  FN_COPYRANGE	data is "<dst offset>,<len>,<dst path>", copied from offset
+ *  FN_RENAME		path was renamed to data, offset holds the NET_RENAME_* flags
+ *  FN_DELTA		data is a delta request without the handle, see applyDelta()
+ *  FN_TRUNCATE		path was truncated to offset bytes
+ *  LOG_ALLOCATE	data is "<NET_FALLOC_* mode>,<len>", allocated from offset
+ * 
+ * Returns the sequence number of the new entry.
+ */
+long logOp(char op, const char *path, off_t offset, const char *data, size_t len) {
+	LogEntry *e = malloc(sizeof(LogEntry)), *old;
+	long seq;
+	
+	e->stamp = nowMs();
+	e->op = op;
+	e->path = strdup(path);
+	e->offset = offset;
+	e->len = len;
+	e->data = malloc(len);
+	memcpy(e->data, data, len);
+	e->refs = 1;
+	
+	pthread_mutex_lock(&logLock);
+	while (logFirst <= logLast && (logLast - logFirst + 1 >= REPL_LOG_ENTRIES || logBytes + len > REPL_LOG_BYTES)) {
+		old = replLog[logFirst % REPL_LOG_ENTRIES];
+		logBytes -= old->len;
+		releaseEntry(old);
+		logFirst++;
+	}
+	seq = e->seq = ++logLast;
+	replLog[seq % REPL_LOG_ENTRIES] = e;
+	logBytes += len;
+	STAT_SET(logSeq, logLast);
+	STAT_SET(logEntries, logLast - logFirst + 1);
+	STAT_SET(logBytes, logBytes);
+	pthread_cond_broadcast(&logAppended);
+	pthread_mutex_unlock(&logLock);
+	
+	return seq;
+}
+
+/**
+ * logOp() on an open file, by the name it has right now. Renames change
+ * names and log themselves under nameLock too, so an operation is logged
+ * either by the old name before the rename or by the new one after it.
+ */
+long logFileOp(char op, MultiFile *file, off_t offset, const char *data, size_t len) {
+	long seq;
+	
+	pthread_mutex_lock(&nameLock);
+	seq = logOp(op, file->fname, offset, data, len);
+	pthread_mutex_unlock(&nameLock);
+	return seq;
+}
+
+/**
+ * Returns 1 with errno set to ESTALE on a replica that missed log entries, so
+ * its files can't be trusted to be the primary's, and 0 otherwise.
+ */
+int replicaStale() {
+	if (!__atomic_load_n(&replStale, __ATOMIC_ACQUIRE)) return 0;
+	errno = ESTALE;
+	return 1;
+}
+
+/**
+ * On a replica, waits up to REPL_WAIT_MS for log entry seq to be applied.
+ * Does nothing on other servers, which have applied all of their own writes.
+ * 
+ * Returns 0 once it is applied, -1 with errno set to ETIMEDOUT otherwise, or
+ * to ESTALE if the replica goes stale first
+ */
+int waitApplied(long seq) {
+	struct timespec until;
+	int ret = 0;
+	
+	if (replSource == NULL) return 0;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += REPL_WAIT_MS % 1000 * 1000000L;
+	until.tv_sec += REPL_WAIT_MS / 1000 + until.tv_nsec / 1000000000L;
+	until.tv_nsec %= 1000000000L;
+	
+	pthread_mutex_lock(&applyLock);
+	while (appliedSeq < seq && !replicaStale()) {
+		if (pthread_cond_timedwait(&applyAdvanced, &applyLock, &until) == ETIMEDOUT) break;
+	}
+	if (appliedSeq < seq) {
+		if (!replicaStale()) errno = ETIMEDOUT;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&applyLock);
+	return ret;
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Function implementations																			*
+ * 																									*
+ * Code below implements each function that the server will provide being,							*
+ * netopen, netclose, netread, netwrite.															*
+ * 																									*
+ ****************************************************************************************************/
+
+void error(char *msg) {
+    perror(msg);
+    exit(0);
+}
+
+/**
+ * Makes the directories leading up to path that don't exist yet, like
+ * mkdir -p.
+ * Returns 0 on success, -1 on failure with errno set appropriately
+ */
+int makeParents(const char *path) {
+	char dir[strlen(path) + 1], *p;
+	
+	strcpy(dir, path);
+	for (p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdirPath(dir, 0755) == -1 && errno != EEXIST) return -1;
+		*p = '/';
+	}
+	return 0;
+}
+
+/**
+ * Creates the file at path for an open with NET_CREATE, along with the
+ * directories on the way to it. A file that exists is left alone. A
+ * replication primary logs an empty write to a new file, so its replicas
+ * create it too.
+ * Returns 0 on success, -1 on failure with errno set appropriately
+ */
+int createFile(const char *path) {
+	int fd = openPath(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	
+	if (fd == -1 && errno == ENOENT && makeParents(path) == 0) fd = openPath(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd == -1) return errno == EEXIST ? 0 : -1;
+	close(fd);
+	if (replPrimary) logOp(FN_WRITE, path, 0, "", 0);
+	return 0;
+}
+
+/**
+ * Opens file for a given client, with the DURABLE_*, NET_APPEND and
+ * NET_CREATE bits of options. If successful, it will return the client's handle on the file, to
+ * be stored in its handle table. On failure, this method will return NULL,
+ * and errno will be set appropriately.
+ */
+ClientHandle *openFile(const char *fname, int flags, int client, char access, int options) {
+	MultiFile *file;
+	ClientHandle *handle = NULL;
+	// replicas only change files through the replication log
+	if (replSource != NULL && flags != O_RDONLY) {
+		errno = EROFS;
+		return NULL;
+	}
+	if (replicaStale()) return NULL;
+	if ((options & NET_CREATE) && flags != O_RDONLY && createFile(fname) == -1) return NULL;
+	// acquire lock 
+	pthread_mutex_lock(&fileLock);
+	file = getFileByName(fname);
+	
+	// file cannot be opened for some reason, so return with errno
+	if (file == NULL) goto OPENEND;
+	handle = addOwner(file, flags, client, access);
+	if (handle == NULL) goto OPENEND;
+	handle->durability = options & DURABLE_MASK;
+	handle->append = (options & NET_APPEND) != 0;
+	
+	OPENEND:
+	//printFileTree();
+	// return lock, and return the handle (or NULL if it was an error)
+	pthread_mutex_unlock(&fileLock);
+	return handle;
+}
+
+/**
+ * Close a client's handle on a file. The handle is freed.
+ */
+void closeFile(ClientHandle *handle) {
+	// acquire lock 
+	pthread_mutex_lock(&fileLock);
+	removeOwner(handle);
+	//printFileTree();
+	pthread_mutex_unlock(&fileLock);
+}
+
+/**
+ * Encodes len bytes of data read from a file at offset as chunks compressed
+ * with codec (see netcompress.h). Chunks are cut at multiples of
+ * COMPRESS_CHUNK in the file, so whole ones can be kept compressed in the
+ * file's cache and sent again without compressing them again, as long as the
+ * file is still at the stamp it was at before the data was read. The stamp
+ * also catches changes made to the file on disk without the server.
+ * 
+ * Returns a malloc()'ed buffer, its length stored in outlen.
+ */
+char *compressRead(MultiFile *file, const FileStamp *stamp, off_t offset, const char *data, size_t len, char codec, int *outlen) {
+	char *out = malloc(len + (len / COMPRESS_CHUNK + 2) * COMPRESS_HDR);
+	size_t done = 0, total = 0, n, clen;
+	long chunk, start;
+	ZChunk *slot;
+	FileStamp now;
+	
+	while (done < len) {
+		n = COMPRESS_CHUNK - (offset + done) % COMPRESS_CHUNK;
+		if (n > len - done) n = len - done;
+		chunk = (offset + done) / COMPRESS_CHUNK;
+		slot = NULL;
+		if (n == COMPRESS_CHUNK) {
+			pthread_mutex_lock(&file->cacheLock);
+			if (file->zcache == NULL) file->zcache = calloc(sizeof(ZChunk), ZCACHE_SLOTS);
+			slot = &file->zcache[chunk % ZCACHE_SLOTS];
+			if (slot->data != NULL && slot->chunk == chunk && sameStamp(&slot->stamp, stamp)) {
+				memcpy(out + total, slot->data, slot->len);
+				total += slot->len;
+				done += n;
+				pthread_mutex_unlock(&file->cacheLock);
+				STAT_ADD(zcacheHits, 1);
+				STAT_ADD(compressRaw, n);
+				STAT_ADD(compressSent, slot->len);
+				continue;
+			}
+			pthread_mutex_unlock(&file->cacheLock);
+			STAT_ADD(zcacheMisses, 1);
+		}
+		
+		start = cpuNs();
+		clen = compressChunk(codec, data + done, n, out + total);
+		STAT_ADD(compressNs, cpuNs() - start);
+		STAT_ADD(compressRaw, n);
+		STAT_ADD(compressSent, clen);
+		
+		// don't cache what a write has already made stale, or past the memory budget
+		if (slot != NULL) stampFile(file, &now);
+		if (slot != NULL && sameStamp(&now, stamp) && STAT_GET(zcacheBytes) + (long) clen <= ZCACHE_BYTES) {
+			pthread_mutex_lock(&file->cacheLock);
+			if (slot->data != NULL) STAT_ADD(zcacheBytes, -(long) slot->len);
+			free(slot->data);
+			slot->chunk = chunk;
+			slot->stamp = *stamp;
+			slot->len = clen;
+			slot->data = malloc(clen);
+			memcpy(slot->data, out + total, clen);
+			STAT_ADD(zcacheBytes, clen);
+			pthread_mutex_unlock(&file->cacheLock);
+		}
+		total += clen;
+		done += n;
+	}
+	*outlen = total;
+	return out;
+}
+
+/**
+ * Reads up to size bytes from offset in a file. The number of bytes actually
+ * read is stored in len. On a replica the read first waits for replication log
+ * entry minseq to be applied, so a client can read its own writes. If codec
+ * isn't CODEC_NONE the data is returned compressed, see compressRead(), and
+ * len is its compressed length.
+ * 
+ * Returns malloc()'ed buffer with file data on success
+ * Return NULL on failure with errno set accordingly
+ */
+char *readFile(ClientHandle *handle, off_t offset, size_t size, long minseq, char codec, int *len) {
+	char *data, *packed;
+	int filefd = handle->file->fd;
+	ssize_t bytesread;
+	FileStamp stamp;
+	
+	if (handle->permission != O_RDONLY && handle->permission != O_RDWR) {
+		errno = EACCES;
+		return NULL;
+	}
+	if (replicaStale() || (minseq > 0 && waitApplied(minseq) == -1)) return NULL;
+	// the handle holds a reference to the file, so it can't go away without the lock
+	trackRead(&handle->pattern, filefd, offset, size);
+	if (codec != CODEC_NONE) stampFile(handle->file, &stamp);
+	data = malloc(size + 1);
+	bytesread = pread(filefd, data, size, offset);
+	if (bytesread == -1) {
+		free(data);
+		return NULL;
+	}
+	// a short read at the end of the file still leaves the stream sequential
+	handle->pattern.next = offset + bytesread;
+	STAT_ADD(readBytes, bytesread);
+	*len = bytesread;
+	if (codec != CODEC_NONE) {
+		packed = compressRead(handle->file, &stamp, offset, data, bytesread, codec, len);
+		free(data);
+		return packed;
+	}
+	return data;
+}
+
+/**
+ * Writes a list of ranges to a file, in order. The data of all ranges is
+ * stored back to back in data. On a replication primary, seq is set to the
+ * log entry of the last range.
+ * 
+ * Returns number of bytes written on success
+ * Return -1 on failure, with errno set appropriately
+ */
+ssize_t writeFile(ClientHandle *handle, WriteRange *ranges, int nranges, const char *data, long *seq) {
+	MultiFile *file = handle->file;
+	ssize_t val = 0, written = 0;
+	off_t first = -1, end = 0, at;
+	struct stat st;
+	int i;
+	
+	if (handle->permission != O_WRONLY && handle->permission != O_RDWR) {
+		errno = EACCES;
+		return -1;
+	}
+	// the handle holds a reference to the file, so it can't go away without the lock
+	if (replPrimary || handle->append) pthread_mutex_lock(&file->writeLock);
+	for (i=0; i<nranges; i++) {
+		at = ranges[i].offset;
+		// appends hold the file's lock from finding its end until they are written
+		if (handle->append && (val = fstat(file->fd, &st)) == -1) break;
+		if (handle->append) at = st.st_size;
+		val = pwrite(file->fd, data, ranges[i].len, at);
+		if (val == -1) break;
+		if (replPrimary) *seq = logFileOp(FN_WRITE, file, at, data, val);
+		written += val;
+		data += ranges[i].len;
+		if (first == -1 || at < first) first = at;
+		if (at + val > end) end = at + val;
+	}
+	fileChanged(file);
+	if (replPrimary || handle->append) pthread_mutex_unlock(&file->writeLock);
+	// watchers get one event covering every range
+	if (first != -1) notifyChange(file->fd, first, end - first);
+	if (val == -1) return -1;
+	if (commitWrite(file->fd, handle->durability) == -1) return -1;
+	return written;
+}
+
+# define SPLICE_MIN  (64 * 1024)	// default for spliceMin, where splicing starts to win in bench/benchsplice
+# define SPLICE_PIPE (1024 * 1024)	// pipe size asked for, so one splice() moves a lot
+# define SPLICE_HEAD 512			// most of a request getRequest() looks at
+
+long spliceMin = SPLICE_MIN;		// smallest write spliced, 0 for never (-w)
+
+/**
+ * Writes a list of ranges to a file like writeFile(), except that their data
+ * is still waiting on the client's socket, rest bytes of it. It is moved
+ * socket -> pipe -> file with splice(), so it is never copied to user space.
+ * pipefd is the session's pipe, created on first use. All of the data is
+ * taken off the socket even if the write fails (ranges may be NULL for a bad
+ * request), so the next request can be read. If the connection fails
+ * instead, lost is set and the caller has to close it.
+ * 
+ * Returns number of bytes written on success
+ * Return -1 on failure, with errno set appropriately
+ */
+ssize_t spliceWrite(ClientHandle *handle, Transport *t, int *pipefd, WriteRange *ranges, int nranges, size_t rest, int *lost) {
+	int filefd = handle != NULL ? handle->file->fd : -1, err = 0, bounce = 0, r = 0;
+	off_t first = -1, end = 0;
+	ssize_t n, m, written = 0;
+	size_t done = 0;
+	loff_t off;
+	char *buf = NULL;
+	
+	*lost = 0;
+	if (ranges == NULL) err = EINVAL;
+	else if (handle == NULL) err = errno;
+	else if (handle->permission != O_WRONLY && handle->permission != O_RDWR) err = EACCES;
+	if (pipefd[0] == -1) {
+		if (pipe2(pipefd, O_CLOEXEC) == -1) {
+			pipefd[0] = pipefd[1] = -1;
+			goto CONNLOST;
+		}
+		// the default 64k pipe takes 16 round trips per megabyte
+		fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE);
+	}
+	
+	while (rest > 0) {
+		n = splice(t->fd, NULL, pipefd[1], NULL, rest, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n == -1 && errno == EINTR) continue;
+		if (n == 0) errno = ECONNRESET;
+		if (n <= 0) goto CONNLOST;
+		rest -= n;
+		// empty the pipe into the ranges before filling it again
+		while (n > 0) {
+			while (!err && r < nranges && done == ranges[r].len) {
+				r++;
+				done = 0;
+			}
+			// more data than the ranges hold, which only a bad request sends
+			if (!err && r == nranges) err = EINVAL;
+			m = err ? n : (ssize_t) (ranges[r].len - done);
+			if (m > n) m = n;
+			off = err ? 0 : ranges[r].offset + done;
+			if (!err && !bounce) {
+				m = splice(pipefd[0], NULL, filefd, &off, m, SPLICE_F_MOVE);
+				if (m == -1 && errno == EINTR) continue;
+				// some files can't be spliced to, those get the rest through a buffer
+				if (m == -1 && errno == EINVAL) bounce = 1;
+				else if (m == -1) err = errno;
+				if (m <= 0) continue;
+			} else {
+				if (buf == NULL) buf = malloc(SPLICE_PIPE);
+				m = read(pipefd[0], buf, m < SPLICE_PIPE ? m : SPLICE_PIPE);
+				if (m == -1 && errno == EINTR) continue;
+				if (m <= 0) goto CONNLOST;
+				// after an error the data is only thrown away
+				if (!err && pwrite(filefd, buf, m, off) != m) err = errno ? errno : ENOSPC;
+				if (err) {
+					n -= m;
+					continue;
+				}
+			}
+			if (first == -1 || ranges[r].offset < first) first = ranges[r].offset;
+			if (ranges[r].offset + (off_t) (done + m) > end) end = ranges[r].offset + done + m;
+			done += m;
+			written += m;
+			n -= m;
+		}
+	}
+	free(buf);
+	
+	if (first != -1) {
+		fileChanged(handle->file);
+		notifyChange(filefd, first, end - first);
+		STAT_ADD(spliceWrites, 1);
+		STAT_ADD(spliceBytes, written);
+	}
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	if (commitWrite(filefd, handle->durability) == -1) return -1;
+	return written;
+	
+	CONNLOST:
+	err = errno;
+	free(buf);
+	*lost = 1;
+	errno = err;
+	return -1;
+}
+
+/**
+ * Sets the size of a file the client has open for writing, like ftruncate().
+ * On a replication primary, seq is set to the log entry of the change.
+ * 
+ * Returns 0 on success, -1 on failure with errno set appropriately
+ */
+int truncateFile(ClientHandle *handle, off_t length, long *seq) {
+	MultiFile *file = handle->file;
+	int ret;
+	
+	if (handle->permission != O_WRONLY && handle->permission != O_RDWR) {
+		errno = EACCES;
+		return -1;
+	}
+	// an append must not find the end of the file just before it moves
+	pthread_mutex_lock(&file->writeLock);
+	ret = ftruncate(file->fd, length);
+	if (ret == 0) {
+		fileChanged(file);
+		if (replPrimary) *seq = logFileOp(FN_TRUNCATE, file, length, NULL, 0);
+	}
+	pthread_mutex_unlock(&file->writeLock);
+	if (ret == -1) return -1;
+	notifyChange(file->fd, length, -1);
+	return commitWrite(file->fd, handle->durability);
+}
+
+/**
+ * Allocates, punches out or zeroes len bytes of a file at offset, as mode
+ * (NET_FALLOC_* bits) says, with fallocate(). Plain allocation falls back
+ * to posix_fallocate() on file systems without it.
+ * 
+ * Returns 0 on success, -1 on failure with errno set appropriately
+ */
+int allocateRange(int fd, int mode, off_t offset, off_t len) {
+	int flags = 0, err;
+	
+	if ((mode & ~(NET_FALLOC_KEEP_SIZE | NET_FALLOC_PUNCH_HOLE | NET_FALLOC_ZERO_RANGE)) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (mode & NET_FALLOC_KEEP_SIZE) flags |= FALLOC_FL_KEEP_SIZE;
+	if (mode & NET_FALLOC_PUNCH_HOLE) flags |= FALLOC_FL_PUNCH_HOLE;
+	if (mode & NET_FALLOC_ZERO_RANGE) flags |= FALLOC_FL_ZERO_RANGE;
+	if (fallocate(fd, flags, offset, len) == 0) return 0;
+	if (errno != EOPNOTSUPP || mode != 0) return -1;
+	err = posix_fallocate(fd, offset, len);
+	if (err == 0) return 0;
+	errno = err;
+	return -1;
+}
+
+/**
+ * Runs allocateRange() on a file the client has open for writing, so large
+ * writers can reserve their space up front instead of fragmenting the disk.
+ * On a replication primary, seq is set to the log entry of the change.
+ * 
+ * Returns 0 on success, -1 on failure with errno set appropriately
+ */
+int allocateFile(ClientHandle *handle, int mode, off_t offset, off_t len, long *seq) {
+	MultiFile *file = handle->file;
+	char args[48];
+	int ret;
+	
+	if (handle->permission != O_WRONLY && handle->permission != O_RDWR) {
+		errno = EACCES;
+		return -1;
+	}
+	pthread_mutex_lock(&file->writeLock);
+	ret = allocateRange(file->fd, mode, offset, len);
+	if (ret == 0) {
+		fileChanged(file);
+		sprintf(args, "%d,%lld", mode, (long long) len);
+		if (replPrimary) *seq = logFileOp(LOG_ALLOCATE, file, offset, args, strlen(args));
+	}
+	pthread_mutex_unlock(&file->writeLock);
+	if (ret == -1) return -1;
+	// space reserved past the end changes nothing a reader can see
+	if (mode != NET_FALLOC_KEEP_SIZE) notifyChange(file->fd, offset, len);
+	return commitWrite(file->fd, handle->durability);
+}
+
+/**
+ * Flushes a file the client has open to stable storage.
+ * 
+ * Returns 0 on success, -1 on failure with errno set appropriately
+ */
+int syncFile(ClientHandle *handle) {
+	return fsync(handle->file->fd);
+}
+
+# define COPY_CHUNK (1024 * 1024)	// buffer for copies copy_file_range() can't do
+
+/**
+ * Copies len bytes from in at inoff to out at outoff inside the kernel, with
+ * copy_file_range() (which shares the blocks on filesystems with reflinks),
+ * falling back to a read/write loop where that isn't supported. Stops early
+ * at the end of in.
+ * 
+ * Returns the number of bytes copied, or -1 with errno set
+ */
+ssize_t copyData(int in, off_t inoff, int out, off_t outoff, size_t len) {
+	loff_t i = inoff, o = outoff;
+	ssize_t n, total = 0;
+	char *buf = NULL;
+	
+	while (len > 0) {
+		n = copy_file_range(in, &i, out, &o, len, 0);
+		if (n == -1 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS)) {
+			// not supported between these files, copy through user space
+			if (buf == NULL) buf = malloc(COPY_CHUNK);
+			n = pread(in, buf, len < COPY_CHUNK ? len : COPY_CHUNK, i);
+			if (n > 0) n = pwrite(out, buf, n, o);
+			if (n > 0) {
+				i += n;
+				o += n;
+			}
+		}
+		if (n == -1) {
+			free(buf);
+			return -1;
+		}
+		if (n == 0) break;
+		total += n;
+		len -= n;
+	}
+	free(buf);
+	return total;
+}
+
+/**
+ * Takes the write locks of two files, in a fixed order so two copies between
+ * the same files can't deadlock. Only needed on a replication primary.
+ */
+void lockPair(MultiFile *a, MultiFile *b) {
+	if (!replPrimary) return;
+	if (a > b) {
+		MultiFile *t = a;
+		a = b;
+		b = t;
+	}
+	if (a != NULL) pthread_mutex_lock(&a->writeLock);
+	if (b != NULL && b != a) pthread_mutex_lock(&b->writeLock);
+}
+
+void unlockPair(MultiFile *a, MultiFile *b) {
+	if (!replPrimary) return;
+	if (a != NULL) pthread_mutex_unlock(&a->writeLock);
+	if (b != NULL && b != a) pthread_mutex_unlock(&b->writeLock);
+}
+
+/**
+ * Copies len bytes at inoff in one open file to outoff in another (or the
+ * same, if the ranges don't overlap), without the data leaving the server.
+ * On a replication primary, seq is set to the log entry of the copy.
+ * 
+ * Returns the number of bytes copied, or -1 with errno set appropriately
+ */
+ssize_t copyRange(ClientHandle *in, off_t inoff, ClientHandle *out, off_t outoff, size_t len, long *seq) {
+	ssize_t copied;
+	
+	if (in->permission == O_WRONLY || out->permission == O_RDONLY) {
+		errno = EACCES;
+		return -1;
+	}
+	if (in->file == out->file && inoff < outoff + (off_t) len && outoff < inoff + (off_t) len) {
+		errno = EINVAL;
+		return -1;
+	}
+	lockPair(in->file, out->file);
+	copied = copyData(in->file->fd, inoff, out->file->fd, outoff, len);
+	fileChanged(out->file);
+	if (copied > 0 && replPrimary) {
+		// as in logFileOp(), for two names
+		pthread_mutex_lock(&nameLock);
+		char args[48 + strlen(out->file->fname)];
+		sprintf(args, "%lld,%zd,%s", (long long) outoff, copied, out->file->fname);
+		*seq = logOp(FN_COPYRANGE, in->file->fname, inoff, args, strlen(args));
+		pthread_mutex_unlock(&nameLock);
+	}
+	unlockPair(in->file, out->file);
+	if (copied == -1) return -1;
+	notifyChange(out->file->fd, outoff, copied);
+	STAT_ADD(copies, 1);
+	STAT_ADD(copyBytes, copied);
+	if (commitWrite(out->file->fd, out->durability) == -1) return -1;
+	return copied;
+}
+
+/**
+ * Replaces the contents of file dst (creating it if needed) with a copy of
+ * file src, for a client with the given access mode.
+ * 
+ * Returns the number of bytes copied, or -1 with errno set appropriately
+ */
+ssize_t copyFile(const char *src, const char *dst, int client, char access, long *seq) {
+	ClientHandle *in = NULL, *out = NULL;
+	int fd, tempIn = 0, tempOut = 0;
+	ssize_t copied = -1;
+	struct stat st;
+	
+	if (replSource != NULL) {
+		errno = EROFS;
+		return -1;
+	}
+	pthread_mutex_lock(&fileLock);
+	in = borrowFile(src, O_RDONLY, client, access, &tempIn);
+	if (in != NULL && (fd = openPath(dst, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) != -1) {
+		close(fd);
+		out = borrowFile(dst, O_WRONLY, client, access, &tempOut);
+	}
+	pthread_mutex_unlock(&fileLock);
+	if (in == NULL || out == NULL) goto COPYEND;
+	if (in->file == out->file) {
+		errno = EINVAL;
+		goto COPYEND;
+	}
+	
+	// the borrowed handles keep both files open while we copy without the lock
+	lockPair(in->file, out->file);
+	if (fstat(in->file->fd, &st) == 0 && ftruncate(out->file->fd, 0) == 0) {
+		copied = copyData(in->file->fd, 0, out->file->fd, 0, st.st_size);
+		fileChanged(out->file);
+	}
+	if (copied != -1 && replPrimary) {
+		char args[48 + strlen(dst)];
+		logOp(FN_TRUNCATE, dst, 0, NULL, 0);
+		sprintf(args, "0,%zd,%s", copied, dst);
+		*seq = logOp(FN_COPYRANGE, src, 0, args, strlen(args));
+	}
+	unlockPair(in->file, out->file);
+	if (copied != -1) {
+		notifyChange(out->file->fd, 0, -1);
+		STAT_ADD(copies, 1);
+		STAT_ADD(copyBytes, copied);
+		if (commitWrite(out->file->fd, out->durability) == -1) copied = -1;
+	}
+	
+	COPYEND:
+	pthread_mutex_lock(&fileLock);
+	returnFile(in, tempIn);
+	returnFile(out, tempOut);
+	pthread_mutex_unlock(&fileLock);
+	return copied;
+}
+
+/**
+ * Renames file or directory from to to with renameat2() (flags are
+ * NET_RENAME_* values), for a client with the given access mode. Open files
+ * on either side count as written to, so the rename fails if another
+ * client's access mode would stop this client from opening one of them for
+ * writing. Files nobody has open, whatever their permissions, and
+ * directories are left to renameat2().
+ * 
+ * Returns 0 on success, or -1 with errno set appropriately
+ */
+int renameFile(const char *from, const char *to, int flags, int client, char access, long *seq) {
+	ClientHandle *a = NULL, *b = NULL;
+	int tempA = 0, tempB = 0, ret = -1;
+	
+	if (replSource != NULL) {
+		errno = EROFS;
+		return -1;
+	}
+	if (flags & ~(NET_RENAME_NOREPLACE | NET_RENAME_EXCHANGE)) {
+		errno = EINVAL;
+		return -1;
+	}
+	
+	// only open files can clash with an access mode, and they are regular files
+	pthread_mutex_lock(&fileLock);
+	if (findFile(from) != NULL && (a = borrowFile(from, O_RDWR, client, access, &tempA)) == NULL) goto RENAMEND;
+	if (findFile(to) != NULL && (b = borrowFile(to, O_RDWR, client, access, &tempB)) == NULL) goto RENAMEND;
+	pthread_mutex_unlock(&fileLock);
+	
+	// the borrowed handles keep both files open without fileLock
+	ret = renamePath(from, to, flags);
+	pthread_mutex_lock(&fileLock);
+	if (ret == 0) {
+		// opens in between find the files by inode, see getFileByName(), and
+		// writes in between are logged by the old names, see logFileOp()
+		pthread_mutex_lock(&nameLock);
+		renameOpenFiles(from, to, flags);
+		if (replPrimary) *seq = logOp(FN_RENAME, from, flags, to, strlen(to));
+		pthread_mutex_unlock(&nameLock);
+		STAT_ADD(renames, 1);
+	}
+	
+	RENAMEND:
+	returnFile(a, tempA);
+	returnFile(b, tempB);
+	pthread_mutex_unlock(&fileLock);
+	return ret;
+}
+
+/**
+ * Computes the CRC32C of len bytes of a file from offset on, or of the rest
+ * of the file if len is 0, and stores it in crc. The number of bytes it
+ * covers, short at the end of the file, is stored in covered. The last few
+ * results are kept with the file's stamp, so checking an unchanged file
+ * again doesn't read it, while one changed on disk is read again.
+ * 
+ * Returns 0 on success, -1 with errno set appropriately
+ */
+int checksumFile(ClientHandle *handle, off_t offset, size_t len, uint32_t *crc, size_t *covered) {
+	MultiFile *file = handle->file;
+	size_t want, done = 0;
+	ssize_t got = 0;
+	CrcEntry *e;
+	FileStamp stamp, now;
+	char *buf;
+	int i;
+	
+	if (handle->permission == O_WRONLY) {
+		errno = EACCES;
+		return -1;
+	}
+	if (replicaStale()) return -1;
+	STAT_ADD(checksums, 1);
+	stampFile(file, &stamp);
+	pthread_mutex_lock(&file->cacheLock);
+	for (i=0; i<CRC_CACHE_SLOTS; i++) {
+		e = &file->crcCache[i];
+		if (e->valid && sameStamp(&e->stamp, &stamp) && e->offset == offset && e->len == len) {
+			*crc = e->crc;
+			*covered = e->covered;
+			pthread_mutex_unlock(&file->cacheLock);
+			STAT_ADD(checksumCached, 1);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&file->cacheLock);
+	
+	*crc = 0;
+	buf = malloc(COPY_CHUNK);
+	while (len == 0 || done < len) {
+		want = len == 0 || len - done > COPY_CHUNK ? COPY_CHUNK : len - done;
+		got = pread(file->fd, buf, want, offset + done);
+		if (got <= 0) break;
+		*crc = netcrc32c(*crc, buf, got);
+		done += got;
+	}
+	free(buf);
+	if (got == -1) return -1;
+	*covered = done;
+	STAT_ADD(checksumBytes, done);
+	
+	// a change that raced with the reads makes the result useless to others
+	stampFile(file, &now);
+	pthread_mutex_lock(&file->cacheLock);
+	if (sameStamp(&now, &stamp)) {
+		e = &file->crcCache[file->crcNext];
+		file->crcNext = (file->crcNext + 1) % CRC_CACHE_SLOTS;
+		e->stamp = stamp;
+		e->offset = offset;
+		e->len = len;
+		e->covered = done;
+		e->crc = *crc;
+		e->valid = 1;
+	}
+	pthread_mutex_unlock(&file->cacheLock);
+	return 0;
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Client communication helper functions															*	
+ * 																									*
+ * Functions below implement the protocol for communication between client							*
+ * and server. These include getMessage(), sendReponse() and sendResponseInt()						*
+ * 																									*
+ ****************************************************************************************************/
+
+int verbose = 0;					// print every frame sent and received (-v)
+
+/**
+ * Closes a connection, waiting for any event being sent on it to go out.
+ */
+void closeConn(Transport *t) {
+	if (t->sendLock != NULL) pthread_mutex_lock(t->sendLock);
+	transportClose(t);
+	if (t->sendLock != NULL) pthread_mutex_unlock(t->sendLock);
+}
+
+/**
+ * Reads the length of the next message from a client into len, for
+ * getBody() to read the message itself. A length below 0 or above
+ * MAX_FRAME_SIZE closes the connection with errno set to EPROTO, nothing
+ * after it could be trusted.
+ * Returns 0 on success, or -1 with errno set once the connection is lost.
+ */
+int getLength(Transport *t, int *len) {
+	// if val == 0 we got a clean close, if val == -1, an error occurred
+	int val = transportRead(t, len, 4);
+	
+	if (val > 0 && (*len < 0 || *len > MAX_FRAME_SIZE)) {
+		val = -1;
+		errno = EPROTO;
+	}
+	if (val == 0 || val == -1) {
+		// either way, we should try to close the connection and return, while maintaining errno
+		val = errno;
+		closeConn(t);
+		errno = val;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Reads a message of len bytes whose length getLength() has read, as for
+ * getMessage().
+ */
+char *getBody(Transport *t, int len, int *msglen) {
+	uint32_t crc;
+	int val, fd = t->fd;
+	char *msg = malloc(len+1);
+	// read actual message
+	val = transportRead(t, msg, len);
+	// if val == 0 we got a clean close, if val == -1, an error occurred
+	if (len > 0 && (val == 0 || val == -1)) {
+		// either way, we should try to close the connection and return, while maintaining errno
+		val = errno;
+		closeConn(t);
+		free(msg);
+		errno = val;
+		return NULL;
+	}
+	if (t->crc) {
+		if (len >= CRC_SIZE) memcpy(&crc, msg + len - CRC_SIZE, CRC_SIZE);
+		if (len < CRC_SIZE || netcrc32c(0, msg, len - CRC_SIZE) != crc) {
+			STAT_ADD(crcErrors, 1);
+			free(msg);
+			errno = EBADMSG;
+			return NULL;
+		}
+		len -= CRC_SIZE;
+	}
+	msg[len] = 0;
+	if (msglen != NULL) *msglen = len;
+	
+	// requests can carry raw data, so only the start of the message is logged
+	if (verbose && len > 64) printf("%d -> '%.64s'... (%d bytes)\n", fd, msg, len);
+	else if (verbose) printf("%d -> '%s'\n", fd, msg);
+	return msg;
+}
+
+/**
+ * Receives a message from a client. Returns null on error with errno set, and a 
+ * malloc()'ed character string containing all the data sent from the client. 
+ * Remember to free the character pointer returned from this function. The
+ * message is NUL terminated, and if msglen is not NULL the real length of the
+ * message (which may contain binary data) is stored there.
+ * 
+ * If this method returns NULL, then the connection was lost, and ERRNO was set
+ * appropriately. It will deal with other types of errors internally. The
+ * exception is a frame that fails its CRC (see netcrc.h), which is dropped
+ * with errno set to EBADMSG while the connection stays up.
+ */
+char *getMessage(Transport *t, int *msglen) {
+	int len;
+	
+	if (getLength(t, &len) == -1) return NULL;
+	return getBody(t, len, msglen);
+}
+
+/**
+ * Sends one frame: a status character, and the (possibly binary) data of up
+ * to 3 buffers back to back. Unless wait is set, the frame is only sent if it
+ * fits without waiting for the client, and fails with EAGAIN otherwise.
+ * Returns 0 on success, or -1 with errno set
+ */
+int writeFrame(Transport *t, char stat, struct iovec *parts, int nparts, int wait) {
+	struct iovec iov[5];
+	char hdr[6];
+	uint32_t crc;
+	int val, len = 2, i;
+	// header is the message length, then status and separator
+	for (i=0; i<nparts; i++) {
+		iov[i + 1] = parts[i];
+		len += parts[i].iov_len;
+	}
+	hdr[4] = stat;
+	hdr[5] = SEP_CHAR;
+	if (verbose) printf("%d <- '%c%c' + %d bytes\n", t->fd, stat, SEP_CHAR, len - 2);
+	if (t->crc) {
+		crc = netcrc32c(0, hdr + 4, 2);
+		for (i=0; i<nparts; i++) crc = netcrc32c(crc, parts[i].iov_base, parts[i].iov_len);
+		iov[++nparts].iov_base = &crc;
+		iov[nparts].iov_len = CRC_SIZE;
+		len += CRC_SIZE;
+	}
+	memcpy(hdr, &len, 4);
+	// one writev() for everything so Nagle doesn't hold the data back
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = 6;
+	
+	// events from the notify thread must not land in the middle of a response
+	if (t->sendLock != NULL) pthread_mutex_lock(t->sendLock);
+	if (!wait && !transportWritable(t, len + 4)) {
+		errno = EAGAIN;
+		val = -1;
+	} else {
+		val = transportWritev(t, iov, nparts + 1);
+	}
+	if (t->sendLock != NULL) pthread_mutex_unlock(t->sendLock);
+	return val;
+}
+
+/**
+ * Sends a status character, and the (possibly binary) data of up to 3 buffers
+ * back to back to a client. Returns 0 on success, or -1 on error, with errno set
+ * 
+ * If this method returns -1, then the connection was lost, and ERRNO was set
+ * appropriately. It will deal with other types of errors internally.
+ */
+int sendResponseParts(Transport *t, char stat, struct iovec *parts, int nparts) {
+	int val;
+	
+	if (writeFrame(t, stat, parts, nparts, 1) == -1) {
+		// we should try to close the connection and return, while maintaining errno
+		val = errno;
+		closeConn(t);
+		errno = val;
+		return -1;
+	}
+	
+	return 0;
+}
+
+/**
+ * Sends a status character, and len bytes of (possibly binary) data to a client
+ * specified by fd. Returns 0 on success, or -1 on error, with errno set
+ */
+int sendResponseData(Transport *t, char stat, const char *data, int datalen) {
+	struct iovec part = { (void *) data, datalen };
+	return sendResponseParts(t, stat, &part, 1);
+}
+
+/**
+ * Sends a status character, and a string message to a client specified by fd.
+ * Returns 0 on success, or -1 on error, with errno set
+ * 
+ * If this method returns -1, then the connection was lost, and ERRNO was set
+ * appropriately. It will deal with other types of errors internally.
+ */
+int sendResponse(Transport *t, char stat, char *resp) {
+	return sendResponseData(t, stat, resp, strlen(resp));
+}
+
+/**
+ * Sends a status character, and integer to a client specified by fd.
+ * Returns 0 on success, or -1 on error, with errno set
+ * 
+ * If this method returns -1, then the connection was lost, and ERRNO was set
+ * appropriately. It will deal with other types of errors internally.
+ */
+int sendResponseInt(Transport *t, char stat, long long num) {
+	char msg[24];
+	
+	sprintf(msg, "%lld", num);
+	return sendResponse(t, stat, msg);
 }
 
 /**
- * Gets a link in the list at a specific index
+ * Sends the result of a request that changed a file: a byte count, followed
+ * on a replication primary by the log sequence number of the change, which
+ * clients use to read their own writes from replicas.
+ * Returns 0 on success, or -1 on error, with errno set
  */
-LinkedNode *linkedListGet(LinkedList *list, int index) {
-	if (index < 0) return NULL;
-	if (index >= list->length) return NULL;
+int sendChangeResponse(Transport *t, long long num, long seq) {
+	char msg[48];
+	
+	if (!replPrimary) return sendResponseInt(t, STATUS_SUCCESS, num);
+	sprintf(msg, "%lld,%ld", num, seq);
+	return sendResponse(t, STATUS_SUCCESS, msg);
+}
 
-	while (list->index < index) {
-		list->index++;
-		list->cur = getNext(list->cur);
+/**
+ * Parses one decimal field terminated by SEP_CHAR starting at *p, without
+ * reading past end. Advances *p past the separator.
+ * 
+ * Returns 0 on success, -1 if there is no well formed field.
+ */
+int nextField(char **p, char *end, long long *val) {
+	char *cur = *p;
+	int neg = 0;
+	
+	*val = 0;
+	if (cur < end && *cur == '-') {
+		neg = 1;
+		cur++;
 	}
+	if (cur >= end || *cur < '0' || *cur > '9') return -1;
+	while (cur < end && *cur >= '0' && *cur <= '9') *val = *val * 10 + (*cur++ - '0');
+	if (cur >= end || *cur != SEP_CHAR) return -1;
+	if (neg) *val = -*val;
+	*p = cur + 1;
+	return 0;
+}
 
-	while (list->index > index) {
-		list->index--;
-		list->cur = getPrev(list->cur);
+/**
+ * Parses two names sent as "<length of first>,<first><second>", as in copy
+ * and rename requests, starting at p and running to end. Both are returned
+ * malloc()'ed and canonical (see canonPath()) in first and second.
+ * 
+ * Returns 0 on success, -1 with errno set to EINVAL if the request is malformed,
+ * or to EACCES if a name leads out of the root.
+ */
+int parseNames(char *p, char *end, char **first, char **second) {
+	long long len;
+	char *raw;
+	
+	if (nextField(&p, end, &len) == -1 || len < 1 || len >= end - p) {
+		errno = EINVAL;
+		return -1;
+	}
+	raw = strndup(p, len);
+	*first = canonPath(raw);
+	free(raw);
+	if (*first == NULL) return -1;
+	raw = strndup(p + len, end - p - len);
+	*second = canonPath(raw);
+	free(raw);
+	if (*second == NULL) {
+		free(*first);
+		return -1;
 	}
-	return list->cur;
+	return 0;
 }
 
 /**
- * Removes an object from the linked list. The comparison is by reference,
- * meaning only the pointer address is checked. Copies will not match.
+ * Parses a write ('W') or batched write ('V') request of len bytes. Stores
+ * the client's handle in fd, the number of ranges in nranges and a pointer
+ * to the raw data in data. If the connection uses a codec the data arrives
+ * compressed, and is uncompressed into a malloc()'ed buffer stored in
+ * unpacked (NULL otherwise), for the caller to free. rest is the number of
+ * data bytes left on the socket by getRequest(), which are not in msg.
  * 
- * Returns 0 if successfully removed a matching link, 1 otherwise.
+ * Returns a malloc()'ed array of ranges on success, or NULL with errno set to
+ * EINVAL if the request is malformed.
  */
-int linkedListRemove(LinkedList *list, void *val) {
-	LinkedNode *node;
-	int i;
+WriteRange *parseWrite(char *msg, int len, long rest, char codec, int *fd, int *nranges, char **data, char **unpacked) {
+	char *p = msg + 2, *end = msg + len;
+	long long val, off, size, total = 0;
+	WriteRange *ranges = NULL;
+	size_t rawlen;
+	long start;
+	int i, count = 1;
 	
-	for (i=0; i<list->length; i++) {
-		node = linkedListGet(list, i);
-		if (node->value == val) {
-			if (node->prev == NULL) {
-				// removing the head
-				list->head = getNext(node);
-				if (list->head != NULL) list->head->prev = NULL;
-			} else if (node->next == NULL) {
-				// removing tail
-				list->tail = getPrev(node);
-				if (list->tail != NULL) list->tail->next = NULL;
-			} else {
-				// a middle node
-				getPrev(node)->next = getNext(node);
-				getNext(node)->prev = getPrev(node);
-			}
-			
-			list->index = 0;
-			list->cur = getHead(list);
-			list->length--;
-			
-			if (list->length == 0) {
-				list->head = NULL;
-				list->tail = NULL;
-			}
-			free(node);
-			return 0;
-		}
+	*unpacked = NULL;	
+	if (nextField(&p, end, &val) == -1) goto BADWRITE;
+	*fd = -val;
+	if (msg[0] == FN_WRITEV) {
+		if (nextField(&p, end, &val) == -1 || val < 1 || val > WB_MAX_RANGES) goto BADWRITE;
+		count = val;
 	}
 	
-	return 1;
+	ranges = malloc(sizeof(WriteRange) * count);
+	for (i=0; i<count; i++) {
+		if (nextField(&p, end, &off) == -1 || off < 0) goto BADWRITE;
+		size = 0;
+		if (msg[0] == FN_WRITEV && (nextField(&p, end, &size) == -1 || size < 0)) goto BADWRITE;
+		ranges[i].offset = off;
+		ranges[i].len = size;
+		total += size;
+	}
+	if (codec != CODEC_NONE) {
+		start = cpuNs();
+		*unpacked = decodePayload(codec, p, end - p, &rawlen);
+		if (*unpacked == NULL) goto BADWRITE;
+		STAT_ADD(decompressNs, cpuNs() - start);
+		STAT_ADD(decompressRaw, rawlen);
+		STAT_ADD(decompressSent, end - p);
+		p = *unpacked;
+		end = p + rawlen;
+	}
+	if (msg[0] == FN_WRITE) {
+		// a plain write runs to the end of the data
+		ranges[0].len = total = end - p + rest;
+	}
+	if (total != end - p + rest) goto BADWRITE;
+	
+	*nranges = count;
+	*data = p;
+	return ranges;
+	
+	BADWRITE:
+	free(ranges);
+	free(*unpacked);
+	*unpacked = NULL;
+	errno = EINVAL;
+	return NULL;
+}
+
+/**
+ * Receives a request of len bytes like getBody(), except that the data of a
+ * write ('W' or 'V') of at least spliceMin bytes is left on the socket: only the header
+ * up to the data is returned, and the number of data bytes still to come is
+ * stored in rest for spliceWrite(). rest is 0 for every other request, and
+ * for batches with too many ranges to find the end of their header in the
+ * first SPLICE_HEAD bytes. Frames that are compressed, checked or in shared
+ * memory are always read whole, as are the writes of a replication primary,
+ * which has to log their data.
+ */
+char *getRequest(Transport *t, int len, int *msglen, long *rest) {
+	char head[SPLICE_HEAD], *p, *end, *msg;
+	long long val, count = 1;
+	int n, i;
+	
+	*rest = 0;
+	if (spliceMin == 0 || len < spliceMin || t->shm != NULL || t->crc || t->codec != CODEC_NONE || replPrimary) return getBody(t, len, msglen);
+	// the client sends a write in one go, so its whole header is almost always here already
+	do n = recv(t->fd, head, sizeof(head), MSG_PEEK);
+	while (n == -1 && errno == EINTR);
+	if (n < 2 || (head[0] != FN_WRITE && head[0] != FN_WRITEV) || head[1] != SEP_CHAR) return getBody(t, len, msglen);
+	p = head + 2;
+	end = head + n;
+	// handle, then a count and <offset>,<size>, for every range of a batch, or just the offset of a write
+	if (nextField(&p, end, &val) == -1) return getBody(t, len, msglen);
+	if (head[0] == FN_WRITEV && nextField(&p, end, &count) == -1) return getBody(t, len, msglen);
+	for (i=0; i<count * (head[0] == FN_WRITEV ? 2 : 1); i++) {
+		if (nextField(&p, end, &val) == -1) return getBody(t, len, msglen);
+	}
+	
+	n = p - head;
+	msg = malloc(n + 1);
+	if (transportRead(t, msg, n) <= 0) {
+		n = errno;
+		closeConn(t);
+		free(msg);
+		errno = n;
+		return NULL;
+	}
+	msg[n] = 0;
+	*msglen = n;
+	*rest = len - n;
+	if (verbose) printf("%d -> '%.64s'... (%d bytes, spliced)\n", t->fd, msg, len);
+	return msg;
 }
 
 /****************************************************************************************************
  * 																									*
- * File permission management																		*	
+ * Change notification																				*
+ * 																									*
+ * Clients can subscribe to the changes of a file with netwatch() instead of						*
+ * polling it. Every watched file has one Watch, shared by all its watchers							*
+ * whatever name they used, and one inotify watch, so changes other processes						*
+ * on this host make show up too. Changes made through the server are noted							*
+ * by the request that made them, with the range it touched, and inotify only						*
+ * fills in for the rest. One thread sends every event, so writers never wait						*
+ * on watchers.																						*
  * 																									*
- * Code below provides a mechanism for implementing unrestricted mode,								*
- * exclusive mode and transaction mode, allowing for clients to choose								*
- * how they view files.																				*
- * 																									*	
  ****************************************************************************************************/
- 
-/*
- * 
- * How this file management system works:
- * 
- * There is a global linked list of files that are open by clients. Each node
- * represents 1 MultiFile object which describes particulars on a file. A file
- * is added to the global file when it is opened by a client for the first time,
- * and removed when no more clients have it opened.
- * 
- * Each MultiFile keeps track of the highest access level (most restrictive)
- * and whether or not any clients have write access. This is for easy permission
- * checking during opens. The highest access level and write value are re-evaluated
- * when a client closes the file.
- * 
- * When a client performs an operation on a file, we first check if they have
- * the file open and that their permissions are appropriate before fufilling
- * the request.
- * 
- * When a client performs a read or write, the issue of "what the fuck happens
- * to the file index" comes up. In transaction mode, the files index remains
- * wherever the client left it last since it will never be modified by anyone
- * else. In any other mode, the file index is set to 0 (start of file). This 
- * may seem like a lousy implementation, and that's because it is. But we 
- * don't have a netseek function, which is even lousier. So this is the only 
- * solution where we don't have to come up with some stupid special case about 
- * "what the fuck happens to the file index once someone rewrites the file"
- * 
- * Now you always get from the start of the file, and always write to the start
- * of the file. Unless you completely own the file.
- * 
- * Deal with it.
+
+/**
+ * A watched file, known by device and inode like its inotify watch.
  */
- 
-typedef struct s_ClientHandle {
-	int fd;
-	int permission;
-	char access;
-} ClientHandle;
+typedef struct s_Watch {
+	int wd;						// inotify watch descriptor, -1 once the kernel dropped it
+	int fd;						// O_PATH descriptor, to stat the file whatever it is called now
+	dev_t dev;
+	ino_t ino;
+	long version;				// changes reported so far
+	off_t lastSize;				// as of the last event, -1 once the file was deleted
+	struct timespec lastMtime;
+	struct s_Watcher *watchers;
+	struct s_Watch *prev, *next;
+} Watch;
 
-# define getClient(nd) ((ClientHandle *) nd->value)
+typedef struct s_Watcher {
+	Transport *conn;			// where the events go
+	int id;						// the client's name for the watch
+	Watch *watch;
+	struct s_Watcher *prev, *next;			// the file's other watchers
+	struct s_Watcher *prevHeld, *nextHeld;	// the session's other watches
+} Watcher;
 
-typedef struct s_MultiFile {
-	int fd;
-	int refcount;
-	int write;
-	char access;
-	char *fname;
-	LinkedList *owners;
-} MultiFile;
+/**
+ * A change made through the server, waiting for the notify thread.
+ */
+typedef struct s_ChangeNote {
+	dev_t dev;
+	ino_t ino;
+	off_t offset;
+	off_t len;
+	off_t size;
+	struct timespec mtime;
+	struct s_ChangeNote *next;
+} ChangeNote;
 
-# define getFile(nd) ((MultiFile *) nd->value)
+# define WATCH_MASK (IN_MODIFY | IN_ATTRIB)		// IN_ATTRIB for the link count dropping to 0
+# define INOTIFY_HOLD_MS 2						// inotify sees our own writes before their notes come in
 
-pthread_mutex_t fileLock;
-LinkedList fileList = {0};
+pthread_mutex_t watchLock = PTHREAD_MUTEX_INITIALIZER;	// the watches, and sending events
+Watch *watchList = NULL;
+int watchedFiles = 0;				// read without the lock, so changes skip all this when 0
+int inotifyFd = -1;
 
-/**
- * Checks all open files to see if this file is open by another client.
- * If it is, we return a reference to that MultiFile. If not, then this
- * method creates a new MultiFile for the requested file.
- * 
- * On success, returns a MultiFile representing the specified file
- * On failure, returns NULL with errno set appropriately
- */
-MultiFile *getFileByName(const char *fname) {
-	LinkedNode *node;
-	MultiFile *file;
-	int fd, i;
-	// loop through each object, checking for fname
-	for (i=0; i<fileList.length; i++) { // go to end of list to get null value when file not found
-		node = linkedListGet(&fileList, i);
-		if (strcmp(getFile(node)->fname, fname) == 0) return getFile(node);
-	}
-	// file not yet opened by another client, so open it with r/w permission
-	fd = open(fname, O_RDWR);
-	if (fd == -1) return NULL;
-	// allocate MultiFile, and initialize values
-	file = calloc(sizeof(MultiFile), 1);
-	file->fd = fd;
-	file->fname = calloc(strlen(fname), 1);
-	strcpy(file->fname, fname);
-	file->owners = calloc(sizeof(LinkedList), 1);
-	// add file to linked list
-	linkedListAdd(&fileList, file);
-	return file;
-}
+pthread_mutex_t notesLock = PTHREAD_MUTEX_INITIALIZER;
+ChangeNote *notesFirst = NULL, **notesLast = &notesFirst;
+int notesWake = -1;					// eventfd the notify thread sleeps on, along with inotifyFd
 
 /**
- * Searches all opened files to get a file by a specific descriptor. Unlike
- * the getFileByName() method, this method will not allocate the file if it
- * does not get a matching file descriptor, as it does not know the name
- * of the file to open.
- * 
- * On success, returns a MultiFile representing the specified file
- * On failure, returns NULL with errno set appropriately
+ * Returns the watch on the file with the given device and inode, or NULL.
+ * Must be called with watchLock held.
  */
-MultiFile *getFileByFD(int fd) {
-	MultiFile *file;
-	int i;
-	// loop through each object, checking for fname
-	for (i=0; i<fileList.length; i++) { // go to end of list to get null value when file not found
-		file = getFile(linkedListGet(&fileList, i));
-		if (file->fd == fd) return file;
+Watch *findWatch(dev_t dev, ino_t ino) {
+	Watch *watch;
+	
+	for (watch = watchList; watch != NULL; watch = watch->next) {
+		if (watch->dev == dev && watch->ino == ino) return watch;
 	}
-	errno = EBADF;
 	return NULL;
 }
 
 /**
- * Returns 0 if client does not have file open in any way, 1 if the 
- * client has access in the given permission, and -1 if the client has
- * access that differs from the specified permission
+ * Subscribes a session to the changes of the file at path, and answers the
+ * client with the id of the new watch, or the error. The answer is sent with
+ * watchLock held, so it goes out ahead of every event of the watch.
+ * 
+ * Returns 0 on success, or -1 if the connection was lost.
  */
-int hasAccess(MultiFile *file, int clientfd, int permission) {
-	LinkedList *list = file->owners;
-	LinkedNode *node;
-	int i;
-
-	for (i=0; i<list->length; i++) {
-		node = linkedListGet(list, i);
-		if (getClient(node)->fd == clientfd) {
-			if (getClient(node)->permission == permission) return 1;
-			return -1;
+int watchFile(Session *session, Transport *conn, const char *path) {
+	Watcher *watcher;
+	Watch *watch;
+	struct stat st;
+	int fd, ret, err;
+	
+	// from now on the notify thread sends on the connection too
+	if (conn->sendLock == NULL) {
+		conn->sendLock = malloc(sizeof(pthread_mutex_t));
+		pthread_mutex_init(conn->sendLock, NULL);
+	}
+	fd = openPath(path, O_PATH | O_CLOEXEC, 0);
+	if (fd == -1 || fstat(fd, &st) == -1) goto WATCHFAIL;
+	
+	pthread_mutex_lock(&watchLock);
+	watch = findWatch(st.st_dev, st.st_ino);
+	if (watch == NULL) {
+		watch = calloc(sizeof(Watch), 1);
+		watch->wd = watchFd(inotifyFd, fd, WATCH_MASK);
+		if (watch->wd == -1) {
+			free(watch);
+			pthread_mutex_unlock(&watchLock);
+			goto WATCHFAIL;
 		}
+		watch->fd = fd;
+		fd = -1;
+		watch->dev = st.st_dev;
+		watch->ino = st.st_ino;
+		watch->lastSize = st.st_size;
+		watch->lastMtime = st.st_mtim;
+		listPush(watchList, watch, prev, next);
+		__atomic_add_fetch(&watchedFiles, 1, __ATOMIC_RELAXED);
 	}
+	watcher = calloc(sizeof(Watcher), 1);
+	watcher->conn = conn;
+	watcher->id = ++session->lastWatch;
+	watcher->watch = watch;
+	listPush(watch->watchers, watcher, prev, next);
+	listPush(session->watches, watcher, prevHeld, nextHeld);
+	STAT_ADD(watches, 1);
+	ret = sendResponseInt(conn, STATUS_SUCCESS, watcher->id);
+	pthread_mutex_unlock(&watchLock);
+	if (fd != -1) close(fd);
+	return ret;
 	
-	return 0;
+	WATCHFAIL:
+	err = errno;
+	if (fd != -1) close(fd);
+	return sendResponseInt(conn, STATUS_FAILURE, err);
 }
 
 /**
- * Updates the maximum access level and write permission on the file.
- * Only occurs when a new client is added or removed
+ * Removes a watcher, and the watch with it if it was the last one.
+ * Must be called with watchLock held.
  */
-void updateAccess(MultiFile *file) {
-	LinkedList *list = file->owners;
-	LinkedNode *node;
-	ClientHandle *handle;
-	int write = 0, i;
-	char maxAccess = 0;
-
-	for (i=0; i<list->length; i++) {
-		node = linkedListGet(list, i);
-		handle = getClient(node);
-		if (handle->permission == O_WRONLY || handle->permission == O_RDWR) write = 1;
-		if (handle->access > maxAccess) maxAccess = handle->access;
-	}
+void dropWatcher(Session *session, Watcher *watcher) {
+	Watch *watch = watcher->watch;
 	
-	file->access = maxAccess;
-	file->write = write;
+	listUnlink(watch->watchers, watcher, prev, next);
+	listUnlink(session->watches, watcher, prevHeld, nextHeld);
+	free(watcher);
+	STAT_ADD(watches, -1);
+	if (watch->watchers != NULL) return;
+	if (watch->wd != -1) inotify_rm_watch(inotifyFd, watch->wd);
+	close(watch->fd);
+	listUnlink(watchList, watch, prev, next);
+	free(watch);
+	__atomic_sub_fetch(&watchedFiles, 1, __ATOMIC_RELAXED);
 }
 
 /**
- * Attempts to add client as an owner of a given MultiFile.
- * 
- * Returns -1 if we are unable to attach to the file due to permission 
- * conflicts. 0 if it was successful.
+ * Ends the watch a session knows as id.
+ * Returns 0 on success, or -1 with errno set to EINVAL if there is no such watch.
  */
-int addOwner(MultiFile *file, int flags, int clientfd, char access) {
-	
-	ClientHandle *handle;
-	
-	if (hasAccess(file, clientfd, flags)) {
-		// don't let clients open a file twice
-		goto BADPERM;
-	}
-	
-	if (file->access == 0) {
-		// new file, add client no matter what
-		goto GOODPERM;
-	}
-	
-	if (file->access == MODE_TRANSACTN || access == MODE_TRANSACTN) {
-		// if the file is not new, and someone has/wants transaction mode, that can't happen
-		goto BADPERM;
-	}
-	
-	if (flags == O_RDONLY) {
-		// if the file is in exclusive or unrestricted and we want to read, we're good to go
-		goto GOODPERM;
-	}
+int unwatchFile(Session *session, int id) {
+	Watcher *watcher;
 	
-	// past here, we know this client wants some form of write access
-	if ((file->access == MODE_EXCLUSIVE || access == MODE_EXCLUSIVE) && file->write) {
-		// fail if the file is/would be in exclusive mode and someone else has write access
-		goto BADPERM;
+	for (watcher = session->watches; watcher != NULL && watcher->id != id; watcher = watcher->nextHeld);
+	if (watcher == NULL) {
+		errno = EINVAL;
+		return -1;
 	}
-	
-	// now either no one else has write access, or we're all in unrestricted mode and don't care!
-	GOODPERM:
-	// initialize client handle
-	handle = calloc(sizeof(ClientHandle), 1);
-	handle->access = access;
-	handle->fd = clientfd;
-	handle->permission = flags;
-	file->refcount++;
-	linkedListAdd(file->owners, handle);
-	updateAccess(file);	// update access level
+	pthread_mutex_lock(&watchLock);
+	dropWatcher(session, watcher);
+	pthread_mutex_unlock(&watchLock);
 	return 0;
+}
+
+/**
+ * Ends every watch of a session, when its connection is gone. Once this
+ * returns no event is sent on the connection any more.
+ */
+void unwatchAll(Session *session) {
+	pthread_mutex_lock(&watchLock);
+	while (session->watches != NULL) dropWatcher(session, session->watches);
+	pthread_mutex_unlock(&watchLock);
+}
+
+/**
+ * Notes a change of len bytes at offset (to the end of the file if len is
+ * -1) made through the server, for the watchers of the file if it has any.
+ * Must be called after the change is made.
+ */
+void notifyChange(int filefd, off_t offset, off_t len) {
+	ChangeNote *note;
+	struct stat st;
+	uint64_t one = 1;
 	
-	// there was a conflict with existing permissions
-	BADPERM:
-	errno = EPERM;
-	return -1;
+	if (__atomic_load_n(&watchedFiles, __ATOMIC_RELAXED) == 0 || fstat(filefd, &st) == -1) return;
+	note = malloc(sizeof(ChangeNote));
+	note->dev = st.st_dev;
+	note->ino = st.st_ino;
+	note->offset = offset;
+	note->len = len != -1 ? len : st.st_size > offset ? st.st_size - offset : 0;
+	note->size = st.st_size;
+	note->mtime = st.st_mtim;
+	note->next = NULL;
+	pthread_mutex_lock(&notesLock);
+	*notesLast = note;
+	notesLast = &note->next;
+	pthread_mutex_unlock(&notesLock);
+	write(notesWake, &one, sizeof(one));
 }
 
 /**
- * Removes an owner from a file. Returns 0 on success. If the client did not
- * have access to the file, errno is set and -1 is returned.
+ * Sends an event to every watcher of a file, and remembers what the file
+ * looked like, so inotify's report of the same change can be told apart.
+ * Must be called with watchLock held.
  */
-int removeOwner(MultiFile *file, int clientfd) {
-	LinkedList *owners;
-	ClientHandle *handle;
-	int i;
-	// if they don't have it open, set errno and return
-	if (!hasAccess(file, clientfd, O_RDONLY)) {
-		// if they have a valid reference to the file, then they tried closing multiple times
-		// so this is the appropriate errno that close() would throw
-		errno = EBADF;
-		return -1;
-	}
-	// first off, remove the client from the list
-	owners = file->owners;
+void reportChange(Watch *watch, off_t offset, off_t len, off_t size, struct timespec mtime) {
+	Watcher *watcher;
+	struct iovec part;
+	char msg[96];
 	
-	for (i=0; i<owners->length; i++) {
-		handle = getClient(linkedListGet(owners, i));
-		if (handle->fd == clientfd) {
-			linkedListRemove(owners, handle);
-			break;
-		}
-	}
-	// free client
-	free(handle);
-	// update refcount
-	file->refcount--;
-	if (file->refcount == 0) {
-		// if no one is holding the file, close and remove file from linked list
-		linkedListRemove(&fileList, file);
-		close(file->fd);	// close file
-		free(file->owners); // only owned by us, so we don't have to cycle through the tree
-		free(file->fname); 	// free string name
-		free(file); 		// finally, free the file descriptor
+	watch->version++;
+	watch->lastSize = size;
+	watch->lastMtime = mtime;
+	for (watcher = watch->watchers; watcher != NULL; watcher = watcher->next) {
+		part.iov_base = msg;
+		part.iov_len = sprintf(msg, "%d,%lld,%lld,%lld,%ld", watcher->id, (long long) offset, (long long) len, (long long) size, watch->version);
+		// a watcher that stopped reading loses events instead of holding up the others
+		if (writeFrame(watcher->conn, STATUS_EVENT, &part, 1, 0) == -1) STAT_ADD(watchDropped, 1);
+		else STAT_ADD(watchEvents, 1);
 	}
-	
-	return 0;
 }
 
-void printFileTree() {
-	MultiFile *file;
-	ClientHandle *client;
-	int i, j;
+/**
+ * Body of the thread that sends every event: first the changes noted by
+ * notifyChange(), which know what they touched, then those inotify saw
+ * that weren't among them.
+ */
+void *notifyThread(void *ptr) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2] = { { notesWake, POLLIN, 0 }, { inotifyFd, POLLIN, 0 } };
+	struct inotify_event *ev;
+	ChangeNote *notes, *note;
+	struct stat st;
+	uint64_t val;
+	ssize_t len;
+	Watch *watch;
+	char *p;
+	(void) ptr;
 	
-	printf("\n\nTREE: \n");
-	for (i=0; i<fileList.length; i++) {
-		file = getFile(linkedListGet(&fileList, i));
-		printf("\tFNAME: %s\n\tFD:    %d\n\tMAXAC: %c\n\tWRITE: %d\n\tREFCT: %d\n\tOWNED:\n", file->fname, file->fd, file->access, file->write, file->refcount);
+	while (1) {
+		if (poll(fds, 2, -1) == -1) continue;
+		// give a request that made the change time to claim it, with its range
+		if (fds[1].revents && !fds[0].revents) poll(fds, 1, INOTIFY_HOLD_MS);
+		if (fds[0].revents) read(notesWake, &val, sizeof(val));
+		pthread_mutex_lock(&notesLock);
+		notes = notesFirst;
+		notesFirst = NULL;
+		notesLast = &notesFirst;
+		pthread_mutex_unlock(&notesLock);
 		
-		for (j=0; j<file->owners->length; j++) {
-			client = getClient(linkedListGet(file->owners, j));
-			printf("\t\tFD: %d\n\t\tAC: %c\n\t\tRW: %d\n\n", client->fd, client->access, client->permission);
+		pthread_mutex_lock(&watchLock);
+		while ((note = notes) != NULL) {
+			notes = note->next;
+			watch = findWatch(note->dev, note->ino);
+			if (watch != NULL) reportChange(watch, note->offset, note->len, note->size, note->mtime);
+			free(note);
+		}
+		len = fds[1].revents ? read(inotifyFd, buf, sizeof(buf)) : 0;
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *) p;
+			for (watch = watchList; watch != NULL && watch->wd != ev->wd; watch = watch->next);
+			if (watch == NULL) continue;
+			if (ev->mask & IN_IGNORED) {
+				watch->wd = -1;
+				continue;
+			}
+			if (fstat(watch->fd, &st) == -1) continue;
+			if (st.st_nlink == 0) {
+				if (watch->lastSize != -1) reportChange(watch, 0, 0, -1, st.st_mtim);
+			} else if (st.st_size != watch->lastSize || st.st_mtim.tv_sec != watch->lastMtime.tv_sec || st.st_mtim.tv_nsec != watch->lastMtime.tv_nsec) {
+				// not one of ours, so all we know is that the file changed
+				reportChange(watch, 0, st.st_size, st.st_size, st.st_mtim);
+			}
 		}
+		pthread_mutex_unlock(&watchLock);
 	}
+	
+	return NULL;
 }
 
 /****************************************************************************************************
  * 																									*
- * Function implementations																			*
+ * Delta writes																						*
  * 																									*
- * Code below implements each function that the server will provide being,							*
- * netopen, netclose, netread, netwrite.															*
+ * A client rewriting a file asks for the checksums of its blocks (see								*
+ * netdelta.h), works out which of them the new contents still hold and sends						*
+ * only copy instructions for those and the rest as literal data. Applying							*
+ * the delta keeps the file's inode, so other clients' handles stay valid.							*
  * 																									*
  ****************************************************************************************************/
 
-void error(char *msg) {
-    perror(msg);
-    exit(0);
-}
-
-/**
- * Opens file for a given client. If successful, it will return a valid
- * file descriptor to return to the client. On failure, this method will
- * return -1, and errno will be set appropriately.
- */
-int openFile(const char *fname, int flags, int clientfd, char access) {
-	MultiFile *file;
-	int retfd = -1;
-	// acquire lock 
-	pthread_mutex_lock(&fileLock);
-	file = getFileByName(fname);
-	
-	// file cannot be opened for some reason, so return with errno
-	if (file == NULL) goto OPENEND;
-	if (addOwner(file, flags, clientfd, access) == -1) goto OPENEND;
-	retfd = file->fd;
-	
-	OPENEND:
-	//printFileTree();
-	// return lock, and return file descriptor (or -1 if it was an error)
-	pthread_mutex_unlock(&fileLock);
-	return retfd;
-}
+typedef struct {
+	long long block;	// first block to copy, or -1 for literal data
+	long long count;	// blocks to copy, or bytes of literal data
+	off_t out;			// where the piece starts in the new contents
+} DeltaOp;
 
 /**
- * Close file for a given client. If successful, it will return 0. 
- * On failure, this method will return -1, and errno will be set appropriately.
+ * Builds the signature of a file for blocks of bs bytes: the file's stamp as
+ * its 8 byte size, version, and modification time in seconds and
+ * nanoseconds, then the weak and strong checksum of each whole block. The
+ * client sends the stamp back with its delta, see deltaFile().
+ * 
+ * Returns a malloc()'ed signature, its length stored in len, or NULL with
+ * errno set appropriately
  */
-int closeFile(int fd, int clientfd) {
-	MultiFile *file;
-	int retval = -1;
-	// acquire lock 
-	pthread_mutex_lock(&fileLock);
-	file = getFileByFD(fd);
-
-	// file cannot be opened for some reason, so return with errno
-	if (file == NULL) goto CLOSEND;
-	if (removeOwner(file, clientfd) == -1) goto CLOSEND;
-	retval = 0;
+char *fileSignature(ClientHandle *handle, size_t bs, int *len) {
+	int filefd = handle->file->fd;
+	size_t chunk = COPY_CHUNK / bs * bs, want, i;
+	long long nblocks, done = 0;
+	char *sig, *buf, *p;
+	WeakSum weak;
+	uint32_t value;
+	uint64_t strong;
+	FileStamp stamp;
+	int64_t head[4];
+	ssize_t got;
 	
-	CLOSEND:
-	//printFileTree();
-	// return lock, and return status
-	pthread_mutex_unlock(&fileLock);
-	return retval;
+	if (handle->permission == O_WRONLY) {
+		errno = EACCES;
+		return NULL;
+	}
+	stampFile(handle->file, &stamp);
+	if (stamp.size == -1) return NULL;
+	nblocks = stamp.size / bs;
+	sig = malloc(DELTA_STAMP_SIZE + nblocks * DELTA_SUM_SIZE);
+	buf = malloc(chunk);
+	p = sig + DELTA_STAMP_SIZE;
+	while (done < nblocks) {
+		want = (nblocks - done) * bs < chunk ? (nblocks - done) * bs : chunk;
+		got = pread(filefd, buf, want, done * bs);
+		if (got == -1) {
+			free(buf);
+			free(sig);
+			return NULL;
+		}
+		// the file shrank since the fstat(), stop at its last whole block
+		for (i=0; i + bs <= (size_t) got; i += bs) {
+			weak = weakSum((unsigned char *) buf + i, bs);
+			value = weakValue(weak);
+			strong = strongSum((unsigned char *) buf + i, bs);
+			memcpy(p, &value, 4);
+			memcpy(p + 4, &strong, 8);
+			p += DELTA_SUM_SIZE;
+			done++;
+		}
+		if ((size_t) got < want) break;
+	}
+	free(buf);
+	head[0] = stamp.size;
+	head[1] = stamp.version;
+	head[2] = stamp.mtime.tv_sec;
+	head[3] = stamp.mtime.tv_nsec;
+	memcpy(sig, head, DELTA_STAMP_SIZE);
+	STAT_ADD(signatures, 1);
+	*len = p - sig;
+	return sig;
 }
 
 /**
- * Reads data from file 
+ * Rewrites a file from a delta running from p to end: decimal block size,
+ * new size and number of pieces, each followed by a sep, then a
+ * "<block>,<count>," pair per piece and the literal data of every piece
+ * with block -1 back to back. The other pieces copy count blocks from
+ * block on from the old contents.
  * 
- * Returns malloc()'ed string with file data on success
- * Return NULL on failure with errno set accordingly
+ * When every copied block stays where it was, only the literal data is
+ * written. Otherwise the moved pieces are first gathered in a scratch
+ * memfd, since they may come from blocks that other pieces overwrite.
+ * 
+ * Returns the new size of the file, or -1 with errno set (EINVAL if the delta
+ * is malformed or refers to blocks the file doesn't have).
  */
-char *readFile(int fd, int clientfd) {
-	MultiFile *file;
-	char *data = NULL;
+ssize_t applyDelta(int filefd, char *p, char *end) {
+	long long bs, newsize, n, literal = 0, reused = 0, moved = 0;
+	off_t out = 0;
+	DeltaOp *ops = NULL, *op;
+	int i, inPlace = 1, scratch = -1;
+	ssize_t ret = -1, len;
+	struct stat st;
 	
-	int bytesread = -1;
-	
-	pthread_mutex_lock(&fileLock);
-	file = getFileByFD(fd);
+	if (nextField(&p, end, &bs) == -1 || nextField(&p, end, &newsize) == -1 || nextField(&p, end, &n) == -1) goto BADDELTA;
+	if (bs < DELTA_MIN_BLOCK || bs > DELTA_MAX_BLOCK || newsize < 0 || n < 0 || n > end - p) goto BADDELTA;
+	if (fstat(filefd, &st) == -1) return -1;
 	
-	if (file == NULL) goto READEND;
+	ops = malloc(sizeof(DeltaOp) * (n + 1));
+	for (i=0; i<n; i++) {
+		op = &ops[i];
+		if (nextField(&p, end, &op->block) == -1 || nextField(&p, end, &op->count) == -1 || op->count < 0) goto BADDELTA;
+		op->out = out;
+		if (op->block == -1) {
+			if (op->count > end - p) goto BADDELTA;
+			literal += op->count;
+			out += op->count;
+		} else {
+			if (op->block < 0 || op->count > st.st_size / bs || (op->block + op->count) * bs > st.st_size) goto BADDELTA;
+			reused += op->count * bs;
+			if (op->block * bs != out) {
+				inPlace = 0;
+				moved += op->count * bs;
+			}
+			out += op->count * bs;
+		}
+	}
+	if (out != newsize || literal != end - p) goto BADDELTA;
 	
-	if (hasAccess(file, clientfd, O_RDONLY) == 1 || hasAccess(file, clientfd, O_RDWR) == 1) {
-		// go to end of file to get length
-		int len = lseek(file->fd, 0, SEEK_END);
-		// go to start of file
-		lseek(file->fd, 0, SEEK_SET);
-		data = malloc(len);
-		read(file->fd, data, len);
-	} else {
-		errno = EACCES;
+	if (!inPlace && (scratch = memfd_create("netdelta", MFD_CLOEXEC)) == -1) goto DELTAEND;
+	// scratch keeps the offsets of the new contents, untouched ranges cost nothing
+	for (i=0; i<n; i++) {
+		op = &ops[i];
+		if (op->block == -1) {
+			len = pwrite(inPlace ? filefd : scratch, p, op->count, op->out);
+			p += op->count;
+		} else if (op->block * bs != op->out) {
+			len = copyData(filefd, op->block * bs, scratch, op->out, op->count * bs);
+		} else {
+			continue;
+		}
+		if (len == -1) goto DELTAEND;
 	}
-	READEND:
-	// free lock and return
-	pthread_mutex_unlock(&fileLock);
-	return data;
+	for (i=0; !inPlace && i<n; i++) {
+		op = &ops[i];
+		if (op->block != -1 && op->block * bs == op->out) continue;
+		len = op->block == -1 ? op->count : op->count * bs;
+		if (copyData(scratch, op->out, filefd, op->out, len) == -1) goto DELTAEND;
+	}
+	if (ftruncate(filefd, newsize) == -1) goto DELTAEND;
+	
+	STAT_ADD(deltas, 1);
+	STAT_ADD(deltaLiteral, literal);
+	STAT_ADD(deltaReused, reused);
+	STAT_ADD(deltaMoved, moved);
+	if (inPlace) STAT_ADD(deltaInPlace, 1);
+	ret = newsize;
+	goto DELTAEND;
+	
+	BADDELTA:
+	errno = EINVAL;
+	DELTAEND:
+	if (scratch != -1) close(scratch);
+	free(ops);
+	return ret;
 }
 
 /**
- * writes data to a file
+ * Applies a delta request's len bytes of data (everything after the handle)
+ * to a file the client has open for reading and writing. The data starts
+ * with the stamp of the signature the delta was made against, see
+ * fileSignature(), and the CRC32C of the new contents, each followed by a
+ * sep; the delta itself follows, see applyDelta(). On a replication primary,
+ * seq is set to the log entry of the delta.
  * 
- * Returns number of bytes written on success
- * Return -1 on failure, with errno set appropriately
+ * Returns the new size of the file, or -1 with errno set appropriately: ESTALE
+ * if the file changed since the signature and nothing was written, EIO if
+ * the new contents don't match the CRC32C, with the delta applied.
  */
-int writeFile(int fd, int clientfd, char *buf) {
-	MultiFile *file;
-	
-	int bytesread = -1;
-	
-	pthread_mutex_lock(&fileLock);
-	file = getFileByFD(fd);
-	
-	if (file == NULL) goto WRITEND;
+ssize_t deltaFile(ClientHandle *handle, char *data, size_t len, long *seq) {
+	MultiFile *file = handle->file;
+	char *end = data + len;
+	long long head[5];
+	FileStamp stamp;
+	ssize_t size = -1;
+	size_t covered;
+	uint32_t crc;
+	int i, mismatch = 0;
 	
-	if (hasAccess(file, clientfd, O_WRONLY) == 1 || hasAccess(file, clientfd, O_RDWR) == 1) {
-		// go to start of file
-		lseek(file->fd, 0, SEEK_SET);
-		bytesread = write(file->fd, buf, strlen(buf));
-	} else {
+	if (handle->permission != O_RDWR) {
 		errno = EACCES;
+		return -1;
 	}
-	WRITEND:
-	// free lock and return
-	pthread_mutex_unlock(&fileLock);
-	return bytesread;
+	for (i=0; i<5; i++) {
+		if (nextField(&data, end, &head[i]) == -1) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	// held for the check too, so no write through the server slips in before the delta
+	pthread_mutex_lock(&file->writeLock);
+	stampFile(file, &stamp);
+	if (stamp.size != head[0] || stamp.version != head[1] || stamp.mtime.tv_sec != head[2] || stamp.mtime.tv_nsec != head[3]) {
+		errno = ESTALE;
+		goto DELTAFILEEND;
+	}
+	size = applyDelta(file->fd, data, end);
+	fileChanged(file);
+	if (size != -1 && replPrimary) *seq = logFileOp(FN_DELTA, file, 0, data, end - data);
+	// checked before anything else can change the file, but the change stands either way
+	if (size != -1 && (checksumFile(handle, 0, 0, &crc, &covered) == -1 || crc != (uint32_t) head[4] || covered != (size_t) size)) mismatch = 1;
+	
+	DELTAFILEEND:
+	pthread_mutex_unlock(&file->writeLock);
+	if (size == -1) return -1;
+	notifyChange(file->fd, 0, -1);
+	if (commitWrite(file->fd, handle->durability) == -1) return -1;
+	if (mismatch) {
+		errno = EIO;
+		return -1;
+	}
+	return size;
 }
 
 /****************************************************************************************************
  * 																									*
- * Client communication helper functions															*	
+ * Replication streams																				*
  * 																									*
- * Functions below implement the protocol for communication between client							*
- * and server. These include getMessage(), sendReponse() and sendResponseInt()						*
+ * On the primary, the worker of a replica's connection turns into a streamer						*
+ * that sends every log entry from the one asked for, waiting for new ones as						*
+ * they are appended. On a replica, one thread follows the primary, applies							*
+ * each entry as it arrives and reconnects if the primary goes away.								*
  * 																									*
  ****************************************************************************************************/
 
 /**
- * Receives a message from a client. Returns null on error with errno set, and a 
- * malloc()'ed character string containing all the data sent from the client. 
- * Remember to free the character pointer returned from this function.
- * 
- * If this method returns NULL, then the connection was lost, and ERRNO was set
- * appropriately. It will deal with other types of errors internally.
+ * Streams the replication log to a replica, starting at entry next, until
+ * the replica disconnects or falls out of the log.
  */
-char *getMessage(int fd) {
-	int val, len;
-	// read length of message
-	val = read(fd, &len, 4);
-	// if val == 0 we got a clean close, if val == -1, an error occurred
-	if (val == 0 || val == -1) {
-		// either way, we should try to close the socket and return, while maintaining errno
-		val = errno;
-		close(fd);
-		errno = val;
-		return NULL;
-	}
+void streamLog(Transport *conn, long next) {
+	struct pollfd pfd = { conn->fd, POLLIN, 0 };
+	struct timespec until;
+	struct iovec parts[3];
+	char hdr[128];
+	LogEntry *e;
+	long last;
+	int ret;
 	
-	char *msg = malloc(len+1);
-	// read actual message
-	val = read(fd, msg, len);
-	// if val == 0 we got a clean close, if val == -1, an error occurred
-	if (val == 0 || val == -1) {
-		// either way, we should try to close the socket and return, while maintaining errno
-		val = errno;
-		close(fd);
-		free(msg);
-		errno = val;
-		return NULL;
+	STAT_ADD(replicas, 1);
+	pthread_mutex_lock(&logLock);
+	while (1) {
+		if (next < logFirst || next > logLast + 1) {
+			// evicted, or asked for by a replica of an earlier run of this primary
+			pthread_mutex_unlock(&logLock);
+			sendResponseInt(conn, STATUS_FAILURE, ERANGE);
+			break;
+		}
+		if (next > logLast) {
+			// a replica never sends anything after subscribing, so input means it hung up
+			pthread_mutex_unlock(&logLock);
+			if (poll(&pfd, 1, 0) != 0) break;
+			pthread_mutex_lock(&logLock);
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec++;
+			if (next > logLast) pthread_cond_timedwait(&logAppended, &logLock, &until);
+			continue;
+		}
+		e = replLog[next % REPL_LOG_ENTRIES];
+		e->refs++;
+		last = logLast;
+		pthread_mutex_unlock(&logLock);
+		
+		parts[0].iov_base = hdr;
+		parts[0].iov_len = sprintf(hdr, "%ld,%ld,%ld,%c,%lld,%zu,", e->seq, last, e->stamp, e->op, (long long) e->offset, strlen(e->path));
+		parts[1].iov_base = e->path;
+		parts[1].iov_len = strlen(e->path);
+		parts[2].iov_base = e->data;
+		parts[2].iov_len = e->len;
+		ret = sendResponseParts(conn, STATUS_SUCCESS, parts, 3);
+		
+		pthread_mutex_lock(&logLock);
+		releaseEntry(e);
+		if (ret == -1) {
+			pthread_mutex_unlock(&logLock);
+			break;
+		}
+		next++;
 	}
-	msg[len] = 0;
-	
-	printf("%d -> '%s'\n", fd, msg);
-	return msg;
+	STAT_ADD(replicas, -1);
 }
 
 /**
- * Sends a status character, and a string message to a client specified by fd.
- * Returns 0 on success, or -1 on error, with errno set
+ * Makes *filefd a descriptor for path, reusing the one cached for *filename
+ * if it is the same file. The file is created if it doesn't exist.
  * 
- * If this method returns -1, then the connection was lost, and ERRNO was set
- * appropriately. It will deal with other types of errors internally.
+ * Returns 0 on success, -1 on failure with errno set appropriately
  */
-int sendResponse(int fd, char stat, char *resp) {
-	char msg[strlen(resp) + 2];
-	int val, len;
-	// create full message to send, and get length
-	sprintf(msg, "%c%c%s", stat, SEP_CHAR, resp);
-	printf("%d <- '%s'\n", fd, msg);
-	len = strlen(msg);
-	// first step is to write the message length to the client (first 4 bytes)
-	val = write(fd, &len, 4);
-	// if val == 0 we got a clean close, if val == -1, an error occurred
-	if (val == 0 || val == -1) {
-		// either way, we should try to close the socket and return, while maintaining errno
-		val = errno;
-		close(fd);
-		errno = val;
-		return -1;
-	}
+int openCached(const char *path, int *filefd, char **filename) {
+	if (*filename != NULL && strcmp(*filename, path) == 0) return 0;
+	if (*filefd != -1) close(*filefd);
+	free(*filename);
+	*filename = NULL;
+	// deltas read the old contents of the file they rewrite
+	*filefd = openPath(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	// the primary may have created the directories too, see createFile()
+	if (*filefd == -1 && errno == ENOENT && makeParents(path) == 0) *filefd = openPath(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (*filefd == -1) return -1;
+	*filename = strdup(path);
+	return 0;
+}
+
+/**
+ * Applies one log entry received from the primary. The file written last is
+ * kept open in *filefd and *filename, since writes tend to come in runs.
+ * 
+ * Returns 0 on success, -1 on failure with errno set appropriately
+ */
+int applyEntry(char op, const char *path, off_t offset, const char *data, size_t len, int *filefd, char **filename) {
+	long long dstoff, count;
+	char *target;
+	int in, skip = 0, ret, mode;
 	
-	// now we write the actual message
-	val = write(fd, msg, len);
-	// if val == 0 we got a clean close, if val == -1, an error occurred
-	if (val == 0 || val == -1) {
-		// either way, we should try to close the socket and return, while maintaining errno
-		val = errno;
-		close(fd);
-		errno = val;
+	if (op == FN_RENAME) {
+		// the cached name may be about to change
+		if (*filefd != -1) close(*filefd);
+		free(*filename);
+		*filename = NULL;
+		*filefd = -1;
+		target = strndup(data, len);
+		ret = renamePath(path, target, offset);
+		if (ret == 0) {
+			pthread_mutex_lock(&fileLock);
+			pthread_mutex_lock(&nameLock);
+			renameOpenFiles(path, target, offset);
+			pthread_mutex_unlock(&nameLock);
+			pthread_mutex_unlock(&fileLock);
+		}
+		free(target);
+		return ret;
+	}
+	if (op == FN_COPYRANGE) {
+		// copy into the file named in data, from the one named by path
+		if (sscanf(data, "%lld,%lld,%n", &dstoff, &count, &skip) != 2 || skip == 0 || skip >= (int) len) {
+			errno = EINVAL;
+			return -1;
+		}
+		in = openPath(path, O_RDONLY | O_CLOEXEC, 0);
+		if (in == -1) return -1;
+		target = strndup(data + skip, len - skip);
+		ret = openCached(target, filefd, filename);
+		if (ret == 0) ret = copyData(in, offset, *filefd, dstoff, count) == -1 ? -1 : 0;
+		pathChanged(target);
+		if (ret == 0) notifyChange(*filefd, dstoff, count);
+		close(in);
+		free(target);
+		return ret;
+	}
+	if (openCached(path, filefd, filename) == -1) return -1;
+	if (op == FN_WRITE) {
+		ret = pwrite(*filefd, data, len, offset) == -1 ? -1 : 0;
+	} else if (op == FN_TRUNCATE) {
+		ret = ftruncate(*filefd, offset);
+	} else if (op == LOG_ALLOCATE) {
+		ret = sscanf(data, "%d,%lld", &mode, &count) == 2 ? allocateRange(*filefd, mode, offset, count) : -1;
+		if (ret == -1 && errno == 0) errno = EINVAL;
+	} else if (op == FN_DELTA) {
+		ret = applyDelta(*filefd, (char *) data, (char *) data + len) == -1 ? -1 : 0;
+	} else {
+		errno = EINVAL;
 		return -1;
 	}
-	
-	return 0;
+	// clients reading the file must not get chunks cached before the change
+	pathChanged(path);
+	if (ret == 0) notifyChange(*filefd, op == FN_WRITE || op == FN_TRUNCATE ? offset : 0, op == FN_WRITE ? (off_t) len : -1);
+	return ret;
 }
 
 /**
- * Sends a status character, and integer to a client specified by fd.
- * Returns 0 on success, or -1 on error, with errno set
- * 
- * If this method returns -1, then the connection was lost, and ERRNO was set
- * appropriately. It will deal with other types of errors internally.
+ * Body of a replica's thread, following the primary at replSource forever,
+ * or until it falls out of the primary's log or fails to apply an entry. The
+ * replica then marks itself stale: it keeps running, but refuses reads with
+ * ESTALE, which sends its clients to the primary, until it is synced again
+ * (with netsync, say) and restarted.
  */
-int sendResponseInt(int fd, char stat, int num) {
-	char msg[10];
+void *followPrimary(void *ptr) {
+	Transport *t;
+	char *msg, *p, *end, *path, op, req[32];
+	long long seq, last, stamp, offset, pathlen;
+	int len, ok, filefd = -1;
+	char *filename = NULL;
+	(void) ptr;
+	
+	while (1) {
+		t = transportConnect(replSource);
+		if (t == NULL) {
+			sleep(1);
+			continue;
+		}
+		// requests have the same framing as responses, so the primary sees an ordinary client
+		msg = NULL;
+		if (sendResponse(t, MODE_UNRESTRCT, "") == -1 || (msg = getMessage(t, NULL)) == NULL || msg[0] != STATUS_SUCCESS) goto RECONNECT;
+		free(msg);
+		msg = NULL;
+		pthread_mutex_lock(&applyLock);
+		sprintf(req, "%ld", appliedSeq + 1);
+		pthread_mutex_unlock(&applyLock);
+		if (sendResponse(t, FN_REPLICATE, req) == -1) goto RECONNECT;
+		STAT_SET(following, 1);
+		
+		while ((msg = getMessage(t, &len)) != NULL) {
+			if (msg[0] != STATUS_SUCCESS) {
+				errno = atoi(msg + 2);
+				perror("Replica fell out of the primary's log");
+				goto STALE;
+			}
+			p = msg + 2;
+			end = msg + len;
+			ok = nextField(&p, end, &seq) == 0 && nextField(&p, end, &last) == 0 && nextField(&p, end, &stamp) == 0;
+			ok = ok && end - p >= 2 && p[1] == SEP_CHAR;
+			if (ok) {
+				op = p[0];
+				p += 2;
+				ok = nextField(&p, end, &offset) == 0 && nextField(&p, end, &pathlen) == 0 && pathlen > 0 && pathlen < end - p + 1;
+			}
+			if (!ok) {
+				fprintf(stderr, "Malformed replication log entry\n");
+				break;
+			}
+			path = strndup(p, pathlen);
+			p += pathlen;
+			// its files no longer match the primary's, whatever comes after
+			if (applyEntry(op, path, offset, p, end - p, &filefd, &filename) == -1) {
+				perror(path);
+				free(path);
+				goto STALE;
+			}
+			free(path);
+			free(msg);
+			msg = NULL;
+			
+			pthread_mutex_lock(&applyLock);
+			appliedSeq = seq;
+			pthread_cond_broadcast(&applyAdvanced);
+			pthread_mutex_unlock(&applyLock);
+			STAT_SET(appliedStamp, stamp);
+			STAT_SET(appliedSeq, seq);
+			STAT_SET(primarySeq, last);
+		}
+		
+		RECONNECT:
+		STAT_SET(following, 0);
+		free(msg);
+		transportClose(t);
+		free(t);
+		sleep(1);
+	}
 	
-	sprintf(msg, "%d", num);
-	return sendResponse(fd, stat, msg);
+	STALE:
+	fprintf(stderr, "Replica is stale, serving no reads until resynced\n");
+	__atomic_store_n(&replStale, 1, __ATOMIC_RELEASE);
+	STAT_SET(stale, 1);
+	STAT_SET(following, 0);
+	// wake reads waiting for entries that won't come
+	pthread_mutex_lock(&applyLock);
+	pthread_cond_broadcast(&applyAdvanced);
+	pthread_mutex_unlock(&applyLock);
+	if (filefd != -1) close(filefd);
+	free(filename);
+	free(msg);
+	transportClose(t);
+	free(t);
+	return NULL;
 }
 
 /****************************************************************************************************
@@ -638,152 +4385,679 @@ int convertToStandard(char md) {
 }
 
 void *handleClient(void *ptr) {
-	LinkedList *files;
-	int clientfd = * ((int *) ptr);
-	int msglen, running = 1;
-	char *inmsg, access;
+	Session session = { 0, NULL, { NULL, 0, -1 }, NULL, NULL, 0, { -1, -1 }, { 0, 0, 0, PTHREAD_COND_INITIALIZER, NULL, NULL } };
+	ClientHandle *handle;
+	Transport *conn = ptr;
+	int clientfd = conn->fd;
+	int inlen, running = 1, checked;
+	long rest;
+	char *inmsg, *codecs, *token, features[4 + SESSION_TOKEN_SIZE], *feature, access;
+	
+	session.id = __atomic_add_fetch(&lastSession, 1, __ATOMIC_RELAXED);
 
-	// read opening msg from client
-	inmsg = getMessage(clientfd);
+	// finish setting up the transport, then read opening msg from client
+	if (transportAccept(conn) == -1) {
+		transportClose(conn);
+		free(conn);
+		connDone();
+		return NULL;
+	}
+	inmsg = getMessage(conn, NULL);
 	
-	if (inmsg == NULL) return NULL;
+	if (inmsg == NULL) {
+		free(conn);
+		connDone();
+		return NULL;
+	}
 	
 	// handles initial connection to client
-	if (inmsg[0] == MODE_UNRESTRCT) {
-		access = MODE_UNRESTRCT;
-		sendResponse(clientfd, STATUS_SUCCESS, "");
-	} else if (inmsg[0] == MODE_EXCLUSIVE) {
-		access = MODE_EXCLUSIVE;
-		sendResponse(clientfd, STATUS_SUCCESS, "");
-	} else if (inmsg[0] == MODE_TRANSACTN) {
-		access = MODE_TRANSACTN;
-		sendResponse(clientfd, STATUS_SUCCESS, "");
+	if (inmsg[0] == MODE_UNRESTRCT || inmsg[0] == MODE_EXCLUSIVE || inmsg[0] == MODE_TRANSACTN) {
+		access = inmsg[0];
+		// a client that can resume sessions follows its features with a token, empty for a new session
+		if ((token = strchr(inmsg + 2, SEP_CHAR)) != NULL) *token++ = '\0';
+		// the client lists the codecs it can use after the mode, best first
+		for (codecs = inmsg + 1; *codecs != '\0' && !codecSupported(*codecs); codecs++);
+		conn->codec = *codecs;
+		// and may ask for checked frames, which start after the answer
+		feature = features;
+		if (conn->codec != CODEC_NONE) *feature++ = conn->codec;
+		if (strchr(inmsg + 1, FRAME_CRC) != NULL) *feature++ = FRAME_CRC;
+		*feature = '\0';
+		checked = feature > features && feature[-1] == FRAME_CRC;
+		if (token != NULL) {
+			// the answer carries the token the session can be resumed with, the old one if it was
+			*feature++ = SEP_CHAR;
+			if (*token == '\0' || resumeSession(&session, conn, token) == -1) registerSession(&session, conn);
+			sessionToken(&session, feature);
+		}
+		sendResponse(conn, STATUS_SUCCESS, features);
+		conn->crc = checked;
 	} else {
-		sendResponseInt(clientfd, STATUS_FAILURE, INVALID_FILE_MODE);
-		close(clientfd);
+		sendResponseInt(conn, STATUS_FAILURE, INVALID_FILE_MODE);
+		transportClose(conn);
 		running = 0;
 	}
 	
 	free(inmsg);
-	files = calloc(sizeof(LinkedList), 1);
 	// loop to handle any number of requests from client
 	while (running) {
 		//printFileTree();
-		inmsg = getMessage(clientfd);
+		if (getLength(conn, &inlen) == -1) break;
+		// big requests wait before their data is read, small ones are read first so reads can be charged for their data
+		if (inlen > ADMIT_SMALL) admitRequest(&session.admit, inlen);
+		inmsg = getRequest(conn, inlen, &inlen, &rest);
 		
+		if (inmsg == NULL && errno == EBADMSG) {
+			// damaged on the way, the client gets to try again
+			admitDone(&session.admit);
+			sendResponseInt(conn, STATUS_FAILURE, EBADMSG);
+			continue;
+		}
 		if (inmsg == NULL) break;
+		if (session.admit.cost == 0) admitRequest(&session.admit, requestCost(inmsg, inlen));
 		
 		if (inmsg[0] == FN_OPEN) {
-			// open a file
-			msglen = strlen(inmsg);
-			inmsg[msglen - 2] = '\0';
-			int val = openFile(inmsg + 2, convertToStandard(inmsg[msglen-1]), clientfd, access);
+			// open a file, the request ends with ",<mode>,<options>"
+			char *opts = strrchr(inmsg, SEP_CHAR), *path;
+			int val = -1, options = 0, err;
+			handle = NULL;
+			errno = EINVAL;
+			if (opts - inmsg >= 4 && opts[-2] == SEP_CHAR) {
+				options = atoi(opts + 1);
+				opts[-2] = '\0';
+				if ((path = canonPath(inmsg + 2)) != NULL) {
+					handle = openFile(path, convertToStandard(opts[-1]), session.id, access, options);
+					free(path);
+				}
+			}
+			if (handle != NULL) {
+				val = holdHandle(&session, handle);
+				if (val == -1) {
+					err = errno;
+					closeFile(handle);
+					errno = err;
+				}
+			}
 			if (val == -1) {
-				sendResponseInt(clientfd, STATUS_FAILURE, errno);
+				sendResponseInt(conn, STATUS_FAILURE, errno);
 			} else {
-				sendResponseInt(clientfd, STATUS_SUCCESS, -val);
-				linkedListAdd(files, getFileByName(inmsg+2));
+				// handles go out negated, like the descriptors they replace
+				sendResponseInt(conn, STATUS_SUCCESS, -val);
 			}
 		} else if (inmsg[0] == FN_CLOSE) {
 			// close a specific file
 			int fd = -atoi(inmsg + 2);
-			int val = closeFile(fd, clientfd);
-			if (val == -1) {
-				sendResponseInt(clientfd, STATUS_FAILURE, errno);
+			handle = dropHandle(&session, fd);
+			if (handle == NULL) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
 			} else {
-				sendResponseInt(clientfd, STATUS_SUCCESS, -fd);
-				linkedListRemove(files, getFileByFD(fd));
+				closeFile(handle);
+				sendResponseInt(conn, STATUS_SUCCESS, -fd);
 			}
 		} else if (inmsg[0] == FN_READ) {
-			// read data and send to client
-			int fd = -atoi(inmsg + 2);
-			char *data = readFile(fd, clientfd);
+			// read a range of data and send to client
+			long long offset = 0, size = 0, minseq = 0;
+			int fd, len = 0;
+			char *data = NULL;
+			if (sscanf(inmsg + 2, "%d,%lld,%lld,%lld", &fd, &offset, &size, &minseq) < 3 || offset < 0 || size < 0 || size > MAX_READ_SIZE) {
+				errno = EINVAL;
+			} else if ((handle = lookupHandle(&session.table, -fd)) != NULL) {
+				data = readFile(handle, offset, size, minseq, conn->codec, &len);
+			}
 			if (data == NULL) {
-				sendResponseInt(clientfd, STATUS_FAILURE, errno);
+				sendResponseInt(conn, STATUS_FAILURE, errno);
 			} else {
-				sendResponse(clientfd, STATUS_SUCCESS, data);
+				sendResponseData(conn, STATUS_SUCCESS, data, len);
+				free(data);
+			}
+		} else if (inmsg[0] == FN_STATS) {
+			// report server counters
+			char *report = formatStats();
+			sendResponse(conn, STATUS_SUCCESS, report);
+			free(report);
+		} else if (inmsg[0] == FN_WRITE || inmsg[0] == FN_WRITEV) {
+			// write one or a batch of ranges to a file
+			int fd, nranges;
+			char *data, *unpacked;
+			ssize_t bytes = -1;
+			long seq = 0;
+			WriteRange *ranges = parseWrite(inmsg, inlen, rest, conn->codec, &fd, &nranges, &data, &unpacked);
+			handle = ranges != NULL ? lookupHandle(&session.table, fd) : NULL;
+			if (rest > 0 && handle != NULL && handle->append) {
+				// an append needs all of its data before it takes the file's lock
+				data = unpacked = malloc(rest);
+				if (transportRead(conn, data, rest) <= 0) {
+					closeConn(conn);
+					free(ranges);
+					free(unpacked);
+					free(inmsg);
+					break;
+				}
+				rest = 0;
+			}
+			if (rest > 0) {
+				// a large write, its data is still on the socket
+				int lost;
+				bytes = spliceWrite(handle, conn, session.pipe, ranges, nranges, rest, &lost);
+				free(ranges);
+				ranges = NULL;
+				if (lost) {
+					closeConn(conn);
+					free(inmsg);
+					break;
+				}
+			}
+			if (ranges != NULL) {
+				if (handle != NULL) bytes = writeFile(handle, ranges, nranges, data, &seq);
+				free(ranges);
+				free(unpacked);
 			}
-		} else if (inmsg[0] == FN_WRITE) {
-			// write data to file. data is sent in two messages
-			int fd = -atoi(inmsg + 2);
-			free(inmsg);
-			inmsg = getMessage(clientfd);
-			int len = strlen(inmsg);
-			inmsg[len-1] = '\0';
-			int bytes = writeFile(fd, clientfd, inmsg+2);
 			if (bytes == -1) {
-				sendResponseInt(clientfd, STATUS_FAILURE, errno);
+				sendResponseInt(conn, STATUS_FAILURE, errno);
 			} else {
-				sendResponseInt(clientfd, STATUS_SUCCESS, bytes);
+				sendChangeResponse(conn, bytes, seq);
 			}
-		}
-		
+		} else if (inmsg[0] == FN_COPY) {
+			// copy a whole file to another, by name
+			char *src, *dst;
+			ssize_t bytes = -1;
+			long seq = 0;
+			if (parseNames(inmsg + 2, inmsg + inlen, &src, &dst) == 0) {
+				bytes = copyFile(src, dst, session.id, access, &seq);
+				free(src);
+				free(dst);
+			}
+			if (bytes == -1) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				sendChangeResponse(conn, bytes, seq);
+			}
+		} else if (inmsg[0] == FN_COPYRANGE) {
+			// copy a range between two open files
+			long long inoff, outoff, len;
+			int in, out;
+			ClientHandle *src = NULL, *dst = NULL;
+			ssize_t bytes = -1;
+			long seq = 0;
+			if (sscanf(inmsg + 2, "%d,%lld,%d,%lld,%lld", &in, &inoff, &out, &outoff, &len) != 5 || inoff < 0 || outoff < 0 || len < 0) {
+				errno = EINVAL;
+			} else if ((src = lookupHandle(&session.table, -in)) != NULL && (dst = lookupHandle(&session.table, -out)) != NULL) {
+				bytes = copyRange(src, inoff, dst, outoff, len, &seq);
+			}
+			if (bytes == -1) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				sendChangeResponse(conn, bytes, seq);
+			}
+		} else if (inmsg[0] == FN_RENAME) {
+			// rename a file, the request is "<flags>,<names>"
+			char *p = inmsg + 2, *from, *to;
+			long long flags;
+			long seq = 0;
+			int val = -1;
+			errno = EINVAL;
+			if (nextField(&p, inmsg + inlen, &flags) == 0 && parseNames(p, inmsg + inlen, &from, &to) == 0) {
+				val = renameFile(from, to, flags, session.id, access, &seq);
+				free(from);
+				free(to);
+			}
+			if (val == -1) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				sendChangeResponse(conn, 0, seq);
+			}
+		} else if (inmsg[0] == FN_SIGNATURE) {
+			// checksums of every block of a file, for a delta write
+			int fd, len = 0;
+			long long bs;
+			char *sig = NULL;
+			if (sscanf(inmsg + 2, "%d,%lld", &fd, &bs) != 2 || bs < DELTA_MIN_BLOCK || bs > DELTA_MAX_BLOCK) {
+				errno = EINVAL;
+			} else if ((handle = lookupHandle(&session.table, -fd)) != NULL) {
+				sig = fileSignature(handle, bs, &len);
+			}
+			if (sig == NULL) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				sendResponseData(conn, STATUS_SUCCESS, sig, len);
+				free(sig);
+			}
+		} else if (inmsg[0] == FN_DELTA) {
+			// rewrite a file from a delta against its current blocks
+			char *p = inmsg + 2, *end = inmsg + inlen;
+			long long fd;
+			ssize_t bytes = -1;
+			long seq = 0;
+			if (nextField(&p, end, &fd) == -1) {
+				errno = EINVAL;
+			} else if ((handle = lookupHandle(&session.table, -fd)) != NULL) {
+				bytes = deltaFile(handle, p, end - p, &seq);
+			}
+			if (bytes == -1) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				sendChangeResponse(conn, bytes, seq);
+			}
+		} else if (inmsg[0] == FN_CHECKSUM) {
+			// CRC32C of a range of a file
+			long long offset, len;
+			size_t covered;
+			uint32_t crc;
+			int fd, val = -1;
+			char resp[48];
+			if (sscanf(inmsg + 2, "%d,%lld,%lld", &fd, &offset, &len) != 3 || offset < 0 || len < 0) {
+				errno = EINVAL;
+			} else if ((handle = lookupHandle(&session.table, -fd)) != NULL) {
+				val = checksumFile(handle, offset, len, &crc, &covered);
+			}
+			if (val == -1) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				sprintf(resp, "%u,%zu", crc, covered);
+				sendResponse(conn, STATUS_SUCCESS, resp);
+			}
+		} else if (inmsg[0] == FN_WATCH) {
+			// subscribe to the changes of a file, events come unasked from then on
+			char *path = canonPath(inmsg + 2);
+			if (path == NULL) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				watchFile(&session, conn, path);
+				free(path);
+			}
+		} else if (inmsg[0] == FN_UNWATCH) {
+			if (unwatchFile(&session, atoi(inmsg + 2)) == -1) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				sendResponse(conn, STATUS_SUCCESS, "");
+			}
+		} else if (inmsg[0] == FN_STAT) {
+			// attributes of a file by name, from the cache
+			struct stat st;
+			char attrs[ATTRS_SIZE], *path = canonPath(inmsg + 2);
+			if (path == NULL || cachedStat(path, &st) == -1) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				formatAttrs(attrs, &st);
+				sendResponse(conn, STATUS_SUCCESS, attrs);
+			}
+			free(path);
+		} else if (inmsg[0] == FN_FSTAT) {
+			// attributes of an open file, which its descriptor gives without a lookup
+			struct stat st;
+			char attrs[ATTRS_SIZE];
+			handle = lookupHandle(&session.table, -atoi(inmsg + 2));
+			if (handle == NULL || fstat(handle->file->fd, &st) == -1) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				formatAttrs(attrs, &st);
+				sendResponse(conn, STATUS_SUCCESS, attrs);
+			}
+		} else if (inmsg[0] == FN_LISTDIR) {
+			// a page of a directory, "<start>,<max>,<attrs>,<path>"
+			char *p = inmsg + 2, *end = inmsg + inlen, *body = NULL, *path, head[48];
+			long long start, max, attrs;
+			struct iovec parts[2];
+			size_t len;
+			long next;
+			int count;
+			errno = EINVAL;
+			if (nextField(&p, end, &start) == 0 && nextField(&p, end, &max) == 0 && nextField(&p, end, &attrs) == 0 && p < end
+					&& start >= 0 && max > 0 && (path = canonPath(p)) != NULL) {
+				body = listDir(path, start, max < LISTDIR_MAX ? max : LISTDIR_MAX, attrs != 0, &next, &count, &len);
+				free(path);
+			}
+			if (body == NULL) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				parts[0].iov_base = head;
+				parts[0].iov_len = sprintf(head, "%ld,%d,", next, count);
+				parts[1].iov_base = body;
+				parts[1].iov_len = len;
+				sendResponseParts(conn, STATUS_SUCCESS, parts, 2);
+				free(body);
+			}
+		} else if (inmsg[0] == FN_TRUNCATE) {
+			// set the size of a file
+			long long length;
+			long seq = 0;
+			int fd, val = -1;
+			if (sscanf(inmsg + 2, "%d,%lld", &fd, &length) != 2 || length < 0) {
+				errno = EINVAL;
+			} else if ((handle = lookupHandle(&session.table, -fd)) != NULL) {
+				val = truncateFile(handle, length, &seq);
+			}
+			if (val == -1) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				sendChangeResponse(conn, 0, seq);
+			}
+		} else if (inmsg[0] == FN_ALLOCATE) {
+			// allocate, punch out or zero a range of a file
+			long long offset, len;
+			long seq = 0;
+			int fd, mode, val = -1;
+			if (sscanf(inmsg + 2, "%d,%d,%lld,%lld", &fd, &mode, &offset, &len) != 4 || offset < 0 || len <= 0) {
+				errno = EINVAL;
+			} else if ((handle = lookupHandle(&session.table, -fd)) != NULL) {
+				val = allocateFile(handle, mode, offset, len, &seq);
+			}
+			if (val == -1) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				sendChangeResponse(conn, 0, seq);
+			}
+		} else if (inmsg[0] == FN_FSYNC) {
+			// flush a file to disk
+			handle = lookupHandle(&session.table, -atoi(inmsg + 2));
+			if (handle == NULL || syncFile(handle) == -1) {
+				sendResponseInt(conn, STATUS_FAILURE, errno);
+			} else {
+				sendResponse(conn, STATUS_SUCCESS, "");
+			}
+		} else if (inmsg[0] == FN_REPLICATE) {
+			// a replica subscribing to the log, the connection only streams entries from now on
+			if (!replPrimary) {
+				sendResponseInt(conn, STATUS_FAILURE, EINVAL);
+			} else {
+				// streaming never ends, so it mustn't hold a place
+				admitDone(&session.admit);
+				streamLog(conn, atol(inmsg + 2));
+				running = 0;
+			}
+		} else if (inmsg[0] == FN_ENDSESSION) {
+			// the client is done, nothing is kept for it
+			forgetSession(&session);
+			sendResponse(conn, STATUS_SUCCESS, "");
+			running = 0;
+		}		
 		free(inmsg);
+		admitDone(&session.admit);
 	}
 	
 	printf("Closed connection FD: %d\n", clientfd);
 	
-	MultiFile *file;
-	int i;
-	for (i=0; i<files->length; i++) {
-		file = getFile(linkedListGet(files, i));
-		closeFile(clientfd, file->fd);
-	}
+	// close everything the client left open, unless it may come back for it
+	admitDone(&session.admit);
+	unwatchAll(&session);
+	parkSession(&session);
+	endSession(&session);
 	
+	transportClose(conn);
+	free(conn->sendLock);
+	free(conn);
+	codecRelease();
+	connDone();
 	return NULL;
 }
 
-void addClient(int clientfd, struct sockaddr_in *info) {
+/****************************************************************************************************
+ * 																									*
+ * Listener shards																					*
+ * 																									*
+ * Instead of one accept loop, the server runs a number of listener shards. Each					*
+ * shard has its own SO_REUSEPORT socket on the server port, so the kernel							*
+ * spreads incoming connections across them, and its own epoll loop running on						*
+ * a thread pinned to one CPU. Workers for the connections a shard accepts are						*
+ * pinned to the same CPU, so a connection stays on the core that accepted it						*
+ * for its whole life. When there is one shard per CPU, a small BPF program							*
+ * makes the kernel pick the shard of the CPU the connection arrived on.							*
+ * 																									*
+ ****************************************************************************************************/
+
+typedef struct {
+	int id;
+	int cpu;
+	int tcpsock;
+	int unixsock;		// only shard 0 listens on the unix socket, -1 otherwise
+	char *unixPath;
+} Shard;
+
+/**
+ * Starts a detached worker for a new connection, on the given CPU.
+ */
+void addClient(int clientfd, char kind, const char *desc, int cpu) {
 	pthread_t threadid;
-	char *ipaddr;
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	// the worker owns the transport, so nothing here can be overwritten by the
+	// next connection before the worker has read it
+	Transport *conn = transportSocket(clientfd, kind);
+	printf("\nConnected to %s, FD: %d, CPU: %d\n", desc, clientfd, cpu);
+	
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	if (pthread_create(&threadid, &attr, &handleClient, (void *) conn) != 0) {
+		transportClose(conn);
+		free(conn);
+		connDone();
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * Creates one shard's non blocking TCP listening socket on port.
+ */
+int listenTCP(struct in_addr addr, int port, int backlog) {
+	struct sockaddr_in serverInfo = {0};
+	int sock, on = 1;
+	
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sock < 0) error("Cannot open socket");
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	// every shard binds its own socket to the same port
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) error("SO_REUSEPORT not supported");
+	
+	// configure server
+	serverInfo.sin_port = htons(port);
+	serverInfo.sin_family = AF_INET;
+	serverInfo.sin_addr = addr;
+	
+	// bind server to socket
+	if (bind(sock, (struct sockaddr *) &serverInfo, sizeof(struct sockaddr_in)) < 0) error("Failed to bind to socket");
+	// set up the server socket to listen for client connections
+	if (listen(sock, backlog) < 0) error("Unable to listen on socket");
+	return sock;
+}
+
+/**
+ * Creates the unix socket that local clients connect to, for both the unix
+ * and shared memory transports. Any stale socket file is replaced.
+ */
+int listenUnix(const char *path, int backlog) {
+	struct sockaddr_un addr = {0};
+	int sock;
+	
+	if (strlen(path) >= sizeof(addr.sun_path)) error("Unix socket path too long");
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sock < 0) error("Cannot open unix socket");
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) error("Failed to bind to unix socket");
+	if (listen(sock, backlog) < 0) error("Unable to listen on unix socket");
+	return sock;
+}
+
+/**
+ * Makes the kernel hand each connection to the listener with the same index
+ * as the CPU it arrived on. Only valid when shard i runs on CPU i.
+ */
+void steerByCPU(int sock, int nshards) {
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },	// A = current cpu
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, nshards },					// A %= shards
+		{ BPF_RET | BPF_A, 0, 0, 0 },									// listener index
+	};
+	struct sock_fprog prog = { 3, code };
+	
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		perror("Unable to steer connections by CPU");
+	}
+}
+
+/**
+ * Accepts every pending connection on a non blocking listening socket.
+ */
+void acceptAll(Shard *shard, int sock) {
+	struct sockaddr_in clientInfo;
+	socklen_t infolen;
+	int clientfd;
 	
-	static int i = 0;
-	static char clientbuf[10];
-	// store client file descriptors in an array to prevent the memory being overwritten
-	// before the worker thread is started and able to copy the value
-	clientbuf[i] = clientfd;
-	ipaddr = inet_ntoa(info->sin_addr);
-	printf("\nConnected to %s, FD: %d\n",ipaddr, clientfd);
-	pthread_create(&threadid, NULL, &handleClient, (void *) (clientbuf + i));
+	while (1) {
+		// at the connection limit this waits, and new clients wait in the backlog
+		connStart();
+		infolen = sizeof(clientInfo);
+		clientfd = accept4(sock, (struct sockaddr *) &clientInfo, &infolen, SOCK_CLOEXEC);
+		if (clientfd < 0) {
+			connDone();
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			// EAGAIN means the backlog is drained; anything else (EMFILE...) we retry on the next wakeup
+			if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Unable to accept client");
+			return;
+		}
+		STAT_ADD(connections, 1);
+		STAT_ADD(shardAccepts[shard->id], 1);
+		// add client to be managed
+		if (sock == shard->unixsock) addClient(clientfd, TRANSPORT_UNIX, shard->unixPath, shard->cpu);
+		else addClient(clientfd, TRANSPORT_TCP, inet_ntoa(clientInfo.sin_addr), shard->cpu);
+	}
+}
+
+/**
+ * Event loop of one listener shard.
+ */
+void *shardLoop(void *ptr) {
+	Shard *shard = ptr;
+	struct epoll_event ev, events[4];
+	cpu_set_t cpus;
+	int epfd, n, i;
+	
+	CPU_ZERO(&cpus);
+	CPU_SET(shard->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
 	
-	i = (i + 1) % 10;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) error("Unable to create epoll instance");
+	ev.events = EPOLLIN;
+	ev.data.fd = shard->tcpsock;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, shard->tcpsock, &ev);
+	if (shard->unixsock != -1) {
+		ev.data.fd = shard->unixsock;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, shard->unixsock, &ev);
+	}
+	
+	while (1) {
+		n = epoll_wait(epfd, events, 4, -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			error("Unable to wait for connections");
+		}
+		for (i=0; i<n; i++) acceptAll(shard, events[i].data.fd);
+	}
+	
+	return NULL;
 }
 
 int main(int argc, char *argv[]) {
-	struct sockaddr_in *serverInfo, *clientInfo;
+	Shard *shards;
+	pthread_t *threads;
+	cpu_set_t allowed;
 	
-	int serversock, clientfd;
-	uint infolen;
+	int opt, i, cpu, ncpus, nshards = 0, backlog = SOMAXCONN, contiguous = 1, port = PORT_NUM;
+	char *unixPath = NULL, *root = NULL, defaultPath[64];
+	struct in_addr listenAddr = { INADDR_ANY };
+	pthread_t committer, follower, notifier, reaper;
+	
+	while ((opt = getopt(argc, argv, "a:p:s:n:b:Pf:w:c:r:m:g:d:v")) != -1) {
+		if (opt == 'a') {
+			if (inet_aton(optarg, &listenAddr) == 0) error("Invalid listen address");
+		}
+		else if (opt == 'p') port = atoi(optarg);
+		else if (opt == 's') unixPath = optarg;
+		else if (opt == 'n') nshards = atoi(optarg);
+		else if (opt == 'b') backlog = atoi(optarg);
+		else if (opt == 'P') replPrimary = 1;
+		else if (opt == 'f') replSource = optarg;
+		else if (opt == 'w') spliceMin = atol(optarg);
+		else if (opt == 'c') maxConns = atoi(optarg);
+		else if (opt == 'r') maxRequests = atoi(optarg);
+		else if (opt == 'm') maxInflight = atol(optarg) << 20;
+		else if (opt == 'g') sessionGrace = atoi(optarg);
+		else if (opt == 'd') root = optarg;
+		else if (opt == 'v') verbose = 1;
+		else {
+			fprintf(stderr, "Usage: %s [-a listen address] [-p port] [-s unix socket path] [-n listener shards] [-b listen backlog] [-P | -f primary url] [-w smallest spliced write, 0 for none] [-c max connections, 0 for no limit] [-r max running requests] [-m max in flight MB] [-g seconds dropped sessions are kept, 0 for none] [-d root directory to serve] [-v]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (replPrimary && replSource != NULL) {
+		fprintf(stderr, "A server is either a replication primary (-P) or a replica (-f), not both\n");
+		exit(1);
+	}
+	if (unixPath == NULL) {
+		// servers on other ports get their own socket, so several can run on one host
+		if (port == PORT_NUM) unixPath = NET_UNIX_PATH;
+		else {
+			sprintf(defaultPath, "/tmp/netfileserver.%d.sock", port);
+			unixPath = defaultPath;
+		}
+	}
 	// ignore SIGPIPE if clients disconnect
 	signal(SIGPIPE, SIG_IGN);
+	// clients are kept beneath the root from the first request on
+	if (initPaths(root) == -1) error("Unable to serve the root directory");
 	
 	// initialize mutex
 	if (pthread_mutex_init(&fileLock, NULL) != 0) error("\nMutex init failed\n");
-    
-	serversock = socket(AF_INET, SOCK_STREAM, 0);
-    if (serversock < 0) error("Cannot open socket");
-    
-	// allocate serverInfo struct
-	serverInfo = calloc(sizeof(struct sockaddr_in), 1);
-	clientInfo = calloc(sizeof(struct sockaddr_in), 1);
-	// configure server
-	serverInfo->sin_port = htons(PORT_NUM);
-    serverInfo->sin_family = AF_INET;
-    serverInfo->sin_addr.s_addr = INADDR_ANY;
-     
-    // bind server to socket
-    if (bind(serversock, (struct sockaddr *) serverInfo, sizeof(struct sockaddr_in)) < 0) error("Failed to bind to socket");
-
-	// set up the server socket to listen for client connections
-    if (listen(serversock, 10) < 0) error("Unable to listen on socket");
-    
-    infolen = sizeof(struct sockaddr_in);
-    
-    while (1) {
-		// accept client connection
-		clientfd = accept(serversock, (struct sockaddr *) clientInfo, &infolen);
-		if (clientfd < 0) error("Unable to accept client");
-		// add client to be managed
-		addClient(clientfd, clientInfo);
+	// start the group commit thread
+	if (pthread_create(&committer, NULL, &commitThread, NULL) != 0) error("\nCommit thread failed\n");
+	// and the one that tells watchers about changes
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	notesWake = eventfd(0, EFD_CLOEXEC);
+	if (inotifyFd == -1 || notesWake == -1) error("\nUnable to watch files\n");
+	else if (pthread_create(&notifier, NULL, &notifyThread, NULL) != 0) error("\nNotify thread failed\n");
+	// and the one that ends sessions whose clients didn't come back
+	if (pthread_create(&reaper, NULL, &reapSessions, NULL) != 0) error("\nSession reaper failed\n");
+	// without it the attribute cache stays empty, and every netstat() goes to the disk
+	dirInotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	// replicas follow their primary from the start
+	if (replPrimary) stats.replRole = 'P';
+	if (replSource != NULL) {
+		stats.replRole = 'R';
+		if (pthread_create(&follower, NULL, &followPrimary, NULL) != 0) error("\nReplication thread failed\n");
+	}
+	
+	// one shard per CPU we are allowed to run on, unless told otherwise
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	ncpus = CPU_COUNT(&allowed);
+	if (nshards <= 0) nshards = ncpus;
+	if (nshards > MAX_SHARDS) nshards = MAX_SHARDS;
+	stats.shards = nshards;
+	
+	shards = calloc(sizeof(Shard), nshards);
+	threads = calloc(sizeof(pthread_t), nshards);
+	for (i=0, cpu=0; i<nshards; i++, cpu++) {
+		// shard i runs on the i-th allowed CPU, wrapping around if there are more shards
+		if (i % ncpus == 0) cpu = 0;
+		while (!CPU_ISSET(cpu, &allowed)) cpu++;
+		if (cpu != i) contiguous = 0;
+		shards[i].id = i;
+		shards[i].cpu = cpu;
+		shards[i].tcpsock = listenTCP(listenAddr, port, backlog);
+		shards[i].unixsock = i == 0 ? listenUnix(unixPath, backlog) : -1;
+		shards[i].unixPath = unixPath;
 	}
-}
\ No newline at end of file
+	if (contiguous && nshards > 1 && nshards == ncpus) steerByCPU(shards[0].tcpsock, nshards);
+	
+	for (i=0; i<nshards; i++) {
+		if (pthread_create(&threads[i], NULL, &shardLoop, &shards[i]) != 0) error("Unable to start listener shard");
+	}
+	printf("Listening on %s:%d and %s with %d shard(s), backlog %d\n", inet_ntoa(listenAddr), port, unixPath, nshards, backlog);
+	for (i=0; i<nshards; i++) pthread_join(threads[i], NULL);
+	return 0;
+}
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "libnetfiles.h"
+
+/**
+ * Copies a local directory tree to a server, sending only what changed.
+ *
+ *   netsync [-j workers] [-c] [-n] <local dir> <server> [remote dir]
+ *
+ * The tree is compared a directory at a time: one netlistdir() brings the
+ * sizes and modification times of everything in a remote directory, instead
+ * of a round trip per file. A file is unchanged if the server has it with the
+ * same size and a modification time no older than the local one (netsync
+ * can't set the time on the server, so a copy it made is always newer than
+ * its source). With -c, files of the same size are compared by CRC32C
+ * instead, a piece at a time, and only the pieces that differ are sent.
+ *
+ * The work is spread over worker processes, each with its own connections
+ * (the library is not thread safe), which take directories to compare and
+ * then pieces to send from shared counters. Files larger than SYNC_PIECE are
+ * sent in pieces, so a large file keeps several workers busy, and files are
+ * sent largest first, so one doesn't hold up the end. Files are created on
+ * the server with NET_CREATE, along with their directories. Empty
+ * directories, links and anything else that isn't a regular file are left
+ * out, and nothing is ever deleted on the server.
+ *
+ * -n only reports what would be sent.
+ */
+
+# define SYNC_WORKERS 8
+# define SYNC_PIECE (4 * 1024 * 1024)	// files are sent in pieces this big
+# define SYNC_PAGE 256					// directory entries per netlistdir() call
+
+// what comparing a file found, kept in shared memory
+# define FILE_UNKNOWN 0			// not compared, because its directory couldn't be listed
+# define FILE_SAME    1			// unchanged, skipped
+# define FILE_SEND    2			// to be sent in full
+# define FILE_VERIFY  3			// same size, pieces compared before they are sent
+
+// and what sending it did
+# define SENT_NONE   0
+# define SENT_SOME   1			// at least one piece was sent
+# define SENT_FAILED 2
+
+typedef struct {
+	char *path;				// relative to both roots
+	int nameAt;				// where its name starts in path
+	off_t size;
+	struct timespec mtime;
+} LocalFile;
+
+typedef struct {
+	int first, count;		// its files, next to each other in files[]
+} SyncDir;
+
+typedef struct {
+	int file;
+	off_t offset;
+	size_t len;
+	int last;				// the file's last piece, which sets its size
+} Piece;
+
+typedef struct {
+	pthread_barrier_t compared;
+	long nextDir, nextPiece;
+	long piecesSent, piecesSame, bytesSent;
+	double compareEnd;
+	char marks[];			// state, then sent, of every file
+} Shared;
+
+LocalFile *files = NULL;
+int nfiles = 0, maxFiles = 0;
+SyncDir *dirs = NULL;
+int ndirs = 0;
+const char *localRoot, *remoteRoot;
+int rootLen;
+int checksums = 0, dryRun = 0;
+Shared *shared;
+char *state;				// FILE_* of every file, fixed once compared
+char *sent;					// SENT_* of every file
+
+double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * nftw() callback, collecting the regular files of the tree.
+ */
+int visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	LocalFile *f;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode)) return 0;
+	if (nfiles == maxFiles) {
+		maxFiles = maxFiles == 0 ? 1024 : maxFiles * 2;
+		files = realloc(files, sizeof(LocalFile) * maxFiles);
+	}
+	f = &files[nfiles++];
+	f->path = strdup(path + rootLen + 1);
+	f->nameAt = ftw->base - rootLen - 1;
+	f->size = st->st_size;
+	f->mtime = st->st_mtim;
+	return 0;
+}
+
+/**
+ * Orders files by directory, then name, so each directory's files are next
+ * to each other in the order netlistdir() gives.
+ */
+int compareFiles(const void *a, const void *b) {
+	const LocalFile *x = a, *y = b;
+	int n = x->nameAt < y->nameAt ? x->nameAt : y->nameAt;
+	int c = strncmp(x->path, y->path, n);
+
+	if (c != 0) return c;
+	if (x->nameAt != y->nameAt) return x->nameAt - y->nameAt;
+	return strcmp(x->path + x->nameAt, y->path + y->nameAt);
+}
+
+int compareEntries(const void *a, const void *b) {
+	return strcmp(((const NetDirEntry *) a)->name, ((const NetDirEntry *) b)->name);
+}
+
+/**
+ * Writes where a file, or directory if name is empty, lives on the server.
+ */
+void remotePath(char *buf, const char *rel, int len) {
+	if (*remoteRoot != '\0' && len > 0) sprintf(buf, "%s/%.*s", remoteRoot, len, rel);
+	else if (*remoteRoot != '\0') strcpy(buf, remoteRoot);
+	else if (len > 0) sprintf(buf, "%.*s", len, rel);
+	else strcpy(buf, ".");
+}
+
+/**
+ * Lists a directory on the server and decides, for each of its local files,
+ * whether it has to be sent.
+ */
+void compareDir(SyncDir *d) {
+	LocalFile *first = &files[d->first], *f;
+	NetDirEntry *entries = NULL, *e, key;
+	char path[PATH_MAX + 256];
+	long cookie = 0;
+	ssize_t got;
+	size_t n = 0, max = 0;
+	int i;
+
+	// the directory part of a path ends with the '/' before the name
+	remotePath(path, first->path, first->nameAt > 0 ? first->nameAt - 1 : 0);
+	do {
+		if (n + SYNC_PAGE > max) {
+			max = max == 0 ? SYNC_PAGE * 4 : max * 2;
+			entries = realloc(entries, sizeof(NetDirEntry) * max);
+		}
+		got = netlistdir(path, &cookie, entries + n, SYNC_PAGE, 1);
+		if (got > 0) n += got;
+	} while (got > 0);
+	// a directory that isn't there yet lists empty, and all of it is sent
+	if (got == -1 && errno != ENOENT) {
+		// its files stay FILE_UNKNOWN, and count as failed
+		perror(path);
+		free(entries);
+		return;
+	}
+	// with several servers the listings of all of them come one after the other
+	qsort(entries, n, sizeof(NetDirEntry), compareEntries);
+
+	for (i=0; i<d->count; i++) {
+		f = first + i;
+		strcpy(key.name, f->path + f->nameAt);
+		e = bsearch(&key, entries, n, sizeof(NetDirEntry), compareEntries);
+		// a name can be listed once per server, and only one of them is the file
+		while (e != NULL && e > entries && strcmp(e[-1].name, key.name) == 0) e--;
+		while (e != NULL && e < entries + n && strcmp(e->name, key.name) == 0 && !S_ISREG(e->st.mode)) e++;
+		if (e == NULL || e == entries + n || strcmp(e->name, key.name) != 0 || e->st.size != f->size) {
+			state[d->first + i] = FILE_SEND;
+		} else if (checksums) {
+			state[d->first + i] = FILE_VERIFY;
+		} else if (e->st.mtime.tv_sec > f->mtime.tv_sec || (e->st.mtime.tv_sec == f->mtime.tv_sec && e->st.mtime.tv_nsec >= f->mtime.tv_nsec)) {
+			state[d->first + i] = FILE_SAME;
+		} else {
+			state[d->first + i] = FILE_SEND;
+		}
+	}
+	free(entries);
+}
+
+// largest first
+int compareSizes(const void *a, const void *b) {
+	off_t x = files[*(const int *) a].size, y = files[*(const int *) b].size;
+
+	return x < y ? 1 : x > y ? -1 : *(const int *) a - *(const int *) b;
+}
+
+/**
+ * Lists the pieces to send, largest files first. Every worker makes the
+ * same list from the shared states, and takes pieces from it by index.
+ */
+Piece *listPieces(long *npieces) {
+	Piece *pieces = NULL;
+	int *order = malloc(sizeof(int) * nfiles), i, j;
+	long n = 0, max = 0;
+	off_t at;
+
+	for (i=0; i<nfiles; i++) order[i] = i;
+	qsort(order, nfiles, sizeof(int), compareSizes);
+	for (i=0; i<nfiles; i++) {
+		j = order[i];
+		if (state[j] != FILE_SEND && state[j] != FILE_VERIFY) continue;
+		at = 0;
+		do {
+			if (n == max) {
+				max = max == 0 ? 1024 : max * 2;
+				pieces = realloc(pieces, sizeof(Piece) * max);
+			}
+			pieces[n].file = j;
+			pieces[n].offset = at;
+			pieces[n].len = files[j].size - at < SYNC_PIECE ? files[j].size - at : SYNC_PIECE;
+			at += pieces[n].len;
+			pieces[n].last = at >= files[j].size;
+			n++;
+		} while (at < files[j].size);
+	}
+	free(order);
+	*npieces = n;
+	return pieces;
+}
+
+/**
+ * Sends one piece of a file, or nothing if -c found it the same on the
+ * server. The last piece also cuts the file on the server to size.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int sendPiece(Piece *p, char *buf) {
+	LocalFile *f = &files[p->file];
+	char path[PATH_MAX + 256];
+	int local, fd = -1, err;
+	uint32_t crc;
+	ssize_t n;
+
+	sprintf(path, "%s/%s", localRoot, f->path);
+	local = open(path, O_RDONLY);
+	if (local == -1) return -1;
+	n = pread(local, buf, p->len, p->offset);
+	close(local);
+	if (n != (ssize_t) p->len) {
+		// it changed since the tree was walked
+		if (n != -1) errno = EAGAIN;
+		return -1;
+	}
+	remotePath(path, f->path, strlen(f->path));
+	if (state[p->file] == FILE_VERIFY) {
+		// read and write, for netchecksum()
+		fd = netopen(path, dryRun ? MODE_RD : MODE_RW);
+		if (fd == -1) return -1;
+		if (p->len == 0 || (netchecksum(fd, p->offset, p->len, &crc) == (ssize_t) p->len && crc == netcrc32c(0, buf, p->len))) {
+			__atomic_add_fetch(&shared->piecesSame, 1, __ATOMIC_RELAXED);
+			return netclose(fd);
+		}
+	} else if (!dryRun) {
+		fd = netopen(path, MODE_WR | NET_CREATE);
+		if (fd == -1) return -1;
+	}
+	if (!dryRun) {
+		if (p->len > 0 && (netlseek(fd, p->offset, SEEK_SET) == -1 || netwrite(fd, buf, p->len) != (ssize_t) p->len)) goto FAIL;
+		// the file on the server may have been longer
+		if (p->last && state[p->file] == FILE_SEND && netftruncate(fd, f->size) == -1) goto FAIL;
+	}
+	if (fd != -1 && netclose(fd) == -1) return -1;
+	__atomic_add_fetch(&shared->piecesSent, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&shared->bytesSent, p->len, __ATOMIC_RELAXED);
+	// a failed piece of the same file wins
+	__sync_bool_compare_and_swap(&sent[p->file], SENT_NONE, SENT_SOME);
+	return 0;
+
+	FAIL:
+	err = errno;
+	netclose(fd);
+	errno = err;
+	return -1;
+}
+
+/**
+ * One worker process: waits until gate closes, which is when the barrier is
+ * set up for all the workers that got started, compares directories until
+ * there are none left, waits for the others, then sends pieces until there
+ * are none left.
+ */
+void worker(char *server, int gate[2]) {
+	Piece *pieces;
+	long i, npieces;
+	char *buf = malloc(SYNC_PIECE), c;
+	int connected;
+
+	close(gate[1]);
+	while (read(gate[0], &c, 1) == -1 && errno == EINTR);
+	close(gate[0]);
+	connected = netserverinit(server, MODE_UNRESTRCT) == 0;
+	if (!connected) perror(server);
+	while (connected && (i = __atomic_fetch_add(&shared->nextDir, 1, __ATOMIC_RELAXED)) < ndirs) compareDir(&dirs[i]);
+	if (pthread_barrier_wait(&shared->compared) == PTHREAD_BARRIER_SERIAL_THREAD) shared->compareEnd = now();
+	if (!connected) exit(1);
+
+	pieces = listPieces(&npieces);
+	while ((i = __atomic_fetch_add(&shared->nextPiece, 1, __ATOMIC_RELAXED)) < npieces) {
+		if (sendPiece(&pieces[i], buf) == -1) {
+			fprintf(stderr, "%s: %s\n", files[pieces[i].file].path, strerror(errno));
+			sent[pieces[i].file] = SENT_FAILED;
+		}
+	}
+	exit(0);
+}
+
+int main(int argc, char *argv[]) {
+	pthread_barrierattr_t attr;
+	double start, end;
+	long same = 0, changed = 0, failed = 0;
+	int opt, workers = SYNC_WORKERS, started, i, gate[2];
+	pid_t pid;
+	char root[PATH_MAX];
+
+	while ((opt = getopt(argc, argv, "j:cn")) != -1) {
+		if (opt == 'j') workers = atoi(optarg);
+		else if (opt == 'c') checksums = 1;
+		else if (opt == 'n') dryRun = 1;
+		else break;
+	}
+	if (optind + 2 > argc || workers < 1) {
+		fprintf(stderr, "Usage: %s [-j workers] [-c compare by checksum] [-n dry run] <local dir> <server> [remote dir]\n", argv[0]);
+		return 1;
+	}
+	// trailing slashes would throw the relative paths off
+	snprintf(root, sizeof(root), "%s", argv[optind]);
+	for (i=strlen(root); i>1 && root[i - 1] == '/'; i--) root[i - 1] = '\0';
+	localRoot = root;
+	rootLen = strlen(root);
+	remoteRoot = optind + 2 < argc ? argv[optind + 2] : "";
+
+	start = now();
+	if (nftw(localRoot, visit, 64, FTW_PHYS) == -1) {
+		perror(localRoot);
+		return 1;
+	}
+	qsort(files, nfiles, sizeof(LocalFile), compareFiles);
+	dirs = malloc(sizeof(SyncDir) * (nfiles + 1));
+	for (i=0; i<nfiles; i++) {
+		if (i == 0 || files[i].nameAt != files[i - 1].nameAt || strncmp(files[i].path, files[i - 1].path, files[i].nameAt) != 0) {
+			dirs[ndirs].first = i;
+			dirs[ndirs++].count = 0;
+		}
+		dirs[ndirs - 1].count++;
+	}
+
+	shared = mmap(NULL, sizeof(Shared) + 2 * nfiles, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	state = shared->marks;
+	sent = shared->marks + nfiles;
+	if (pipe(gate) == -1) {
+		perror("pipe");
+		return 1;
+	}
+	// go on with fewer workers if not all of them can be started
+	for (started=0; started<workers; started++) {
+		if ((pid = fork()) == 0) worker(argv[optind + 1], gate);
+		if (pid == -1) {
+			perror("fork");
+			break;
+		}
+	}
+	if (started == 0) return 1;
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&shared->compared, &attr, started);
+	close(gate[0]);
+	close(gate[1]);
+	while (wait(NULL) > 0);
+	end = now();
+
+	for (i=0; i<nfiles; i++) {
+		if (state[i] == FILE_UNKNOWN || sent[i] == SENT_FAILED) failed++;
+		else if (sent[i] == SENT_SOME) changed++;
+		else same++;
+	}
+	printf("%d files in %d directories: %ld unchanged (skipped), %ld %s, %ld failed\n",
+		nfiles, ndirs, same, changed, dryRun ? "to send" : "sent", failed);
+	printf("%.1f MB in %ld pieces (%ld pieces unchanged) in %.2f s: %.1f MB/s, %.0f files/s, compared in %.2f s\n",
+		shared->bytesSent / (1024.0 * 1024), shared->piecesSent, shared->piecesSame, end - start,
+		shared->bytesSent / (1024.0 * 1024) / (end - start), nfiles / (end - start), shared->compareEnd - start);
+	return failed > 0;
+}
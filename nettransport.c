@@ -0,0 +1,570 @@
+#define _GNU_SOURCE
+#include "nettransport.h"
+#include "libnetfiles.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+
+/****************************************************************************************************
+ * 																									*
+ * Socket transports																				*
+ * 																									*
+ ****************************************************************************************************/
+
+/**
+ * Wraps a connected socket in a transport. Returns the new transport.
+ */
+Transport *transportSocket(int fd, char kind) {
+	Transport *t = calloc(sizeof(Transport), 1);
+	t->fd = fd;
+	t->kind = kind;
+	return t;
+}
+
+/**
+ * Reads exactly len bytes from fd, looping over short reads.
+ * Returns len on success, 0 on a clean close and -1 on error with errno set.
+ */
+int readFully(int fd, void *buf, int len) {
+	int val, got = 0;
+
+	while (got < len) {
+		val = read(fd, (char *) buf + got, len - got);
+		if (val == -1 && errno == EINTR) continue;
+		if (val <= 0) return val;
+		got += val;
+	}
+
+	return got;
+}
+
+/**
+ * Writes every buffer in iov to fd, looping over short writes. The iovec
+ * array is modified. Returns 0 on success and -1 on error with errno set.
+ */
+int writevFully(int fd, struct iovec *iov, int cnt) {
+	struct msghdr msg = {0};
+	ssize_t val;
+
+	while (cnt > 0) {
+		// sendmsg() rather than writev() so a dead peer gives EPIPE instead of SIGPIPE
+		msg.msg_iov = iov;
+		msg.msg_iovlen = cnt;
+		val = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (val == -1 && errno == EINTR) continue;
+		if (val <= 0) return -1;
+		// skip over everything that was written
+		while (cnt > 0 && val >= (ssize_t) iov->iov_len) {
+			val -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + val;
+			iov->iov_len -= val;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Connects to a TCP server. address is "host" or "host:port".
+ * Returns the socket, or -1 with errno set.
+ */
+int connectTCP(const char *address) {
+	struct sockaddr_in serverAddressInfo;			// Super-special secret C struct that holds address info for building our socket
+	struct hostent *serverIPAddress;				// Super-special secret C struct that holds info about a machine's address
+	char host[256], *colon;
+	int sockfd, port = PORT_NUM;
+
+	snprintf(host, sizeof(host), "%s", address);
+	colon = strrchr(host, ':');
+	if (colon != NULL) {
+		*colon = '\0';
+		port = atoi(colon + 1);
+	}
+
+	// look up the IP address that matches up with the name given - the name given might
+	//    BE an IP address, which is fine, and store it in the 'serverIPAddress' struct
+	serverIPAddress = gethostbyname(host);
+	if (serverIPAddress == NULL) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0) return -1;
+
+	// zero out the socket address info struct .. always initialize!
+	memset(&serverAddressInfo, 0, sizeof(serverAddressInfo));
+	serverAddressInfo.sin_family = AF_INET;
+	// set the remote port .. translate from a 'normal' int to a super-special 'network-port-int'
+	serverAddressInfo.sin_port = htons(port);
+	memcpy(&serverAddressInfo.sin_addr.s_addr, serverIPAddress->h_addr, serverIPAddress->h_length);
+
+	if (connect(sockfd, (struct sockaddr *) &serverAddressInfo, sizeof(serverAddressInfo)) < 0) {
+		port = errno;
+		close(sockfd);
+		errno = port;
+		return -1;
+	}
+
+	return sockfd;
+}
+
+/**
+ * Connects to a server's unix socket at path, or NET_UNIX_PATH if path is
+ * empty. Returns the socket, or -1 with errno set.
+ */
+int connectUnix(const char *path) {
+	struct sockaddr_un addr = {0};
+	int sockfd, err;
+
+	if (*path == '\0') path = NET_UNIX_PATH;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockfd < 0) return -1;
+	if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		err = errno;
+		close(sockfd);
+		errno = err;
+		return -1;
+	}
+
+	return sockfd;
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Shared memory transport																			*
+ * 																									*
+ * Each direction is a single producer, single consumer byte ring. The producer						*
+ * only moves head and the consumer only moves tail, so no locks are needed.						*
+ * A side that finds nothing to do raises its flag in the ring, checks again,						*
+ * and sleeps on its eventfd. The other side only rings the eventfd when it							*
+ * sees the flag, so a busy connection makes no system calls at all.								*
+ * 																									*
+ ****************************************************************************************************/
+
+# define ringLoad(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+# define ringStore(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+# define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)		// the memfd of the rings must carry these
+
+/**
+ * Rings the other side's doorbell.
+ */
+void ringPeer(ShmRings *shm) {
+	uint64_t one = 1;
+	write(shm->peer, &one, sizeof(one));
+}
+
+/**
+ * Sleeps until our doorbell rings. Returns 0 when woken, or -1 with errno set
+ * to EPIPE when the other side has gone away.
+ */
+int ringWait(Transport *t) {
+	struct pollfd fds[2];
+	uint64_t val;
+
+	fds[0].fd = t->shm->wake;
+	fds[0].events = POLLIN;
+	fds[1].fd = t->fd;
+	fds[1].events = POLLIN;
+
+	while (poll(fds, 2, -1) == -1) {
+		if (errno != EINTR) return -1;
+	}
+	// nothing is ever sent on the socket after the handshake, so readable means closed
+	if (fds[1].revents) {
+		errno = EPIPE;
+		return -1;
+	}
+	read(t->shm->wake, &val, sizeof(val));
+	return 0;
+}
+
+/**
+ * Returns how many bytes are waiting in a ring, or -1 if the other side has
+ * corrupted it.
+ */
+int64_t ringUsed(Ring *ring) {
+	uint64_t used = ringLoad(&ring->head) - ringLoad(&ring->tail);
+
+	if (used > RING_SIZE) return -1;
+	return used;
+}
+
+int ringRead(Transport *t, void *buf, int len) {
+	Ring *ring = t->shm->in;
+	int64_t used;
+	uint64_t tail;
+	int got = 0, chunk, pos;
+
+	while (got < len) {
+		used = ringUsed(ring);
+		if (used == 0) {
+			ringStore(&ring->sleeping, 1);
+			used = ringUsed(ring);
+			if (used == 0 && ringWait(t) == -1) return -1;
+			ringStore(&ring->sleeping, 0);
+			continue;
+		}
+		if (used == -1) {
+			errno = EPROTO;
+			return -1;
+		}
+
+		tail = ring->tail;
+		pos = tail & (RING_SIZE - 1);
+		chunk = len - got;
+		if (chunk > used) chunk = used;
+		if (chunk > RING_SIZE - pos) chunk = RING_SIZE - pos;
+		memcpy((char *) buf + got, ring->data + pos, chunk);
+		ringStore(&ring->tail, tail + chunk);
+		got += chunk;
+		if (ringLoad(&ring->blocked)) ringPeer(t->shm);
+	}
+
+	return got;
+}
+
+int ringWritev(Transport *t, struct iovec *iov, int cnt) {
+	Ring *ring = t->shm->out;
+	int64_t used;
+	uint64_t head;
+	size_t chunk, pos, done;
+	int i;
+
+	for (i=0; i<cnt; i++) {
+		done = 0;
+		while (done < iov[i].iov_len) {
+			used = ringUsed(ring);
+			if (used == -1) {
+				errno = EPROTO;
+				return -1;
+			}
+			if (used == RING_SIZE) {
+				ringStore(&ring->blocked, 1);
+				if (ringUsed(ring) == RING_SIZE && ringWait(t) == -1) return -1;
+				ringStore(&ring->blocked, 0);
+				continue;
+			}
+
+			// copy straight from the caller's buffer into the ring
+			head = ring->head;
+			pos = head & (RING_SIZE - 1);
+			chunk = iov[i].iov_len - done;
+			if (chunk > (size_t) (RING_SIZE - used)) chunk = RING_SIZE - used;
+			if (chunk > RING_SIZE - pos) chunk = RING_SIZE - pos;
+			memcpy(ring->data + pos, (char *) iov[i].iov_base + done, chunk);
+			ringStore(&ring->head, head + chunk);
+			done += chunk;
+			if (ringLoad(&ring->sleeping)) ringPeer(t->shm);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Maps the rings in memfd and fills in shm. client says which side we are.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int ringMap(ShmRings *shm, int memfd, int client) {
+	Ring *rings;
+
+	rings = mmap(NULL, 2 * sizeof(Ring), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (rings == MAP_FAILED) return -1;
+	shm->base = rings;
+	// ring 0 carries requests, ring 1 carries responses
+	shm->out = client ? &rings[0] : &rings[1];
+	shm->in = client ? &rings[1] : &rings[0];
+	return 0;
+}
+
+/**
+ * Client side of the shared memory handshake on a connected unix socket.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int connectShm(Transport *t) {
+	struct msghdr msg = {0};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char kind = TRANSPORT_SHM;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} ctrl;
+	int fds[3], err;
+
+	t->shm = calloc(sizeof(ShmRings), 1);
+	// fds are the rings, the server's doorbell and ours
+	fds[0] = memfd_create("netfiles-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	fds[1] = eventfd(0, EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_CLOEXEC);
+	if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1) goto SHMFAIL;
+	if (ftruncate(fds[0], 2 * sizeof(Ring)) == -1) goto SHMFAIL;
+	// the server won't map rings we could still shrink under it
+	if (fcntl(fds[0], F_ADD_SEALS, SHM_SEALS) == -1) goto SHMFAIL;
+	if (ringMap(t->shm, fds[0], 1) == -1) goto SHMFAIL;
+	t->shm->peer = fds[1];
+	t->shm->wake = fds[2];
+
+	iov.iov_base = &kind;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(t->fd, &msg, MSG_NOSIGNAL) != 1) goto SHMFAIL;
+
+	close(fds[0]);
+	return 0;
+
+	SHMFAIL:
+	err = errno;
+	if (fds[0] != -1) close(fds[0]);
+	if (fds[1] != -1) close(fds[1]);
+	if (fds[2] != -1) close(fds[2]);
+	if (t->shm->base != NULL) munmap(t->shm->base, 2 * sizeof(Ring));
+	free(t->shm);
+	t->shm = NULL;
+	errno = err;
+	return -1;
+}
+
+/****************************************************************************************************
+ * 																									*
+ * Transport interface																				*
+ * 																									*
+ ****************************************************************************************************/
+
+/**
+ * Connects to a server given a url of the form described in nettransport.h.
+ * A bare host name means TCP.
+ *
+ * Returns a new transport, or NULL with errno set.
+ */
+Transport *transportConnect(const char *url) {
+	Transport *t;
+	char kind = TRANSPORT_TCP;
+	int fd, err;
+
+	if (strncmp(url, "tcp://", 6) == 0) {
+		url += 6;
+	} else if (strncmp(url, "unix://", 7) == 0) {
+		url += 7;
+		kind = TRANSPORT_UNIX;
+	} else if (strncmp(url, "shm://", 6) == 0) {
+		url += 6;
+		kind = TRANSPORT_SHM;
+	}
+
+	if (kind == TRANSPORT_TCP) {
+		fd = connectTCP(url);
+		if (fd == -1) return NULL;
+		return transportSocket(fd, kind);
+	}
+
+	fd = connectUnix(url);
+	if (fd == -1) return NULL;
+	t = transportSocket(fd, kind);
+	if (kind == TRANSPORT_UNIX) {
+		// tell the server to use the socket itself
+		if (write(fd, &kind, 1) == 1) return t;
+	} else if (connectShm(t) == 0) {
+		return t;
+	}
+
+	err = errno;
+	close(fd);
+	free(t);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * Server side of the unix socket handshake. Reads the transport the client
+ * picked and, for shared memory, maps the rings it sent over.
+ *
+ * Returns 0 on success, or -1 with errno set.
+ */
+int transportAccept(Transport *t) {
+	struct msghdr msg = {0};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct stat st;
+	char kind = 0;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} ctrl;
+	int fds[3] = { -1, -1, -1 }, n = 0, i, seals;
+
+	if (t->kind != TRANSPORT_UNIX) return 0;
+
+	iov.iov_base = &kind;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+	if (recvmsg(t->fd, &msg, MSG_CMSG_CLOEXEC) != 1) goto ACCEPTFAIL;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (n > 3) n = 3;
+		memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+	}
+
+	if (kind == TRANSPORT_UNIX && n == 0) return 0;
+	if (kind != TRANSPORT_SHM || n != 3) goto ACCEPTFAIL;
+	// make sure the client gave us a region big enough for both rings, that
+	// stays that size: touching a page it truncated away would kill us
+	if (fstat(fds[0], &st) == -1 || st.st_size < (off_t) (2 * sizeof(Ring))) goto ACCEPTFAIL;
+	seals = fcntl(fds[0], F_GET_SEALS);
+	if (seals == -1 || (seals & SHM_SEALS) != SHM_SEALS) goto ACCEPTFAIL;
+
+	t->shm = calloc(sizeof(ShmRings), 1);
+	if (ringMap(t->shm, fds[0], 0) == -1) {
+		free(t->shm);
+		t->shm = NULL;
+		goto ACCEPTFAIL;
+	}
+	close(fds[0]);
+	t->shm->wake = fds[1];
+	t->shm->peer = fds[2];
+	t->kind = TRANSPORT_SHM;
+	return 0;
+
+	ACCEPTFAIL:
+	for (i=0; i<n; i++) close(fds[i]);
+	errno = EPROTO;
+	return -1;
+}
+
+/**
+ * Reads exactly len bytes from a transport.
+ * Returns len on success, 0 on a clean close and -1 on error with errno set.
+ */
+int transportRead(Transport *t, void *buf, int len) {
+	if (t->fd == -1) {
+		errno = EBADF;
+		return -1;
+	}
+	if (t->shm != NULL) return ringRead(t, buf, len);
+	return readFully(t->fd, buf, len);
+}
+
+/**
+ * Writes every buffer in iov to a transport. The iovec array may be modified.
+ * Returns 0 on success and -1 on error with errno set.
+ */
+int transportWritev(Transport *t, struct iovec *iov, int cnt) {
+	if (t->fd == -1) {
+		errno = EBADF;
+		return -1;
+	}
+	if (t->shm != NULL) return ringWritev(t, iov, cnt);
+	return writevFully(t->fd, iov, cnt);
+}
+
+/**
+ * Tells whether len bytes can be written to a transport right now without
+ * waiting for the other side. For sockets that is only a good guess (there
+ * is some room in the send buffer), enough for small frames.
+ */
+int transportWritable(Transport *t, size_t len) {
+	struct pollfd pfd = { t->fd, POLLOUT, 0 };
+	int64_t used;
+
+	if (t->fd == -1) return 0;
+	if (t->shm != NULL) {
+		used = ringUsed(t->shm->out);
+		return used != -1 && RING_SIZE - used >= (int64_t) len;
+	}
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+}
+
+/**
+ * Waits up to timeout ms (-1 for ever) until at least one of n transports
+ * has something to read, or has gone away, and sets ready[i] for each that
+ * has. Returns the number of ready transports, 0 on timeout, or -1 with errno
+ * set.
+ */
+int transportPoll(Transport **ts, int n, int timeout, char *ready) {
+	struct pollfd fds[2 * n];
+	uint64_t val;
+	int i, ret, nfds = 0, count = 0;
+
+	for (i=0; i<n; i++) {
+		// a closed transport counts as ready, so reading it reports the error
+		ready[i] = ts[i]->fd == -1;
+		if (ts[i]->shm != NULL) {
+			// the producer only rings our doorbell while we say we're sleeping
+			ringStore(&ts[i]->shm->in->sleeping, 1);
+			if (ringUsed(ts[i]->shm->in) != 0) ready[i] = 1;
+			fds[nfds].fd = ts[i]->shm->wake;
+			fds[nfds++].events = POLLIN;
+		}
+		count += ready[i];
+		// poll() skips the -1 of a closed transport
+		fds[nfds].fd = ts[i]->fd;
+		fds[nfds++].events = POLLIN;
+	}
+	while ((ret = poll(fds, nfds, count > 0 ? 0 : timeout)) == -1 && errno == EINTR);
+	for (i=0, nfds=0; i<n; i++) {
+		if (ts[i]->shm != NULL) {
+			ringStore(&ts[i]->shm->in->sleeping, 0);
+			if (ret > 0 && fds[nfds].revents) read(ts[i]->shm->wake, &val, sizeof(val));
+			if (ringUsed(ts[i]->shm->in) != 0) ready[i] = 1;
+			nfds++;
+		}
+		if (ret > 0 && fds[nfds].revents) ready[i] = 1;
+		nfds++;
+	}
+	if (ret == -1) return -1;
+	for (i=0, count=0; i<n; i++) count += ready[i];
+	return count;
+}
+
+/**
+ * Releases everything behind a transport. The structure itself stays valid
+ * (every later read or write fails with EBADF) and must be free()'d by
+ * whoever owns it.
+ */
+void transportClose(Transport *t) {
+	if (t->shm != NULL) {
+		munmap(t->shm->base, 2 * sizeof(Ring));
+		close(t->shm->wake);
+		close(t->shm->peer);
+		free(t->shm);
+		t->shm = NULL;
+	}
+	if (t->fd != -1) close(t->fd);
+	t->fd = -1;
+}
@@ -0,0 +1,71 @@
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/**
+ * Transports carry the length prefixed messages described in libnetfiles.h
+ * between the client library and the server. Three are supported:
+ *
+ *  tcp://host[:port]	plain TCP, the default when no scheme is given
+ *  unix://[path]		an AF_UNIX stream socket, NET_UNIX_PATH if no path
+ *  shm://[path]		a pair of shared memory rings, set up over the unix
+ *  					socket at path
+ *
+ * On a unix socket the client's first byte picks between the socket itself
+ * ('U') and shared memory ('M'). For shared memory that byte carries, as
+ * SCM_RIGHTS, a memfd holding two rings (client->server, server->client),
+ * sealed against shrinking and growing, and one eventfd per side that the
+ * other side rings when it has produced data or freed space. The socket
+ * stays open only so either side notices when the other goes away.
+ */
+
+#ifndef __NETTRANSPORT_H
+#  define __NETTRANSPORT_H
+
+#  define TRANSPORT_TCP  'T'
+#  define TRANSPORT_UNIX 'U'
+#  define TRANSPORT_SHM  'M'
+
+#  define NET_UNIX_PATH "/tmp/netfileserver.sock"
+
+#  define RING_SIZE (1024 * 1024)		// bytes per direction, must be a power of 2
+
+typedef struct {
+	uint64_t head;			// total bytes produced, only written by the producer
+	char pad0[56];
+	uint64_t tail;			// total bytes consumed, only written by the consumer
+	char pad1[56];
+	int sleeping;			// consumer is waiting for data
+	int blocked;			// producer is waiting for space
+	char pad2[56];
+	char data[RING_SIZE];
+} Ring;
+
+typedef struct {
+	Ring *in;				// ring we consume from
+	Ring *out;				// ring we produce into
+	int wake;				// eventfd we sleep on
+	int peer;				// eventfd that wakes the other side
+	void *base;				// both rings, as mapped
+} ShmRings;
+
+typedef struct {
+	int fd;					// the socket, which also identifies a client on the server
+	char kind;				// TRANSPORT_TCP, TRANSPORT_UNIX or TRANSPORT_SHM
+	ShmRings *shm;			// NULL unless kind is TRANSPORT_SHM
+	char codec;				// payload compression agreed on at connect, see netcompress.h
+	char crc;				// frames end with a CRC32C, see netcrc.h
+	pthread_mutex_t *sendLock;	// held around every frame once other threads send on it too, NULL before
+} Transport;
+
+Transport *transportSocket(int fd, char kind);
+Transport *transportConnect(const char *url);
+int transportAccept(Transport *t);
+int transportRead(Transport *t, void *buf, int len);
+int transportWritev(Transport *t, struct iovec *iov, int cnt);
+int transportWritable(Transport *t, size_t len);
+int transportPoll(Transport **ts, int n, int timeout, char *ready);
+void transportClose(Transport *t);
+
+#endif
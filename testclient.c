@@ -15,8 +15,9 @@ int main(int argc, char *argv[])
 	netserverinit("localhost", MODE_UNRESTRCT);
 	int fd = netopen("test1.txt", MODE_RW);
 	char buf[20];
-	netread(fd, buf, 20);
-	printf(buf);
+	ssize_t len = netread(fd, buf, 19);
+	buf[len < 0 ? 0 : len] = '\0';
+	printf("%s", buf);
 	buf[0] = 'H';
 	netwrite(fd, buf, 20);
 	netclose(fd);